@@ -40,8 +40,11 @@
 #include "common.h"
 #include "file_opera.h"
 #include "w25q128.h"
+#include "w25q128_async.h"
 #include "lfs_spi_flash_adapter.h"
+#include "storage.h"
 #include "aes.h"
+#include "auto_update.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -318,8 +321,8 @@ void SystemClock_Config(void)
 static void aes_test(void)
 {
   FRESULT res;
-  uint8_t key[AES_KEYLEN] = "ThisIsA256BitKeyForAESTest!";
-  uint8_t iv[AES_BLOCKLEN] = "InitialVector12";
+  const uint8_t *key = AES_image_key;
+  const uint8_t *iv = AES_image_iv;
   const TCHAR *test_file = "0:/text/test.txt";
   const TCHAR *encrypted_file = "0:/text/encrypted.txt.aes";
   const TCHAR *decrypted_file = "0:/text/decrypted.txt";
@@ -539,21 +542,41 @@ static void show_spi_flash_info(void)
     break;
   }
 
+  // 挂载LittleFS, 其中读取JEDEC ID和SFDP并建立分区表; 挂载保持到跳转应用程序,
+  // 菜单操作不再重新挂载
+  COM_StatusTypeDef lfs_status = Storage_Acquire(STORAGE_LFS);
+  if (Storage_GetState(STORAGE_LFS)->detected)
+  {
+    uint32_t i;
+
+    printf("  JEDEC ID: %02X %02X %02X\r\n", W25Q128_info.manufacturer, W25Q128_info.memory_type,
+           W25Q128_info.capacity_id);
+    printf("  Geometry: %s\r\n", W25Q128_info.sfdp ? "SFDP" : "JEDEC ID");
+    printf("  Capacity: %lu KBytes, %u-byte addresses\r\n", (unsigned long)(W25Q128_info.capacity / 1024),
+           W25Q128_info.addr_bytes);
+    printf("  Page size: %lu bytes\r\n", (unsigned long)W25Q128_info.page_size);
+    printf("  Erase sizes:");
+    for (i = 0; (i < W25Q128_ERASE_TYPES) && (W25Q128_info.erase[i].size != 0); i++)
+    {
+      printf(" %luK(%02Xh)", (unsigned long)(W25Q128_info.erase[i].size / 1024), W25Q128_info.erase[i].cmd);
+    }
+    printf("\r\n");
+  }
+
   // 显示LittleFS配置信息
   printf("\n====== LittleFS Configuration ======\r\n");
   printf("  Block size: %d bytes\r\n", SPI_FLASH_BLOCK_SIZE);
-  printf("  Total blocks: %d\r\n", SPI_FLASH_BLOCK_COUNT);
+  printf("  Total blocks: %d (%d KBytes)\r\n", SPI_FLASH_BLOCK_COUNT, SPI_FLASH_BLOCK_COUNT * SPI_FLASH_BLOCK_SIZE / 1024);
   printf("  Program size: %d bytes\r\n", SPI_FLASH_PROG_SIZE);
   printf("  Read size: %d bytes\r\n", SPI_FLASH_READ_SIZE);
   printf("  Cache size: %d bytes\r\n", lfs_spi_flash_cfg.cache_size);
   printf("  Lookahead size: %d bytes\r\n", lfs_spi_flash_cfg.lookahead_size);
 
-  // 尝试挂载LittleFS以检查状态
+  // 显示挂载结果
   printf("\n  Checking LittleFS status...\r\n");
-  int lfs_result = lfs_mount(&lfs_instance, &lfs_spi_flash_cfg);
-  if (lfs_result == LFS_ERR_OK)
+  if (lfs_status == COM_OK)
   {
-    printf("  LittleFS mounted successfully\r\n");
+    printf("  LittleFS mounted successfully (%lu ms)\r\n", (unsigned long)Storage_GetState(STORAGE_LFS)->mount_ms);
 
     // 显示文件系统信息
     struct lfs_info info;
@@ -563,13 +586,15 @@ static void show_spi_flash_info(void)
              info.size, (info.type == LFS_TYPE_DIR ? "Directory" : "File"));
     }
 
-    // 卸载文件系统
-    lfs_unmount(&lfs_instance);
+    Storage_Release(STORAGE_LFS);
   }
   else
   {
-    printf("  LittleFS mount failed: Error code=%d\r\n", lfs_result);
-    printf("  File system may need formatting\r\n");
+    printf("  LittleFS mount failed: Error code=%d\r\n", (int)Storage_GetState(STORAGE_LFS)->error);
+    if (lfs_status == COM_DATA)
+    {
+      printf("  No file system, format it from the menu\r\n");
+    }
   }
 
   printf("====================================\r\n\r\n");
@@ -582,11 +607,11 @@ static void power_on_check(void)
   printf("Bootloader started...\r\n");
   printf("Checking TF card...\r\n");
 
-  // 先挂载文件系统
-  FRESULT fres = f_mount(&SDFatFS, "0:", 1);
-  if (fres != FR_OK)
+  // 先挂载文件系统, 挂载保持到跳转应用程序
+  COM_StatusTypeDef tf_status = Storage_Acquire(STORAGE_TF);
+  if (tf_status != COM_OK)
   {
-    printf("f_mount failed: %d\r\n", fres);
+    printf("f_mount failed: %d\r\n", (int)Storage_GetState(STORAGE_TF)->error);
   }
 
   HAL_SD_CardStateTypeDef sd_state;
@@ -625,6 +650,13 @@ static void power_on_check(void)
     aes_test();
   }
 
+  // 无人值守升级: TF卡或LittleFS中有升级清单时自动安装, 不需要串口操作
+  AutoUpdate_Run((tf_status == COM_OK) && (sd_state == HAL_SD_CARD_TRANSFER));
+  if (tf_status == COM_OK)
+  {
+    Storage_Release(STORAGE_TF);
+  }
+
   // 检查串口命令
   if (uart_wait_command(&cmd, UART_TIMEOUT) && cmd == 'M')
   {
@@ -636,6 +668,7 @@ static void power_on_check(void)
     if (app_is_valid())
     {
       printf("Jumping to application...\r\n");
+      Storage_Shutdown();
       jump_to_app();
     }
     else
@@ -657,6 +690,7 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
   {
     led_timer_counter++; // 每1ms递增
     led_control_task();  // 在中断中调用LED控制
+    W25Q128_async_tick(); // 推进W25Q128异步擦除和编程
   }
 }
 /* USER CODE END 4 */
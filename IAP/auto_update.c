@@ -0,0 +1,524 @@
+/**
+ ******************************************************************************
+ * @file    IAP/auto_update.c
+ * @brief   Unattended update at power on. A manifest on the TF card
+ *          (AUTO_UPDATE_TF_MANIFEST) or in LittleFS (AUTO_UPDATE_LFS_MANIFEST)
+ *          names an image with its version and CRC-32. The image is installed
+ *          when the policy asks for it compared to the U-Boot header of the
+ *          installed application, no console interaction is needed.
+ *          The image file is checked completely (CRC, header version and
+ *          name) before the application area is erased, so a bad card never
+ *          costs the running application. The image must carry a U-Boot
+ *          header: its ih_time is what stops the same image from being
+ *          installed again on the next boot.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "auto_update.h"
+#include "common.h"
+#include "main.h"
+#include "flash_if.h"
+#include "crc32.h"
+#include "aes.h"
+#include "tf_install.h"
+#include "update_pipeline.h"
+#include "seal_install.h"
+#include "io_arena.h"
+#include "ff.h"
+#include "lfs_spi_flash_adapter.h"
+#include "storage.h"
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+/* Private define ------------------------------------------------------------*/
+#define AUTO_UPDATE_BUFFER_SIZE ((uint32_t)4096)
+
+/* Private variables ---------------------------------------------------------*/
+static AutoUpdate_ManifestTypeDef Manifest;
+static char aManifestText[AUTO_UPDATE_MANIFEST_SIZE + 1];
+static FIL UpdateFile;
+static struct lfs_file UpdateLfsFile;
+static UpdateSource_TypeDef UpdateSource;
+static UpdateTransform_TypeDef aUpdateTransform[2];
+static ImageSink_TypeDef UpdateSink;
+static UpdatePipeline_TypeDef UpdatePipeline;
+static SealInstall_StatsTypeDef SealStats;
+static uint32_t LfsHeld = 0;
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Print one line of the update log
+ * @param  text: message
+ * @retval None
+ */
+static void AutoUpdate_Log(const char *text)
+{
+  Serial_PutString((uint8_t *)"[auto-update] ");
+  Serial_PutString((uint8_t *)text);
+  Serial_PutString((uint8_t *)"\r\n");
+}
+
+/**
+ * @brief  Open a file on the manifest source
+ * @param  source: TF card or LittleFS
+ * @param  path: file path on that source
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef AutoUpdate_Open(AutoUpdate_SourceTypeDef source, const char *path)
+{
+  if (source == AUTO_UPDATE_SOURCE_TF)
+  {
+    return (f_open(&UpdateFile, path, FA_READ) == FR_OK) ? COM_OK : COM_ERROR;
+  }
+  if (lfs_spi_flash_file_open(&lfs_instance, &UpdateLfsFile, path, LFS_O_RDONLY) != LFS_ERR_OK)
+  {
+    return COM_ERROR;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Read from the file opened by AutoUpdate_Open
+ * @param  source: TF card or LittleFS
+ * @param  p_buffer: destination
+ * @param  length: bytes wanted
+ * @retval Bytes read, 0 at the end of the file, -1 on error
+ */
+static int32_t AutoUpdate_Read(AutoUpdate_SourceTypeDef source, uint8_t *p_buffer, uint32_t length)
+{
+  UINT bytes_read;
+
+  if (source == AUTO_UPDATE_SOURCE_TF)
+  {
+    if (f_read(&UpdateFile, p_buffer, length, &bytes_read) != FR_OK)
+    {
+      return -1;
+    }
+    return (int32_t)bytes_read;
+  }
+  return (int32_t)lfs_file_read(&lfs_instance, &UpdateLfsFile, p_buffer, length);
+}
+
+/**
+ * @brief  Close the file opened by AutoUpdate_Open
+ * @param  source: TF card or LittleFS
+ * @retval None
+ */
+static void AutoUpdate_Close(AutoUpdate_SourceTypeDef source)
+{
+  if (source == AUTO_UPDATE_SOURCE_TF)
+  {
+    f_close(&UpdateFile);
+  }
+  else
+  {
+    lfs_file_close(&lfs_instance, &UpdateLfsFile);
+  }
+}
+
+/**
+ * @brief  Read the manifest of one source into aManifestText
+ * @param  source: TF card or LittleFS
+ * @retval COM_OK if a manifest was read
+ */
+static COM_StatusTypeDef AutoUpdate_ReadManifest(AutoUpdate_SourceTypeDef source)
+{
+  const char *path = (source == AUTO_UPDATE_SOURCE_TF) ? AUTO_UPDATE_TF_MANIFEST : AUTO_UPDATE_LFS_MANIFEST;
+  int32_t length;
+
+  if (source == AUTO_UPDATE_SOURCE_LFS)
+  {
+    if (Storage_Acquire(STORAGE_LFS) != COM_OK)
+    {
+      return COM_ERROR;
+    }
+    LfsHeld = 1;
+  }
+
+  if (AutoUpdate_Open(source, path) != COM_OK)
+  {
+    return COM_ERROR;
+  }
+  length = AutoUpdate_Read(source, (uint8_t *)aManifestText, AUTO_UPDATE_MANIFEST_SIZE);
+  AutoUpdate_Close(source);
+  if (length <= 0)
+  {
+    return COM_ERROR;
+  }
+  aManifestText[length] = '\0';
+  return COM_OK;
+}
+
+/**
+ * @brief  Parse aManifestText into Manifest
+ * @param  None
+ * @retval COM_OK, or COM_DATA if a required key is missing or malformed
+ */
+static COM_StatusTypeDef AutoUpdate_ParseManifest(void)
+{
+  char *line = aManifestText, *next, *value, *end;
+  uint32_t have_version = 0, have_crc = 0;
+
+  memset(Manifest.image, 0, sizeof(Manifest.image));
+  memset(Manifest.name, 0, sizeof(Manifest.name));
+  Manifest.policy = AUTO_UPDATE_POLICY_NEWER;
+
+  for (; line != NULL; line = next)
+  {
+    next = strchr(line, '\n');
+    if (next != NULL)
+    {
+      *next++ = '\0';
+    }
+
+    /* Trim the line, skip blank and comment lines */
+    while (isspace((unsigned char)*line))
+    {
+      line++;
+    }
+    end = line + strlen(line);
+    while ((end > line) && isspace((unsigned char)end[-1]))
+    {
+      *--end = '\0';
+    }
+    if ((*line == '\0') || (*line == '#'))
+    {
+      continue;
+    }
+
+    value = strchr(line, '=');
+    if (value == NULL)
+    {
+      return COM_DATA;
+    }
+    for (end = value; (end > line) && isspace((unsigned char)end[-1]); end--)
+    {
+    }
+    *end = '\0';
+    for (value++; isspace((unsigned char)*value); value++)
+    {
+    }
+
+    if (strcmp(line, "image") == 0)
+    {
+      if ((value[0] == '\0') || (strlen(value) >= sizeof(Manifest.image)) || (strchr(value, '/') != NULL))
+      {
+        return COM_DATA;
+      }
+      strcpy(Manifest.image, value);
+    }
+    else if (strcmp(line, "name") == 0)
+    {
+      if (strlen(value) > AUTO_UPDATE_NAME_LENGTH)
+      {
+        return COM_DATA;
+      }
+      strcpy(Manifest.name, value);
+    }
+    else if (strcmp(line, "version") == 0)
+    {
+      have_version = Str2Int((uint8_t *)value, &Manifest.version);
+    }
+    else if (strcmp(line, "crc") == 0)
+    {
+      have_crc = Str2Int((uint8_t *)value, &Manifest.crc);
+    }
+    else if (strcmp(line, "policy") == 0)
+    {
+      if (strcmp(value, "newer") == 0)
+      {
+        Manifest.policy = AUTO_UPDATE_POLICY_NEWER;
+      }
+      else if (strcmp(value, "different") == 0)
+      {
+        Manifest.policy = AUTO_UPDATE_POLICY_DIFFERENT;
+      }
+      else if (strcmp(value, "off") == 0)
+      {
+        Manifest.policy = AUTO_UPDATE_POLICY_OFF;
+      }
+      else
+      {
+        return COM_DATA;
+      }
+    }
+    /* Unknown keys are left for newer bootloaders */
+  }
+
+  if ((Manifest.image[0] == '\0') || !have_version || !have_crc)
+  {
+    return COM_DATA;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Compare the manifest with the installed application
+ * @param  None
+ * @retval 1 if the image of the manifest should be installed
+ */
+static uint32_t AutoUpdate_IsWanted(void)
+{
+  const image_header_t *installed = (const image_header_t *)APPLICATION_ADDRESS;
+  uint32_t same_name;
+
+  if (Manifest.policy == AUTO_UPDATE_POLICY_OFF)
+  {
+    AutoUpdate_Log("policy is off");
+    return 0;
+  }
+  if (installed->ih_magic != UBOOT_MAGIC)
+  {
+    AutoUpdate_Log("no U-Boot header installed");
+    return 1;
+  }
+
+  same_name = (Manifest.name[0] == '\0') ||
+              (strncmp((const char *)installed->ih_name, Manifest.name, sizeof(installed->ih_name)) == 0);
+  if (!same_name)
+  {
+    AutoUpdate_Log("installed image has another name");
+    return 1;
+  }
+  if (Manifest.policy == AUTO_UPDATE_POLICY_NEWER)
+  {
+    return (Manifest.version > installed->ih_time);
+  }
+  return (Manifest.version != installed->ih_time);
+}
+
+/**
+ * @brief  Check the whole image file against the manifest before anything
+ *         is erased
+ * @param  path: image path on the manifest source
+ * @param  entry: receives the flags, version and label of the image
+ * @param  p_buffer: AUTO_UPDATE_BUFFER_SIZE bytes
+ * @retval COM_OK, COM_ERROR on a read error, COM_DATA on a mismatch
+ */
+static COM_StatusTypeDef AutoUpdate_Verify(const char *path, FwCatalog_EntryTypeDef *entry, uint8_t *p_buffer)
+{
+  uint32_t crc = CRC32_INIT, first = 1;
+  int32_t length;
+
+  if (AutoUpdate_Open(Manifest.source, path) != COM_OK)
+  {
+    AutoUpdate_Log("image not found");
+    return COM_ERROR;
+  }
+  while ((length = AutoUpdate_Read(Manifest.source, p_buffer, AUTO_UPDATE_BUFFER_SIZE)) > 0)
+  {
+    if (first)
+    {
+      first = 0;
+      FwCatalog_ParseHeader(p_buffer, (uint32_t)length, entry);
+    }
+    crc = Crc32_Update(crc, p_buffer, (uint32_t)length);
+  }
+  AutoUpdate_Close(Manifest.source);
+
+  if (length < 0)
+  {
+    AutoUpdate_Log("image read error");
+    return COM_ERROR;
+  }
+  if (crc != Manifest.crc)
+  {
+    AutoUpdate_Log("image CRC does not match the manifest");
+    return COM_DATA;
+  }
+  if (!(entry->flags & FW_ENTRY_UIMAGE) || (entry->version != Manifest.version))
+  {
+    AutoUpdate_Log("image header does not match the manifest version");
+    return COM_DATA;
+  }
+  if ((Manifest.name[0] != '\0') && (strncmp(entry->label, Manifest.name, FW_CATALOG_LABEL_LENGTH - 1) != 0))
+  {
+    AutoUpdate_Log("image header does not match the manifest name");
+    return COM_DATA;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Install an image through the update pipeline, the file CRC is
+ *         checked once more on the way. An indexed sealed image only has the
+ *         sectors that differ written, so an update cut short by a reset is
+ *         finished at the next boot without erasing the sectors it completed.
+ * @param  path: image path on the manifest source
+ * @param  flags: FW_ENTRY_AES or FW_ENTRY_SEALED as needed
+ * @retval see UpdatePipeline_Run and SealInstall_Run
+ */
+static COM_StatusTypeDef AutoUpdate_InstallPipeline(const char *path, uint8_t flags)
+{
+  COM_StatusTypeDef status;
+
+  if (Manifest.source == AUTO_UPDATE_SOURCE_TF)
+  {
+    UpdateSource_InitFatFs(&UpdateSource);
+  }
+  else
+  {
+    UpdateSource_InitLfs(&UpdateSource);
+  }
+  if (flags & FW_ENTRY_SEALED)
+  {
+    status = SealInstall_Run(&UpdateSource, path, &SealStats);
+    if (status != COM_ABORT)
+    {
+      return status;
+    }
+  }
+  ImageSink_InitFlash(&UpdateSink);
+  UpdatePipeline_Init(&UpdatePipeline, &UpdateSource, &UpdateSink);
+  UpdateTransform_InitCrc(&aUpdateTransform[0], 1, Manifest.crc);
+  UpdatePipeline_Add(&UpdatePipeline, &aUpdateTransform[0]);
+  if (flags & FW_ENTRY_SEALED)
+  {
+    UpdateTransform_InitUnseal(&aUpdateTransform[1]);
+    UpdatePipeline_Add(&UpdatePipeline, &aUpdateTransform[1]);
+  }
+  else if (flags & FW_ENTRY_AES)
+  {
+    UpdateTransform_InitDecrypt(&aUpdateTransform[1]);
+    UpdatePipeline_Add(&UpdatePipeline, &aUpdateTransform[1]);
+  }
+  return UpdatePipeline_Run(&UpdatePipeline, path, NULL);
+}
+
+/**
+ * @brief  Look for a manifest and install its image when needed
+ * @param  tf_present: 1 if the TF card is mounted
+ * @retval COM_OK if an image was installed, COM_ABORT if there was nothing
+ *         to do, another status if the update failed
+ */
+COM_StatusTypeDef AutoUpdate_Run(uint32_t tf_present)
+{
+  FwCatalog_EntryTypeDef entry;
+  TFInstall_StatsTypeDef stats;
+  const image_header_t *installed = (const image_header_t *)APPLICATION_ADDRESS;
+  char path[AUTO_UPDATE_IMAGE_NAME_LENGTH + 8];
+  char line[96];
+  const char *value;
+  uint8_t *p_buffer;
+  COM_StatusTypeDef status;
+
+  /* A missing manifest costs one failed open on each source */
+  LfsHeld = 0;
+  if (tf_present && (AutoUpdate_ReadManifest(AUTO_UPDATE_SOURCE_TF) == COM_OK))
+  {
+    Manifest.source = AUTO_UPDATE_SOURCE_TF;
+  }
+  else if (AutoUpdate_ReadManifest(AUTO_UPDATE_SOURCE_LFS) == COM_OK)
+  {
+    Manifest.source = AUTO_UPDATE_SOURCE_LFS;
+  }
+  else
+  {
+    if (LfsHeld)
+    {
+      Storage_Release(STORAGE_LFS);
+    }
+    return COM_ABORT;
+  }
+
+  status = AutoUpdate_ParseManifest();
+  if (status != COM_OK)
+  {
+    AutoUpdate_Log("manifest is malformed, ignored");
+  }
+  else
+  {
+    snprintf(line, sizeof(line), "manifest on %s: %s version 0x%08lX",
+             (Manifest.source == AUTO_UPDATE_SOURCE_TF) ? "TF card" : "LittleFS", Manifest.image,
+             (unsigned long)Manifest.version);
+    AutoUpdate_Log(line);
+    if (!AutoUpdate_IsWanted())
+    {
+      AutoUpdate_Log("installed image is up to date");
+      status = COM_ABORT;
+    }
+  }
+  if (status != COM_OK)
+  {
+    if (LfsHeld)
+    {
+      Storage_Release(STORAGE_LFS);
+    }
+    return status;
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  value = strrchr(Manifest.image, '.');
+  if ((value != NULL) && (strcmp(value, ".aes") == 0))
+  {
+    entry.flags |= FW_ENTRY_AES;
+  }
+  else if ((value != NULL) && (strcmp(value, ".aex") == 0))
+  {
+    entry.flags |= FW_ENTRY_SEALED;
+  }
+  snprintf(path, sizeof(path), "%s/%s", (Manifest.source == AUTO_UPDATE_SOURCE_TF) ? FW_CATALOG_DIR : "",
+           Manifest.image);
+
+  p_buffer = IoArena_Get(AUTO_UPDATE_BUFFER_SIZE, "auto update");
+  if (p_buffer == NULL)
+  {
+    status = COM_ERROR;
+  }
+  else
+  {
+    status = AutoUpdate_Verify(path, &entry, p_buffer);
+    if (status == COM_OK)
+    {
+      AutoUpdate_Log("image verified, installing...");
+      /* Both installers take their own buffers */
+      IoArena_Put(p_buffer);
+      p_buffer = NULL;
+      /* Sealed images always go through the pipeline, which authenticates
+         every record before the Flash is erased */
+      if ((Manifest.source == AUTO_UPDATE_SOURCE_TF) && !(entry.flags & FW_ENTRY_SEALED))
+      {
+        status = TFCard_Install(path, (entry.flags & FW_ENTRY_AES) != 0, &stats);
+      }
+      else
+      {
+        status = AutoUpdate_InstallPipeline(path, entry.flags);
+      }
+    }
+    IoArena_Put(p_buffer);
+  }
+  if (LfsHeld)
+  {
+    Storage_Release(STORAGE_LFS);
+  }
+
+  if (status == COM_OK)
+  {
+    /* Read back what the application area now holds */
+    if ((installed->ih_magic != UBOOT_MAGIC) || (installed->ih_time != Manifest.version))
+    {
+      status = COM_DATA;
+    }
+  }
+  if (status == COM_OK)
+  {
+    snprintf(line, sizeof(line), "installed %s", Manifest.image);
+  }
+  else
+  {
+    snprintf(line, sizeof(line), "update of %s failed (%d), keeping the boot sequence", Manifest.image, (int)status);
+  }
+  AutoUpdate_Log(line);
+  return status;
+}
+
+/**
+ * @}
+ */
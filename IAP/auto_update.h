@@ -0,0 +1,63 @@
+/**
+ ******************************************************************************
+ * @file    IAP/auto_update.h
+ * @brief   Unattended update at power on, driven by a manifest on the TF
+ *          card or in the LittleFS of the SPI Flash.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __AUTO_UPDATE_H
+#define __AUTO_UPDATE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+#include "fw_catalog.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* The TF card manifest wins over the LittleFS one, images are looked for
+   next to the manifest that names them */
+#define AUTO_UPDATE_TF_MANIFEST  FW_CATALOG_DIR "/manifest.txt"
+#define AUTO_UPDATE_LFS_MANIFEST "/manifest.txt"
+#define AUTO_UPDATE_MANIFEST_SIZE ((uint32_t)512)
+#define AUTO_UPDATE_IMAGE_NAME_LENGTH FW_CATALOG_NAME_LENGTH
+#define AUTO_UPDATE_NAME_LENGTH ((uint32_t)32)
+
+/* Exported types ------------------------------------------------------------*/
+typedef enum
+{
+  AUTO_UPDATE_POLICY_NEWER = 0, /* Only a higher version than the installed one */
+  AUTO_UPDATE_POLICY_DIFFERENT, /* Any other version or name, allows a rollback */
+  AUTO_UPDATE_POLICY_OFF        /* Manifest is ignored */
+} AutoUpdate_PolicyTypeDef;
+
+typedef enum
+{
+  AUTO_UPDATE_SOURCE_TF = 0,
+  AUTO_UPDATE_SOURCE_LFS
+} AutoUpdate_SourceTypeDef;
+
+/**
+ * @brief  Content of a manifest, one key=value per line:
+ *           image=app.aes        file next to the manifest (required)
+ *           version=0x65a1b2c3   ih_time of the image (required)
+ *           crc=0x1234abcd       CRC-32 of the whole file (required)
+ *           name=my_app          ih_name of the image (optional)
+ *           policy=newer         newer, different or off
+ *         '#' starts a comment line.
+ */
+typedef struct
+{
+  char image[AUTO_UPDATE_IMAGE_NAME_LENGTH];
+  char name[AUTO_UPDATE_NAME_LENGTH + 1];
+  uint32_t version;
+  uint32_t crc;
+  AutoUpdate_PolicyTypeDef policy;
+  AutoUpdate_SourceTypeDef source;
+} AutoUpdate_ManifestTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+COM_StatusTypeDef AutoUpdate_Run(uint32_t tf_present);
+
+#endif /* __AUTO_UPDATE_H */
@@ -24,11 +24,22 @@
 #include "common.h"
 #include "main.h"
 #include "usart.h"
+#include "string.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* Private macro -------------------------------------------------------------*/
+#define SERIAL_RX_RING_MASK (SERIAL_RX_RING_SIZE - 1)
+
 /* Private variables ---------------------------------------------------------*/
+/* Circular DMA target, the write index is derived from the stream NDTR */
+static uint8_t aRxRing[SERIAL_RX_RING_SIZE];
+/* Bytes taken out of the ring since Serial_DMA_RxStart */
+static uint32_t RxRingRead = 0;
+/* Bytes stored by the DMA up to the last half/full transfer interrupt, the
+   NDTR alone cannot tell how many times the ring was lapped */
+static volatile uint32_t RxRingWritten = 0;
+
 /* Exported variables --------------------------------------------------------*/
 UART_HandleTypeDef UartHandle = {0};
 
@@ -44,6 +55,16 @@ void Common_Init(void)
 {
   /* Map UartHandle to the actual UART4 handle */
   UartHandle = huart4;
+
+  /* DMA callbacks must report to the copy used by the IAP code */
+  if (UartHandle.hdmarx != NULL)
+  {
+    UartHandle.hdmarx->Parent = &UartHandle;
+  }
+  if (UartHandle.hdmatx != NULL)
+  {
+    UartHandle.hdmatx->Parent = &UartHandle;
+  }
 }
 
 /**
@@ -182,6 +203,210 @@ HAL_StatusTypeDef Serial_PutByte(uint8_t param)
   }
   return HAL_UART_Transmit(&UartHandle, &param, 1, TX_TIMEOUT);
 }
+/**
+ * @brief  Half and full transfer interrupt of the receive ring
+ * @param  hdma: UART4 RX DMA handle
+ * @retval None
+ */
+static void Serial_DMA_RxHalfCplt(DMA_HandleTypeDef *hdma)
+{
+  (void)hdma;
+  RxRingWritten += SERIAL_RX_RING_SIZE / 2;
+}
+
+/**
+ * @brief  Bytes stored by the DMA since Serial_DMA_RxStart
+ * @note   The interrupt count gives the laps and the NDTR the position in
+ *         the ring. An interrupt still pending when the NDTR is read is
+ *         covered as long as it is less than one ring late.
+ * @param  None
+ * @retval Running count of received bytes, wraps at 2^32
+ */
+static uint32_t Serial_DMA_RxWritten(void)
+{
+  uint32_t written, head;
+
+  do
+  {
+    written = RxRingWritten;
+    head = (SERIAL_RX_RING_SIZE - __HAL_DMA_GET_COUNTER(UartHandle.hdmarx)) & SERIAL_RX_RING_MASK;
+  } while (written != RxRingWritten);
+
+  return written + ((head - written) & SERIAL_RX_RING_MASK);
+}
+
+/**
+ * @brief  Start continuous UART reception into the DMA ring
+ * @note   The UART HAL receive state is not touched, blocking HAL_UART_Receive
+ *         must not be used until Serial_DMA_RxStop() is called.
+ * @param  None
+ * @retval HAL_StatusTypeDef HAL_OK if the stream is running
+ */
+HAL_StatusTypeDef Serial_DMA_RxStart(void)
+{
+  RxRingRead = 0;
+  RxRingWritten = 0;
+
+  /* The half and full transfer interrupts count the laps of the ring */
+  UartHandle.hdmarx->XferHalfCpltCallback = Serial_DMA_RxHalfCplt;
+  UartHandle.hdmarx->XferCpltCallback = Serial_DMA_RxHalfCplt;
+  UartHandle.hdmarx->XferErrorCallback = NULL;
+  if (HAL_DMA_Start_IT(UartHandle.hdmarx, (uint32_t)&UartHandle.Instance->DR,
+                       (uint32_t)aRxRing, SERIAL_RX_RING_SIZE) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  /* Drop a stale byte / overrun left from the command line */
+  __HAL_UART_CLEAR_OREFLAG(&UartHandle);
+  SET_BIT(UartHandle.Instance->CR3, USART_CR3_DMAR);
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Stop the DMA ring and give the receiver back to the HAL
+ * @param  None
+ * @retval None
+ */
+void Serial_DMA_RxStop(void)
+{
+  CLEAR_BIT(UartHandle.Instance->CR3, USART_CR3_DMAR);
+  HAL_DMA_Abort(UartHandle.hdmarx);
+}
+
+/**
+ * @brief  Discard everything received so far, also clears an overrun
+ * @param  None
+ * @retval None
+ */
+void Serial_DMA_RxFlush(void)
+{
+  RxRingRead = Serial_DMA_RxWritten();
+}
+
+/**
+ * @brief  Check whether the DMA overwrote bytes not read yet
+ * @param  None
+ * @retval 1 after an overrun, until Serial_DMA_RxFlush or Serial_DMA_RxStart
+ */
+uint32_t Serial_DMA_RxOverrun(void)
+{
+  return (Serial_DMA_RxWritten() - RxRingRead) > SERIAL_RX_RING_SIZE;
+}
+
+/**
+ * @brief  Read bytes from the DMA receive ring
+ * @param  p_data: destination buffer
+ * @param  size: number of bytes to read
+ * @param  timeout: overall timeout in ms, 0 only takes what is already there
+ * @retval HAL_OK when all bytes were read, HAL_ERROR when the DMA lapped the
+ *         read position (the ring overran, see Serial_DMA_RxOverrun),
+ *         HAL_TIMEOUT otherwise
+ */
+HAL_StatusTypeDef Serial_DMA_Receive(uint8_t *p_data, uint32_t size, uint32_t timeout)
+{
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t avail, chunk, tail;
+
+  while (size > 0)
+  {
+    avail = Serial_DMA_RxWritten() - RxRingRead;
+    if (avail > SERIAL_RX_RING_SIZE)
+    {
+      return HAL_ERROR;
+    }
+    if (avail == 0)
+    {
+      if ((HAL_GetTick() - tickstart) >= timeout)
+      {
+        return HAL_TIMEOUT;
+      }
+      continue;
+    }
+
+    /* Copy up to the end of the ring, the wrap is handled on the next pass */
+    tail = RxRingRead & SERIAL_RX_RING_MASK;
+    chunk = SERIAL_RX_RING_SIZE - tail;
+    if (chunk > avail)
+    {
+      chunk = avail;
+    }
+    if (chunk > size)
+    {
+      chunk = size;
+    }
+    memcpy(p_data, &aRxRing[tail], chunk);
+    /* The DMA may have reached the copied bytes meanwhile */
+    if ((Serial_DMA_RxWritten() - RxRingRead) > SERIAL_RX_RING_SIZE)
+    {
+      return HAL_ERROR;
+    }
+    RxRingRead += chunk;
+    p_data += chunk;
+    size -= chunk;
+  }
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Start sending a buffer through the UART4 TX DMA stream
+ * @note   Returns at once, the buffer must stay untouched until
+ *         Serial_DMA_TxWait() returns.
+ * @param  p_data: data to send
+ * @param  size: number of bytes
+ * @retval HAL_StatusTypeDef HAL_OK if the transfer started
+ */
+HAL_StatusTypeDef Serial_DMA_Transmit(uint8_t *p_data, uint32_t size)
+{
+  if (HAL_DMA_Start(UartHandle.hdmatx, (uint32_t)p_data,
+                    (uint32_t)&UartHandle.Instance->DR, size) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  __HAL_UART_CLEAR_FLAG(&UartHandle, UART_FLAG_TC);
+  SET_BIT(UartHandle.Instance->CR3, USART_CR3_DMAT);
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Wait until a Serial_DMA_Transmit() transfer has left the UART
+ * @param  timeout: timeout in ms
+ * @retval HAL_StatusTypeDef HAL_OK if OK
+ */
+HAL_StatusTypeDef Serial_DMA_TxWait(uint32_t timeout)
+{
+  uint32_t tickstart = HAL_GetTick();
+  HAL_StatusTypeDef status = HAL_OK;
+
+  if (UartHandle.hdmatx->State == HAL_DMA_STATE_BUSY)
+  {
+    status = HAL_DMA_PollForTransfer(UartHandle.hdmatx, HAL_DMA_FULL_TRANSFER, timeout);
+  }
+
+  /* Last byte out of the shift register */
+  while ((status == HAL_OK) && (__HAL_UART_GET_FLAG(&UartHandle, UART_FLAG_TC) == RESET))
+  {
+    if ((HAL_GetTick() - tickstart) > timeout)
+    {
+      status = HAL_TIMEOUT;
+    }
+  }
+
+  CLEAR_BIT(UartHandle.Instance->CR3, USART_CR3_DMAT);
+  if (status != HAL_OK)
+  {
+    __HAL_DMA_DISABLE(UartHandle.hdmatx);
+    UartHandle.hdmatx->State = HAL_DMA_STATE_READY;
+    __HAL_UNLOCK(UartHandle.hdmatx);
+  }
+
+  return status;
+}
+
 /**
  * @}
  */
@@ -29,6 +29,9 @@
 #define TX_TIMEOUT ((uint32_t)100)
 #define RX_TIMEOUT ((uint32_t)0xFFFFFFFF)
 
+/* UART4 DMA receive ring, must be a power of two and hold several 1K packets */
+#define SERIAL_RX_RING_SIZE ((uint32_t)4096)
+
 /* Exported macro ------------------------------------------------------------*/
 #define IS_CAP_LETTER(c) (((c) >= 'A') && ((c) <= 'F'))
 #define IS_LC_LETTER(c) (((c) >= 'a') && ((c) <= 'f'))
@@ -49,6 +52,13 @@ void Int2Str(uint8_t *p_str, uint32_t intnum);
 uint32_t Str2Int(uint8_t *inputstr, uint32_t *intnum);
 void Serial_PutString(uint8_t *p_string);
 HAL_StatusTypeDef Serial_PutByte(uint8_t param);
+HAL_StatusTypeDef Serial_DMA_RxStart(void);
+void Serial_DMA_RxStop(void);
+void Serial_DMA_RxFlush(void);
+uint32_t Serial_DMA_RxOverrun(void);
+HAL_StatusTypeDef Serial_DMA_Receive(uint8_t *p_data, uint32_t size, uint32_t timeout);
+HAL_StatusTypeDef Serial_DMA_Transmit(uint8_t *p_data, uint32_t size);
+HAL_StatusTypeDef Serial_DMA_TxWait(uint32_t timeout);
 
 #endif /* __COMMON_H */
 
@@ -0,0 +1,22 @@
+/**
+ ******************************************************************************
+ * @file    IAP/crc32.h
+ * @brief   CRC-32 (IEEE 802.3, as zlib and PC tools compute it) of files and
+ *          buffers.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CRC32_H
+#define __CRC32_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+
+/* Exported constants --------------------------------------------------------*/
+#define CRC32_INIT ((uint32_t)0)
+
+/* Exported functions ------------------------------------------------------- */
+uint32_t Crc32_Update(uint32_t crc, const uint8_t *p_data, uint32_t length);
+
+#endif /* __CRC32_H */
@@ -78,6 +78,46 @@ uint32_t FLASH_If_Erase(uint32_t StartSector)
   return (0);
 }
 
+/**
+ * @brief  This function does an erase of all the sectors covering an area
+ * @param  StartAddress: start of the area
+ * @param  Size: size of the area in bytes (0 erases the first sector only)
+ * @retval 0: the area was successfully erased
+ *         1: Error occurred
+ */
+uint32_t FLASH_If_EraseRange(uint32_t StartAddress, uint32_t Size)
+{
+  uint32_t EndAddress;
+  uint32_t SectorError;
+  FLASH_EraseInitTypeDef pEraseInit;
+
+  if (Size == 0)
+  {
+    Size = 1;
+  }
+  EndAddress = StartAddress + Size - 1;
+  if (EndAddress > USER_FLASH_END_ADDRESS)
+  {
+    EndAddress = USER_FLASH_END_ADDRESS;
+  }
+
+  /* Unlock the Flash to enable the flash control register access *************/
+  FLASH_If_Init();
+
+  pEraseInit.TypeErase = TYPEERASE_SECTORS;
+  pEraseInit.Sector = GetSector(StartAddress);
+  pEraseInit.NbSectors = GetSector(EndAddress) - pEraseInit.Sector + 1;
+  pEraseInit.VoltageRange = VOLTAGE_RANGE_3;
+
+  if (HAL_FLASHEx_Erase(&pEraseInit, &SectorError) != HAL_OK)
+  {
+    /* Error occurred while sector erase */
+    return (1);
+  }
+
+  return (0);
+}
+
 /**
  * @brief  This function writes a data buffer in flash (data are 32-bit aligned).
  * @note   After writing data buffer, the flash content is checked.
@@ -73,6 +73,7 @@ enum
 /* Exported functions ------------------------------------------------------- */
 void FLASH_If_Init(void);
 uint32_t FLASH_If_Erase(uint32_t StartSector);
+uint32_t FLASH_If_EraseRange(uint32_t StartAddress, uint32_t Size);
 uint32_t FLASH_If_Write(uint32_t FlashAddress, uint32_t *Data, uint32_t DataLength);
 uint16_t FLASH_If_GetWriteProtectionStatus(void);
 HAL_StatusTypeDef FLASH_If_WriteProtectionConfig(uint32_t modifier);
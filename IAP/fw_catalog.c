@@ -0,0 +1,640 @@
+/**
+ ******************************************************************************
+ * @file    IAP/fw_catalog.c
+ * @brief   Catalog of the firmware images (.bin/.aes/.aex) on the TF card.
+ *          The catalog is saved in FW_CATALOG_INDEX with name, size, version,
+ *          CRC-32 and target of every image. FW_CATALOG_DIR is only walked
+ *          again when its time stamp changed, and then only new or modified
+ *          files are read. The root, which may hold thousands of other files,
+ *          is walked when no index exists and on an explicit rescan.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "fw_catalog.h"
+#include "common.h"
+#include "main.h"
+#include "crc32.h"
+#include "aes.h"
+#include "aes_seal.h"
+#include "image_sink.h"
+#include "io_arena.h"
+#include "ff.h"
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+/* Private define ------------------------------------------------------------*/
+#define FW_INDEX_MAGIC ((uint32_t)0x54435746) /* "FWCT" */
+#define FW_SCAN_BUFFER_SIZE ((uint32_t)4096)
+
+/* Private types -------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t magic;
+  uint16_t entry_size;
+  uint16_t count;
+  uint16_t dir_fdate;
+  uint16_t dir_ftime;
+  uint32_t crc;       /* CRC-32 of the entries */
+} FwCatalog_IndexTypeDef;
+
+/* Private variables ---------------------------------------------------------*/
+static FwCatalog_TypeDef Catalog;
+static FIL CatalogFile;
+static DIR CatalogDir;
+static FILINFO CatalogInfo;
+static union
+{
+  struct AES_stream stream;
+  struct AES_seal seal;
+} CatalogAes;
+
+static const char *const aSortLabel[FW_SORT_NB] = {"name", "version", "size"};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Case insensitive check of a file extension
+ * @param  name: file name
+ * @param  ext: extension with the dot
+ * @retval 1 if name ends with ext
+ */
+static uint32_t HasExtension(const char *name, const char *ext)
+{
+  const char *dot = strrchr(name, '.');
+
+  if (dot == NULL)
+  {
+    return 0;
+  }
+  while ((*dot != '\0') && (*ext != '\0'))
+  {
+    if (tolower((unsigned char)*dot++) != tolower((unsigned char)*ext++))
+    {
+      return 0;
+    }
+  }
+  return (*dot == '\0') && (*ext == '\0');
+}
+
+/**
+ * @brief  Find an entry by directory and name
+ * @param  name: file name
+ * @param  root: FW_ENTRY_ROOT or 0
+ * @retval entry or NULL
+ */
+static FwCatalog_EntryTypeDef *FwCatalog_Find(const char *name, uint8_t root)
+{
+  uint32_t i;
+
+  for (i = 0; i < Catalog.count; i++)
+  {
+    if (((Catalog.entry[i].flags & FW_ENTRY_ROOT) == root) && (strcmp(Catalog.entry[i].name, name) == 0))
+    {
+      return &Catalog.entry[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Read an image once for its CRC and U-Boot header
+ * @param  dir: directory of the file
+ * @param  entry: entry with name, flags and size set
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef FwCatalog_ReadImage(const char *dir, FwCatalog_EntryTypeDef *entry)
+{
+  char path[FW_CATALOG_NAME_LENGTH + 8];
+  uint32_t crc = CRC32_INIT, first = 1;
+  uint8_t *p_buffer;
+  UINT bytes_read;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, entry->name);
+  p_buffer = IoArena_Get(FW_SCAN_BUFFER_SIZE, "catalog scan");
+  if (p_buffer == NULL)
+  {
+    return COM_ERROR;
+  }
+  if (f_open(&CatalogFile, path, FA_READ) != FR_OK)
+  {
+    IoArena_Put(p_buffer);
+    return COM_ERROR;
+  }
+
+  for (;;)
+  {
+    if (f_read(&CatalogFile, p_buffer, FW_SCAN_BUFFER_SIZE, &bytes_read) != FR_OK)
+    {
+      f_close(&CatalogFile);
+      IoArena_Put(p_buffer);
+      return COM_ERROR;
+    }
+    if (bytes_read == 0)
+    {
+      break;
+    }
+
+    if (first)
+    {
+      first = 0;
+      FwCatalog_ParseHeader(p_buffer, bytes_read, entry);
+    }
+
+    crc = Crc32_Update(crc, p_buffer, bytes_read);
+  }
+
+  f_close(&CatalogFile);
+  IoArena_Put(p_buffer);
+  entry->crc = crc;
+  return COM_OK;
+}
+
+/**
+ * @brief  Bring the entries of one directory up to date
+ * @param  dir: directory to walk
+ * @param  root: FW_ENTRY_ROOT or 0
+ * @retval COM_OK or COM_ERROR if the directory cannot be read
+ */
+static COM_StatusTypeDef FwCatalog_ScanDir(const char *dir, uint8_t root)
+{
+  FwCatalog_EntryTypeDef *entry;
+  const char *stored_name;
+  uint32_t i, j;
+
+  for (i = 0; i < Catalog.count; i++)
+  {
+    Catalog.entry[i].flags &= (uint8_t)~FW_ENTRY_SEEN;
+  }
+
+  if (f_opendir(&CatalogDir, dir) != FR_OK)
+  {
+    return COM_ERROR;
+  }
+
+  while ((f_readdir(&CatalogDir, &CatalogInfo) == FR_OK) && (CatalogInfo.fname[0] != '\0'))
+  {
+    if ((CatalogInfo.fattrib & AM_DIR) ||
+        !(HasExtension(CatalogInfo.fname, ".bin") || HasExtension(CatalogInfo.fname, ".aes") ||
+          HasExtension(CatalogInfo.fname, ".aex")))
+    {
+      continue;
+    }
+    if (strlen(CatalogInfo.fname) >= FW_CATALOG_NAME_LENGTH)
+    {
+      Catalog.skipped++;
+      continue;
+    }
+
+    entry = FwCatalog_Find(CatalogInfo.fname, root);
+    if ((entry != NULL) && (entry->size == CatalogInfo.fsize) &&
+        (entry->fdate == CatalogInfo.fdate) && (entry->ftime == CatalogInfo.ftime))
+    {
+      /* Unchanged, keep CRC and version */
+      entry->flags |= FW_ENTRY_SEEN;
+      continue;
+    }
+
+    if (entry == NULL)
+    {
+      if (Catalog.count >= FW_CATALOG_MAX)
+      {
+        Catalog.skipped++;
+        continue;
+      }
+      entry = &Catalog.entry[Catalog.count++];
+      memset(entry, 0, sizeof(*entry));
+      strcpy(entry->name, CatalogInfo.fname);
+      entry->flags = root;
+      if (HasExtension(entry->name, ".aes"))
+      {
+        entry->flags |= FW_ENTRY_AES;
+      }
+      else if (HasExtension(entry->name, ".aex"))
+      {
+        entry->flags |= FW_ENTRY_SEALED;
+      }
+      entry->target = (uint8_t)ImageSink_Route(entry->name, &stored_name);
+    }
+
+    entry->size = (uint32_t)CatalogInfo.fsize;
+    entry->fdate = CatalogInfo.fdate;
+    entry->ftime = CatalogInfo.ftime;
+    Catalog.rescanned++;
+    if (FwCatalog_ReadImage(dir, entry) == COM_OK)
+    {
+      entry->flags |= FW_ENTRY_SEEN;
+    }
+  }
+  f_closedir(&CatalogDir);
+
+  /* Drop the files of this directory that are gone */
+  for (i = 0, j = 0; i < Catalog.count; i++)
+  {
+    if (((Catalog.entry[i].flags & FW_ENTRY_ROOT) != root) || (Catalog.entry[i].flags & FW_ENTRY_SEEN))
+    {
+      if (i != j)
+      {
+        Catalog.entry[j] = Catalog.entry[i];
+      }
+      Catalog.entry[j++].flags &= (uint8_t)~FW_ENTRY_SEEN;
+    }
+  }
+  Catalog.count = j;
+  return COM_OK;
+}
+
+/**
+ * @brief  Read the index file
+ * @param  None
+ * @retval COM_OK if a valid index was loaded
+ */
+static COM_StatusTypeDef FwCatalog_ReadIndex(void)
+{
+  FwCatalog_IndexTypeDef index;
+  UINT bytes_read;
+  uint32_t length;
+  COM_StatusTypeDef status = COM_ERROR;
+
+  if (f_open(&CatalogFile, FW_CATALOG_INDEX, FA_READ) != FR_OK)
+  {
+    return COM_ERROR;
+  }
+
+  if ((f_read(&CatalogFile, &index, sizeof(index), &bytes_read) == FR_OK) && (bytes_read == sizeof(index)) &&
+      (index.magic == FW_INDEX_MAGIC) && (index.entry_size == sizeof(FwCatalog_EntryTypeDef)) &&
+      (index.count <= FW_CATALOG_MAX))
+  {
+    length = index.count * sizeof(FwCatalog_EntryTypeDef);
+    if ((f_read(&CatalogFile, Catalog.entry, length, &bytes_read) == FR_OK) && (bytes_read == length) &&
+        (Crc32_Update(CRC32_INIT, (const uint8_t *)Catalog.entry, length) == index.crc))
+    {
+      Catalog.count = index.count;
+      Catalog.dir_fdate = index.dir_fdate;
+      Catalog.dir_ftime = index.dir_ftime;
+      status = COM_OK;
+    }
+  }
+
+  f_close(&CatalogFile);
+  return status;
+}
+
+/**
+ * @brief  Save the catalog to the index file
+ * @param  None
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef FwCatalog_WriteIndex(void)
+{
+  FwCatalog_IndexTypeDef index;
+  UINT bytes_written;
+  uint32_t length = Catalog.count * sizeof(FwCatalog_EntryTypeDef);
+  FRESULT res;
+
+  index.magic = FW_INDEX_MAGIC;
+  index.entry_size = sizeof(FwCatalog_EntryTypeDef);
+  index.count = (uint16_t)Catalog.count;
+  index.dir_fdate = Catalog.dir_fdate;
+  index.dir_ftime = Catalog.dir_ftime;
+  index.crc = Crc32_Update(CRC32_INIT, (const uint8_t *)Catalog.entry, length);
+
+  if (f_open(&CatalogFile, FW_CATALOG_INDEX, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+  {
+    return COM_ERROR;
+  }
+  res = f_write(&CatalogFile, &index, sizeof(index), &bytes_written);
+  if ((res == FR_OK) && (length != 0))
+  {
+    res = f_write(&CatalogFile, Catalog.entry, length, &bytes_written);
+  }
+  if (f_close(&CatalogFile) != FR_OK)
+  {
+    res = FR_DISK_ERR;
+  }
+  return (res == FR_OK) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Compare two entries for the current sort order
+ * @param  a: first entry
+ * @param  b: second entry
+ * @retval < 0 if a comes first
+ */
+static int32_t FwCatalog_Compare(const FwCatalog_EntryTypeDef *a, const FwCatalog_EntryTypeDef *b)
+{
+  switch (Catalog.sort)
+  {
+  case FW_SORT_VERSION:
+    if (a->version != b->version)
+    {
+      return (a->version > b->version) ? -1 : 1;
+    }
+    break;
+  case FW_SORT_SIZE:
+    if (a->size != b->size)
+    {
+      return (a->size < b->size) ? -1 : 1;
+    }
+    break;
+  default:
+    break;
+  }
+  return strcmp(a->name, b->name);
+}
+
+/**
+ * @brief  Print one page of the catalog
+ * @param  title: heading
+ * @param  page: page number from 0
+ * @param  pages: number of pages
+ * @retval None
+ */
+static void FwCatalog_ShowPage(const char *title, uint32_t page, uint32_t pages)
+{
+  char line[FW_CATALOG_NAME_LENGTH + FW_CATALOG_LABEL_LENGTH + 64];
+  const FwCatalog_EntryTypeDef *entry;
+  uint32_t i, index;
+
+  snprintf(line, sizeof(line), "\r\n %s (%lu images, page %lu/%lu, by %s):\r\n", title,
+           (unsigned long)Catalog.count, (unsigned long)(page + 1), (unsigned long)pages,
+           aSortLabel[Catalog.sort]);
+  Serial_PutString((uint8_t *)line);
+
+  for (i = 0; i < FW_CATALOG_PAGE_SIZE; i++)
+  {
+    index = page * FW_CATALOG_PAGE_SIZE + i;
+    if (index >= Catalog.count)
+    {
+      break;
+    }
+    entry = &Catalog.entry[Catalog.order[index]];
+    snprintf(line, sizeof(line), "  [%lu] %s%s %lu bytes crc %08lX", (unsigned long)(i + 1),
+             (entry->flags & FW_ENTRY_ROOT) ? "/" : "fw/", entry->name, (unsigned long)entry->size,
+             (unsigned long)entry->crc);
+    Serial_PutString((uint8_t *)line);
+    if (entry->flags & FW_ENTRY_UIMAGE)
+    {
+      snprintf(line, sizeof(line), " \"%s\" t=%lu", entry->label, (unsigned long)entry->version);
+      Serial_PutString((uint8_t *)line);
+    }
+    Serial_PutString((uint8_t *)"\r\n");
+  }
+  if (Catalog.skipped != 0)
+  {
+    snprintf(line, sizeof(line), "  (%lu images not listed: catalog full or name too long)\r\n",
+             (unsigned long)Catalog.skipped);
+    Serial_PutString((uint8_t *)line);
+  }
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Load the catalog of the mounted TF card, refreshing it if needed
+ * @param  full_rescan: 1 to walk the root and re-read every image
+ * @retval COM_OK, COM_ERROR if the card cannot be read
+ */
+COM_StatusTypeDef FwCatalog_Load(uint32_t full_rescan)
+{
+  FRESULT res;
+  uint32_t dirty = 0, scan_root = full_rescan;
+
+  Catalog.rescanned = 0;
+  Catalog.skipped = 0;
+
+  res = f_stat(FW_CATALOG_DIR, &CatalogInfo);
+  if (res == FR_NO_FILE)
+  {
+    if (f_mkdir(FW_CATALOG_DIR) != FR_OK)
+    {
+      return COM_ERROR;
+    }
+    res = f_stat(FW_CATALOG_DIR, &CatalogInfo);
+  }
+  if (res != FR_OK)
+  {
+    return COM_ERROR;
+  }
+
+  if (full_rescan || (FwCatalog_ReadIndex() != COM_OK))
+  {
+    Catalog.count = 0;
+    scan_root = 1;
+    dirty = 1;
+  }
+
+  if (scan_root)
+  {
+    Serial_PutString((uint8_t *)"Indexing the TF card root...\r\n");
+    if (FwCatalog_ScanDir("0:", FW_ENTRY_ROOT) != COM_OK)
+    {
+      return COM_ERROR;
+    }
+  }
+
+  if (dirty || (CatalogInfo.fdate != Catalog.dir_fdate) || (CatalogInfo.ftime != Catalog.dir_ftime))
+  {
+    if (FwCatalog_ScanDir(FW_CATALOG_DIR, 0) != COM_OK)
+    {
+      return COM_ERROR;
+    }
+    Catalog.dir_fdate = CatalogInfo.fdate;
+    Catalog.dir_ftime = CatalogInfo.ftime;
+    dirty = 1;
+  }
+
+  if (dirty && (FwCatalog_WriteIndex() != COM_OK))
+  {
+    Serial_PutString((uint8_t *)"Warning: cannot save " FW_CATALOG_INDEX "\r\n");
+  }
+
+  FwCatalog_Sort(Catalog.sort);
+  return COM_OK;
+}
+
+/**
+ * @brief  Order the entries for the menu
+ * @param  sort: key
+ * @retval None
+ */
+void FwCatalog_Sort(FwCatalog_SortTypeDef sort)
+{
+  uint32_t i, j;
+  uint8_t index;
+
+  Catalog.sort = (sort < FW_SORT_NB) ? sort : FW_SORT_NAME;
+  for (i = 0; i < Catalog.count; i++)
+  {
+    Catalog.order[i] = (uint8_t)i;
+  }
+
+  /* Insertion sort, at most FW_CATALOG_MAX entries */
+  for (i = 1; i < Catalog.count; i++)
+  {
+    index = Catalog.order[i];
+    for (j = i; (j > 0) && (FwCatalog_Compare(&Catalog.entry[index], &Catalog.entry[Catalog.order[j - 1]]) < 0); j--)
+    {
+      Catalog.order[j] = Catalog.order[j - 1];
+    }
+    Catalog.order[j] = index;
+  }
+}
+
+/**
+ * @brief  Let the user pick an image, page by page
+ * @param  title: heading of the list
+ * @retval selected entry, NULL if aborted or the catalog is empty
+ */
+const FwCatalog_EntryTypeDef *FwCatalog_Select(const char *title)
+{
+  uint32_t page = 0, pages, count;
+  uint8_t key;
+
+  for (;;)
+  {
+    if (Catalog.count == 0)
+    {
+      Serial_PutString((uint8_t *)"No bin, aes or aex files found!\r\n");
+      return NULL;
+    }
+    pages = (Catalog.count + FW_CATALOG_PAGE_SIZE - 1) / FW_CATALOG_PAGE_SIZE;
+    if (page >= pages)
+    {
+      page = pages - 1;
+    }
+    count = Catalog.count - page * FW_CATALOG_PAGE_SIZE;
+    if (count > FW_CATALOG_PAGE_SIZE)
+    {
+      count = FW_CATALOG_PAGE_SIZE;
+    }
+
+    FwCatalog_ShowPage(title, page, pages);
+    Serial_PutString((uint8_t *)"\r\n Select 1-9, n/p next/previous page, s sort, r rescan, a abort: ");
+
+    if (HAL_UART_Receive(&UartHandle, &key, 1, RX_TIMEOUT) != HAL_OK)
+    {
+      continue;
+    }
+    Serial_PutString((uint8_t *)"\r\n");
+
+    if ((key >= '1') && (key < '1' + count))
+    {
+      return &Catalog.entry[Catalog.order[page * FW_CATALOG_PAGE_SIZE + key - '1']];
+    }
+    switch (key)
+    {
+    case 'n':
+    case 'N':
+      page = (page + 1 < pages) ? page + 1 : 0;
+      break;
+    case 'p':
+    case 'P':
+      page = (page > 0) ? page - 1 : pages - 1;
+      break;
+    case 's':
+    case 'S':
+      FwCatalog_Sort((FwCatalog_SortTypeDef)((Catalog.sort + 1) % FW_SORT_NB));
+      page = 0;
+      break;
+    case 'r':
+    case 'R':
+      if (FwCatalog_Load(1) != COM_OK)
+      {
+        Serial_PutString((uint8_t *)"Failed to read the TF card!\r\n");
+        return NULL;
+      }
+      page = 0;
+      break;
+    case 'a':
+    case 'A':
+      Serial_PutString((uint8_t *)"Operation aborted!\r\n");
+      return NULL;
+    default:
+      Serial_PutString((uint8_t *)"Invalid input!\r\n");
+      break;
+    }
+  }
+}
+
+/**
+ * @brief  Take version and label from the U-Boot header at the start of an
+ *         image, decrypting it first for an .aes or .aex file. The header of
+ *         a sealed image is authenticated, its first record is not: the
+ *         version shown is only trusted once the image is installed.
+ * @param  p_data: first bytes of the file
+ * @param  length: number of bytes, at least 68 (.aex: 112) are needed
+ * @param  entry: entry with FW_ENTRY_AES or FW_ENTRY_SEALED set as needed
+ * @retval 1 if a header was found
+ */
+uint32_t FwCatalog_ParseHeader(const uint8_t *p_data, uint32_t length, FwCatalog_EntryTypeDef *entry)
+{
+  uint8_t plain[sizeof(image_header_t) + AES_BLOCKLEN];
+  const image_header_t *header = NULL;
+
+  entry->version = 0;
+  entry->label[0] = '\0';
+  entry->flags &= (uint8_t)~FW_ENTRY_UIMAGE;
+
+  if (entry->flags & FW_ENTRY_SEALED)
+  {
+    if (length >= AES_SEAL_HEADER_SIZE + sizeof(image_header_t))
+    {
+      AES_seal_init(&CatalogAes.seal, AES_image_key);
+      if ((AES_seal_open(&CatalogAes.seal, p_data) == AES_SEAL_OK) &&
+          (CatalogAes.seal.size >= sizeof(image_header_t)))
+      {
+        AES_seal_peek(&CatalogAes.seal, p_data + AES_SEAL_HEADER_SIZE, plain, sizeof(image_header_t));
+        header = (const image_header_t *)plain;
+      }
+    }
+  }
+  else if (!(entry->flags & FW_ENTRY_AES))
+  {
+    if (length >= sizeof(image_header_t))
+    {
+      header = (const image_header_t *)p_data;
+    }
+  }
+  else if (length >= AES_FILE_HEADER_SIZE + sizeof(image_header_t))
+  {
+    /* The header is in the first four blocks */
+    AES_CBC_stream_init(&CatalogAes.stream, AES_image_key, AES_image_iv);
+    if (AES_CBC_stream_decrypt(&CatalogAes.stream, p_data, AES_FILE_HEADER_SIZE + sizeof(image_header_t), plain) >=
+        sizeof(image_header_t))
+    {
+      header = (const image_header_t *)plain;
+    }
+  }
+
+  if ((header == NULL) || (header->ih_magic != UBOOT_MAGIC))
+  {
+    return 0;
+  }
+  entry->version = header->ih_time;
+  memcpy(entry->label, header->ih_name, FW_CATALOG_LABEL_LENGTH - 1);
+  entry->label[FW_CATALOG_LABEL_LENGTH - 1] = '\0';
+  entry->flags |= FW_ENTRY_UIMAGE;
+  return 1;
+}
+
+/**
+ * @brief  Full FatFs path of an entry
+ * @param  entry: catalog entry
+ * @param  path: output buffer
+ * @param  size: size of path
+ * @retval None
+ */
+void FwCatalog_Path(const FwCatalog_EntryTypeDef *entry, char *path, uint32_t size)
+{
+  snprintf(path, size, "%s/%s", (entry->flags & FW_ENTRY_ROOT) ? "0:" : FW_CATALOG_DIR, entry->name);
+}
+
+/**
+ * @}
+ */
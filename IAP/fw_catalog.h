@@ -0,0 +1,79 @@
+/**
+ ******************************************************************************
+ * @file    IAP/fw_catalog.h
+ * @brief   Catalog of the firmware images on the TF card, kept in an index
+ *          file so the card is not walked on every visit of the menus.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FW_CATALOG_H
+#define __FW_CATALOG_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Images are looked for in FW_CATALOG_DIR and, on a full rescan, in the root */
+#define FW_CATALOG_DIR          "0:/fw"
+#define FW_CATALOG_INDEX        "0:/fw/index"
+#define FW_CATALOG_MAX          ((uint32_t)96)
+#define FW_CATALOG_NAME_LENGTH  ((uint32_t)48)
+#define FW_CATALOG_LABEL_LENGTH ((uint32_t)24)
+/* Entries per menu page, selected with keys 1-9 */
+#define FW_CATALOG_PAGE_SIZE    ((uint32_t)9)
+
+/* FwCatalog_EntryTypeDef flags */
+#define FW_ENTRY_ROOT   ((uint8_t)0x01) /* In the root, else in FW_CATALOG_DIR */
+#define FW_ENTRY_AES    ((uint8_t)0x02) /* Made by AES_encrypt_file */
+#define FW_ENTRY_UIMAGE ((uint8_t)0x04) /* version and label from a U-Boot header */
+#define FW_ENTRY_SEALED ((uint8_t)0x08) /* Made by AES_seal_file */
+#define FW_ENTRY_SEEN   ((uint8_t)0x80) /* Found again by the running rescan */
+
+/* Exported types ------------------------------------------------------------*/
+typedef enum
+{
+  FW_SORT_NAME = 0,
+  FW_SORT_VERSION, /* Newest first */
+  FW_SORT_SIZE,
+  FW_SORT_NB
+} FwCatalog_SortTypeDef;
+
+/**
+ * @brief  One image, stored as is in the index file
+ */
+typedef struct
+{
+  char name[FW_CATALOG_NAME_LENGTH];   /* File name without directory */
+  char label[FW_CATALOG_LABEL_LENGTH]; /* ih_name of the U-Boot header */
+  uint32_t size;                       /* File size */
+  uint32_t crc;                        /* CRC-32 of the whole file */
+  uint32_t version;                    /* ih_time of the U-Boot header, 0 if none */
+  uint16_t fdate;                      /* File time stamp, used to spot changes */
+  uint16_t ftime;
+  uint8_t flags;
+  uint8_t target;                      /* ImageSink_TargetTypeDef the name routes to */
+  uint16_t reserved;
+} FwCatalog_EntryTypeDef;
+
+typedef struct
+{
+  uint32_t count;
+  uint32_t skipped;   /* Images left out: catalog full or name too long */
+  uint32_t rescanned; /* Files read by the last refresh */
+  uint16_t dir_fdate; /* Time stamp of FW_CATALOG_DIR when indexed */
+  uint16_t dir_ftime;
+  FwCatalog_SortTypeDef sort;
+  uint8_t order[FW_CATALOG_MAX];
+  FwCatalog_EntryTypeDef entry[FW_CATALOG_MAX];
+} FwCatalog_TypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+COM_StatusTypeDef FwCatalog_Load(uint32_t full_rescan);
+void FwCatalog_Sort(FwCatalog_SortTypeDef sort);
+const FwCatalog_EntryTypeDef *FwCatalog_Select(const char *title);
+void FwCatalog_Path(const FwCatalog_EntryTypeDef *entry, char *path, uint32_t size);
+uint32_t FwCatalog_ParseHeader(const uint8_t *p_data, uint32_t length, FwCatalog_EntryTypeDef *entry);
+
+#endif /* __FW_CATALOG_H */
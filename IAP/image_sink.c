@@ -0,0 +1,611 @@
+/**
+ ******************************************************************************
+ * @file    IAP/image_sink.c
+ * @brief   Streaming destinations for received images. Data is staged in a
+ *          4 KB buffer and handed to the backend in whole blocks, so the
+ *          SPI Flash sees full LittleFS blocks and the TF card multi-sector
+ *          writes.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "image_sink.h"
+#include "io_arena.h"
+#include "flash_if.h"
+#include "fatfs.h"
+#include "lfs_spi_flash_adapter.h"
+#include "storage.h"
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+/* Private function prototypes -----------------------------------------------*/
+static COM_StatusTypeDef FlashSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size);
+static COM_StatusTypeDef FlashSink_Program(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length);
+static COM_StatusTypeDef FlashSink_Close(ImageSink_TypeDef *sink, uint32_t commit);
+static COM_StatusTypeDef LfsSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size);
+static COM_StatusTypeDef LfsSink_Program(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length);
+static COM_StatusTypeDef LfsSink_Close(ImageSink_TypeDef *sink, uint32_t commit);
+static COM_StatusTypeDef SdSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size);
+static COM_StatusTypeDef SdSink_Program(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length);
+static COM_StatusTypeDef SdSink_Close(ImageSink_TypeDef *sink, uint32_t commit);
+
+/* Private typedef -----------------------------------------------------------*/
+/**
+ * @brief  Batch routing rule, a file matches on its prefix or its extension
+ */
+typedef struct
+{
+  const char *prefix;             /* Matched and stripped from the stored name */
+  const char *suffix;             /* Matched case-insensitively */
+  ImageSink_TargetTypeDef target;
+  ImageSink_TargetTypeDef next;   /* Used instead once the session wrote the
+                                     application */
+} ImageSink_RouteTypeDef;
+
+/* Private variables ---------------------------------------------------------*/
+static const ImageSink_OpsTypeDef aTargetOps[IMAGE_TARGET_NB] =
+{
+  {FlashSink_Open, FlashSink_Program, FlashSink_Close},
+  {LfsSink_Open, LfsSink_Program, LfsSink_Close},
+  {SdSink_Open, SdSink_Program, SdSink_Close},
+};
+
+static const char *const aTargetLabel[IMAGE_TARGET_NB] =
+{
+  "internal Flash",
+  "SPI Flash (LittleFS)",
+  "TF card",
+};
+
+/* First match wins, the last entry catches everything else. A session
+   writes the application once: the first .bin without a prefix goes to the
+   internal Flash, the later ones to the TF card, so a batch of several .bin
+   files is not cancelled. A second flash_ file is still refused. */
+static const ImageSink_RouteTypeDef aRouteTable[] =
+{
+  {"flash_", NULL, IMAGE_TARGET_FLASH, IMAGE_TARGET_FLASH},
+  {"lfs_", NULL, IMAGE_TARGET_LFS, IMAGE_TARGET_LFS},
+  {"sd_", NULL, IMAGE_TARGET_SD, IMAGE_TARGET_SD},
+  {NULL, ".bin", IMAGE_TARGET_FLASH, IMAGE_TARGET_SD}, /* application image */
+  {NULL, ".aes", IMAGE_TARGET_LFS, IMAGE_TARGET_LFS},  /* encrypted images, installed later */
+  {NULL, ".aex", IMAGE_TARGET_LFS, IMAGE_TARGET_LFS},  /* sealed images, installed later */
+  {NULL, ".cfg", IMAGE_TARGET_LFS, IMAGE_TARGET_LFS},  /* configuration files */
+  {NULL, ".ini", IMAGE_TARGET_LFS, IMAGE_TARGET_LFS},
+  {NULL, ".json", IMAGE_TARGET_LFS, IMAGE_TARGET_LFS},
+  {NULL, NULL, IMAGE_TARGET_SD, IMAGE_TARGET_SD},      /* resources and everything else */
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Erase the application area needed by the image
+ * @param  sink: sink being opened
+ * @param  name: file name, unused
+ * @param  size: image size, 0 if unknown
+ * @retval COM_OK, COM_LIMIT if the image does not fit, COM_DATA on erase error
+ */
+static COM_StatusTypeDef FlashSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size)
+{
+  (void)name;
+
+  if (size > USER_FLASH_SIZE)
+  {
+    return COM_LIMIT;
+  }
+
+  /* All sectors at once: no long erase stall in the middle of a transfer */
+  if (FLASH_If_EraseRange(APPLICATION_ADDRESS, (size != 0) ? size : USER_FLASH_SIZE) != 0)
+  {
+    return COM_DATA;
+  }
+
+  sink->address = APPLICATION_ADDRESS;
+  return COM_OK;
+}
+
+/**
+ * @brief  Program a block into the application area
+ * @param  sink: open sink
+ * @param  data: 32bit aligned data
+ * @param  length: number of bytes, the last word is padded with 0xFF
+ * @retval COM_OK or COM_DATA on write/verify error
+ */
+static COM_StatusTypeDef FlashSink_Program(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length)
+{
+  uint32_t words = length / 4;
+  uint32_t last = 0xFFFFFFFF;
+
+  if ((sink->address + length - 1) > USER_FLASH_END_ADDRESS)
+  {
+    return COM_LIMIT;
+  }
+
+  if ((words != 0) && (FLASH_If_Write(sink->address, (uint32_t *)data, words) != FLASHIF_OK))
+  {
+    return COM_DATA;
+  }
+  sink->address += words * 4;
+
+  if (length & 3)
+  {
+    memcpy(&last, &data[words * 4], length & 3);
+    if (FLASH_If_Write(sink->address, &last, 1) != FLASHIF_OK)
+    {
+      return COM_DATA;
+    }
+    sink->address += 4;
+  }
+
+  return COM_OK;
+}
+
+/**
+ * @brief  Nothing to release for the internal Flash
+ * @param  sink: open sink
+ * @param  commit: unused, a partial image is rejected by the header check
+ * @retval COM_OK
+ */
+static COM_StatusTypeDef FlashSink_Close(ImageSink_TypeDef *sink, uint32_t commit)
+{
+  (void)sink;
+  (void)commit;
+  return COM_OK;
+}
+
+/**
+ * @brief  Take the LittleFS session and create the destination file
+ * @param  sink: sink being opened
+ * @param  name: file name
+ * @param  size: image size, unused
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef LfsSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size)
+{
+  (void)size;
+
+  if (Storage_Acquire(STORAGE_LFS) != COM_OK)
+  {
+    return COM_ERROR;
+  }
+
+  snprintf(sink->path, sizeof(sink->path), "%s", name);
+  if (lfs_spi_flash_file_open(&lfs_instance, &sink->file.lfs, sink->path,
+                              LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) != LFS_ERR_OK)
+  {
+    Storage_Release(STORAGE_LFS);
+    return COM_ERROR;
+  }
+
+  return COM_OK;
+}
+
+/**
+ * @brief  Append a block to the LittleFS file
+ * @param  sink: open sink
+ * @param  data: data to write
+ * @param  length: number of bytes
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef LfsSink_Program(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length)
+{
+  if (lfs_file_write(&lfs_instance, &sink->file.lfs, data, length) != (lfs_ssize_t)length)
+  {
+    return COM_DATA;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Close the LittleFS file, drop it if incomplete, and release the
+ *         session
+ * @param  sink: open sink
+ * @param  commit: 0 removes the file
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef LfsSink_Close(ImageSink_TypeDef *sink, uint32_t commit)
+{
+  COM_StatusTypeDef status = COM_OK;
+
+  if (lfs_file_close(&lfs_instance, &sink->file.lfs) != LFS_ERR_OK)
+  {
+    status = COM_DATA;
+  }
+  if ((commit == 0) || (status != COM_OK))
+  {
+    lfs_remove(&lfs_instance, sink->path);
+  }
+  Storage_Release(STORAGE_LFS);
+
+  return status;
+}
+
+/**
+ * @brief  Take the TF card session and create the destination file
+ * @param  sink: sink being opened
+ * @param  name: file name
+ * @param  size: image size, unused
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef SdSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size)
+{
+  (void)size;
+
+  if (Storage_Acquire(STORAGE_TF) != COM_OK)
+  {
+    return COM_ERROR;
+  }
+
+  snprintf(sink->path, sizeof(sink->path), "0:/%s", name);
+  if (f_open(&sink->file.fil, sink->path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+  {
+    Storage_Release(STORAGE_TF);
+    return COM_ERROR;
+  }
+
+  return COM_OK;
+}
+
+/**
+ * @brief  Append a block to the FatFs file
+ * @param  sink: open sink
+ * @param  data: data to write
+ * @param  length: number of bytes
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef SdSink_Program(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length)
+{
+  UINT bw;
+
+  if ((f_write(&sink->file.fil, data, length, &bw) != FR_OK) || (bw != length))
+  {
+    return COM_DATA;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Close the FatFs file, drop it if incomplete, and release the
+ *         session
+ * @param  sink: open sink
+ * @param  commit: 0 removes the file
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef SdSink_Close(ImageSink_TypeDef *sink, uint32_t commit)
+{
+  COM_StatusTypeDef status = COM_OK;
+
+  if (f_close(&sink->file.fil) != FR_OK)
+  {
+    status = COM_DATA;
+  }
+  if ((commit == 0) || (status != COM_OK))
+  {
+    f_unlink(sink->path);
+  }
+  Storage_Release(STORAGE_TF);
+
+  return status;
+}
+
+/**
+ * @brief  Case-insensitive check of a file name extension
+ * @param  name: file name
+ * @param  suffix: extension including the dot
+ * @retval 1 if name ends with suffix
+ */
+static uint32_t EndsWith(const char *name, const char *suffix)
+{
+  size_t name_len = strlen(name);
+  size_t suffix_len = strlen(suffix);
+  const char *p;
+
+  if (name_len < suffix_len)
+  {
+    return 0;
+  }
+  /* Only formed once it is known to point inside name */
+  p = name + name_len - suffix_len;
+  while (*suffix != '\0')
+  {
+    if (tolower((unsigned char)*p++) != tolower((unsigned char)*suffix++))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief  Common part of the sink constructors
+ * @param  sink: sink to set up
+ * @param  target: fixed backend, ignored when routed
+ * @param  routed: 1 to pick the backend from each file name
+ * @retval None
+ */
+static void ImageSink_Setup(ImageSink_TypeDef *sink, ImageSink_TargetTypeDef target, uint32_t routed)
+{
+  sink->target = target;
+  sink->ops = &aTargetOps[target];
+  sink->label = routed ? "routed by file name" : aTargetLabel[target];
+  sink->routed = routed;
+  sink->flash_used = 0;
+  sink->is_open = 0;
+  sink->size = 0;
+  sink->written = 0;
+  sink->fill = 0;
+  sink->address = 0;
+  sink->path[0] = '\0';
+  sink->buffer = NULL;
+  sink->log_count = 0;
+}
+
+/**
+ * @brief  Record the outcome of a file in the session log
+ * @param  sink: sink
+ * @param  status: result to store in the current entry
+ * @retval None
+ */
+static void ImageSink_LogStatus(ImageSink_TypeDef *sink, COM_StatusTypeDef status)
+{
+  if ((sink->log_count > 0) && (sink->log_count <= IMAGE_SINK_LOG_SIZE))
+  {
+    sink->log[sink->log_count - 1].status = status;
+  }
+}
+
+/**
+ * @brief  Find the routing rule of a file
+ * @param  name: received file name
+ * @param  p_stored_name: set to the name to store the file under
+ * @retval first matching entry of aRouteTable
+ */
+static const ImageSink_RouteTypeDef *ImageSink_FindRoute(const char *name, const char **p_stored_name)
+{
+  const ImageSink_RouteTypeDef *route;
+  size_t len;
+
+  for (route = aRouteTable; ; route++)
+  {
+    if (route->prefix != NULL)
+    {
+      len = strlen(route->prefix);
+      if ((strncmp(name, route->prefix, len) == 0) && (name[len] != '\0'))
+      {
+        *p_stored_name = name + len;
+        return route;
+      }
+    }
+    else if ((route->suffix == NULL) || EndsWith(name, route->suffix))
+    {
+      *p_stored_name = name;
+      return route;
+    }
+  }
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Sink programming the image at APPLICATION_ADDRESS
+ * @param  sink: sink to set up
+ * @retval None
+ */
+void ImageSink_InitFlash(ImageSink_TypeDef *sink)
+{
+  ImageSink_Setup(sink, IMAGE_TARGET_FLASH, 0);
+}
+
+/**
+ * @brief  Sink writing a file in the root of the SPI Flash LittleFS
+ * @param  sink: sink to set up
+ * @retval None
+ */
+void ImageSink_InitLfs(ImageSink_TypeDef *sink)
+{
+  ImageSink_Setup(sink, IMAGE_TARGET_LFS, 0);
+}
+
+/**
+ * @brief  Sink writing a file in the root of the TF card
+ * @param  sink: sink to set up
+ * @retval None
+ */
+void ImageSink_InitSd(ImageSink_TypeDef *sink)
+{
+  ImageSink_Setup(sink, IMAGE_TARGET_SD, 0);
+}
+
+/**
+ * @brief  Sink choosing the backend of every file from its name, used for
+ *         YMODEM batch sessions (see aRouteTable)
+ * @param  sink: sink to set up
+ * @retval None
+ */
+void ImageSink_InitRouted(ImageSink_TypeDef *sink)
+{
+  ImageSink_Setup(sink, IMAGE_TARGET_SD, 1);
+}
+
+/**
+ * @brief  Find the destination of a file, as the first file of a session
+ * @param  name: received file name
+ * @param  p_stored_name: set to the name to store the file under
+ * @retval ImageSink_TargetTypeDef destination
+ */
+ImageSink_TargetTypeDef ImageSink_Route(const char *name, const char **p_stored_name)
+{
+  return ImageSink_FindRoute(name, p_stored_name)->target;
+}
+
+/**
+ * @brief  Name of a destination
+ * @param  target: destination
+ * @retval string shown to the user
+ */
+const char *ImageSink_TargetLabel(ImageSink_TargetTypeDef target)
+{
+  return (target < IMAGE_TARGET_NB) ? aTargetLabel[target] : "?";
+}
+
+/**
+ * @brief  Start a new image
+ * @param  sink: sink set up by one of the ImageSink_Init functions
+ * @param  name: file name of the image
+ * @param  size: announced size, 0 if unknown
+ * @retval COM_StatusTypeDef result of the backend
+ */
+COM_StatusTypeDef ImageSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size)
+{
+  const ImageSink_RouteTypeDef *route;
+  COM_StatusTypeDef status;
+  ImageSink_LogTypeDef *entry;
+
+  sink->size = size;
+  sink->written = 0;
+  sink->fill = 0;
+
+  if (sink->routed)
+  {
+    route = ImageSink_FindRoute(name, &name);
+    sink->target = sink->flash_used ? route->next : route->target;
+    sink->ops = &aTargetOps[sink->target];
+  }
+
+  if (sink->log_count < IMAGE_SINK_LOG_SIZE)
+  {
+    entry = &sink->log[sink->log_count];
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->size = size;
+    entry->target = sink->target;
+    entry->status = COM_ERROR;
+  }
+  sink->log_count++;
+
+  /* A second application image would erase the first one, when routed only
+     a second flash_ file gets here */
+  if ((sink->target == IMAGE_TARGET_FLASH) && (sink->flash_used != 0))
+  {
+    status = COM_LIMIT;
+  }
+  else
+  {
+    sink->buffer = IoArena_Get(IMAGE_SINK_BUFFER_SIZE, "image sink");
+    status = (sink->buffer != NULL) ? sink->ops->Open(sink, name, size) : COM_ERROR;
+  }
+  if ((status == COM_OK) && (sink->target == IMAGE_TARGET_FLASH))
+  {
+    sink->flash_used = 1;
+  }
+  if (status != COM_OK)
+  {
+    IoArena_Put(sink->buffer);
+    sink->buffer = NULL;
+  }
+
+  sink->is_open = (status == COM_OK);
+  ImageSink_LogStatus(sink, status);
+  return status;
+}
+
+/**
+ * @brief  Stream image data into the sink
+ * @param  sink: open sink
+ * @param  data: data to write
+ * @param  length: number of bytes
+ * @retval COM_StatusTypeDef result of the backend
+ */
+COM_StatusTypeDef ImageSink_Write(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length)
+{
+  COM_StatusTypeDef status;
+  uint32_t chunk;
+
+  while (length > 0)
+  {
+    /* Whole aligned blocks are programmed from the caller's buffer */
+    if ((sink->fill == 0) && (length >= IMAGE_SINK_BUFFER_SIZE) && (((uint32_t)data & 3) == 0))
+    {
+      status = sink->ops->Program(sink, data, IMAGE_SINK_BUFFER_SIZE);
+      if (status != COM_OK)
+      {
+        ImageSink_LogStatus(sink, status);
+        return status;
+      }
+      sink->written += IMAGE_SINK_BUFFER_SIZE;
+      data += IMAGE_SINK_BUFFER_SIZE;
+      length -= IMAGE_SINK_BUFFER_SIZE;
+      continue;
+    }
+
+    chunk = IMAGE_SINK_BUFFER_SIZE - sink->fill;
+    if (chunk > length)
+    {
+      chunk = length;
+    }
+    memcpy(&sink->buffer[sink->fill], data, chunk);
+    sink->fill += chunk;
+    sink->written += chunk;
+    data += chunk;
+    length -= chunk;
+
+    if (sink->fill == IMAGE_SINK_BUFFER_SIZE)
+    {
+      sink->fill = 0;
+      status = sink->ops->Program(sink, sink->buffer, IMAGE_SINK_BUFFER_SIZE);
+      if (status != COM_OK)
+      {
+        ImageSink_LogStatus(sink, status);
+        return status;
+      }
+    }
+  }
+
+  return COM_OK;
+}
+
+/**
+ * @brief  Finish the image
+ * @param  sink: sink, nothing is done if it is not open
+ * @param  commit: 1 to keep the data, 0 to discard a partial file
+ * @retval COM_StatusTypeDef result of the last write and of the backend
+ */
+COM_StatusTypeDef ImageSink_Close(ImageSink_TypeDef *sink, uint32_t commit)
+{
+  COM_StatusTypeDef status = COM_OK;
+  COM_StatusTypeDef close_status;
+
+  if (!sink->is_open)
+  {
+    return COM_OK;
+  }
+
+  if ((commit != 0) && (sink->fill != 0))
+  {
+    status = sink->ops->Program(sink, sink->buffer, sink->fill);
+    if (status != COM_OK)
+    {
+      commit = 0;
+    }
+  }
+  sink->fill = 0;
+
+  close_status = sink->ops->Close(sink, commit);
+  sink->is_open = 0;
+  IoArena_Put(sink->buffer);
+  sink->buffer = NULL;
+
+  if (status == COM_OK)
+  {
+    status = close_status;
+  }
+  ImageSink_LogStatus(sink, ((status == COM_OK) && (commit == 0)) ? COM_ABORT : status);
+  return status;
+}
+
+/**
+ * @}
+ */
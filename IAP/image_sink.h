@@ -0,0 +1,95 @@
+/**
+ ******************************************************************************
+ * @file    IAP/image_sink.h
+ * @brief   Destinations an incoming image can be streamed into: the internal
+ *          Flash, a LittleFS file on the SPI Flash or a FatFs file on the TF
+ *          card.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __IMAGE_SINK_H
+#define __IMAGE_SINK_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+#include "ff.h"
+#include "lfs.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Staging buffer: one LittleFS block, eight SD sectors */
+#define IMAGE_SINK_BUFFER_SIZE ((uint32_t)4096)
+#define IMAGE_SINK_PATH_LENGTH ((uint32_t)80)
+/* Files remembered for the report of a batch session */
+#define IMAGE_SINK_LOG_SIZE    ((uint32_t)16)
+#define IMAGE_SINK_LOG_NAME    ((uint32_t)40)
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct ImageSink ImageSink_TypeDef;
+
+typedef enum
+{
+  IMAGE_TARGET_FLASH = 0,
+  IMAGE_TARGET_LFS,
+  IMAGE_TARGET_SD,
+  IMAGE_TARGET_NB
+} ImageSink_TargetTypeDef;
+
+/**
+ * @brief  One file of a session
+ */
+typedef struct
+{
+  char name[IMAGE_SINK_LOG_NAME];
+  uint32_t size;
+  ImageSink_TargetTypeDef target;
+  COM_StatusTypeDef status;
+} ImageSink_LogTypeDef;
+
+/**
+ * @brief  Backend of a sink, Program is always called with whole staging
+ *         buffers except for the last call before Close
+ */
+typedef struct
+{
+  COM_StatusTypeDef (*Open)(ImageSink_TypeDef *sink, const char *name, uint32_t size);
+  COM_StatusTypeDef (*Program)(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length);
+  COM_StatusTypeDef (*Close)(ImageSink_TypeDef *sink, uint32_t commit);
+} ImageSink_OpsTypeDef;
+
+struct ImageSink
+{
+  const ImageSink_OpsTypeDef *ops;   /* Backend of the open file */
+  const char *label;                 /* Shown to the user */
+  uint32_t routed;                   /* Backend chosen per file name */
+  ImageSink_TargetTypeDef target;    /* Backend of the open file */
+  uint32_t flash_used;               /* Application already written this session */
+  uint32_t is_open;
+  uint32_t size;                     /* Announced size, 0 if unknown */
+  uint32_t written;                  /* Bytes accepted by ImageSink_Write */
+  uint32_t fill;                     /* Bytes waiting in buffer */
+  uint32_t address;                  /* Flash backend: next address to program */
+  char path[IMAGE_SINK_PATH_LENGTH]; /* File backends: path of the open file */
+  union
+  {
+    lfs_file_t lfs;
+    FIL fil;
+  } file;
+  uint32_t log_count;
+  ImageSink_LogTypeDef log[IMAGE_SINK_LOG_SIZE];
+  uint8_t *buffer;                   /* From the I/O arena while a file is open */
+};
+
+/* Exported functions ------------------------------------------------------- */
+void ImageSink_InitFlash(ImageSink_TypeDef *sink);
+void ImageSink_InitLfs(ImageSink_TypeDef *sink);
+void ImageSink_InitSd(ImageSink_TypeDef *sink);
+void ImageSink_InitRouted(ImageSink_TypeDef *sink);
+ImageSink_TargetTypeDef ImageSink_Route(const char *name, const char **p_stored_name);
+const char *ImageSink_TargetLabel(ImageSink_TargetTypeDef target);
+COM_StatusTypeDef ImageSink_Open(ImageSink_TypeDef *sink, const char *name, uint32_t size);
+COM_StatusTypeDef ImageSink_Write(ImageSink_TypeDef *sink, const uint8_t *data, uint32_t length);
+COM_StatusTypeDef ImageSink_Close(ImageSink_TypeDef *sink, uint32_t commit);
+
+#endif /* __IMAGE_SINK_H */
@@ -0,0 +1,145 @@
+/**
+ ******************************************************************************
+ * @file    IAP/io_arena.c
+ * @brief   Fixed block pool for I/O buffers. Every buffer is 32 byte aligned
+ *          in the main SRAM, so it can be used by the SDIO, SPI and UART DMA
+ *          (the CCM RAM is not reachable by DMA). A buffer is a run of
+ *          contiguous blocks, found first fit.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "io_arena.h"
+#include "common.h"
+#include <stdio.h>
+
+/* Private variables ---------------------------------------------------------*/
+static __ALIGNED(32) uint8_t aArena[IO_ARENA_BLOCK_COUNT][IO_ARENA_BLOCK_SIZE];
+/* Length of the run starting at a block, 0 for free blocks and run tails */
+static uint8_t aRunLength[IO_ARENA_BLOCK_COUNT];
+static uint8_t aBlockUsed[IO_ARENA_BLOCK_COUNT];
+static const char *aOwner[IO_ARENA_BLOCK_COUNT];
+static IoArena_StatsTypeDef ArenaStats;
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Check out a buffer
+ * @param  size: bytes needed
+ * @param  owner: name of the user, shown by IoArena_ShowUsage
+ * @retval buffer, NULL if no run of free blocks is large enough
+ */
+void *IoArena_Get(uint32_t size, const char *owner)
+{
+  uint32_t blocks = (size + IO_ARENA_BLOCK_SIZE - 1) / IO_ARENA_BLOCK_SIZE;
+  uint32_t start, i;
+
+  if (blocks == 0)
+  {
+    blocks = 1;
+  }
+
+  for (start = 0; start + blocks <= IO_ARENA_BLOCK_COUNT; start++)
+  {
+    for (i = 0; (i < blocks) && !aBlockUsed[start + i]; i++)
+    {
+    }
+    if (i == blocks)
+    {
+      for (i = 0; i < blocks; i++)
+      {
+        aBlockUsed[start + i] = 1;
+      }
+      aRunLength[start] = (uint8_t)blocks;
+      aOwner[start] = owner;
+      ArenaStats.in_use += blocks;
+      if (ArenaStats.in_use > ArenaStats.high_water)
+      {
+        ArenaStats.high_water = ArenaStats.in_use;
+      }
+      return aArena[start];
+    }
+    start += i;
+  }
+
+  ArenaStats.failures++;
+  Serial_PutString((uint8_t *)"\r\nI/O arena exhausted, needed by ");
+  Serial_PutString((uint8_t *)owner);
+  IoArena_ShowUsage();
+  return NULL;
+}
+
+/**
+ * @brief  Give a buffer back
+ * @param  p_buffer: buffer from IoArena_Get, NULL is ignored
+ * @retval None
+ */
+void IoArena_Put(void *p_buffer)
+{
+  uint32_t start, i;
+
+  if (p_buffer == NULL)
+  {
+    return;
+  }
+
+  start = (uint32_t)((uint8_t *)p_buffer - &aArena[0][0]) / IO_ARENA_BLOCK_SIZE;
+  if ((start >= IO_ARENA_BLOCK_COUNT) || (aRunLength[start] == 0))
+  {
+    return;
+  }
+
+  for (i = 0; i < aRunLength[start]; i++)
+  {
+    aBlockUsed[start + i] = 0;
+  }
+  ArenaStats.in_use -= aRunLength[start];
+  aRunLength[start] = 0;
+  aOwner[start] = NULL;
+}
+
+/**
+ * @brief  Read the counters
+ * @param  p_stats: copy of the counters
+ * @retval None
+ */
+void IoArena_GetStats(IoArena_StatsTypeDef *p_stats)
+{
+  *p_stats = ArenaStats;
+}
+
+/**
+ * @brief  Print the counters and the buffers checked out
+ * @param  None
+ * @retval None
+ */
+void IoArena_ShowUsage(void)
+{
+  char line[96];
+  uint32_t i;
+
+  snprintf(line, sizeof(line), "\r\n I/O arena: %lu/%lu KB in use, high water %lu KB, %lu failures\r\n",
+           (unsigned long)(ArenaStats.in_use * IO_ARENA_BLOCK_SIZE / 1024),
+           (unsigned long)(IO_ARENA_BLOCK_COUNT * IO_ARENA_BLOCK_SIZE / 1024),
+           (unsigned long)(ArenaStats.high_water * IO_ARENA_BLOCK_SIZE / 1024),
+           (unsigned long)ArenaStats.failures);
+  Serial_PutString((uint8_t *)line);
+
+  for (i = 0; i < IO_ARENA_BLOCK_COUNT; i++)
+  {
+    if (aRunLength[i] != 0)
+    {
+      snprintf(line, sizeof(line), "  %lu KB %s\r\n",
+               (unsigned long)(aRunLength[i] * IO_ARENA_BLOCK_SIZE / 1024), aOwner[i]);
+      Serial_PutString((uint8_t *)line);
+    }
+  }
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,38 @@
+/**
+ ******************************************************************************
+ * @file    IAP/io_arena.h
+ * @brief   Pool of I/O buffers shared by the update paths. Buffers are
+ *          checked out for one operation and given back at its end, so the
+ *          RAM of the largest operation is reserved once at link time
+ *          instead of on the stack or the heap.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __IO_ARENA_H
+#define __IO_ARENA_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Buffers are made of contiguous blocks, the largest user is an encrypted
+   TF card install: two 8 KB read buffers and one 8 KB + 32 decrypt buffer */
+#define IO_ARENA_BLOCK_SIZE  ((uint32_t)1024)
+#define IO_ARENA_BLOCK_COUNT ((uint32_t)32)
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t in_use;     /* Blocks checked out now */
+  uint32_t high_water; /* Most blocks ever checked out at once */
+  uint32_t failures;   /* Requests that could not be served */
+} IoArena_StatsTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void *IoArena_Get(uint32_t size, const char *owner);
+void IoArena_Put(void *p_buffer);
+void IoArena_GetStats(IoArena_StatsTypeDef *p_stats);
+void IoArena_ShowUsage(void);
+
+#endif /* __IO_ARENA_H */
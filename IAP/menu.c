@@ -33,8 +33,20 @@
 #include "flash_if.h"
 #include "menu.h"
 #include "ymodem.h"
+#include "image_sink.h"
+#include "tf_install.h"
+#include "tf_copy.h"
+#include "update_pipeline.h"
+#include "seal_install.h"
+#include "fw_catalog.h"
+#include "io_arena.h"
+#include "crc32.h"
+#include "aes.h"
 #include "ff.h"
 #include "lfs_spi_flash_adapter.h"
+#include "storage.h"
+#include "w25q128_cache.h"
+#include "w25q128_async.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,6 +59,12 @@ pFunction JumpToApplication;
 uint32_t JumpAddress;
 uint32_t FlashProtection = 0;
 uint8_t aFileName[FILE_NAME_LENGTH];
+static ImageSink_TypeDef DownloadSink; /* Too big for the stack */
+/* Stages of the storage update paths, the sink is DownloadSink */
+static UpdateSource_TypeDef PipelineSource;
+static UpdateTransform_TypeDef PipelineTransform;
+static UpdatePipeline_TypeDef Pipeline;
+static SealInstall_StatsTypeDef SealStats;
 
 /* External variables --------------------------------------------------------*/
 extern FATFS SDFatFS; /* File system object for SD logical drive */
@@ -61,14 +79,240 @@ void StoreFromTFCard(void);
 void StoreFromFlash(void);
 void DeleteStoredImage(void);
 void DeleteEntireFileSystem(void);
+void Benchmark_Menu(void);
+void AES_Benchmark(void);
+void SPIFlash_Benchmark(void);
 
 /* Private defines -----------------------------------------------------------*/
 #define MAX_BIN_FILES 10          // 最大支持的bin文件数量
 #define BIN_FILE_EXTENSION ".bin" // bin文件扩展名
 #define AES_FILE_EXTENSION ".aes" // aes加密文件扩展名
+#define SEALED_FILE_EXTENSION ".aex" // 带认证的加密文件扩展名
+#define FILE_NAME_SLOT 256        // 文件名表每项长度
+#define MENU_BUFFER_SIZE 4096     // 读写缓冲区大小, 从I/O arena借用
+#define BENCH_READ_SIZE 0x10000   // SPI Flash读测试长度
+#define BENCH_PROG_PAGES 16       // SPI Flash写测试页数, 一个扇区
+#define BENCH_RECORD_SIZE 64      // 扇区缓存测试每次写入的长度
+#define MENU_IDLE_POLL 10         // 主菜单等待按键时, 每隔多少ms做一步存储维护
 
 /* Private functions ---------------------------------------------------------*/
 
+/**
+ * @brief  判断文件是否为AES_encrypt_file生成的加密镜像
+ * @param  name: file name
+ * @retval 1 for an .aes file
+ */
+static uint32_t IsAesFile(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+
+  return (ext != NULL) && (strcmp(ext, AES_FILE_EXTENSION) == 0);
+}
+
+/**
+ * @brief  判断文件是否为AES_seal_file生成的带认证加密镜像
+ * @param  name: file name
+ * @retval 1 for an .aex file
+ */
+static uint32_t IsSealedFile(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+
+  return (ext != NULL) && (strcmp(ext, SEALED_FILE_EXTENSION) == 0);
+}
+
+/**
+ * @brief  等待用户输入y或n
+ * @param  None
+ * @retval 1 for y, 0 for n
+ */
+static uint32_t WaitYesNo(void)
+{
+  uint8_t key = 0;
+
+  while (1)
+  {
+    if (HAL_UART_Receive(&UartHandle, &key, 1, HAL_MAX_DELAY) == HAL_OK)
+    {
+      if (key == 'y' || key == 'Y')
+      {
+        return 1;
+      }
+      else if (key == 'n' || key == 'N')
+      {
+        return 0;
+      }
+      else
+      {
+        Serial_PutString((uint8_t *)"Invalid input! Please enter 'y' or 'n': ");
+      }
+    }
+  }
+}
+
+/**
+ * @brief  取得LittleFS会话, 已挂载时立即返回
+ *         Flash上没有可用的文件系统时, 只有用户确认后才格式化
+ * @param  None
+ * @retval COM_OK if the session is held, to be released with Storage_Release
+ */
+static COM_StatusTypeDef AcquireLfs(void)
+{
+  COM_StatusTypeDef status = Storage_Acquire(STORAGE_LFS);
+
+  if (status == COM_DATA)
+  {
+    Serial_PutString((uint8_t *)"\r\nNo LittleFS file system on the SPI Flash.\r\n");
+    Serial_PutString((uint8_t *)"Format it now? Everything stored on it is lost (y/n): ");
+    if (WaitYesNo())
+    {
+      Serial_PutString((uint8_t *)"\r\nFormatting file system...\r\n");
+      status = Storage_Format(NULL);
+      if (status == COM_OK)
+      {
+        status = Storage_Acquire(STORAGE_LFS);
+      }
+    }
+  }
+  if (status != COM_OK)
+  {
+    Serial_PutString((uint8_t *)"Failed to mount LittleFS!\r\n");
+  }
+  return status;
+}
+
+/**
+ * @brief  打印每字节周期数, 保留一位小数
+ * @param  label: 测试项名称
+ * @param  cycles: DWT周期数
+ * @param  bytes: 处理的字节数
+ * @retval None
+ */
+static void ShowCyclesPerByte(const char *label, uint32_t cycles, uint32_t bytes)
+{
+  uint8_t number[11];
+  uint32_t tenths = (uint32_t)(((uint64_t)cycles * 10) / bytes);
+
+  Serial_PutString((uint8_t *)label);
+  Int2Str(number, tenths / 10);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)".");
+  Int2Str(number, tenths % 10);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" cycles/byte\r\n");
+}
+
+/**
+ * @brief  打印传输速度, 单位KB/s
+ * @param  label: 测试项名称
+ * @param  cycles: DWT周期数
+ * @param  bytes: 传输的字节数
+ * @retval None
+ */
+static void ShowThroughput(const char *label, uint32_t cycles, uint32_t bytes)
+{
+  uint8_t number[11];
+
+  Serial_PutString((uint8_t *)label);
+  Int2Str(number, (uint32_t)(((uint64_t)bytes * SystemCoreClock) / ((uint64_t)cycles * 1024)));
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" KB/s\r\n");
+}
+
+/**
+ * @brief  打印擦除规划器用的指令和节省的时间
+ * @param  p_stats: W25Q128_erase_range的统计
+ * @retval None
+ */
+static void ShowEraseStats(const W25Q128_EraseStatsTypeDef *p_stats)
+{
+  uint8_t number[11];
+  uint32_t estimate = p_stats->sectors * W25Q128_SECTOR_ERASE_MS;
+
+  Serial_PutString((uint8_t *)"  Erase commands: ");
+  Int2Str(number, p_stats->chip);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" chip, ");
+  Int2Str(number, p_stats->block64);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" x 64KB, ");
+  Int2Str(number, p_stats->block32);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" x 32KB, ");
+  Int2Str(number, p_stats->sector);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" x 4KB\r\n  Time: ");
+  Int2Str(number, p_stats->ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms, ");
+  Int2Str(number, p_stats->sectors);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" sector erases would take about ");
+  Int2Str(number, estimate);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms");
+  if (estimate > p_stats->ms)
+  {
+    Serial_PutString((uint8_t *)", saved ");
+    Int2Str(number, estimate - p_stats->ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" ms");
+  }
+  Serial_PutString((uint8_t *)"\r\n");
+}
+
+/**
+ * @brief  打印批量传输中每个文件的结果
+ * @param  sink: sink used for the session
+ * @retval None
+ */
+static void ShowSessionReport(const ImageSink_TypeDef *sink)
+{
+  uint8_t number[11];
+  uint32_t i;
+  const char *status_str;
+
+  Serial_PutString((uint8_t *)"\r\n Files of the session:\r\n");
+  for (i = 0; (i < sink->log_count) && (i < IMAGE_SINK_LOG_SIZE); i++)
+  {
+    const ImageSink_LogTypeDef *entry = &sink->log[i];
+
+    switch (entry->status)
+    {
+    case COM_OK:
+      status_str = "OK";
+      break;
+    case COM_LIMIT:
+      status_str = "too big / no room";
+      break;
+    case COM_DATA:
+      status_str = "write error";
+      break;
+    case COM_ABORT:
+      status_str = "incomplete, removed";
+      break;
+    default:
+      status_str = "cannot open destination";
+      break;
+    }
+
+    Serial_PutString((uint8_t *)"  ");
+    Serial_PutString((uint8_t *)entry->name);
+    Serial_PutString((uint8_t *)" (");
+    Int2Str(number, entry->size);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" bytes) -> ");
+    Serial_PutString((uint8_t *)ImageSink_TargetLabel(entry->target));
+    Serial_PutString((uint8_t *)": ");
+    Serial_PutString((uint8_t *)status_str);
+    Serial_PutString((uint8_t *)"\r\n");
+  }
+  if (sink->log_count > IMAGE_SINK_LOG_SIZE)
+  {
+    Serial_PutString((uint8_t *)"  ...\r\n");
+  }
+}
+
 /**
  * @brief  Download a file via serial port
  * @param  None
@@ -78,10 +322,43 @@ void SerialDownload(void)
 {
   uint8_t number[11] = {0};
   uint32_t size = 0;
+  uint8_t key = 0;
   COM_StatusTypeDef result;
 
+  // 选择接收目标：内部Flash、SPI Flash(LFS)或TF卡
+  Serial_PutString((uint8_t *)"\r\nSelect destination:\r\n");
+  Serial_PutString((uint8_t *)"  Internal Flash (application) ------- 1\r\n");
+  Serial_PutString((uint8_t *)"  SPI Flash LittleFS file ------------ 2\r\n");
+  Serial_PutString((uint8_t *)"  TF card file ----------------------- 3\r\n");
+  Serial_PutString((uint8_t *)"  Batch, routed by file name --------- 4\r\n");
+  Serial_PutString((uint8_t *)"    (flash_*, first *.bin: Flash  lfs_*, *.aes, *.aex, *.cfg, *.ini, *.json: LFS  other: TF)\r\n");
+  __HAL_UART_FLUSH_DRREGISTER(&UartHandle);
+  HAL_UART_Receive(&UartHandle, &key, 1, RX_TIMEOUT);
+  switch (key)
+  {
+  case '2':
+    ImageSink_InitLfs(&DownloadSink);
+    break;
+  case '3':
+    ImageSink_InitSd(&DownloadSink);
+    break;
+  case '1':
+    ImageSink_InitFlash(&DownloadSink);
+    break;
+  case '4':
+    ImageSink_InitRouted(&DownloadSink);
+    break;
+  default:
+    Serial_PutString((uint8_t *)"\r\nOperation aborted!\r\n");
+    return;
+  }
+  Serial_PutString((uint8_t *)"Destination: ");
+  Serial_PutString((uint8_t *)DownloadSink.label);
+  Serial_PutString((uint8_t *)"\r\n");
+
   Serial_PutString((uint8_t *)"Waiting for the file to be sent ... (press 'a' to abort)\n\r");
-  result = Ymodem_Receive(&size);
+  Serial_PutString((uint8_t *)"Press 'g' first to use YMODEM-G (e.g. sz --ymodem-g)\n\r");
+  result = Ymodem_Receive(&size, &DownloadSink);
   if (result == COM_OK)
   {
     HAL_Delay(100);
@@ -105,10 +382,19 @@ void SerialDownload(void)
   {
     Serial_PutString((uint8_t *)"\r\n\nAborted by user.\n\r");
   }
+  else if (result == COM_OVERRUN)
+  {
+    Serial_PutString((uint8_t *)"\n\rReceive buffer overrun, the destination is too slow for YMODEM-G: use YMODEM!\n\r");
+  }
   else
   {
     Serial_PutString((uint8_t *)"\n\rFailed to receive the file!\n\r");
   }
+
+  if (DownloadSink.log_count > 1 || (DownloadSink.routed && DownloadSink.log_count > 0))
+  {
+    ShowSessionReport(&DownloadSink);
+  }
 }
 
 /**
@@ -306,10 +592,10 @@ void SerialUpload(void)
 
   /* Now wait for the receive command */
   HAL_UART_Receive(&UartHandle, &status, 1, RX_TIMEOUT);
-  if (status == CRC16)
+  if ((status == CRC16) || (status == CRC16_G))
   {
-    /* Transmit the flash image through ymodem protocol */
-    status = Ymodem_Transmit((uint8_t *)APPLICATION_ADDRESS, file_name, file_size);
+    /* Transmit the flash image through ymodem protocol, 'G' selects YMODEM-G */
+    status = Ymodem_Transmit((uint8_t *)APPLICATION_ADDRESS, file_name, file_size, status == CRC16_G);
 
     if (status != 0)
     {
@@ -350,7 +636,7 @@ void Main_Menu(void)
     FlashProtection = FLASH_If_GetWriteProtectionStatus();
 
     Serial_PutString((uint8_t *)"\r\n======================== Main Menu =========================\r\n\n");
-    Serial_PutString((uint8_t *)"  Download image to the internal Flash ----------------- 1\r\n\n");
+    Serial_PutString((uint8_t *)"  Download image to the Flash, LFS or TF card ---------- 1\r\n\n");
     Serial_PutString((uint8_t *)"  Download image from TF to the internal Flash --------- 2\r\n\n");
     Serial_PutString((uint8_t *)"  Download image from LFS to the internal Flash -------- 3\r\n\n");
     Serial_PutString((uint8_t *)"  Upload image from the internal Flash ----------------- 4\r\n\n");
@@ -365,13 +651,18 @@ void Main_Menu(void)
     {
       Serial_PutString((uint8_t *)"  Enable the write protection -------------------------- 7\r\n\n");
     }
+    Serial_PutString((uint8_t *)"  Show I/O buffer usage -------------------------------- 8\r\n\n");
+    Serial_PutString((uint8_t *)"  Benchmark menu --------------------------------------- 9\r\n\n");
     Serial_PutString((uint8_t *)"============================================================\r\n\n");
 
     /* Clean the input path */
     __HAL_UART_FLUSH_DRREGISTER(&UartHandle);
 
-    /* Receive key */
-    HAL_UART_Receive(&UartHandle, &key, 1, RX_TIMEOUT);
+    /* Receive key, LittleFS is tidied and pre-erased while waiting */
+    while (HAL_UART_Receive(&UartHandle, &key, 1, MENU_IDLE_POLL) != HAL_OK)
+    {
+      Storage_Idle();
+    }
 
     switch (key)
     {
@@ -404,6 +695,9 @@ void Main_Menu(void)
       // /* Initialize user application's Stack Pointer */
       // __set_MSP(*(__IO uint32_t *)APPLICATION_ADDRESS);
       // JumpToApplication();
+      /* Let a pre-erase finish and unmount, as before any exit from the
+         bootloader */
+      Storage_Shutdown();
       HAL_NVIC_SystemReset();
       break;
     case '6':
@@ -418,6 +712,7 @@ void Main_Menu(void)
         {
           Serial_PutString((uint8_t *)"Write Protection disabled...\r\n");
           Serial_PutString((uint8_t *)"System will now restart...\r\n");
+          Storage_Shutdown();
           /* Launch the option byte loading */
           HAL_FLASH_OB_Launch();
           /* Ulock the flash */
@@ -434,6 +729,7 @@ void Main_Menu(void)
         {
           Serial_PutString((uint8_t *)"Write Protection enabled...\r\n");
           Serial_PutString((uint8_t *)"System will now restart...\r\n");
+          Storage_Shutdown();
           /* Launch the option byte loading */
           HAL_FLASH_OB_Launch();
         }
@@ -443,8 +739,15 @@ void Main_Menu(void)
         }
       }
       break;
+    case '8':
+      IoArena_ShowUsage();
+      break;
+    case '9':
+      /* Benchmark menu */
+      Benchmark_Menu();
+      break;
     default:
-      Serial_PutString((uint8_t *)"Invalid Number ! ==> The number should be either 1, 2, 3, 4, 5, 6 or 7\r");
+      Serial_PutString((uint8_t *)"Invalid Number ! ==> The number should be either 1, 2, 3, 4, 5, 6, 7, 8 or 9\r");
       break;
     }
   }
@@ -517,12 +820,7 @@ void StoreImage_Menu(void)
  */
 void StoreFromFlash(void)
 {
-  int err;
-  struct lfs_file lfs_file;
-  uint32_t flash_address = APPLICATION_ADDRESS;
   uint32_t file_size = USER_FLASH_SIZE;
-  uint8_t buffer[4096];
-  uint32_t total_read = 0;
   image_header_t *header = (image_header_t *)APPLICATION_ADDRESS;
   char file_name[FILE_NAME_LENGTH];
 
@@ -609,128 +907,62 @@ void StoreFromFlash(void)
     }
   }
 
-  // 初始化SPI Flash和LittleFS
-  Serial_PutString((uint8_t *)"\r\nInitializing SPI Flash and LittleFS...\r\n");
-  err = lfs_spi_flash_init();
-  if (err != 0)
-  {
-    Serial_PutString((uint8_t *)"SPI Flash initialization failed!\r\n");
-    return;
-  }
-
-  // 挂载LittleFS文件系统
-  Serial_PutString((uint8_t *)"Mounting LittleFS...\r\n");
-  err = lfs_spi_flash_mount(NULL);
-  if (err != LFS_ERR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to mount LittleFS!\r\n");
-    return;
-  }
-
-  // 在LFS中创建文件
-  Serial_PutString((uint8_t *)"Creating file in LittleFS...\r\n");
-  err = lfs_file_open(&lfs_instance, &lfs_file, file_name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
-  if (err != LFS_ERR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to create file in LittleFS!\r\n");
-    lfs_spi_flash_unmount(NULL);
-    return;
-  }
-
-  // 从Flash读取数据并写入LFS
-  Serial_PutString((uint8_t *)"Writing Flash content to LittleFS...\r\n");
-  total_read = 0;
-  while (total_read < file_size)
-  {
-    uint32_t bytes_to_read = (file_size - total_read) > sizeof(buffer) ? sizeof(buffer) : (file_size - total_read);
-
-    // 从Flash读取数据
-    memcpy(buffer, (void *)flash_address, bytes_to_read);
-
-    // 写入LFS文件
-    int written = lfs_file_write(&lfs_instance, &lfs_file, buffer, bytes_to_read);
-    if (written < 0)
-    {
-      Serial_PutString((uint8_t *)"Failed to write to LittleFS file!\r\n");
-      lfs_file_close(&lfs_instance, &lfs_file);
-      lfs_spi_flash_unmount(NULL);
-      return;
-    }
-
-    flash_address += bytes_to_read;
-    total_read += bytes_to_read;
-
-    // 显示进度
-    Serial_PutString((uint8_t *)"Progress: ");
-    uint8_t progress_str[16];
-    Int2Str(progress_str, (total_read * 100) / file_size);
-    Serial_PutString(progress_str);
-    Serial_PutString((uint8_t *)"%\r");
-  }
-
-  Serial_PutString((uint8_t *)"\r\nFile written successfully to LittleFS!\r\n");
-
-  // 确保数据被刷新到存储
-  err = lfs_file_sync(&lfs_instance, &lfs_file);
-  if (err != LFS_ERR_OK)
+  if (file_size > USER_FLASH_SIZE)
   {
-    Serial_PutString((uint8_t *)"Failed to sync file!\r\n");
+    file_size = USER_FLASH_SIZE;
   }
 
-  // 关闭文件
-  err = lfs_file_close(&lfs_instance, &lfs_file);
-  if (err != LFS_ERR_OK)
+  // 通过更新流水线存储: 内部Flash -> LFS文件, LFS输出端自行取得和释放LittleFS会话
+  UpdateSource_InitFlash(&PipelineSource, APPLICATION_ADDRESS, file_size);
+  ImageSink_InitLfs(&DownloadSink);
+  UpdatePipeline_Init(&Pipeline, &PipelineSource, &DownloadSink);
+  Serial_PutString((uint8_t *)"\r\nWriting Flash content to LittleFS...\r\n");
+  switch (UpdatePipeline_Run(&Pipeline, NULL, file_name))
   {
-    Serial_PutString((uint8_t *)"Failed to close LittleFS file!\r\n");
+    case COM_OK:
+      Serial_PutString((uint8_t *)"File written successfully to LittleFS!\r\n");
+      UpdatePipeline_ShowStats(&Pipeline);
+      Serial_PutString((uint8_t *)"Flash to LittleFS storage completed!\r\n");
+      break;
+    case COM_LIMIT:
+      Serial_PutString((uint8_t *)"Error: Nothing to store!\r\n");
+      break;
+    default:
+      Serial_PutString((uint8_t *)"Failed to write the LittleFS file!\r\n");
+      break;
   }
-
-  lfs_spi_flash_unmount(NULL);
-  Serial_PutString((uint8_t *)"Flash to LittleFS storage completed!\r\n");
 }
 
 /**
  * @brief  删除LFS中存储的镜像
- * @param  None
+ * @param  bin_files: file name table of MAX_BIN_FILES entries
  * @retval None
  */
-void DeleteStoredImage(void)
+static void DoDeleteStoredImage(char (*bin_files)[FILE_NAME_SLOT])
 {
   int err;
   struct lfs_dir dir;
-  char bin_files[MAX_BIN_FILES][256];
   uint8_t bin_count = 0;
   uint8_t key = 0;
 
-  // 初始化SPI Flash和LittleFS
-  Serial_PutString((uint8_t *)"\r\nInitializing SPI Flash and LittleFS...\r\n");
-  err = lfs_spi_flash_init();
-  if (err != 0)
-  {
-    Serial_PutString((uint8_t *)"SPI Flash initialization failed!\r\n");
-    return;
-  }
-
-  // 挂载LittleFS文件系统
-  Serial_PutString((uint8_t *)"Mounting LittleFS...\r\n");
-  err = lfs_spi_flash_mount(NULL);
-  if (err != LFS_ERR_OK)
+  // 取得LittleFS会话, 文件系统保持挂载时不再挂载
+  if (AcquireLfs() != COM_OK)
   {
-    Serial_PutString((uint8_t *)"Failed to mount LittleFS!\r\n");
     return;
   }
 
   // 扫描LFS上的bin文件
-  Serial_PutString((uint8_t *)"Scanning LittleFS for bin and aes files...\r\n");
+  Serial_PutString((uint8_t *)"\r\nScanning LittleFS for bin, aes and aex files...\r\n");
   err = lfs_dir_open(&lfs_instance, &dir, "/");
   if (err != LFS_ERR_OK)
   {
     Serial_PutString((uint8_t *)"Failed to open LittleFS directory!\r\n");
-    lfs_spi_flash_unmount(NULL);
+    Storage_Release(STORAGE_LFS);
     return;
   }
 
   // 列出所有bin和aes文件
-  Serial_PutString((uint8_t *)"\r\nFound bin and aes files in LittleFS:\r\n");
+  Serial_PutString((uint8_t *)"\r\nFound bin, aes and aex files in LittleFS:\r\n");
   struct lfs_info info;
   while (lfs_dir_read(&lfs_instance, &dir, &info) > 0)
   {
@@ -738,7 +970,8 @@ void DeleteStoredImage(void)
     if (info.type == LFS_TYPE_REG)
     {
       char *ext = strrchr(info.name, '.');
-      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0))
+      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0 ||
+                          strcmp(ext, SEALED_FILE_EXTENSION) == 0))
       {
         if (bin_count < MAX_BIN_FILES)
         {
@@ -764,8 +997,8 @@ void DeleteStoredImage(void)
 
   if (bin_count == 0)
   {
-    Serial_PutString((uint8_t *)"No bin or aes files found in LittleFS!\r\n");
-    lfs_spi_flash_unmount(NULL);
+    Serial_PutString((uint8_t *)"No bin, aes or aex files found in LittleFS!\r\n");
+    Storage_Release(STORAGE_LFS);
     return;
   }
 
@@ -784,7 +1017,7 @@ void DeleteStoredImage(void)
       if (key == 'a' || key == 'A')
       {
         Serial_PutString((uint8_t *)"\r\nOperation aborted!\r\n");
-        lfs_spi_flash_unmount(NULL);
+        Storage_Release(STORAGE_LFS);
         return;
       }
       else if (key >= '1' && key <= '0' + bin_count)
@@ -814,421 +1047,208 @@ void DeleteStoredImage(void)
     Serial_PutString((uint8_t *)"File deleted successfully!\r\n");
   }
 
-  lfs_spi_flash_unmount(NULL);
+  Storage_Release(STORAGE_LFS);
+}
+
+/**
+ * @brief  删除LFS中存储的镜像, 文件名表从I/O arena借用
+ * @param  None
+ * @retval None
+ */
+void DeleteStoredImage(void)
+{
+  char (*bin_files)[FILE_NAME_SLOT] = IoArena_Get(MAX_BIN_FILES * FILE_NAME_SLOT, "file list");
+
+  if (bin_files != NULL)
+  {
+    DoDeleteStoredImage(bin_files);
+  }
+
+  IoArena_Put(bin_files);
 }
 
 /**
  * @brief  从TF卡选择.bin文件存储到SPI-Flash的LFS文件系统
+ *         SD卡DMA读取与SPI Flash写入重叠进行, 写入后回读校验CRC-32
  * @param  None
  * @retval None
  */
 void StoreFromTFCard(void)
 {
-  FRESULT res;
-  DIR dir;
-  FILINFO fno;
-  char bin_files[MAX_BIN_FILES][256]; // 存储bin文件名
-  uint8_t bin_count = 0;
-  uint8_t key = 0;
-  uint32_t file_size = 0;
-  uint8_t buffer[4096]; // 读取缓冲区
-  UINT bytes_read;
-  uint32_t total_written = 0;
-  int err;
+  const FwCatalog_EntryTypeDef *entry;
+  TFCopy_StatsTypeDef stats;
+  COM_StatusTypeDef status;
+  uint8_t number[11];
 
-  // 初始化SD卡和FATFS
-  Serial_PutString((uint8_t *)"\r\nInitializing TF card...\r\n");
-  res = f_mount(&SDFatFS, "0:", 1);
-  if (res != FR_OK)
+  // 取得TF卡和LittleFS会话, 已挂载的卷直接使用
+  if (Storage_Acquire(STORAGE_TF) != COM_OK)
   {
-    Serial_PutString((uint8_t *)"Failed to mount TF card!\r\n");
+    Serial_PutString((uint8_t *)"\r\nFailed to mount TF card!\r\n");
     return;
   }
-
-  // 初始化SPI Flash和LittleFS
-  Serial_PutString((uint8_t *)"\r\nInitializing SPI Flash and LittleFS...\r\n");
-  err = lfs_spi_flash_init();
-  if (err != 0)
+  if (AcquireLfs() != COM_OK)
   {
-    Serial_PutString((uint8_t *)"SPI Flash initialization failed!\r\n");
-    f_mount(NULL, "0:", 0);
+    Storage_Release(STORAGE_TF);
     return;
   }
 
-  // 挂载LittleFS文件系统
-  Serial_PutString((uint8_t *)"Mounting LittleFS...\r\n");
-  err = lfs_spi_flash_mount(NULL); // 使用NULL让函数使用内部的全局实例
-  if (err != LFS_ERR_OK)
+  // 从固件目录索引中选择文件, 仅在目录变化时重新扫描
+  if (FwCatalog_Load(0) != COM_OK)
   {
-    Serial_PutString((uint8_t *)"Failed to mount LittleFS!\r\n");
-    f_mount(NULL, "0:", 0);
+    Serial_PutString((uint8_t *)"Failed to read the firmware catalog!\r\n");
+    Storage_Release(STORAGE_LFS);
+    Storage_Release(STORAGE_TF);
     return;
   }
-
-  // 扫描TF卡上的bin文件
-  Serial_PutString((uint8_t *)"Scanning TF card for bin files...\r\n");
-  res = f_opendir(&dir, "0:/");
-  if (res != FR_OK)
+  entry = FwCatalog_Select("Firmware on the TF card");
+  if (entry == NULL)
   {
-    Serial_PutString((uint8_t *)"Failed to open TF card directory!\r\n");
-    lfs_spi_flash_unmount(NULL);
-    f_mount(NULL, "0:", 0);
+    Storage_Release(STORAGE_LFS);
+    Storage_Release(STORAGE_TF);
     return;
   }
 
-  // 列出所有bin和aes文件
-  Serial_PutString((uint8_t *)"\r\nFound bin and aes files on TF card:\r\n");
-  while (1)
+  // 添加驱动器号和目录前缀
+  char full_path[FW_CATALOG_NAME_LENGTH + 8];
+  FwCatalog_Path(entry, full_path, sizeof(full_path));
+  Serial_PutString((uint8_t *)"\r\nOpening file: ");
+  Serial_PutString((uint8_t *)full_path);
+  Serial_PutString((uint8_t *)"\r\n");
+
+  // 复制到LFS: 同名文件被替换, CRC-32作为文件属性与数据一同提交
+  Serial_PutString((uint8_t *)"File size: ");
+  Int2Str(number, entry->size);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" bytes\r\nCopying file to LittleFS...\r\n");
+  status = TFCopy_ToLfs(full_path, entry->name, &stats);
+
+  Storage_Release(STORAGE_LFS);
+  Storage_Release(STORAGE_TF);
+
+  switch (status)
   {
-    res = f_readdir(&dir, &fno);
-    if (res != FR_OK || fno.fname[0] == 0)
-    {
+    case COM_OK:
+      Serial_PutString((uint8_t *)"File copied and verified!\r\n");
+      TFCopy_ShowStats(&stats);
+      Serial_PutString((uint8_t *)"\r\nTF card to LittleFS update completed!\r\n");
+      break;
+    case COM_LIMIT:
+      Serial_PutString((uint8_t *)"Error: File is empty!\r\n");
+      break;
+    case COM_DATA:
+      Serial_PutString((uint8_t *)"LittleFS write or read-back check failed, copy removed!\r\n");
+      break;
+    default:
+      Serial_PutString((uint8_t *)"File read error!\r\n");
       break;
-    }
-
-    // 检查是否是bin或aes文件
-    if (!(fno.fattrib & AM_DIR))
-    {
-      char *ext = strrchr(fno.fname, '.');
-      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0))
-      {
-        if (bin_count < MAX_BIN_FILES)
-        {
-          strcpy(bin_files[bin_count], fno.fname);
-          Serial_PutString((uint8_t *)"  ");
-          Serial_PutString((uint8_t *)"[");
-          Int2Str((uint8_t *)buffer, bin_count + 1);
-          Serial_PutString((uint8_t *)buffer);
-          Serial_PutString((uint8_t *)"] ");
-          Serial_PutString((uint8_t *)fno.fname);
-          Serial_PutString((uint8_t *)"\r\n");
-          bin_count++;
-        }
-      }
-    }
   }
-  f_closedir(&dir);
+}
 
-  if (bin_count == 0)
+/**
+ * @brief  TF卡更新函数
+ * @param  None
+ * @retval None
+ */
+void TFCard_Update(void)
+{
+  const FwCatalog_EntryTypeDef *entry;
+  uint8_t buffer[16];
+  TFInstall_StatsTypeDef stats;
+  image_header_t *header = (image_header_t *)APPLICATION_ADDRESS;
+
+  // 取得TF卡会话, 已挂载时直接使用
+  if (Storage_Acquire(STORAGE_TF) != COM_OK)
   {
-    Serial_PutString((uint8_t *)"No bin or aes files found on TF card!\r\n");
-    lfs_spi_flash_unmount(NULL);
-    f_mount(NULL, "0:", 0);
+    Serial_PutString((uint8_t *)"\r\nFailed to mount TF card!\r\n");
     return;
   }
 
-  // 提示用户选择文件
-  Serial_PutString((uint8_t *)"\r\nPlease select a file (1-");
-  Int2Str((uint8_t *)buffer, bin_count);
-  Serial_PutString((uint8_t *)buffer);
-  Serial_PutString((uint8_t *)") or press 'a' to abort: ");
-
-  // 等待用户输入
-  while (1)
+  // 从固件目录索引中选择文件, 仅在目录变化时重新扫描
+  if (FwCatalog_Load(0) != COM_OK)
   {
-    if (HAL_UART_Receive(&UartHandle, &key, 1, RX_TIMEOUT) == HAL_OK)
-    {
-      if (key == 'a' || key == 'A')
-      {
-        Serial_PutString((uint8_t *)"\r\nOperation aborted!\r\n");
-        lfs_spi_flash_unmount(NULL);
-        f_mount(NULL, "0:", 0);
-        return;
-      }
-      else if (key >= '1' && key <= '0' + bin_count)
-      {
-        break;
-      }
-      else
-      {
-        Serial_PutString((uint8_t *)"Invalid input!\r\n");
-      }
-    }
+    Serial_PutString((uint8_t *)"Failed to read the firmware catalog!\r\n");
+    Storage_Release(STORAGE_TF);
+    return;
   }
-
-  // 打开选中的bin文件
-  uint8_t file_index = key - '1';
-  Serial_PutString((uint8_t *)"\r\nOpening file: ");
-  Serial_PutString((uint8_t *)bin_files[file_index]);
-  Serial_PutString((uint8_t *)"\r\n");
-
-  // 添加驱动器号前缀
-  char full_path[260];
-  sprintf(full_path, "0:/%s", bin_files[file_index]);
-
-  FIL file;
-  res = f_open(&file, full_path, FA_READ);
-  if (res != FR_OK)
+  entry = FwCatalog_Select("Firmware on the TF card");
+  if (entry == NULL)
   {
-    Serial_PutString((uint8_t *)"Failed to open file!\r\n");
-    lfs_spi_flash_unmount(NULL);
-    f_mount(NULL, "0:", 0);
+    Storage_Release(STORAGE_TF);
     return;
   }
 
-  // 获取文件大小
-  file_size = f_size(&file);
-  Serial_PutString((uint8_t *)"File size: ");
-  Int2Str((uint8_t *)buffer, file_size);
-  Serial_PutString((uint8_t *)buffer);
-  Serial_PutString((uint8_t *)" bytes\r\n");
-
-  // 在LFS中创建或打开文件
-  Serial_PutString((uint8_t *)"Creating file in LittleFS...\r\n");
-  struct lfs_file lfs_file_obj;
-  err = lfs_file_open(&lfs_instance, &lfs_file_obj, bin_files[file_index], LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
-  if (err != LFS_ERR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to create file in LittleFS!\r\n");
-    f_close(&file);
-    lfs_spi_flash_unmount(NULL);
-    f_mount(NULL, "0:", 0);
-    return;
-  }
-
-  // 读取并写入bin文件到LFS
-  Serial_PutString((uint8_t *)"Writing file to LittleFS...\r\n");
-  total_written = 0;
-  while (total_written < file_size)
-  {
-    uint32_t bytes_to_read = (file_size - total_written) > sizeof(buffer) ? sizeof(buffer) : (file_size - total_written);
-    res = f_read(&file, buffer, bytes_to_read, &bytes_read);
-    if (res != FR_OK || bytes_read != bytes_to_read)
-    {
-      Serial_PutString((uint8_t *)"File read error!\r\n");
-      lfs_file_close(&lfs_instance, &lfs_file_obj);
-      f_close(&file);
-      lfs_spi_flash_unmount(NULL);
-      f_mount(NULL, "0:", 0);
-      return;
-    }
+  // 添加驱动器号和目录前缀
+  char full_path[FW_CATALOG_NAME_LENGTH + 8];
+  FwCatalog_Path(entry, full_path, sizeof(full_path));
+  Serial_PutString((uint8_t *)"\r\nOpening file: ");
+  Serial_PutString((uint8_t *)full_path);
+  Serial_PutString((uint8_t *)"\r\n");
 
-    // 写入LFS文件系统
-    int written = lfs_file_write(&lfs_instance, &lfs_file_obj, buffer, bytes_read);
-    if (written < 0)
+  // 擦除并写入Flash, SD卡DMA读取与Flash编程重叠进行, aes文件边读边解密
+  uint32_t decrypt = (entry->flags & FW_ENTRY_AES) != 0;
+  uint32_t sealed = (entry->flags & FW_ENTRY_SEALED) != 0;
+  uint32_t indexed = 0;
+  COM_StatusTypeDef status;
+  Serial_PutString((uint8_t *)((decrypt || sealed) ? "Erasing, decrypting and writing Flash...\r\n" : "Erasing and writing Flash...\r\n"));
+  if (sealed)
+  {
+    // 带索引的aex文件按扇区比较, 只擦写内容不同的扇区; 无索引的走更新流水线
+    UpdateSource_InitFatFs(&PipelineSource);
+    status = SealInstall_Run(&PipelineSource, full_path, &SealStats);
+    indexed = (status != COM_ABORT);
+    stats.size = SealStats.size;
+    if (!indexed)
     {
-      Serial_PutString((uint8_t *)"Failed to write to LittleFS file!\r\n");
-      lfs_file_close(&lfs_instance, &lfs_file_obj);
-      f_close(&file);
-      lfs_spi_flash_unmount(NULL);
-      f_mount(NULL, "0:", 0);
-      return;
+      // 全部记录认证通过后才擦除Flash
+      ImageSink_InitFlash(&DownloadSink);
+      UpdatePipeline_Init(&Pipeline, &PipelineSource, &DownloadSink);
+      UpdateTransform_InitUnseal(&PipelineTransform);
+      UpdatePipeline_Add(&Pipeline, &PipelineTransform);
+      status = UpdatePipeline_Run(&Pipeline, full_path, NULL);
+      stats.size = Pipeline.out_size;
     }
-
-    total_written += written;
-
-    // 显示进度
-    Serial_PutString((uint8_t *)"Progress: ");
-    Int2Str((uint8_t *)buffer, (total_written * 100) / file_size);
-    Serial_PutString((uint8_t *)buffer);
-    Serial_PutString((uint8_t *)"%\r");
   }
-
-  Serial_PutString((uint8_t *)"\r\nFile written successfully to LittleFS!\r\n");
-
-  // 确保数据被刷新到存储
-  err = lfs_file_sync(&lfs_instance, &lfs_file_obj);
-  if (err != LFS_ERR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to sync file!\r\n");
-  }
-
-  // 关闭文件
-  err = lfs_file_close(&lfs_instance, &lfs_file_obj);
-  if (err != LFS_ERR_OK)
+  else
   {
-    Serial_PutString((uint8_t *)"Failed to close LittleFS file!\r\n");
+    status = TFCard_Install(full_path, decrypt, &stats);
   }
-
-  f_close(&file);
-  lfs_spi_flash_unmount(NULL);
-  f_mount(NULL, "0:", 0);
-
-  Serial_PutString((uint8_t *)"\r\nTF card to LittleFS update completed!\r\n");
-}
-
-/**
- * @brief  TF卡更新函数
- * @param  None
- * @retval None
- */
-void TFCard_Update(void)
-{
-  FRESULT res;
-  DIR dir;
-  FILINFO fno;
-  char bin_files[MAX_BIN_FILES][256]; // 存储bin文件名
-  uint8_t bin_count = 0;
-  uint8_t key = 0;
-  uint32_t file_size = 0;
-  uint8_t buffer[4096]; // 读取缓冲区
-  UINT bytes_read;
-  uint32_t flash_address = APPLICATION_ADDRESS;
-  image_header_t *header = (image_header_t *)APPLICATION_ADDRESS;
-
-  // 初始化SD卡和FATFS
-  Serial_PutString((uint8_t *)"\r\nInitializing TF card...\r\n");
-  res = f_mount(&SDFatFS, "0:", 1);
-  if (res != FR_OK)
+  switch (status)
   {
-    Serial_PutString((uint8_t *)"Failed to mount TF card!\r\n");
+  case COM_OK:
+    break;
+  case COM_LIMIT:
+    Serial_PutString((uint8_t *)"Error: File is empty, exceeds Flash capacity or has a bad length prefix!\r\n");
+    Storage_Release(STORAGE_TF);
     return;
-  }
-
-  // 扫描TF卡上的bin和aes文件
-  Serial_PutString((uint8_t *)"Scanning for bin and aes files...\r\n");
-  res = f_opendir(&dir, "0:/");
-  if (res != FR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to open directory!\r\n");
-    f_mount(NULL, "0:", 0);
+  case COM_DATA:
+    Serial_PutString((uint8_t *)(sealed ? "Flash erase or write failed, or sealed image failed authentication!\r\n"
+                                        : "Flash erase or write failed!\r\n"));
+    Storage_Release(STORAGE_TF);
     return;
-  }
-
-  // 列出所有bin和aes文件
-  Serial_PutString((uint8_t *)"\r\nFound bin and aes files:\r\n");
-  while (1)
-  {
-    res = f_readdir(&dir, &fno);
-    if (res != FR_OK || fno.fname[0] == 0)
-    {
-      break;
-    }
-
-    // 检查是否是bin或aes文件
-    if (!(fno.fattrib & AM_DIR))
-    {
-      char *ext = strrchr(fno.fname, '.');
-      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0))
-      {
-        if (bin_count < MAX_BIN_FILES)
-        {
-          strcpy(bin_files[bin_count], fno.fname);
-          Serial_PutString((uint8_t *)"  ");
-          Serial_PutString((uint8_t *)"[");
-          Int2Str((uint8_t *)buffer, bin_count + 1);
-          Serial_PutString((uint8_t *)buffer);
-          Serial_PutString((uint8_t *)"] ");
-          Serial_PutString((uint8_t *)fno.fname);
-          Serial_PutString((uint8_t *)"\r\n");
-          bin_count++;
-        }
-      }
-    }
-  }
-  f_closedir(&dir);
-
-  if (bin_count == 0)
-  {
-    Serial_PutString((uint8_t *)"No bin or aes files found!\r\n");
-    f_mount(NULL, "0:", 0);
+  default:
+    Serial_PutString((uint8_t *)"File read error!\r\n");
+    Storage_Release(STORAGE_TF);
     return;
   }
 
-  // 提示用户选择文件
-  Serial_PutString((uint8_t *)"\r\nPlease select a file (1-");
-  Int2Str((uint8_t *)buffer, bin_count);
-  Serial_PutString((uint8_t *)buffer);
-  Serial_PutString((uint8_t *)") or press 'a' to abort: ");
-
-  // 等待用户输入
-  while (1)
-  {
-    if (HAL_UART_Receive(&UartHandle, &key, 1, RX_TIMEOUT) == HAL_OK)
-    {
-      if (key == 'a' || key == 'A')
-      {
-        Serial_PutString((uint8_t *)"\r\nOperation aborted!\r\n");
-        f_mount(NULL, "0:", 0);
-        return;
-      }
-      else if (key >= '1' && key <= '0' + bin_count)
-      {
-        break;
-      }
-      else
-      {
-        Serial_PutString((uint8_t *)"Invalid input!\r\n");
-      }
-    }
-  }
-
-  // 打开选中的bin文件
-  uint8_t file_index = key - '1';
-  Serial_PutString((uint8_t *)"\r\nOpening file: ");
-  Serial_PutString((uint8_t *)bin_files[file_index]);
-  Serial_PutString((uint8_t *)"\r\n");
-
-  // 添加驱动器号前缀
-  char full_path[260];
-  sprintf(full_path, "0:/%s", bin_files[file_index]);
-
-  FIL file;
-  res = f_open(&file, full_path, FA_READ);
-  if (res != FR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to open file!\r\n");
-    f_mount(NULL, "0:", 0);
-    return;
-  }
-
-  // 获取文件大小
-  file_size = f_size(&file);
   Serial_PutString((uint8_t *)"File size: ");
-  Int2Str((uint8_t *)buffer, file_size);
+  Int2Str((uint8_t *)buffer, stats.size);
   Serial_PutString((uint8_t *)buffer);
   Serial_PutString((uint8_t *)" bytes\r\n");
-
-  // 检查Flash空间是否足够
-  if (file_size > USER_FLASH_SIZE)
+  Serial_PutString((uint8_t *)"\r\nFile written successfully!\r\n");
+  if (indexed)
   {
-    Serial_PutString((uint8_t *)"Error: File size exceeds Flash capacity!\r\n");
-    f_close(&file);
-    f_mount(NULL, "0:", 0);
-    return;
+    SealInstall_ShowStats(&SealStats);
   }
-
-  // 擦除Flash
-  Serial_PutString((uint8_t *)"Erasing Flash...\r\n");
-  if (FLASH_If_Erase(APPLICATION_ADDRESS) != FLASHIF_OK)
+  else if (sealed)
   {
-    Serial_PutString((uint8_t *)"Flash erase failed!\r\n");
-    f_close(&file);
-    f_mount(NULL, "0:", 0);
-    return;
+    UpdatePipeline_ShowStats(&Pipeline);
   }
-
-  // 读取并写入bin文件到Flash
-  Serial_PutString((uint8_t *)"Writing file to Flash...\r\n");
-  uint32_t total_written = 0;
-  while (total_written < file_size)
+  else
   {
-    uint32_t bytes_to_read = (file_size - total_written) > sizeof(buffer) ? sizeof(buffer) : (file_size - total_written);
-    res = f_read(&file, buffer, bytes_to_read, &bytes_read);
-    if (res != FR_OK || bytes_read != bytes_to_read)
-    {
-      Serial_PutString((uint8_t *)"File read error!\r\n");
-      f_close(&file);
-      f_mount(NULL, "0:", 0);
-      return;
-    }
-
-    // 写入Flash - 计算正确的32位字数，向上取整
-    uint32_t word_count = (bytes_read + 3) / 4; // 确保非4字节倍数也能正确处理
-    if (FLASH_If_Write(flash_address, (uint32_t *)buffer, word_count) != FLASHIF_OK)
-    {
-      Serial_PutString((uint8_t *)"Flash write failed!\r\n");
-      f_close(&file);
-      f_mount(NULL, "0:", 0);
-      return;
-    }
-
-    flash_address += bytes_read;
-    total_written += bytes_read;
+    TFCard_ShowStats(&stats);
   }
 
-  Serial_PutString((uint8_t *)"\r\nFile written successfully!\r\n");
-
   // 检查应用程序是否有效
   Serial_PutString((uint8_t *)"Checking application validity...\r\n");
   if (header->ih_magic == UBOOT_MAGIC)
@@ -1252,61 +1272,45 @@ void TFCard_Update(void)
     }
   }
 
-  // 关闭文件并卸载文件系统
-  f_close(&file);
-  f_mount(NULL, "0:", 0);
+  // 释放TF卡会话, 卷保持挂载
+  Storage_Release(STORAGE_TF);
   Serial_PutString((uint8_t *)"TF card update completed!\r\n");
 }
 
 /**
  * @brief  从LFS系统选择.bin文件并更新镜像到Flash
- * @param  None
+ * @param  bin_files: file name table of MAX_BIN_FILES entries
+ * @param  buffer: I/O buffer of MENU_BUFFER_SIZE bytes
  * @retval None
  */
-void LFS_Update(void)
+static void DoLFS_Update(char (*bin_files)[FILE_NAME_SLOT], uint8_t *buffer)
 {
   int err;
-  struct lfs_file file;
-  char bin_files[MAX_BIN_FILES][256]; // 存储bin文件名
   uint8_t bin_count = 0;
   uint8_t key = 0;
-  uint32_t file_size = 0;
-  uint8_t buffer[4096]; // 读取缓冲区
-  uint32_t flash_address = APPLICATION_ADDRESS;
-  uint32_t total_read = 0;
+  uint32_t decrypt, indexed;
+  COM_StatusTypeDef status;
   image_header_t *header = (image_header_t *)APPLICATION_ADDRESS;
 
-  // 初始化SPI Flash和LittleFS
-  Serial_PutString((uint8_t *)"\r\nInitializing SPI Flash and LittleFS...\r\n");
-  err = lfs_spi_flash_init();
-  if (err != 0)
+  // 取得LittleFS会话, 文件系统保持挂载时不再挂载
+  if (AcquireLfs() != COM_OK)
   {
-    Serial_PutString((uint8_t *)"SPI Flash initialization failed!\r\n");
-    return;
-  }
-
-  // 挂载LittleFS文件系统
-  Serial_PutString((uint8_t *)"Mounting LittleFS...\r\n");
-  err = lfs_spi_flash_mount(NULL); // 使用NULL让函数使用内部的全局实例
-  if (err != LFS_ERR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to mount LittleFS!\r\n");
     return;
   }
 
   // 扫描LFS上的bin文件
-  Serial_PutString((uint8_t *)"Scanning LittleFS for bin files...\r\n");
+  Serial_PutString((uint8_t *)"\r\nScanning LittleFS for bin, aes and aex files...\r\n");
   struct lfs_dir dir;
   err = lfs_dir_open(&lfs_instance, &dir, "/");
   if (err != LFS_ERR_OK)
   {
     Serial_PutString((uint8_t *)"Failed to open LittleFS directory!\r\n");
-    lfs_spi_flash_unmount(NULL);
+    Storage_Release(STORAGE_LFS);
     return;
   }
 
   // 列出所有bin文件
-  Serial_PutString((uint8_t *)"\r\nFound bin and aes files in LittleFS:\r\n");
+  Serial_PutString((uint8_t *)"\r\nFound bin, aes and aex files in LittleFS:\r\n");
   struct lfs_info info;
   while (lfs_dir_read(&lfs_instance, &dir, &info) > 0)
   {
@@ -1314,7 +1318,8 @@ void LFS_Update(void)
     if (info.type == LFS_TYPE_REG)
     {
       char *ext = strrchr(info.name, '.');
-      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0))
+      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0 ||
+                          strcmp(ext, SEALED_FILE_EXTENSION) == 0))
       {
         if (bin_count < MAX_BIN_FILES)
         {
@@ -1338,8 +1343,8 @@ void LFS_Update(void)
 
   if (bin_count == 0)
   {
-    Serial_PutString((uint8_t *)"No bin or aes files found in LittleFS!\r\n");
-    lfs_spi_flash_unmount(NULL);
+    Serial_PutString((uint8_t *)"No bin, aes or aex files found in LittleFS!\r\n");
+    Storage_Release(STORAGE_LFS);
     return;
   }
 
@@ -1357,7 +1362,7 @@ void LFS_Update(void)
       if (key == 'a' || key == 'A')
       {
         Serial_PutString((uint8_t *)"\r\nOperation aborted!\r\n");
-        lfs_spi_flash_unmount(NULL);
+        Storage_Release(STORAGE_LFS);
         return;
       }
       else if (key >= '1' && key <= '0' + bin_count)
@@ -1377,85 +1382,80 @@ void LFS_Update(void)
   Serial_PutString((uint8_t *)bin_files[file_index]);
   Serial_PutString((uint8_t *)"\r\n");
 
-  err = lfs_file_open(&lfs_instance, &file, bin_files[file_index], LFS_O_RDONLY);
-  if (err != LFS_ERR_OK)
-  {
-    Serial_PutString((uint8_t *)"Failed to open file!\r\n");
-    lfs_spi_flash_unmount(NULL);
-    return;
-  }
-
-  // 获取文件大小
-  file_size = lfs_file_size(&lfs_instance, &file);
-  Serial_PutString((uint8_t *)"File size: ");
-  Int2Str((uint8_t *)buffer, file_size);
-  Serial_PutString((uint8_t *)buffer);
-  Serial_PutString((uint8_t *)" bytes\r\n");
-
-  // 检查Flash空间是否足够
-  if (file_size > USER_FLASH_SIZE)
+  // 擦除Flash前按文件属性中的CRC-32校验文件, 无属性的旧文件照常安装
+  switch (TFCopy_VerifyLfs(bin_files[file_index], buffer, MENU_BUFFER_SIZE, NULL))
   {
-    Serial_PutString((uint8_t *)"Error: File size exceeds Flash capacity!\r\n");
-    lfs_file_close(&lfs_instance, &file);
-    lfs_spi_flash_unmount(NULL);
-    return;
+    case COM_OK:
+      Serial_PutString((uint8_t *)"CRC-32 check passed\r\n");
+      break;
+    case COM_ABORT:
+      Serial_PutString((uint8_t *)"No CRC-32 stored with the file, not checked\r\n");
+      break;
+    case COM_DATA:
+      Serial_PutString((uint8_t *)"Error: File does not match its CRC-32, Flash left untouched!\r\n");
+      Storage_Release(STORAGE_LFS);
+      return;
+    default:
+      Serial_PutString((uint8_t *)"File read error!\r\n");
+      Storage_Release(STORAGE_LFS);
+      return;
   }
 
-  // 擦除Flash
-  Serial_PutString((uint8_t *)"Erasing Flash...\r\n");
-  if (FLASH_If_Erase(APPLICATION_ADDRESS) != FLASHIF_OK)
+  UpdateSource_InitLfs(&PipelineSource);
+  decrypt = IsAesFile(bin_files[file_index]) || IsSealedFile(bin_files[file_index]);
+  status = COM_ABORT;
+  if (IsSealedFile(bin_files[file_index]))
   {
-    Serial_PutString((uint8_t *)"Flash erase failed!\r\n");
-    lfs_file_close(&lfs_instance, &file);
-    lfs_spi_flash_unmount(NULL);
-    return;
+    // 带索引的aex文件只擦写内容不同的扇区, 中断后重新安装会跳过已写好的扇区
+    Serial_PutString((uint8_t *)"Comparing Flash with the image index...\r\n");
+    status = SealInstall_Run(&PipelineSource, bin_files[file_index], &SealStats);
   }
-
-  // 读取LFS文件并写入Flash
-  Serial_PutString((uint8_t *)"Writing file to Flash...\r\n");
-  total_read = 0;
-  while (total_read < file_size)
+  indexed = (status != COM_ABORT);
+  if (!indexed)
   {
-    uint32_t bytes_to_read = (file_size - total_read) > sizeof(buffer) ? sizeof(buffer) : (file_size - total_read);
-    err = lfs_file_read(&lfs_instance, &file, buffer, bytes_to_read);
-    if (err < 0)
+    // 通过更新流水线安装: LFS文件 -> (aes解密) -> 内部Flash
+    ImageSink_InitFlash(&DownloadSink);
+    UpdatePipeline_Init(&Pipeline, &PipelineSource, &DownloadSink);
+    if (IsSealedFile(bin_files[file_index]))
     {
-      Serial_PutString((uint8_t *)"File read error!\r\n");
-      lfs_file_close(&lfs_instance, &file);
-      lfs_spi_flash_unmount(NULL);
-      return;
+      // 全部4 KB记录的CMAC校验通过后才擦除并写入Flash, 校验失败时Flash不变
+      UpdateTransform_InitUnseal(&PipelineTransform);
+      UpdatePipeline_Add(&Pipeline, &PipelineTransform);
     }
-    else if (err == 0)
+    else if (decrypt)
     {
-      break; // 文件读取结束
+      UpdateTransform_InitDecrypt(&PipelineTransform);
+      UpdatePipeline_Add(&Pipeline, &PipelineTransform);
     }
+    Serial_PutString((uint8_t *)(decrypt ? "Decrypting file to Flash...\r\n" : "Writing file to Flash...\r\n"));
+    status = UpdatePipeline_Run(&Pipeline, bin_files[file_index], NULL);
+  }
+  Storage_Release(STORAGE_LFS);
 
-    // 写入Flash - 计算正确的32位字数，向上取整
-    uint32_t word_count = (err + 3) / 4; // 确保非4字节倍数也能正确处理
-    if (FLASH_If_Write(flash_address, (uint32_t *)buffer, word_count) != FLASHIF_OK)
-    {
-      Serial_PutString((uint8_t *)"Flash write failed!\r\n");
-      lfs_file_close(&lfs_instance, &file);
-      lfs_spi_flash_unmount(NULL);
+  switch (status)
+  {
+    case COM_OK:
+      Serial_PutString((uint8_t *)"File written successfully to Flash!\r\n");
+      if (indexed)
+      {
+        SealInstall_ShowStats(&SealStats);
+      }
+      else
+      {
+        UpdatePipeline_ShowStats(&Pipeline);
+      }
+      break;
+    case COM_LIMIT:
+      Serial_PutString((uint8_t *)"Error: File is empty, too big or has a bad length prefix!\r\n");
+      return;
+    case COM_DATA:
+      Serial_PutString((uint8_t *)"Flash erase or write failed, or sealed image failed authentication!\r\n");
+      return;
+    default:
+      Serial_PutString((uint8_t *)"File read error or encrypted file truncated!\r\n");
       return;
-    }
-
-    flash_address += err;
-    total_read += err;
-
-    // 显示进度
-    Serial_PutString((uint8_t *)"Progress: ");
-    Int2Str((uint8_t *)buffer, (total_read * 100) / file_size);
-    Serial_PutString((uint8_t *)buffer);
-    Serial_PutString((uint8_t *)"%\r");
   }
 
-  Serial_PutString((uint8_t *)"\r\nFile written successfully to Flash!\r\n");
-
-  // 关闭文件并卸载文件系统
-  lfs_file_close(&lfs_instance, &file);
-  lfs_spi_flash_unmount(NULL);
-
   // 检查应用程序是否有效
   Serial_PutString((uint8_t *)"Checking application validity...\r\n");
   if (header->ih_magic == UBOOT_MAGIC)
@@ -1482,6 +1482,25 @@ void LFS_Update(void)
   Serial_PutString((uint8_t *)"LittleFS to Flash update completed!\r\n");
 }
 
+/**
+ * @brief  从LFS系统选择.bin文件并更新镜像到Flash, 缓冲区从I/O arena借用
+ * @param  None
+ * @retval None
+ */
+void LFS_Update(void)
+{
+  char (*bin_files)[FILE_NAME_SLOT] = IoArena_Get(MAX_BIN_FILES * FILE_NAME_SLOT, "file list");
+  uint8_t *buffer = IoArena_Get(MENU_BUFFER_SIZE, "LFS update");
+
+  if ((bin_files != NULL) && (buffer != NULL))
+  {
+    DoLFS_Update(bin_files, buffer);
+  }
+
+  IoArena_Put(buffer);
+  IoArena_Put(bin_files);
+}
+
 /**
  * @brief  显示已存储的镜像文件
  * @param  None
@@ -1496,31 +1515,19 @@ void ShowStoredImages(void)
   uint32_t file_count = 0;
   uint32_t total_size = 0;
 
-  // 初始化SPI Flash和LittleFS
-  Serial_PutString((uint8_t *)"\r\nInitializing SPI Flash and LittleFS...\r\n");
-  err = lfs_spi_flash_init();
-  if (err != 0)
-  {
-    Serial_PutString((uint8_t *)"SPI Flash initialization failed!\r\n");
-    return;
-  }
-
-  // 挂载LittleFS文件系统
-  Serial_PutString((uint8_t *)"Mounting LittleFS...\r\n");
-  err = lfs_spi_flash_mount(NULL);
-  if (err != LFS_ERR_OK)
+  // 取得LittleFS会话, 文件系统保持挂载时不再挂载
+  if (AcquireLfs() != COM_OK)
   {
-    Serial_PutString((uint8_t *)"Failed to mount LittleFS!\r\n");
     return;
   }
 
   // 打开根目录
-  Serial_PutString((uint8_t *)"Scanning for stored images...\r\n\r\n");
+  Serial_PutString((uint8_t *)"\r\nScanning for stored images...\r\n\r\n");
   err = lfs_dir_open(&lfs_instance, &dir, "/");
   if (err != LFS_ERR_OK)
   {
     Serial_PutString((uint8_t *)"Failed to open directory!\r\n");
-    lfs_spi_flash_unmount(NULL);
+    Storage_Release(STORAGE_LFS);
     return;
   }
 
@@ -1535,7 +1542,8 @@ void ShowStoredImages(void)
     if (info.type == LFS_TYPE_REG) // 只处理普通文件
     {
       char *ext = strrchr(info.name, '.');
-      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0))
+      if (ext != NULL && (strcmp(ext, BIN_FILE_EXTENSION) == 0 || strcmp(ext, AES_FILE_EXTENSION) == 0 ||
+                          strcmp(ext, SEALED_FILE_EXTENSION) == 0))
       {
         file_count++;
         total_size += info.size;
@@ -1577,15 +1585,27 @@ void ShowStoredImages(void)
   Serial_PutString((uint8_t *)"Total size: ");
   Int2Str((uint8_t *)buffer, total_size);
   Serial_PutString((uint8_t *)buffer);
-  Serial_PutString((uint8_t *)" bytes\r\n\r\n");
+  Serial_PutString((uint8_t *)" bytes\r\n");
+
+  // 空闲时预擦除的效果: 命中的块写入时不用等擦除
+  Serial_PutString((uint8_t *)"Pre-erased blocks ready: ");
+  Int2Str((uint8_t *)buffer, lfs_spi_flash_ready_blocks());
+  Serial_PutString((uint8_t *)buffer);
+  Serial_PutString((uint8_t *)", erases skipped: ");
+  Int2Str((uint8_t *)buffer, lfs_spi_flash_idle_stats.hits);
+  Serial_PutString((uint8_t *)buffer);
+  Serial_PutString((uint8_t *)", done inline: ");
+  Int2Str((uint8_t *)buffer, lfs_spi_flash_idle_stats.misses);
+  Serial_PutString((uint8_t *)buffer);
+  Serial_PutString((uint8_t *)"\r\n\r\n");
 
   if (file_count == 0)
   {
     Serial_PutString((uint8_t *)"No stored images found.\r\n");
   }
 
-  // 卸载文件系统
-  lfs_spi_flash_unmount(NULL);
+  // 释放LittleFS会话, 文件系统保持挂载
+  Storage_Release(STORAGE_LFS);
 }
 
 /**
@@ -1595,60 +1615,397 @@ void ShowStoredImages(void)
  */
 void DeleteEntireFileSystem(void)
 {
-  int err;
-  uint8_t key = 0;
+  W25Q128_EraseStatsTypeDef erase_stats;
+  COM_StatusTypeDef status;
 
   // 警告用户
   Serial_PutString((uint8_t *)"\r\nWARNING: This will delete ALL files in the file system!\r\n");
   Serial_PutString((uint8_t *)"Are you sure you want to continue? (y/n): ");
 
   // 等待用户确认
-  while (1)
+  if (!WaitYesNo())
   {
-    if (HAL_UART_Receive(&UartHandle, &key, 1, HAL_MAX_DELAY) == HAL_OK)
-    {
-      if (key == 'y' || key == 'Y')
-      {
-        break;
-      }
-      else if (key == 'n' || key == 'N')
-      {
-        Serial_PutString((uint8_t *)"\r\nOperation cancelled.\r\n");
-        return;
-      }
-      else
-      {
-        Serial_PutString((uint8_t *)"Invalid input! Please enter 'y' or 'n': ");
-      }
-    }
+    Serial_PutString((uint8_t *)"\r\nOperation cancelled.\r\n");
+    return;
   }
 
-  // 初始化SPI Flash和LittleFS
-  Serial_PutString((uint8_t *)"\r\nInitializing SPI Flash and LittleFS...\r\n");
-  err = lfs_spi_flash_init();
-  if (err != 0)
+  // 擦除整个分区后格式化, 旧文件的数据不留在Flash中
+  Serial_PutString((uint8_t *)"\r\nErasing and formatting file system...\r\n");
+  status = Storage_Format(&erase_stats);
+  if (status == COM_ERROR)
   {
     Serial_PutString((uint8_t *)"SPI Flash initialization failed!\r\n");
     return;
   }
-
-  // 格式化文件系统
-  Serial_PutString((uint8_t *)"Formatting file system...\r\n");
-  err = lfs_spi_flash_format(NULL);
-  if (err != LFS_ERR_OK)
+  if (status != COM_OK)
   {
-    Serial_PutString((uint8_t *)"Failed to format file system! Error: ");
+    Serial_PutString((uint8_t *)"Failed to erase or format file system! Error: ");
     uint8_t err_str[16];
-    Int2Str(err_str, err);
+    Int2Str(err_str, (uint32_t)Storage_GetState(STORAGE_LFS)->error);
     Serial_PutString(err_str);
     Serial_PutString((uint8_t *)"\r\n");
     return;
   }
+  ShowEraseStats(&erase_stats);
 
   Serial_PutString((uint8_t *)"File system formatted successfully!\r\n");
   Serial_PutString((uint8_t *)"All files have been deleted.\r\n");
 }
 
+/**
+ * @brief  性能测试菜单
+ * @param  None
+ * @retval None
+ */
+void Benchmark_Menu(void)
+{
+  uint8_t key = 0;
+
+  while (1)
+  {
+    Serial_PutString((uint8_t *)"\r\n=============== Benchmark Menu ===============\r\n\n");
+    Serial_PutString((uint8_t *)"  1. AES self-test and benchmark --------- 1\r\n\n");
+    Serial_PutString((uint8_t *)"  2. SPI Flash benchmark ----------------- 2\r\n\n");
+    Serial_PutString((uint8_t *)"  Return to main menu -------------------- 0\r\n\n");
+    Serial_PutString((uint8_t *)"==============================================\r\n\n");
+    Serial_PutString((uint8_t *)"Please select an option: ");
+
+    /* Clean the input path */
+    __HAL_UART_FLUSH_DRREGISTER(&UartHandle);
+
+    /* Receive key */
+    HAL_UART_Receive(&UartHandle, &key, 1, RX_TIMEOUT);
+
+    switch (key)
+    {
+    case '1':
+      AES_Benchmark();
+      break;
+    case '2':
+      SPIFlash_Benchmark();
+      break;
+    case '0':
+      /* Return to main menu */
+      Serial_PutString((uint8_t *)"\r\nReturning to main menu...\r\n");
+      return;
+    default:
+      Serial_PutString((uint8_t *)"Invalid Number ! ==> The number should be either 0, 1 or 2\r");
+      break;
+    }
+  }
+}
+
+/**
+ * @brief  AES自检(FIPS-197/SP 800-38A)并用DWT周期计数器测量加解密速度
+ * @param  None
+ * @retval None
+ */
+void AES_Benchmark(void)
+{
+  struct AES_ctx ctx;
+  uint8_t number[11];
+  uint8_t *buffer;
+  uint32_t start;
+  uint32_t cycles;
+  int result;
+
+  Serial_PutString((uint8_t *)"\r\nAES self-test: ");
+  result = AES_self_test();
+  if (result != 0)
+  {
+    Serial_PutString((uint8_t *)"vector ");
+    Int2Str(number, (uint32_t)result);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" FAILED\r\n");
+    return;
+  }
+  Serial_PutString((uint8_t *)"passed\r\n");
+
+  buffer = IoArena_Get(MENU_BUFFER_SIZE, "aes bench");
+  if (buffer == NULL)
+  {
+    Serial_PutString((uint8_t *)"No buffer available!\r\n");
+    return;
+  }
+  memset(buffer, 0x5A, MENU_BUFFER_SIZE);
+
+  // 自检最后用的是测试密钥, 第一次是完整的密钥扩展, 第二次走缓存
+  start = DWT->CYCCNT;
+  AES_init_ctx_iv(&ctx, AES_image_key, AES_image_iv);
+  cycles = DWT->CYCCNT - start;
+  Serial_PutString((uint8_t *)"  Key setup: ");
+  Int2Str(number, cycles);
+  Serial_PutString(number);
+  start = DWT->CYCCNT;
+  AES_init_ctx_iv(&ctx, AES_image_key, AES_image_iv);
+  cycles = DWT->CYCCNT - start;
+  Serial_PutString((uint8_t *)" cycles, cached: ");
+  Int2Str(number, cycles);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" cycles\r\n");
+
+  start = DWT->CYCCNT;
+  AES_CBC_decrypt_buffer(&ctx, buffer, MENU_BUFFER_SIZE);
+  ShowCyclesPerByte("  CBC decrypt: ", DWT->CYCCNT - start, MENU_BUFFER_SIZE);
+
+  start = DWT->CYCCNT;
+  AES_CBC_encrypt_buffer(&ctx, buffer, MENU_BUFFER_SIZE);
+  ShowCyclesPerByte("  CBC encrypt: ", DWT->CYCCNT - start, MENU_BUFFER_SIZE);
+
+  start = DWT->CYCCNT;
+  AES_CTR_xcrypt_buffer(&ctx, buffer, MENU_BUFFER_SIZE);
+  ShowCyclesPerByte("  CTR:         ", DWT->CYCCNT - start, MENU_BUFFER_SIZE);
+
+  IoArena_Put(buffer);
+}
+
+/**
+ * @brief  W25Q128_read_stream回调, 累加CRC
+ * @param  context: uint32_t CRC
+ * @param  data: 读出的数据
+ * @param  length: 字节数
+ * @retval 0
+ */
+static int BenchCrcCallback(void *context, const uint8_t *data, uint32_t length)
+{
+  *(uint32_t *)context = Crc32_Update(*(uint32_t *)context, data, length);
+  return 0;
+}
+
+/**
+ * @brief  用扇区缓存逐条写入一个扇区的小记录, 打印擦除次数
+ * @param  buffer: MENU_BUFFER_SIZE字节的记录数据
+ * @retval 0成功, -1 SPI传输出错
+ */
+static int SPIFlash_CacheBenchmark(uint8_t *buffer)
+{
+  static W25Q128_CacheTypeDef cache;
+  uint8_t number[11];
+  uint8_t *sector;
+  uint32_t start, cycles, offset;
+  int err = 0;
+
+  sector = IoArena_Get(W25Q128_SECTOR_SIZE, "flash cache");
+  if (sector == NULL)
+  {
+    Serial_PutString((uint8_t *)"No buffer available!\r\n");
+    return 0;
+  }
+  W25Q128_cache_init(&cache, sector);
+  for (offset = 0; offset < MENU_BUFFER_SIZE; offset++)
+  {
+    buffer[offset] = (uint8_t)(offset * 13);
+  }
+
+  start = DWT->CYCCNT;
+  for (offset = 0; (offset < W25Q128_SECTOR_SIZE) && (err == 0); offset += BENCH_RECORD_SIZE)
+  {
+    err = W25Q128_cache_write(&cache, &buffer[offset], W25Q128_SCRATCH_ADDR + offset, BENCH_RECORD_SIZE);
+  }
+  if (err == 0)
+  {
+    err = W25Q128_cache_flush(&cache);
+  }
+  cycles = DWT->CYCCNT - start;
+
+  if (err == 0)
+  {
+    Serial_PutString((uint8_t *)"\r\nSector cache, ");
+    Int2Str(number, cache.writes);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" writes of ");
+    Int2Str(number, BENCH_RECORD_SIZE);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" bytes, ");
+    Int2Str(number, cache.erases);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" erase(s):\r\n");
+    ShowThroughput("  Write:        ", cycles, W25Q128_SECTOR_SIZE);
+    // 回读校验, 读到sector中避开缓存
+    err = W25Q128_read(sector, W25Q128_SCRATCH_ADDR, W25Q128_SECTOR_SIZE);
+  }
+  if (err == 0)
+  {
+    Serial_PutString((uint8_t *)((memcmp(sector, buffer, W25Q128_SECTOR_SIZE) == 0) ? "  Verify: passed\r\n"
+                                                                                    : "  Verify: FAILED\r\n"));
+  }
+  IoArena_Put(sector);
+  return err;
+}
+
+/**
+ * @brief  排队异步擦除测试块, 擦除进行中读取4KB, 打印读取延迟
+ * @param  buffer: MENU_BUFFER_SIZE字节
+ * @retval 0成功, -1 SPI传输出错
+ */
+static int SPIFlash_SuspendBenchmark(uint8_t *buffer)
+{
+  uint8_t number[11];
+  uint32_t tickstart, start, cycles;
+  int err;
+
+  if (W25Q128_async_erase(W25Q128_SCRATCH_ADDR, W25Q128_BLOCK64_SIZE, NULL, NULL) != 0)
+  {
+    return -1;
+  }
+  tickstart = HAL_GetTick();
+  // 等TIM1中断发出擦除指令
+  while ((HAL_GetTick() - tickstart) < 2)
+  {
+  }
+  start = DWT->CYCCNT;
+  err = W25Q128_read(buffer, 0, MENU_BUFFER_SIZE);
+  cycles = DWT->CYCCNT - start;
+  W25Q128_async_wait();
+
+  if (err == 0)
+  {
+    Serial_PutString((uint8_t *)"\r\nRead 4KB during a 64KB erase: ");
+    Int2Str(number, cycles / (SystemCoreClock / 1000000U));
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" us, erase took ");
+    Int2Str(number, HAL_GetTick() - tickstart);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" ms\r\n");
+  }
+  return err;
+}
+
+/**
+ * @brief  测量W25Q128读和页编程速度, 先用每字节轮询(原实现)再用DMA
+ * @note   使用LittleFS分区之外的W25Q128_SCRATCH_ADDR扇区, 擦除时间不计入
+ * @param  None
+ * @retval None
+ */
+void SPIFlash_Benchmark(void)
+{
+  uint8_t *buffer;
+  uint8_t dma_mode = W25Q128_get_dma();
+  uint32_t start, cycles, offset, i;
+  uint32_t crc, stream_crc;
+  W25Q128_EraseStatsTypeDef erase_stats;
+  uint8_t mode;
+  int err = 0;
+
+  if (lfs_spi_flash_init() != 0)
+  {
+    Serial_PutString((uint8_t *)"\r\nSPI Flash init failed!\r\n");
+    return;
+  }
+  buffer = IoArena_Get(MENU_BUFFER_SIZE, "flash bench");
+  if (buffer == NULL)
+  {
+    Serial_PutString((uint8_t *)"No buffer available!\r\n");
+    return;
+  }
+
+  for (mode = 0; (mode < 2) && (err == 0); mode++)
+  {
+    W25Q128_set_dma(mode);
+    Serial_PutString((uint8_t *)(mode ? "\r\nDMA:\r\n" : "\r\nByte by byte:\r\n"));
+
+    // 读: 64KB, 每次4KB
+    start = DWT->CYCCNT;
+    for (offset = 0; (offset < BENCH_READ_SIZE) && (err == 0); offset += MENU_BUFFER_SIZE)
+    {
+      err = W25Q128_read(buffer, W25Q128_SCRATCH_ADDR + offset, MENU_BUFFER_SIZE);
+    }
+    cycles = DWT->CYCCNT - start;
+    if (err == 0)
+    {
+      ShowThroughput("  Read:         ", cycles, BENCH_READ_SIZE);
+    }
+
+    // 读并计算CRC: 先读后算, 再用流式读取让CRC和DMA重叠
+    crc = CRC32_INIT;
+    start = DWT->CYCCNT;
+    for (offset = 0; (offset < BENCH_READ_SIZE) && (err == 0); offset += MENU_BUFFER_SIZE)
+    {
+      err = W25Q128_read(buffer, W25Q128_SCRATCH_ADDR + offset, MENU_BUFFER_SIZE);
+      crc = Crc32_Update(crc, buffer, MENU_BUFFER_SIZE);
+    }
+    cycles = DWT->CYCCNT - start;
+    stream_crc = CRC32_INIT;
+    start = DWT->CYCCNT;
+    if (err == 0)
+    {
+      err = W25Q128_read_stream(W25Q128_SCRATCH_ADDR, BENCH_READ_SIZE, buffer, MENU_BUFFER_SIZE / 2,
+                                BenchCrcCallback, &stream_crc);
+    }
+    if (err == 0)
+    {
+      ShowThroughput("  Read + CRC:   ", cycles, BENCH_READ_SIZE);
+      ShowThroughput("  Stream + CRC: ", DWT->CYCCNT - start, BENCH_READ_SIZE);
+      if (stream_crc != crc)
+      {
+        Serial_PutString((uint8_t *)"  Stream CRC mismatch!\r\n");
+      }
+    }
+
+    // 页编程: 一个扇区, 擦除不计时
+    for (i = 0; i < MENU_BUFFER_SIZE; i++)
+    {
+      buffer[i] = (uint8_t)(i * 7 + mode);
+    }
+    W25Q128_erase_sector(W25Q128_SCRATCH_ADDR / W25Q128_SECTOR_SIZE);
+    start = DWT->CYCCNT;
+    for (i = 0; (i < BENCH_PROG_PAGES) && (err == 0); i++)
+    {
+      err = W25Q128_page_program(&buffer[i * W25Q128_PAGE_SIZE], W25Q128_SCRATCH_ADDR + i * W25Q128_PAGE_SIZE,
+                                 W25Q128_PAGE_SIZE);
+    }
+    cycles = DWT->CYCCNT - start;
+    if (err == 0)
+    {
+      ShowThroughput("  Page program: ", cycles, BENCH_PROG_PAGES * W25Q128_PAGE_SIZE);
+    }
+
+    // 回读校验
+    memset(buffer, 0, MENU_BUFFER_SIZE);
+    if ((err == 0) && (W25Q128_read(buffer, W25Q128_SCRATCH_ADDR, MENU_BUFFER_SIZE) == 0))
+    {
+      for (i = 0; i < MENU_BUFFER_SIZE; i++)
+      {
+        if (buffer[i] != (uint8_t)(i * 7 + mode))
+        {
+          break;
+        }
+      }
+      Serial_PutString((uint8_t *)((i == MENU_BUFFER_SIZE) ? "  Verify: passed\r\n" : "  Verify: FAILED\r\n"));
+    }
+  }
+
+  // 扇区缓存: 一个扇区分成BENCH_RECORD_SIZE字节的小记录逐条写入
+  if (err == 0)
+  {
+    err = SPIFlash_CacheBenchmark(buffer);
+  }
+
+  // 异步擦除: 擦除进行中读取LittleFS区域, 读取时暂停擦除
+  if (err == 0)
+  {
+    err = SPIFlash_SuspendBenchmark(buffer);
+  }
+
+  // 擦除规划器: 整个测试块用一条64KB擦除
+  if ((err == 0) && (W25Q128_erase_range(W25Q128_SCRATCH_ADDR, W25Q128_BLOCK64_SIZE, &erase_stats) == 0))
+  {
+    Serial_PutString((uint8_t *)"\r\nErase scratch block:\r\n");
+    ShowEraseStats(&erase_stats);
+  }
+  if (err != 0)
+  {
+    Serial_PutString((uint8_t *)"  SPI transfer error!\r\n");
+  }
+
+  W25Q128_set_dma(dma_mode);
+  IoArena_Put(buffer);
+
+  // 驱动重新初始化过, 芯片也绕过LittleFS擦写过: 下次使用时重新检测、挂载,
+  // 不再相信预擦除记录
+  Storage_Invalidate(STORAGE_LFS);
+}
+
 /**
  * @}
  */
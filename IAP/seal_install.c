@@ -0,0 +1,329 @@
+/**
+ ******************************************************************************
+ * @file    IAP/seal_install.c
+ * @brief   Sector-skip install of an indexed sealed image. The application
+ *          area is compared sector by sector with the index of the image
+ *          (a truncated CMAC of every plain chunk), only the sectors that
+ *          differ are erased and programmed, from records read at their own
+ *          offsets. An install cut short by a reset is finished by running
+ *          it again: the sectors it completed match and are skipped. Until
+ *          then the header sector is left erased, so no half written image
+ *          is started.
+ *          Every record of a sector is authenticated before the sector is
+ *          erased, so an image that does not authenticate leaves the Flash
+ *          as it was.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "seal_install.h"
+#include "common.h"
+#include "flash_if.h"
+#include "io_arena.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Private define ------------------------------------------------------------*/
+#if (APPLICATION_ADDRESS < 0x08020000U) /* ADDR_FLASH_SECTOR_5, the cast does not suit #if */
+#error "SEAL_INSTALL_SECTOR_SIZE assumes the application starts in a 128 Kbyte sector"
+#endif
+#define SEAL_INSTALL_CHUNKS_PER_SECTOR (SEAL_INSTALL_SECTOR_SIZE / AES_SEAL_CHUNK_SIZE)
+
+/* Private variables ---------------------------------------------------------*/
+static struct AES_seal InstallSeal;
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Read a whole range of the source
+ * @param  source: open source
+ * @param  offset: first byte
+ * @param  data: destination
+ * @param  length: bytes
+ * @retval COM_OK, or COM_ERROR on a read error or a short file
+ */
+static COM_StatusTypeDef SealInstall_Read(UpdateSource_TypeDef *source, uint32_t offset, uint8_t *data,
+                                          uint32_t length)
+{
+  uint32_t done = 0;
+  int32_t bytes_read;
+
+  if (source->ops->Seek(source, offset) != COM_OK)
+  {
+    return COM_ERROR;
+  }
+  while (done < length)
+  {
+    bytes_read = source->ops->Read(source, &data[done], length - done);
+    if (bytes_read <= 0)
+    {
+      return COM_ERROR;
+    }
+    done += (uint32_t)bytes_read;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Read and unseal one record
+ * @param  source: open source
+ * @param  chunk: record index
+ * @param  buffer: UPDATE_PIPELINE_BUFFER_SIZE bytes, the plain chunk on return
+ * @param  p_plain: plain bytes in buffer
+ * @retval COM_OK, COM_DATA if the record does not authenticate or does not
+ *         match its index entry, COM_ERROR on a read error
+ */
+static COM_StatusTypeDef SealInstall_Unseal(UpdateSource_TypeDef *source, uint32_t chunk, uint8_t *buffer,
+                                            size_t *p_plain)
+{
+  uint32_t length;
+
+  AES_seal_seek(&InstallSeal, chunk);
+  length = (uint32_t)AES_seal_record_length(&InstallSeal);
+  if (SealInstall_Read(source, AES_seal_record_offset(&InstallSeal, chunk), buffer, length) != COM_OK)
+  {
+    return COM_ERROR;
+  }
+  if ((AES_unseal_record(&InstallSeal, buffer, length, p_plain) != AES_SEAL_OK) ||
+      !AES_seal_chunk_match(&InstallSeal, chunk, buffer))
+  {
+    return COM_DATA;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Install with the buffers checked out
+ * @param  source: source set up by one of the UpdateSource_Init functions
+ * @param  name: file to read
+ * @param  buffer: UPDATE_PIPELINE_BUFFER_SIZE bytes, 32bit aligned
+ * @param  index: AES_SEAL_INDEX_MAX_SIZE bytes
+ * @param  p_stats: statistics
+ * @retval see SealInstall_Run
+ */
+static COM_StatusTypeDef SealInstall_Copy(UpdateSource_TypeDef *source, const char *name, uint8_t *buffer,
+                                          uint8_t *index, SealInstall_StatsTypeDef *p_stats)
+{
+  COM_StatusTypeDef status;
+  uint32_t file_size, chunks, sector, first, last, chunk, address, changed = 0, tickstart;
+  char line[40];
+  size_t plain;
+  int err;
+
+  status = source->ops->Open(source, name, &file_size);
+  if (status != COM_OK)
+  {
+    return status;
+  }
+
+  AES_seal_init(&InstallSeal, AES_image_key);
+  status = SealInstall_Read(source, 0, buffer, AES_SEAL_HEADER_SIZE);
+  if (status == COM_OK)
+  {
+    err = AES_seal_open(&InstallSeal, buffer);
+    status = (err == AES_SEAL_ERR_AUTH) ? COM_DATA : ((err != AES_SEAL_OK) ? COM_LIMIT : COM_OK);
+  }
+  if ((status == COM_OK) && (AES_seal_index_length(&InstallSeal) == 0))
+  {
+    status = COM_ABORT;
+  }
+  if ((status == COM_OK) &&
+      ((InstallSeal.chunk_size != AES_SEAL_CHUNK_SIZE) ||
+       (AES_seal_index_length(&InstallSeal) > AES_SEAL_INDEX_MAX_SIZE) ||
+       (file_size != AES_seal_file_size(&InstallSeal)) || (InstallSeal.size == 0) ||
+       (InstallSeal.size > USER_FLASH_SIZE)))
+  {
+    status = COM_LIMIT;
+  }
+  chunks = AES_seal_chunk_count(&InstallSeal);
+  if (status == COM_OK)
+  {
+    status = SealInstall_Read(source, AES_seal_record_offset(&InstallSeal, chunks), index,
+                              (uint32_t)AES_seal_index_length(&InstallSeal));
+  }
+  if ((status == COM_OK) && (AES_seal_open_index(&InstallSeal, index) != AES_SEAL_OK))
+  {
+    status = COM_DATA;
+  }
+  if (status != COM_OK)
+  {
+    source->ops->Close(source);
+    return status;
+  }
+  p_stats->size = InstallSeal.size;
+  p_stats->sectors = (chunks + SEAL_INSTALL_CHUNKS_PER_SECTOR - 1) / SEAL_INSTALL_CHUNKS_PER_SECTOR;
+
+  /* Find the sectors to write and authenticate their records before
+     anything is erased */
+  tickstart = HAL_GetTick();
+  for (sector = 0; sector < p_stats->sectors; sector++)
+  {
+    first = sector * SEAL_INSTALL_CHUNKS_PER_SECTOR;
+    last = (first + SEAL_INSTALL_CHUNKS_PER_SECTOR < chunks) ? first + SEAL_INSTALL_CHUNKS_PER_SECTOR : chunks;
+    address = APPLICATION_ADDRESS + sector * SEAL_INSTALL_SECTOR_SIZE;
+    for (chunk = first; chunk < last; chunk++)
+    {
+      const uint8_t *installed = (const uint8_t *)(address + (chunk - first) * AES_SEAL_CHUNK_SIZE);
+
+      if (!AES_seal_chunk_match(&InstallSeal, chunk, installed))
+      {
+        changed |= 1U << sector;
+        break;
+      }
+    }
+  }
+  /* The header sector is rewritten with any other, see below */
+  if (changed != 0)
+  {
+    changed |= 1U;
+  }
+
+  for (sector = 0; (sector < p_stats->sectors) && (status == COM_OK); sector++)
+  {
+    address = APPLICATION_ADDRESS + sector * SEAL_INSTALL_SECTOR_SIZE;
+    snprintf(line, sizeof(line), "  Sector 0x%08lX: %s\r\n", (unsigned long)address,
+             (changed & (1U << sector)) ? "to be written" : "unchanged");
+    Serial_PutString((uint8_t *)line);
+    if (!(changed & (1U << sector)))
+    {
+      continue;
+    }
+    first = sector * SEAL_INSTALL_CHUNKS_PER_SECTOR;
+    last = (first + SEAL_INSTALL_CHUNKS_PER_SECTOR < chunks) ? first + SEAL_INSTALL_CHUNKS_PER_SECTOR : chunks;
+    for (chunk = first; (chunk < last) && (status == COM_OK); chunk++)
+    {
+      status = SealInstall_Unseal(source, chunk, buffer, &plain);
+    }
+  }
+  p_stats->verify_ms = HAL_GetTick() - tickstart;
+
+  /* The sector holding the image header is erased before any other and
+     programmed last, and it is written whenever another sector is, even
+     if it matched. app_is_valid only looks at the header, so a run cut
+     short leaves no image to start rather than a header in front of a
+     body that is half old, half new. */
+  if ((status == COM_OK) && (changed & 1U))
+  {
+    tickstart = HAL_GetTick();
+    if (FLASH_If_EraseRange(APPLICATION_ADDRESS, SEAL_INSTALL_SECTOR_SIZE) != 0)
+    {
+      status = COM_DATA;
+    }
+    p_stats->erase_ms += HAL_GetTick() - tickstart;
+  }
+  for (sector = 1; (sector <= p_stats->sectors) && (status == COM_OK); sector++)
+  {
+    uint32_t current = sector % p_stats->sectors;
+
+    if (!(changed & (1U << current)))
+    {
+      continue;
+    }
+    address = APPLICATION_ADDRESS + current * SEAL_INSTALL_SECTOR_SIZE;
+    tickstart = HAL_GetTick();
+    if ((current != 0) && (FLASH_If_EraseRange(address, SEAL_INSTALL_SECTOR_SIZE) != 0))
+    {
+      status = COM_DATA;
+    }
+    p_stats->erase_ms += HAL_GetTick() - tickstart;
+
+    tickstart = HAL_GetTick();
+    first = current * SEAL_INSTALL_CHUNKS_PER_SECTOR;
+    last = (first + SEAL_INSTALL_CHUNKS_PER_SECTOR < chunks) ? first + SEAL_INSTALL_CHUNKS_PER_SECTOR : chunks;
+    for (chunk = first; (chunk < last) && (status == COM_OK); chunk++)
+    {
+      /* Authenticated again, the file is not trusted to be the one checked */
+      status = SealInstall_Unseal(source, chunk, buffer, &plain);
+      if (status == COM_OK)
+      {
+        /* The tail of the last chunk is padded to a word */
+        memset(&buffer[plain], 0xFF, 3);
+        if (FLASH_If_Write(address, (uint32_t *)buffer, (uint32_t)(plain + 3) / 4) != FLASHIF_OK)
+        {
+          status = COM_DATA;
+        }
+        address += AES_SEAL_CHUNK_SIZE;
+      }
+    }
+    p_stats->program_ms += HAL_GetTick() - tickstart;
+    if (status == COM_OK)
+    {
+      p_stats->sectors_written++;
+    }
+  }
+  source->ops->Close(source);
+  return status;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Install an indexed sealed image into the application area, the
+ *         sectors that already hold their part of the image are skipped
+ * @param  source: source set up by one of the UpdateSource_Init functions
+ * @param  name: file to read
+ * @param  p_stats: statistics
+ * @retval COM_OK, COM_ABORT if the image has no index (use the update
+ *         pipeline), COM_LIMIT if empty, too big or not a sealed image of
+ *         AES_SEAL_CHUNK_SIZE chunks, COM_DATA if the image does not
+ *         authenticate or on an erase or write error, COM_ERROR on a read
+ *         error or when the I/O arena has no room
+ */
+COM_StatusTypeDef SealInstall_Run(UpdateSource_TypeDef *source, const char *name, SealInstall_StatsTypeDef *p_stats)
+{
+  COM_StatusTypeDef status = COM_ERROR;
+  uint32_t total_start = HAL_GetTick();
+  uint8_t *buffer;
+  uint8_t *index;
+
+  memset(p_stats, 0, sizeof(*p_stats));
+  buffer = IoArena_Get(UPDATE_PIPELINE_BUFFER_SIZE, "seal install");
+  index = IoArena_Get(AES_SEAL_INDEX_MAX_SIZE, "seal install index");
+  if ((buffer != NULL) && (index != NULL))
+  {
+    status = SealInstall_Copy(source, name, buffer, index, p_stats);
+  }
+  IoArena_Put(index);
+  IoArena_Put(buffer);
+
+  p_stats->total_ms = HAL_GetTick() - total_start;
+  return status;
+}
+
+/**
+ * @brief  Print the sectors written and the time spent in each phase
+ * @param  p_stats: statistics of SealInstall_Run
+ * @retval None
+ */
+void SealInstall_ShowStats(const SealInstall_StatsTypeDef *p_stats)
+{
+  uint8_t number[11];
+
+  Serial_PutString((uint8_t *)"  Sectors written: ");
+  Int2Str(number, p_stats->sectors_written);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" of ");
+  Int2Str(number, p_stats->sectors);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)"\r\n  Verify:          ");
+  Int2Str(number, p_stats->verify_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  Erase:           ");
+  Int2Str(number, p_stats->erase_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  Program:         ");
+  Int2Str(number, p_stats->program_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  Total:           ");
+  Int2Str(number, p_stats->total_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n");
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+ * @file    IAP/seal_install.h
+ * @brief   Install an indexed sealed image (.aex) into the application area
+ *          one Flash sector at a time, leaving alone the sectors that
+ *          already hold what the image index says.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SEAL_INSTALL_H
+#define __SEAL_INSTALL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+#include "update_pipeline.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Sectors 5 to 11 of the application area are all 128 Kbyte */
+#define SEAL_INSTALL_SECTOR_SIZE ((uint32_t)0x20000)
+
+/* Exported types ------------------------------------------------------------*/
+/**
+ * @brief  Outcome of an install, times in ms
+ */
+typedef struct
+{
+  uint32_t size;            /* Plain image size */
+  uint32_t sectors;         /* Sectors covered by the image */
+  uint32_t sectors_written; /* Erased and programmed */
+  uint32_t verify_ms;       /* Flash compared with the index, records authenticated */
+  uint32_t erase_ms;
+  uint32_t program_ms;      /* Records read, unsealed and programmed */
+  uint32_t total_ms;
+} SealInstall_StatsTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+COM_StatusTypeDef SealInstall_Run(UpdateSource_TypeDef *source, const char *name, SealInstall_StatsTypeDef *p_stats);
+void SealInstall_ShowStats(const SealInstall_StatsTypeDef *p_stats);
+
+#endif /* __SEAL_INSTALL_H */
@@ -0,0 +1,247 @@
+/**
+ ******************************************************************************
+ * @file    IAP/storage.c
+ * @brief   Mount sessions of LittleFS and of the TF card. Mounting LittleFS
+ *          walks its metadata and mounting the card reads its boot sector
+ *          and FAT, so a volume is mounted once and kept: menu actions find
+ *          it ready. References only tell whether a volume may be unmounted
+ *          or formatted now.
+ *          A LittleFS mount that fails is reported, not repaired: an I/O
+ *          error is retried on the next acquire, a missing or damaged file
+ *          system is left for the user to format.
+ *          FatFs checks the card status on every access and mounts a card
+ *          that was swapped by itself, a kept TF mount stays valid.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "storage.h"
+#include "lfs_spi_flash_adapter.h"
+#include "w25q128_async.h"
+#include "fatfs.h"
+
+/* Private variables ---------------------------------------------------------*/
+static Storage_StateTypeDef StorageState[STORAGE_NB];
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Mount LittleFS as it is on the SPI Flash
+ * @param  p_state: state of STORAGE_LFS
+ * @retval COM_OK, COM_DATA if the Flash holds no usable file system,
+ *         COM_ERROR if the Flash does not answer or on an I/O error
+ */
+static COM_StatusTypeDef Storage_MountLfs(Storage_StateTypeDef *p_state)
+{
+  if (!p_state->detected)
+  {
+    if (lfs_spi_flash_init() != 0)
+    {
+      p_state->error = LFS_ERR_IO;
+      return COM_ERROR;
+    }
+    p_state->detected = 1;
+  }
+
+  p_state->error = lfs_spi_flash_mount_existing(&lfs_instance);
+  if (p_state->error == LFS_ERR_IO)
+  {
+    p_state->detected = 0;
+    return COM_ERROR;
+  }
+  return (p_state->error == LFS_ERR_OK) ? COM_OK : COM_DATA;
+}
+
+/**
+ * @brief  Mount the TF card
+ * @param  p_state: state of STORAGE_TF
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef Storage_MountTf(Storage_StateTypeDef *p_state)
+{
+  p_state->error = (int32_t)f_mount(&SDFatFS, "0:", 1);
+  return (p_state->error == FR_OK) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Unmount a volume
+ * @param  volume: volume to unmount
+ * @retval None
+ */
+static void Storage_Unmount(Storage_VolumeTypeDef volume)
+{
+  if (!StorageState[volume].mounted)
+  {
+    return;
+  }
+  if (volume == STORAGE_LFS)
+  {
+    lfs_spi_flash_unmount(&lfs_instance);
+  }
+  else
+  {
+    f_mount(NULL, "0:", 0);
+  }
+  StorageState[volume].mounted = 0;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Take a reference to a volume, mounting it if it is not mounted
+ * @param  volume: volume to use
+ * @retval COM_OK, to be paired with Storage_Release. COM_DATA if the SPI
+ *         Flash holds no usable file system, COM_ERROR if the device does
+ *         not answer or the card does not mount
+ */
+COM_StatusTypeDef Storage_Acquire(Storage_VolumeTypeDef volume)
+{
+  Storage_StateTypeDef *p_state = &StorageState[volume];
+  COM_StatusTypeDef status = COM_OK;
+  uint32_t tickstart;
+
+  if (!p_state->mounted)
+  {
+    tickstart = HAL_GetTick();
+    status = (volume == STORAGE_LFS) ? Storage_MountLfs(p_state) : Storage_MountTf(p_state);
+    p_state->mount_ms = HAL_GetTick() - tickstart;
+    if (status != COM_OK)
+    {
+      return status;
+    }
+    p_state->mounted = 1;
+    p_state->mounts++;
+  }
+  p_state->refs++;
+  return COM_OK;
+}
+
+/**
+ * @brief  Drop a reference taken by Storage_Acquire, the volume stays
+ *         mounted for the next user
+ * @param  volume: volume used
+ * @retval None
+ */
+void Storage_Release(Storage_VolumeTypeDef volume)
+{
+  if (StorageState[volume].refs > 0)
+  {
+    StorageState[volume].refs--;
+  }
+}
+
+/**
+ * @brief  Forget the mount of a volume nobody holds, the next acquire
+ *         mounts it again. For use after the device was written behind
+ *         the file system or reported errors.
+ * @param  volume: volume to drop
+ * @retval None
+ */
+void Storage_Invalidate(Storage_VolumeTypeDef volume)
+{
+  if (StorageState[volume].refs == 0)
+  {
+    Storage_Unmount(volume);
+  }
+  if (volume == STORAGE_LFS)
+  {
+    StorageState[STORAGE_LFS].detected = 0;
+    lfs_spi_flash_forget_erased();
+  }
+}
+
+/**
+ * @brief  Create an empty LittleFS on the SPI Flash. Only for use once the
+ *         user confirmed that every stored file may be lost.
+ * @param  p_erase: if not NULL the whole partition is erased first, so the
+ *         data of the old files does not stay in the Flash, and the erase
+ *         statistics are returned here
+ * @retval COM_OK, COM_LIMIT while a user holds the volume, COM_ERROR if
+ *         the Flash does not answer, COM_DATA if the erase or the format
+ *         failed
+ */
+COM_StatusTypeDef Storage_Format(W25Q128_EraseStatsTypeDef *p_erase)
+{
+  if (StorageState[STORAGE_LFS].refs != 0)
+  {
+    return COM_LIMIT;
+  }
+  Storage_Unmount(STORAGE_LFS);
+  /* The pre-erased blocks were those of the old partition, the erase
+     below marks again what it clears */
+  lfs_spi_flash_forget_erased();
+
+  if (lfs_spi_flash_init() != 0)
+  {
+    StorageState[STORAGE_LFS].detected = 0;
+    return COM_ERROR;
+  }
+  StorageState[STORAGE_LFS].detected = 1;
+
+  if ((p_erase != NULL) && (lfs_spi_flash_erase_blocks(0, SPI_FLASH_BLOCK_COUNT, p_erase) != LFS_ERR_OK))
+  {
+    return COM_DATA;
+  }
+  StorageState[STORAGE_LFS].error = lfs_spi_flash_format(&lfs_instance);
+  return (StorageState[STORAGE_LFS].error == LFS_ERR_OK) ? COM_OK : COM_DATA;
+}
+
+/**
+ * @brief  Background maintenance while the bootloader waits for the user:
+ *         one step of garbage collection and pre-erasing of free blocks on
+ *         LittleFS, when it is mounted and nobody holds it. The erase runs
+ *         from the W25Q128 queue, this returns at once.
+ * @param  None
+ * @retval None
+ */
+void Storage_Idle(void)
+{
+  Storage_StateTypeDef *state = &StorageState[STORAGE_LFS];
+  int err;
+
+  if (!state->mounted || (state->refs != 0))
+  {
+    return;
+  }
+  err = lfs_spi_flash_idle(&lfs_instance);
+  if (err < 0)
+  {
+    state->error = err;
+  }
+}
+
+/**
+ * @brief  Unmount every volume, before the application is started
+ * @param  None
+ * @retval None
+ */
+void Storage_Shutdown(void)
+{
+  uint32_t volume;
+
+  for (volume = 0; volume < STORAGE_NB; volume++)
+  {
+    StorageState[volume].refs = 0;
+    Storage_Unmount((Storage_VolumeTypeDef)volume);
+  }
+  /* A pre-erase may still be running, the application owns the Flash */
+  W25Q128_async_wait();
+}
+
+/**
+ * @brief  State of a volume, for display
+ * @param  volume: volume
+ * @retval Pointer to the state
+ */
+const Storage_StateTypeDef *Storage_GetState(Storage_VolumeTypeDef volume)
+{
+  return &StorageState[volume];
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,50 @@
+/**
+ ******************************************************************************
+ * @file    IAP/storage.h
+ * @brief   Mount sessions of the two file systems. A volume is mounted by
+ *          the first user and stays mounted between menu actions, users
+ *          only take and drop a reference. A file system that does not
+ *          mount is never formatted here, that takes Storage_Format.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STORAGE_H
+#define __STORAGE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+#include "w25q128.h"
+
+/* Exported types ------------------------------------------------------------*/
+typedef enum
+{
+  STORAGE_LFS = 0, /* LittleFS on the SPI Flash, lfs_instance */
+  STORAGE_TF,      /* FatFs on the TF card, drive "0:" */
+  STORAGE_NB
+} Storage_VolumeTypeDef;
+
+/**
+ * @brief  State of one volume
+ */
+typedef struct
+{
+  uint8_t mounted;
+  uint8_t refs;      /* Users holding the volume */
+  uint8_t detected;  /* STORAGE_LFS: SPI Flash geometry read, redone after an I/O error */
+  int32_t error;     /* lfs or FatFs result of the last mount attempt */
+  uint32_t mounts;   /* Mounts done since reset */
+  uint32_t mount_ms; /* Time taken by the last mount */
+} Storage_StateTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+COM_StatusTypeDef Storage_Acquire(Storage_VolumeTypeDef volume);
+void Storage_Release(Storage_VolumeTypeDef volume);
+void Storage_Invalidate(Storage_VolumeTypeDef volume);
+COM_StatusTypeDef Storage_Format(W25Q128_EraseStatsTypeDef *p_erase);
+void Storage_Idle(void);
+void Storage_Shutdown(void);
+const Storage_StateTypeDef *Storage_GetState(Storage_VolumeTypeDef volume);
+
+#endif /* __STORAGE_H */
@@ -0,0 +1,338 @@
+/**
+ ******************************************************************************
+ * @file    IAP/tf_copy.c
+ * @brief   TF card to LittleFS copy. The file is read in multi-sector chunks
+ *          by SDIO DMA into one buffer while the other buffer is written to
+ *          the SPI Flash, the same double buffering as the TF card install.
+ *          The CRC-32 of the data is computed on the way and committed with
+ *          the file as the TF_COPY_ATTR_DIGEST attribute, the copy is then
+ *          read back and checked against it. The attribute lets any later
+ *          reader of the file check it as well.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "tf_copy.h"
+#include "tf_install.h"
+#include "common.h"
+#include "crc32.h"
+#include "io_arena.h"
+#include "ff.h"
+#include "lfs_spi_flash_adapter.h"
+#include <string.h>
+#include <stdio.h>
+
+/* Private variables ---------------------------------------------------------*/
+/* Read buffers, checked out of the I/O arena for the copy */
+static uint8_t *aCopyBuffer[2];
+static DWORD aCopyClmt[TF_INSTALL_CLMT_SIZE];
+static FIL CopyFile;
+static struct lfs_file CopyLfsFile;
+static struct lfs_file VerifyLfsFile;
+/* Committed by LittleFS when the copy is closed */
+static TFCopy_DigestTypeDef CopyDigest;
+static struct lfs_attr CopyAttr = {TF_COPY_ATTR_DIGEST, &CopyDigest, sizeof(CopyDigest)};
+static const struct lfs_file_config CopyFileConfig = {NULL, &CopyAttr, 1};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Write a chunk to the LittleFS file and add it to the CRC
+ * @param  p_buf: chunk
+ * @param  length: bytes
+ * @param  p_stats: write time is added here, crc is updated
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef TFCopy_Write(const uint8_t *p_buf, uint32_t length, TFCopy_StatsTypeDef *p_stats)
+{
+  uint32_t tickstart = HAL_GetTick();
+  lfs_ssize_t written;
+
+  p_stats->crc = Crc32_Update(p_stats->crc, p_buf, length);
+  written = lfs_file_write(&lfs_instance, &CopyLfsFile, p_buf, length);
+  p_stats->write_ms += HAL_GetTick() - tickstart;
+
+  return (written == (lfs_ssize_t)length) ? COM_OK : COM_DATA;
+}
+
+/**
+ * @brief  Fallback when the cluster map does not fit: plain f_read
+ * @param  p_stats: statistics
+ * @retval COM_StatusTypeDef result
+ */
+static COM_StatusTypeDef TFCopy_Sequential(TFCopy_StatsTypeDef *p_stats)
+{
+  uint32_t done = 0, size = (uint32_t)f_size(&CopyFile), last = 0;
+  uint32_t tickstart;
+  UINT bytes_read;
+
+  while (done < size)
+  {
+    tickstart = HAL_GetTick();
+    if ((f_read(&CopyFile, aCopyBuffer[0], TF_INSTALL_CHUNK_SIZE, &bytes_read) != FR_OK) || (bytes_read == 0))
+    {
+      return COM_ERROR;
+    }
+    p_stats->sd_wait_ms += HAL_GetTick() - tickstart;
+
+    if (TFCopy_Write(aCopyBuffer[0], bytes_read, p_stats) != COM_OK)
+    {
+      return COM_DATA;
+    }
+    done += bytes_read;
+    TFCard_Progress(done, size, &last);
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Copy with the buffers checked out
+ * @param  path: full FatFs path
+ * @param  lfs_name: LittleFS file, replaced if it exists
+ * @param  p_stats: filled with the time of every phase
+ * @retval see TFCopy_ToLfs
+ */
+static COM_StatusTypeDef TFCopy_File(const char *path, const char *lfs_name, TFCopy_StatsTypeDef *p_stats)
+{
+  COM_StatusTypeDef status = COM_OK;
+  uint32_t size, slot = 0, last = 0;
+  uint32_t length[2] = {0, 0};
+  uint32_t read_back_crc;
+  FSIZE_t ofs = 0;
+  uint32_t tickstart, total_start = HAL_GetTick();
+
+  memset(p_stats, 0, sizeof(*p_stats));
+  p_stats->crc = CRC32_INIT;
+
+  if (f_open(&CopyFile, path, FA_READ) != FR_OK)
+  {
+    return COM_ERROR;
+  }
+  size = (uint32_t)f_size(&CopyFile);
+  if (size == 0)
+  {
+    f_close(&CopyFile);
+    return COM_LIMIT;
+  }
+
+  /* An interrupted copy must not look like a checked one */
+  CopyDigest.size = 0;
+  CopyDigest.crc = 0;
+  if (lfs_spi_flash_file_opencfg(&lfs_instance, &CopyLfsFile, lfs_name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC,
+                                 &CopyFileConfig) != LFS_ERR_OK)
+  {
+    f_close(&CopyFile);
+    return COM_DATA;
+  }
+
+  /* Map the clusters of the file, too fragmented files fall back to f_read */
+  aCopyClmt[0] = TF_INSTALL_CLMT_SIZE;
+  CopyFile.cltbl = aCopyClmt;
+  if (f_lseek(&CopyFile, CREATE_LINKMAP) != FR_OK)
+  {
+    CopyFile.cltbl = NULL;
+    f_lseek(&CopyFile, 0);
+    status = TFCopy_Sequential(p_stats);
+  }
+  else
+  {
+    p_stats->overlapped = 1;
+
+    tickstart = HAL_GetTick();
+    status = TFCard_StartRead(&CopyFile, ofs, aCopyBuffer[slot], &length[slot]);
+    if (status == COM_OK)
+    {
+      status = TFCard_WaitRead();
+    }
+    p_stats->sd_wait_ms += HAL_GetTick() - tickstart;
+
+    while ((status == COM_OK) && (ofs < size))
+    {
+      FSIZE_t next_ofs = ofs + length[slot];
+
+      /* Next chunk comes in by DMA while this one goes to the SPI Flash */
+      if (next_ofs < size)
+      {
+        status = TFCard_StartRead(&CopyFile, next_ofs, aCopyBuffer[slot ^ 1], &length[slot ^ 1]);
+        if (status != COM_OK)
+        {
+          break;
+        }
+      }
+
+      status = TFCopy_Write(aCopyBuffer[slot], length[slot], p_stats);
+
+      if (next_ofs < size)
+      {
+        tickstart = HAL_GetTick();
+        if (TFCard_WaitRead() != COM_OK)
+        {
+          status = (status == COM_OK) ? COM_ERROR : status;
+        }
+        p_stats->sd_wait_ms += HAL_GetTick() - tickstart;
+      }
+
+      ofs = next_ofs;
+      slot ^= 1;
+      TFCard_Progress((uint32_t)ofs, size, &last);
+    }
+  }
+  f_close(&CopyFile);
+  Serial_PutString((uint8_t *)"\r\n");
+
+  /* The close commits the data and the digest together */
+  if (status == COM_OK)
+  {
+    CopyDigest.size = size;
+    CopyDigest.crc = p_stats->crc;
+  }
+  tickstart = HAL_GetTick();
+  if ((lfs_file_close(&lfs_instance, &CopyLfsFile) != LFS_ERR_OK) && (status == COM_OK))
+  {
+    status = COM_DATA;
+  }
+  p_stats->write_ms += HAL_GetTick() - tickstart;
+
+  if (status == COM_OK)
+  {
+    tickstart = HAL_GetTick();
+    status = TFCopy_VerifyLfs(lfs_name, aCopyBuffer[0], TF_INSTALL_CHUNK_SIZE, &read_back_crc);
+    p_stats->verify_ms = HAL_GetTick() - tickstart;
+    if (status == COM_ABORT)
+    {
+      /* Digest did not make it to the metadata */
+      status = COM_DATA;
+    }
+  }
+  if (status != COM_OK)
+  {
+    lfs_remove(&lfs_instance, lfs_name);
+  }
+
+  p_stats->size = size;
+  p_stats->total_ms = HAL_GetTick() - total_start;
+  return status;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Copy a file of the mounted TF card into the mounted LittleFS
+ * @param  path: full FatFs path, e.g. "0:/fw/app.bin"
+ * @param  lfs_name: LittleFS file, replaced if it exists
+ * @param  p_stats: filled with the CRC and the time of every phase
+ * @retval COM_OK, COM_LIMIT for an empty file, COM_DATA on a LittleFS error
+ *         or when the read-back does not match, COM_ERROR on TF card error
+ *         or when the I/O arena has no room for the buffers.
+ *         A failed copy is removed from LittleFS.
+ */
+COM_StatusTypeDef TFCopy_ToLfs(const char *path, const char *lfs_name, TFCopy_StatsTypeDef *p_stats)
+{
+  COM_StatusTypeDef status = COM_ERROR;
+
+  aCopyBuffer[0] = IoArena_Get(TF_INSTALL_CHUNK_SIZE, "TF copy buffer 0");
+  aCopyBuffer[1] = IoArena_Get(TF_INSTALL_CHUNK_SIZE, "TF copy buffer 1");
+
+  if ((aCopyBuffer[0] != NULL) && (aCopyBuffer[1] != NULL))
+  {
+    status = TFCopy_File(path, lfs_name, p_stats);
+  }
+
+  IoArena_Put(aCopyBuffer[1]);
+  IoArena_Put(aCopyBuffer[0]);
+  return status;
+}
+
+/**
+ * @brief  Read a LittleFS file back and check it against its digest
+ * @param  lfs_name: file in the mounted LittleFS
+ * @param  p_buffer: read buffer
+ * @param  size: buffer size, TF_COPY_VERIFY_BUFFER_SIZE or more
+ * @param  p_crc: CRC-32 of the file, may be NULL
+ * @retval COM_OK if it matches, COM_DATA if not, COM_ABORT if the file has
+ *         no digest (not written by TFCopy_ToLfs), COM_ERROR on read error
+ */
+COM_StatusTypeDef TFCopy_VerifyLfs(const char *lfs_name, uint8_t *p_buffer, uint32_t size, uint32_t *p_crc)
+{
+  TFCopy_DigestTypeDef digest;
+  lfs_ssize_t attr_size, bytes_read;
+  uint32_t crc = CRC32_INIT, total = 0;
+
+  attr_size = lfs_getattr(&lfs_instance, lfs_name, TF_COPY_ATTR_DIGEST, &digest, sizeof(digest));
+  if ((attr_size < 0) && (attr_size != LFS_ERR_NOATTR))
+  {
+    return COM_ERROR;
+  }
+
+  if (lfs_spi_flash_file_open(&lfs_instance, &VerifyLfsFile, lfs_name, LFS_O_RDONLY) != LFS_ERR_OK)
+  {
+    return COM_ERROR;
+  }
+  while ((bytes_read = lfs_file_read(&lfs_instance, &VerifyLfsFile, p_buffer, size)) > 0)
+  {
+    crc = Crc32_Update(crc, p_buffer, (uint32_t)bytes_read);
+    total += (uint32_t)bytes_read;
+  }
+  lfs_file_close(&lfs_instance, &VerifyLfsFile);
+
+  if (bytes_read < 0)
+  {
+    return COM_ERROR;
+  }
+  if (p_crc != NULL)
+  {
+    *p_crc = crc;
+  }
+  if (attr_size != (lfs_ssize_t)sizeof(digest))
+  {
+    return COM_ABORT;
+  }
+  return ((digest.size == total) && (digest.crc == crc)) ? COM_OK : COM_DATA;
+}
+
+/**
+ * @brief  Print the phase timing of a copy
+ * @param  p_stats: statistics filled by TFCopy_ToLfs
+ * @retval None
+ */
+void TFCopy_ShowStats(const TFCopy_StatsTypeDef *p_stats)
+{
+  uint8_t number[11];
+
+  snprintf((char *)number, sizeof(number), "0x%08lX", (unsigned long)p_stats->crc);
+  Serial_PutString((uint8_t *)"  CRC-32:         ");
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)"\r\n  Flash write:    ");
+  Int2Str(number, p_stats->write_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  SD read stalls: ");
+  Int2Str(number, p_stats->sd_wait_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)(p_stats->overlapped ? " ms (overlapped DMA)\r\n" : " ms (f_read, no overlap)\r\n"));
+  Serial_PutString((uint8_t *)"  Read-back:      ");
+  Int2Str(number, p_stats->verify_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  Total:          ");
+  Int2Str(number, p_stats->total_ms);
+  Serial_PutString(number);
+  if (p_stats->total_ms != 0)
+  {
+    Serial_PutString((uint8_t *)" ms (");
+    Int2Str(number, p_stats->size / p_stats->total_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" KB/s)");
+  }
+  else
+  {
+    Serial_PutString((uint8_t *)" ms");
+  }
+  Serial_PutString((uint8_t *)"\r\n");
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,50 @@
+/**
+ ******************************************************************************
+ * @file    IAP/tf_copy.h
+ * @brief   Copy of TF card files into LittleFS with the SD reads overlapped
+ *          with the SPI Flash programming, the CRC-32 of the data is kept as
+ *          a file attribute and checked on read-back.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __TF_COPY_H
+#define __TF_COPY_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* LittleFS attribute holding a TFCopy_DigestTypeDef */
+#define TF_COPY_ATTR_DIGEST ((uint8_t)0x44)
+/* Buffer size for TFCopy_VerifyLfs, one copy chunk is enough */
+#define TF_COPY_VERIFY_BUFFER_SIZE ((uint32_t)4096)
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t size; /* Bytes covered by the CRC */
+  uint32_t crc;  /* CRC-32 of the file, as Crc32_Update */
+} TFCopy_DigestTypeDef;
+
+/**
+ * @brief  Time spent in each phase of a copy, in ms
+ */
+typedef struct
+{
+  uint32_t size;       /* Bytes copied */
+  uint32_t crc;        /* CRC-32 of the data */
+  uint32_t write_ms;   /* lfs_file_write and the final close */
+  uint32_t sd_wait_ms; /* Waiting for the SD card while the SPI Flash was idle */
+  uint32_t verify_ms;  /* Read-back of the LittleFS file */
+  uint32_t total_ms;
+  uint32_t overlapped; /* 0 when the file had to be read through f_read */
+} TFCopy_StatsTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+COM_StatusTypeDef TFCopy_ToLfs(const char *path, const char *lfs_name, TFCopy_StatsTypeDef *p_stats);
+COM_StatusTypeDef TFCopy_VerifyLfs(const char *lfs_name, uint8_t *p_buffer, uint32_t size, uint32_t *p_crc);
+void TFCopy_ShowStats(const TFCopy_StatsTypeDef *p_stats);
+
+#endif /* __TF_COPY_H */
@@ -0,0 +1,476 @@
+/**
+ ******************************************************************************
+ * @file    IAP/tf_install.c
+ * @brief   TF card to internal Flash install. The file is mapped to card
+ *          sectors through the FatFs fast seek table and read in multi-sector
+ *          chunks by SDIO DMA into one buffer while the other buffer is being
+ *          programmed, so the install takes about max(SD, Flash) time.
+ *          An .aes image is decrypted chunk by chunk between the read and
+ *          the programming, no plain copy is ever stored.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "tf_install.h"
+#include "common.h"
+#include "flash_if.h"
+#include "fatfs.h"
+#include "sdio.h"
+#include "bsp_driver_sd.h"
+#include "aes.h"
+#include "io_arena.h"
+#include <string.h>
+
+/* Private define ------------------------------------------------------------*/
+#define TF_SECTOR_SIZE   ((uint32_t)512)
+#define TF_READ_TIMEOUT  ((uint32_t)1000)
+
+/* Private variables ---------------------------------------------------------*/
+/* Read buffers, checked out of the I/O arena for the install */
+static uint8_t *aInstallBuffer[2];
+static DWORD aInstallClmt[TF_INSTALL_CLMT_SIZE];
+static FIL InstallFile;
+/* Decrypted chunk: up to one block carried over from the previous chunk */
+#define TF_PLAIN_BUFFER_SIZE (TF_INSTALL_CHUNK_SIZE + 2 * AES_BLOCKLEN)
+static uint8_t *pPlainBuffer;
+static struct AES_stream InstallStream;
+static uint32_t InstallDecrypt;
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Find the card sector holding a file offset
+ * @param  fp: file with a cluster link map
+ * @param  ofs: sector aligned file offset
+ * @param  p_sector: card sector
+ * @param  p_count: number of contiguous sectors from p_sector on
+ * @retval 1 if found, 0 past the end of the map
+ */
+static uint32_t TFCard_MapSector(FIL *fp, FSIZE_t ofs, uint32_t *p_sector, uint32_t *p_count)
+{
+  FATFS *fs = fp->obj.fs;
+  DWORD *tbl = fp->cltbl + 1;
+  DWORD cl = (DWORD)(ofs / TF_SECTOR_SIZE / fs->csize);
+  DWORD sect_in_cl = (DWORD)(ofs / TF_SECTOR_SIZE) % fs->csize;
+  DWORD ncl;
+
+  /* Same walk as clmt_clust() in ff.c */
+  for (;;)
+  {
+    ncl = *tbl++;
+    if (ncl == 0)
+    {
+      return 0;
+    }
+    if (cl < ncl)
+    {
+      break;
+    }
+    cl -= ncl;
+    tbl++;
+  }
+
+  *p_sector = fs->database + (*tbl + cl - 2) * fs->csize + sect_in_cl;
+  *p_count = (ncl - cl) * fs->csize - sect_in_cl;
+  return 1;
+}
+
+/**
+ * @brief  Turn a chunk of the file into image bytes
+ * @param  p_buf: chunk read from the card
+ * @param  p_length: chunk length in, image bytes out
+ * @param  p_stats: decrypt time is added here
+ * @retval Buffer to program, p_buf itself for a plain image
+ */
+static uint8_t *TFCard_Transform(uint8_t *p_buf, uint32_t *p_length, TFInstall_StatsTypeDef *p_stats)
+{
+  uint32_t tickstart;
+
+  if (!InstallDecrypt)
+  {
+    return p_buf;
+  }
+
+  tickstart = HAL_GetTick();
+  *p_length = AES_CBC_stream_decrypt(&InstallStream, p_buf, *p_length, pPlainBuffer);
+  p_stats->decrypt_ms += HAL_GetTick() - tickstart;
+  return pPlainBuffer;
+}
+
+/**
+ * @brief  Program a chunk at the current Flash address
+ * @param  p_address: Flash address, advanced by the length
+ * @param  p_buf: 32bit aligned chunk with room for the padding
+ * @param  length: valid bytes, the last word is padded with 0xFF
+ * @param  p_stats: program time is added here
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef TFCard_Program(uint32_t *p_address, uint8_t *p_buf, uint32_t length,
+                                        TFInstall_StatsTypeDef *p_stats)
+{
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t words = (length + 3) / 4;
+  uint32_t status;
+
+  memset(&p_buf[length], 0xFF, words * 4 - length);
+  status = FLASH_If_Write(*p_address, (uint32_t *)p_buf, words);
+  p_stats->program_ms += HAL_GetTick() - tickstart;
+  *p_address += length;
+
+  return (status == FLASHIF_OK) ? COM_OK : COM_DATA;
+}
+
+/**
+ * @brief  Fallback when the cluster map does not fit: plain f_read
+ * @param  fp: open file
+ * @param  p_stats: statistics
+ * @retval COM_StatusTypeDef result
+ */
+static COM_StatusTypeDef TFCard_InstallSequential(FIL *fp, TFInstall_StatsTypeDef *p_stats)
+{
+  uint32_t address = APPLICATION_ADDRESS;
+  uint32_t done = 0, size = (uint32_t)f_size(fp), last = 0;
+  uint32_t tickstart, length;
+  uint8_t *p_data;
+  UINT bytes_read;
+
+  while (done < size)
+  {
+    tickstart = HAL_GetTick();
+    if ((f_read(fp, aInstallBuffer[0], TF_INSTALL_CHUNK_SIZE, &bytes_read) != FR_OK) || (bytes_read == 0))
+    {
+      return COM_ERROR;
+    }
+    p_stats->sd_wait_ms += HAL_GetTick() - tickstart;
+
+    length = bytes_read;
+    p_data = TFCard_Transform(aInstallBuffer[0], &length, p_stats);
+    if (TFCard_Program(&address, p_data, length, p_stats) != COM_OK)
+    {
+      return COM_DATA;
+    }
+    done += bytes_read;
+    TFCard_Progress(done, size, &last);
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Install with the buffers checked out
+ * @param  path: full path, e.g. "0:/app.bin"
+ * @param  decrypt: 1 if the file was made by AES_encrypt_file
+ * @param  p_stats: filled with the time of every phase
+ * @retval see TFCard_Install
+ */
+static COM_StatusTypeDef TFCard_InstallFile(const char *path, uint32_t decrypt, TFInstall_StatsTypeDef *p_stats)
+{
+  COM_StatusTypeDef status = COM_OK;
+  uint32_t address = APPLICATION_ADDRESS;
+  uint32_t size, image_size, slot = 0, last = 0;
+  uint32_t length[2] = {0, 0};
+  uint32_t plain_length;
+  uint8_t *p_data;
+  uint8_t prefix[AES_FILE_HEADER_SIZE];
+  UINT bytes_read;
+  FSIZE_t ofs = 0;
+  uint32_t tickstart, total_start = HAL_GetTick();
+
+  memset(p_stats, 0, sizeof(*p_stats));
+
+  if (f_open(&InstallFile, path, FA_READ) != FR_OK)
+  {
+    return COM_ERROR;
+  }
+  size = (uint32_t)f_size(&InstallFile);
+  image_size = size;
+
+  /* AES_encrypt_file output is the length prefix and exactly that many bytes */
+  InstallDecrypt = decrypt;
+  p_stats->decrypted = decrypt;
+  if (decrypt)
+  {
+    if ((f_read(&InstallFile, prefix, sizeof(prefix), &bytes_read) != FR_OK) || (bytes_read != sizeof(prefix)))
+    {
+      f_close(&InstallFile);
+      return COM_ERROR;
+    }
+    image_size = (uint32_t)prefix[0] | ((uint32_t)prefix[1] << 8) |
+                 ((uint32_t)prefix[2] << 16) | ((uint32_t)prefix[3] << 24);
+    if (image_size != size - AES_FILE_HEADER_SIZE)
+    {
+      f_close(&InstallFile);
+      return COM_LIMIT;
+    }
+    AES_CBC_stream_init(&InstallStream, AES_image_key, AES_image_iv);
+  }
+
+  if ((image_size == 0) || (image_size > USER_FLASH_SIZE))
+  {
+    f_close(&InstallFile);
+    return COM_LIMIT;
+  }
+
+  tickstart = HAL_GetTick();
+  if (FLASH_If_EraseRange(APPLICATION_ADDRESS, image_size) != 0)
+  {
+    f_close(&InstallFile);
+    return COM_DATA;
+  }
+  p_stats->erase_ms = HAL_GetTick() - tickstart;
+
+  /* Map the clusters of the file, too fragmented files fall back to f_read */
+  aInstallClmt[0] = TF_INSTALL_CLMT_SIZE;
+  InstallFile.cltbl = aInstallClmt;
+  if (f_lseek(&InstallFile, CREATE_LINKMAP) != FR_OK)
+  {
+    InstallFile.cltbl = NULL;
+    f_lseek(&InstallFile, 0);
+    status = TFCard_InstallSequential(&InstallFile, p_stats);
+  }
+  else
+  {
+    p_stats->overlapped = 1;
+
+    /* First chunk without overlap, it also gives the raw SD read rate */
+    tickstart = HAL_GetTick();
+    status = TFCard_StartRead(&InstallFile, ofs, aInstallBuffer[slot], &length[slot]);
+    if (status == COM_OK)
+    {
+      status = TFCard_WaitRead();
+    }
+    p_stats->sd_probe_ms = HAL_GetTick() - tickstart;
+    p_stats->sd_probe_size = length[slot];
+
+    while ((status == COM_OK) && (ofs < size))
+    {
+      FSIZE_t next_ofs = ofs + length[slot];
+
+      /* Next chunk comes in by DMA while this one is programmed */
+      if (next_ofs < size)
+      {
+        status = TFCard_StartRead(&InstallFile, next_ofs, aInstallBuffer[slot ^ 1], &length[slot ^ 1]);
+        if (status != COM_OK)
+        {
+          break;
+        }
+      }
+
+      plain_length = length[slot];
+      p_data = TFCard_Transform(aInstallBuffer[slot], &plain_length, p_stats);
+      status = TFCard_Program(&address, p_data, plain_length, p_stats);
+
+      if (next_ofs < size)
+      {
+        tickstart = HAL_GetTick();
+        if (TFCard_WaitRead() != COM_OK)
+        {
+          status = (status == COM_OK) ? COM_ERROR : status;
+        }
+        p_stats->sd_wait_ms += HAL_GetTick() - tickstart;
+      }
+
+      ofs = next_ofs;
+      slot ^= 1;
+      TFCard_Progress((uint32_t)ofs, size, &last);
+    }
+  }
+
+  f_close(&InstallFile);
+
+  /* A truncated .aes file leaves part of the image unwritten */
+  if ((status == COM_OK) && decrypt && !AES_CBC_stream_complete(&InstallStream))
+  {
+    status = COM_ERROR;
+  }
+
+  p_stats->size = image_size;
+  p_stats->total_ms = HAL_GetTick() - total_start;
+  Serial_PutString((uint8_t *)"\r\n");
+  return status;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Start the DMA read of the chunk at a file offset
+ * @param  fp: file with a cluster link map
+ * @param  ofs: sector aligned file offset
+ * @param  p_buf: destination, TF_INSTALL_CHUNK_SIZE bytes
+ * @param  p_length: bytes of the file the chunk will hold
+ * @retval COM_OK or COM_ERROR
+ */
+COM_StatusTypeDef TFCard_StartRead(FIL *fp, FSIZE_t ofs, uint8_t *p_buf, uint32_t *p_length)
+{
+  uint32_t sector, count, remaining;
+  uint32_t tickstart = HAL_GetTick();
+
+  if (!TFCard_MapSector(fp, ofs, &sector, &count))
+  {
+    return COM_ERROR;
+  }
+
+  remaining = (uint32_t)(f_size(fp) - ofs);
+  if (count > TF_INSTALL_CHUNK_SIZE / TF_SECTOR_SIZE)
+  {
+    count = TF_INSTALL_CHUNK_SIZE / TF_SECTOR_SIZE;
+  }
+  if (count > (remaining + TF_SECTOR_SIZE - 1) / TF_SECTOR_SIZE)
+  {
+    count = (remaining + TF_SECTOR_SIZE - 1) / TF_SECTOR_SIZE;
+  }
+  *p_length = (count * TF_SECTOR_SIZE < remaining) ? count * TF_SECTOR_SIZE : remaining;
+
+  /* The card must be back in transfer state after the previous command */
+  while (BSP_SD_GetCardState() != SD_TRANSFER_OK)
+  {
+    if ((HAL_GetTick() - tickstart) > TF_READ_TIMEOUT)
+    {
+      return COM_ERROR;
+    }
+  }
+
+  if (BSP_SD_ReadBlocks_DMA((uint32_t *)p_buf, sector, count) != MSD_OK)
+  {
+    return COM_ERROR;
+  }
+  return COM_OK;
+}
+
+/**
+ * @brief  Wait for the DMA read started by TFCard_StartRead
+ * @param  None
+ * @retval COM_OK or COM_ERROR
+ */
+COM_StatusTypeDef TFCard_WaitRead(void)
+{
+  uint32_t tickstart = HAL_GetTick();
+
+  while (HAL_SD_GetState(&hsd) == HAL_SD_STATE_BUSY)
+  {
+    if ((HAL_GetTick() - tickstart) > TF_READ_TIMEOUT)
+    {
+      HAL_SD_Abort(&hsd);
+      return COM_ERROR;
+    }
+  }
+  return (hsd.ErrorCode == HAL_SD_ERROR_NONE) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Print the progress every 10 %
+ * @param  done: bytes programmed
+ * @param  size: file size
+ * @param  p_last: last percentage shown
+ * @retval None
+ */
+void TFCard_Progress(uint32_t done, uint32_t size, uint32_t *p_last)
+{
+  uint8_t number[11];
+  uint32_t percent = (uint32_t)(((uint64_t)done * 100) / size);
+
+  if (percent >= *p_last + 10 || percent == 100)
+  {
+    *p_last = percent;
+    Serial_PutString((uint8_t *)"Progress: ");
+    Int2Str(number, percent);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)"%\r");
+  }
+}
+
+/**
+ * @brief  Install a file of the mounted TF card into the application area
+ * @param  path: full path, e.g. "0:/app.bin"
+ * @param  decrypt: 1 if the file was made by AES_encrypt_file
+ * @param  p_stats: filled with the time of every phase
+ * @retval COM_OK, COM_LIMIT if empty, too big or with a bad length prefix,
+ *         COM_DATA on Flash error, COM_ERROR on TF card error or when the
+ *         I/O arena has no room for the buffers
+ */
+COM_StatusTypeDef TFCard_Install(const char *path, uint32_t decrypt, TFInstall_StatsTypeDef *p_stats)
+{
+  COM_StatusTypeDef status = COM_ERROR;
+
+  aInstallBuffer[0] = IoArena_Get(TF_INSTALL_CHUNK_SIZE, "TF install buffer 0");
+  aInstallBuffer[1] = IoArena_Get(TF_INSTALL_CHUNK_SIZE, "TF install buffer 1");
+  pPlainBuffer = decrypt ? IoArena_Get(TF_PLAIN_BUFFER_SIZE, "TF install decrypt") : NULL;
+
+  if ((aInstallBuffer[0] != NULL) && (aInstallBuffer[1] != NULL) && (!decrypt || (pPlainBuffer != NULL)))
+  {
+    status = TFCard_InstallFile(path, decrypt, p_stats);
+  }
+
+  IoArena_Put(pPlainBuffer);
+  IoArena_Put(aInstallBuffer[1]);
+  IoArena_Put(aInstallBuffer[0]);
+  return status;
+}
+
+/**
+ * @brief  Print the phase timing of an install
+ * @param  p_stats: statistics filled by TFCard_Install
+ * @retval None
+ */
+void TFCard_ShowStats(const TFInstall_StatsTypeDef *p_stats)
+{
+  uint8_t number[11];
+
+  Serial_PutString((uint8_t *)"  Erase:          ");
+  Int2Str(number, p_stats->erase_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  Program:        ");
+  Int2Str(number, p_stats->program_ms);
+  Serial_PutString(number);
+  if (p_stats->program_ms != 0)
+  {
+    Serial_PutString((uint8_t *)" ms (");
+    Int2Str(number, p_stats->size / p_stats->program_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" KB/s)");
+  }
+  else
+  {
+    Serial_PutString((uint8_t *)" ms");
+  }
+  if (p_stats->decrypted)
+  {
+    Serial_PutString((uint8_t *)"\r\n  Decrypt:        ");
+    Int2Str(number, p_stats->decrypt_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" ms");
+  }
+  Serial_PutString((uint8_t *)"\r\n  SD read stalls: ");
+  Int2Str(number, p_stats->sd_wait_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)(p_stats->overlapped ? " ms (overlapped DMA)\r\n" : " ms (f_read, no overlap)\r\n"));
+  if ((p_stats->overlapped) && (p_stats->sd_probe_ms != 0))
+  {
+    Serial_PutString((uint8_t *)"  SD read rate:   ");
+    Int2Str(number, p_stats->sd_probe_size / p_stats->sd_probe_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" KB/s\r\n");
+  }
+  Serial_PutString((uint8_t *)"  Total:          ");
+  Int2Str(number, p_stats->total_ms);
+  Serial_PutString(number);
+  if (p_stats->total_ms != 0)
+  {
+    Serial_PutString((uint8_t *)" ms (");
+    Int2Str(number, p_stats->size / p_stats->total_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" KB/s)");
+  }
+  else
+  {
+    Serial_PutString((uint8_t *)" ms");
+  }
+  Serial_PutString((uint8_t *)"\r\n");
+}
+
+/**
+ * @}
+ */
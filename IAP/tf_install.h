@@ -0,0 +1,52 @@
+/**
+ ******************************************************************************
+ * @file    IAP/tf_install.h
+ * @brief   Install an image from the TF card into the application area with
+ *          the SD reads overlapped with the Flash programming, .aes images
+ *          are decrypted on the way.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __TF_INSTALL_H
+#define __TF_INSTALL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+#include "ff.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* One SD command reads up to 16 sectors */
+#define TF_INSTALL_CHUNK_SIZE ((uint32_t)8192)
+/* Cluster link map entries, (entries - 1) / 2 fragments are supported */
+#define TF_INSTALL_CLMT_SIZE  ((uint32_t)64)
+
+/* Exported types ------------------------------------------------------------*/
+/**
+ * @brief  Time spent in each phase of an install, in ms
+ */
+typedef struct
+{
+  uint32_t size;        /* Bytes programmed */
+  uint32_t erase_ms;    /* Sector erase */
+  uint32_t program_ms;  /* FLASH_If_Write */
+  uint32_t decrypt_ms;  /* AES, .aes images only */
+  uint32_t sd_wait_ms;  /* Waiting for the SD card while the Flash was idle */
+  uint32_t sd_probe_ms; /* First chunk, read without overlap */
+  uint32_t sd_probe_size;
+  uint32_t total_ms;
+  uint32_t overlapped;  /* 0 when the file had to be read through f_read */
+  uint32_t decrypted;   /* 1 for an .aes image */
+} TFInstall_StatsTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+COM_StatusTypeDef TFCard_Install(const char *path, uint32_t decrypt, TFInstall_StatsTypeDef *p_stats);
+void TFCard_ShowStats(const TFInstall_StatsTypeDef *p_stats);
+/* Chunked DMA reads of a file opened with a cluster link map, shared with
+   the other TF card readers */
+COM_StatusTypeDef TFCard_StartRead(FIL *fp, FSIZE_t ofs, uint8_t *p_buf, uint32_t *p_length);
+COM_StatusTypeDef TFCard_WaitRead(void);
+void TFCard_Progress(uint32_t done, uint32_t size, uint32_t *p_last);
+
+#endif /* __TF_INSTALL_H */
@@ -0,0 +1,869 @@
+/**
+ ******************************************************************************
+ * @file    IAP/update_pipeline.c
+ * @brief   Update pipeline. One loop moves an image from a source (FatFs,
+ *          LittleFS or internal Flash) through a chain of transforms
+ *          (decrypt, unseal, CRC-32) into an image sink (internal Flash, LittleFS or
+ *          TF card), so erase, programming, progress and error handling are
+ *          written once for every path.
+ *          The chunk buffer is handed by reference from stage to stage: the
+ *          source reads into it, the transforms work in place and whole
+ *          chunks are programmed by the sink straight from it.
+ ******************************************************************************
+ */
+
+/** @addtogroup STM32F4xx_IAP_Main
+ * @{
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "update_pipeline.h"
+#include "common.h"
+#include "flash_if.h"
+#include "crc32.h"
+#include "io_arena.h"
+#include "lfs_spi_flash_adapter.h"
+#include <string.h>
+
+/* Private function prototypes -----------------------------------------------*/
+static COM_StatusTypeDef FatFsSource_Open(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size);
+static int32_t FatFsSource_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length);
+static COM_StatusTypeDef FatFsSource_Seek(UpdateSource_TypeDef *source, uint32_t offset);
+static void FatFsSource_Close(UpdateSource_TypeDef *source);
+static COM_StatusTypeDef LfsSource_Open(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size);
+static int32_t LfsSource_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length);
+static COM_StatusTypeDef LfsSource_Seek(UpdateSource_TypeDef *source, uint32_t offset);
+static void LfsSource_Close(UpdateSource_TypeDef *source);
+static COM_StatusTypeDef FlashSource_Open(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size);
+static int32_t FlashSource_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length);
+static COM_StatusTypeDef FlashSource_Seek(UpdateSource_TypeDef *source, uint32_t offset);
+static void FlashSource_Close(UpdateSource_TypeDef *source);
+static void DecryptTransform_Start(UpdateTransform_TypeDef *transform);
+static uint32_t DecryptTransform_Apply(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length);
+static COM_StatusTypeDef DecryptTransform_Size(UpdateTransform_TypeDef *transform, uint32_t *p_size);
+static COM_StatusTypeDef DecryptTransform_Finish(UpdateTransform_TypeDef *transform);
+static void UnsealTransform_Start(UpdateTransform_TypeDef *transform);
+static uint32_t UnsealTransform_Apply(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length);
+static COM_StatusTypeDef UnsealTransform_Size(UpdateTransform_TypeDef *transform, uint32_t *p_size);
+static COM_StatusTypeDef UnsealTransform_Finish(UpdateTransform_TypeDef *transform);
+static void CrcTransform_Start(UpdateTransform_TypeDef *transform);
+static uint32_t CrcTransform_Apply(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length);
+static COM_StatusTypeDef CrcTransform_Finish(UpdateTransform_TypeDef *transform);
+
+/* Private variables ---------------------------------------------------------*/
+static const UpdateSource_OpsTypeDef FatFsSourceOps =
+{
+  FatFsSource_Open, FatFsSource_Read, FatFsSource_Seek, FatFsSource_Close
+};
+static const UpdateSource_OpsTypeDef LfsSourceOps =
+{
+  LfsSource_Open, LfsSource_Read, LfsSource_Seek, LfsSource_Close
+};
+static const UpdateSource_OpsTypeDef FlashSourceOps =
+{
+  FlashSource_Open, FlashSource_Read, FlashSource_Seek, FlashSource_Close
+};
+
+static const UpdateTransform_OpsTypeDef DecryptTransformOps =
+{
+  DecryptTransform_Start, DecryptTransform_Apply, DecryptTransform_Size, DecryptTransform_Finish
+};
+static const UpdateTransform_OpsTypeDef UnsealTransformOps =
+{
+  UnsealTransform_Start, UnsealTransform_Apply, UnsealTransform_Size, UnsealTransform_Finish
+};
+static const UpdateTransform_OpsTypeDef CrcTransformOps =
+{
+  CrcTransform_Start, CrcTransform_Apply, NULL, CrcTransform_Finish
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Open a file of the mounted TF card
+ * @param  source: source being opened
+ * @param  name: full FatFs path
+ * @param  p_size: file size
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef FatFsSource_Open(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size)
+{
+  if (f_open(&source->file.fil, name, FA_READ) != FR_OK)
+  {
+    return COM_ERROR;
+  }
+  *p_size = (uint32_t)f_size(&source->file.fil);
+  return COM_OK;
+}
+
+/**
+ * @brief  Read from the TF card file
+ * @param  source: open source
+ * @param  data: destination
+ * @param  length: bytes wanted
+ * @retval Bytes read, 0 at the end of the file, -1 on error
+ */
+static int32_t FatFsSource_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length)
+{
+  UINT bytes_read;
+
+  if (f_read(&source->file.fil, data, length, &bytes_read) != FR_OK)
+  {
+    return -1;
+  }
+  return (int32_t)bytes_read;
+}
+
+/**
+ * @brief  Move the read position of the TF card file
+ * @param  source: open source
+ * @param  offset: bytes from the start of the file
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef FatFsSource_Seek(UpdateSource_TypeDef *source, uint32_t offset)
+{
+  return (f_lseek(&source->file.fil, offset) == FR_OK) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Close the TF card file
+ * @param  source: open source
+ * @retval None
+ */
+static void FatFsSource_Close(UpdateSource_TypeDef *source)
+{
+  f_close(&source->file.fil);
+}
+
+/**
+ * @brief  Open a file of the mounted LittleFS
+ * @param  source: source being opened
+ * @param  name: LittleFS path
+ * @param  p_size: file size
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef LfsSource_Open(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size)
+{
+  lfs_soff_t size;
+
+  if (lfs_spi_flash_file_open(&lfs_instance, &source->file.lfs, name, LFS_O_RDONLY) != LFS_ERR_OK)
+  {
+    return COM_ERROR;
+  }
+  size = lfs_file_size(&lfs_instance, &source->file.lfs);
+  if (size < 0)
+  {
+    lfs_file_close(&lfs_instance, &source->file.lfs);
+    return COM_ERROR;
+  }
+  *p_size = (uint32_t)size;
+  return COM_OK;
+}
+
+/**
+ * @brief  Read from the LittleFS file
+ * @param  source: open source
+ * @param  data: destination
+ * @param  length: bytes wanted
+ * @retval Bytes read, 0 at the end of the file, < 0 on error
+ */
+static int32_t LfsSource_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length)
+{
+  return (int32_t)lfs_file_read(&lfs_instance, &source->file.lfs, data, length);
+}
+
+/**
+ * @brief  Move the read position of the LittleFS file
+ * @param  source: open source
+ * @param  offset: bytes from the start of the file
+ * @retval COM_OK or COM_ERROR
+ */
+static COM_StatusTypeDef LfsSource_Seek(UpdateSource_TypeDef *source, uint32_t offset)
+{
+  return (lfs_file_seek(&lfs_instance, &source->file.lfs, (lfs_soff_t)offset, LFS_SEEK_SET) >= 0) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Close the LittleFS file
+ * @param  source: open source
+ * @retval None
+ */
+static void LfsSource_Close(UpdateSource_TypeDef *source)
+{
+  lfs_file_close(&lfs_instance, &source->file.lfs);
+}
+
+/**
+ * @brief  Nothing to open in the internal Flash
+ * @param  source: source set up by UpdateSource_InitFlash
+ * @param  name: unused
+ * @param  p_size: size given to UpdateSource_InitFlash
+ * @retval COM_OK
+ */
+static COM_StatusTypeDef FlashSource_Open(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size)
+{
+  (void)name;
+
+  source->offset = 0;
+  *p_size = source->size;
+  return COM_OK;
+}
+
+/**
+ * @brief  Copy the next bytes of the Flash range
+ * @param  source: open source
+ * @param  data: destination
+ * @param  length: bytes wanted
+ * @retval Bytes copied, 0 at the end of the range
+ */
+static int32_t FlashSource_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length)
+{
+  if (length > source->size - source->offset)
+  {
+    length = source->size - source->offset;
+  }
+  memcpy(data, (const void *)(source->address + source->offset), length);
+  source->offset += length;
+  return (int32_t)length;
+}
+
+/**
+ * @brief  Move the read position in the Flash range
+ * @param  source: open source
+ * @param  offset: bytes from the start of the range
+ * @retval COM_OK or COM_ERROR past the end of the range
+ */
+static COM_StatusTypeDef FlashSource_Seek(UpdateSource_TypeDef *source, uint32_t offset)
+{
+  if (offset > source->size)
+  {
+    return COM_ERROR;
+  }
+  source->offset = offset;
+  return COM_OK;
+}
+
+/**
+ * @brief  Nothing to release for the internal Flash
+ * @param  source: open source
+ * @retval None
+ */
+static void FlashSource_Close(UpdateSource_TypeDef *source)
+{
+  (void)source;
+}
+
+/**
+ * @brief  Restart the AES stream
+ * @param  transform: decrypt transform
+ * @retval None
+ */
+static void DecryptTransform_Start(UpdateTransform_TypeDef *transform)
+{
+  AES_CBC_stream_init(&transform->aes.stream, AES_image_key, AES_image_iv);
+}
+
+/**
+ * @brief  Decrypt in place. The length prefix is the prologue, so every
+ *         later chunk starts on a block boundary and nothing is carried over.
+ * @param  transform: decrypt transform
+ * @param  data: data from the source
+ * @param  length: bytes
+ * @retval Plain bytes left in data
+ */
+static uint32_t DecryptTransform_Apply(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length)
+{
+  return AES_CBC_stream_decrypt(&transform->aes.stream, data, length, data);
+}
+
+/**
+ * @brief  Plain image size from the length prefix
+ * @param  transform: decrypt transform that has seen the prologue
+ * @param  p_size: file size in, image size out
+ * @retval COM_OK or COM_LIMIT for a bad length prefix
+ */
+static COM_StatusTypeDef DecryptTransform_Size(UpdateTransform_TypeDef *transform, uint32_t *p_size)
+{
+  if ((transform->aes.stream.header_fill != AES_FILE_HEADER_SIZE) ||
+      (transform->aes.stream.size != *p_size - AES_FILE_HEADER_SIZE))
+  {
+    return COM_LIMIT;
+  }
+  *p_size = transform->aes.stream.size;
+  return COM_OK;
+}
+
+/**
+ * @brief  Check that the whole image came out
+ * @param  transform: decrypt transform
+ * @retval COM_OK or COM_ERROR for a truncated file
+ */
+static COM_StatusTypeDef DecryptTransform_Finish(UpdateTransform_TypeDef *transform)
+{
+  return AES_CBC_stream_complete(&transform->aes.stream) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Derive the keys of the sealed image
+ * @param  transform: unseal transform
+ * @retval None
+ */
+static void UnsealTransform_Start(UpdateTransform_TypeDef *transform)
+{
+  AES_seal_init(&transform->aes.seal, AES_image_key);
+  transform->error = AES_SEAL_OK;
+  transform->trailer = 0;
+}
+
+/**
+ * @brief  Check the header (the prologue), then authenticate and decrypt one
+ *         record per chunk in place, then check the index if there is one
+ * @param  transform: unseal transform
+ * @param  data: header, one whole record or the index
+ * @param  length: bytes
+ * @retval Plain bytes left in data, UPDATE_TRANSFORM_FAILED for a record
+ *         or an index that does not authenticate
+ */
+static uint32_t UnsealTransform_Apply(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length)
+{
+  size_t plain;
+
+  if (transform->aes.seal.chunk_size == 0)
+  {
+    /* A bad header is reported by the Size callback */
+    transform->error = (length == AES_SEAL_HEADER_SIZE) ? AES_seal_open(&transform->aes.seal, data) : AES_SEAL_ERR_FORMAT;
+    return 0;
+  }
+  if (AES_seal_complete(&transform->aes.seal))
+  {
+    /* The trailer, nothing of it is passed on */
+    transform->error = (length == AES_seal_index_length(&transform->aes.seal))
+                         ? AES_seal_open_index(&transform->aes.seal, data) : AES_SEAL_ERR_FORMAT;
+    return (transform->error == AES_SEAL_OK) ? 0 : UPDATE_TRANSFORM_FAILED;
+  }
+
+  transform->error = AES_unseal_record(&transform->aes.seal, data, length, &plain);
+  return (transform->error == AES_SEAL_OK) ? (uint32_t)plain : UPDATE_TRANSFORM_FAILED;
+}
+
+/**
+ * @brief  Plain image size from the authenticated header, the index of an
+ *         indexed image is the trailer
+ * @param  transform: unseal transform that has seen the prologue
+ * @param  p_size: file size in, image size out
+ * @retval COM_OK, COM_DATA if the header does not authenticate, COM_LIMIT
+ *         for another format, chunk size or file size
+ */
+static COM_StatusTypeDef UnsealTransform_Size(UpdateTransform_TypeDef *transform, uint32_t *p_size)
+{
+  const struct AES_seal *seal = &transform->aes.seal;
+
+  if (transform->error == AES_SEAL_ERR_AUTH)
+  {
+    return COM_DATA;
+  }
+  /* One record per pipeline chunk */
+  if ((transform->error != AES_SEAL_OK) || (seal->chunk_size != UPDATE_PIPELINE_CHUNK_SIZE) ||
+      (*p_size != AES_seal_file_size(seal)))
+  {
+    return COM_LIMIT;
+  }
+  transform->trailer = (uint32_t)AES_seal_index_length(seal);
+  *p_size = seal->size;
+  return COM_OK;
+}
+
+/**
+ * @brief  Check that every record came in
+ * @param  transform: unseal transform
+ * @retval COM_OK or COM_ERROR for a truncated file
+ */
+static COM_StatusTypeDef UnsealTransform_Finish(UpdateTransform_TypeDef *transform)
+{
+  return AES_seal_complete(&transform->aes.seal) ? COM_OK : COM_ERROR;
+}
+
+/**
+ * @brief  Restart the CRC
+ * @param  transform: CRC transform
+ * @retval None
+ */
+static void CrcTransform_Start(UpdateTransform_TypeDef *transform)
+{
+  transform->crc = CRC32_INIT;
+}
+
+/**
+ * @brief  Add the data to the CRC, the data is passed on unchanged
+ * @param  transform: CRC transform
+ * @param  data: data
+ * @param  length: bytes
+ * @retval length
+ */
+static uint32_t CrcTransform_Apply(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length)
+{
+  transform->crc = Crc32_Update(transform->crc, data, length);
+  return length;
+}
+
+/**
+ * @brief  Compare the CRC with the expected one
+ * @param  transform: CRC transform
+ * @retval COM_OK or COM_DATA
+ */
+static COM_StatusTypeDef CrcTransform_Finish(UpdateTransform_TypeDef *transform)
+{
+  return (!transform->check || (transform->crc == transform->expected)) ? COM_OK : COM_DATA;
+}
+
+/**
+ * @brief  Read until the buffer is full or the source ends
+ * @param  source: open source
+ * @param  data: destination
+ * @param  length: bytes wanted
+ * @retval Bytes read, short only at the end of the source, -1 on error
+ */
+static int32_t UpdatePipeline_Read(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length)
+{
+  uint32_t done = 0;
+  int32_t bytes_read;
+
+  while (done < length)
+  {
+    bytes_read = source->ops->Read(source, &data[done], length - done);
+    if (bytes_read < 0)
+    {
+      return -1;
+    }
+    if (bytes_read == 0)
+    {
+      break;
+    }
+    done += (uint32_t)bytes_read;
+  }
+  return (int32_t)done;
+}
+
+/**
+ * @brief  Pass a chunk through every transform
+ * @param  pipeline: pipeline
+ * @param  data: chunk, transformed in place
+ * @param  length: bytes
+ * @retval Bytes left for the sink, UPDATE_TRANSFORM_FAILED when a transform
+ *         rejected the chunk
+ */
+static uint32_t UpdatePipeline_Transform(UpdatePipeline_TypeDef *pipeline, uint8_t *data, uint32_t length)
+{
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t i;
+
+  for (i = 0; (i < pipeline->transform_count) && (length != UPDATE_TRANSFORM_FAILED); i++)
+  {
+    length = pipeline->transform[i]->ops->Apply(pipeline->transform[i], data, length);
+  }
+  pipeline->transform_ms += HAL_GetTick() - tickstart;
+  return length;
+}
+
+/**
+ * @brief  Print the progress every 10 %
+ * @param  done: bytes read
+ * @param  size: source size
+ * @param  p_last: last percentage shown
+ * @retval None
+ */
+static void UpdatePipeline_Progress(uint32_t done, uint32_t size, uint32_t *p_last)
+{
+  uint8_t number[11];
+  uint32_t percent = (size != 0) ? (uint32_t)(((uint64_t)done * 100) / size) : 100;
+
+  if (percent >= *p_last + 10 || percent == 100)
+  {
+    *p_last = percent;
+    Serial_PutString((uint8_t *)"Progress: ");
+    Int2Str(number, percent);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)"%\r");
+  }
+}
+
+/**
+ * @brief  Run with the chunk buffer checked out
+ * @param  pipeline: pipeline
+ * @param  buffer: UPDATE_PIPELINE_BUFFER_SIZE bytes, 32bit aligned
+ * @param  sink: pipeline->sink, or NULL to run the source and transforms
+ *         only (nothing is written)
+ * @param  source_name: passed to the source
+ * @param  sink_name: passed to the sink
+ * @retval see UpdatePipeline_Run
+ */
+static COM_StatusTypeDef UpdatePipeline_Copy(UpdatePipeline_TypeDef *pipeline, uint8_t *buffer, ImageSink_TypeDef *sink,
+                                             const char *source_name, const char *sink_name)
+{
+  UpdateSource_TypeDef *source = pipeline->source;
+  COM_StatusTypeDef status, finish_status;
+  uint32_t size, image_size, end, limit, prologue = 0, overhead = 0, last = 0, length, i;
+  uint32_t tickstart;
+  int32_t bytes_read;
+
+  status = source->ops->Open(source, source_name, &size);
+  if (status != COM_OK)
+  {
+    return status;
+  }
+
+  for (i = 0; i < pipeline->transform_count; i++)
+  {
+    pipeline->transform[i]->ops->Start(pipeline->transform[i]);
+    if (pipeline->transform[i]->prologue > prologue)
+    {
+      prologue = pipeline->transform[i]->prologue;
+    }
+    if (pipeline->transform[i]->overhead > overhead)
+    {
+      overhead = pipeline->transform[i]->overhead;
+    }
+  }
+
+  /* The prologue (e.g. a length prefix) goes through alone, the sink size
+     may depend on it */
+  length = 0;
+  if (prologue != 0)
+  {
+    tickstart = HAL_GetTick();
+    bytes_read = UpdatePipeline_Read(source, buffer, prologue);
+    pipeline->read_ms += HAL_GetTick() - tickstart;
+    if (bytes_read < 0)
+    {
+      source->ops->Close(source);
+      return COM_ERROR;
+    }
+    pipeline->in_size = (uint32_t)bytes_read;
+    length = UpdatePipeline_Transform(pipeline, buffer, (uint32_t)bytes_read);
+    if (length == UPDATE_TRANSFORM_FAILED)
+    {
+      source->ops->Close(source);
+      return COM_DATA;
+    }
+  }
+
+  image_size = size;
+  end = size;
+  for (i = 0; (i < pipeline->transform_count) && (status == COM_OK); i++)
+  {
+    if (pipeline->transform[i]->ops->Size != NULL)
+    {
+      status = pipeline->transform[i]->ops->Size(pipeline->transform[i], &image_size);
+    }
+    if ((status == COM_OK) && (pipeline->transform[i]->trailer > size - end))
+    {
+      end = size - pipeline->transform[i]->trailer;
+    }
+  }
+  if ((status == COM_OK) && (image_size == 0))
+  {
+    status = COM_LIMIT;
+  }
+  if ((status == COM_OK) && (sink != NULL))
+  {
+    tickstart = HAL_GetTick();
+    status = ImageSink_Open(sink, sink_name, image_size);
+    if ((status == COM_OK) && (length != 0))
+    {
+      status = ImageSink_Write(sink, buffer, length);
+      pipeline->out_size = length;
+    }
+    pipeline->write_ms += HAL_GetTick() - tickstart;
+  }
+
+  while (status == COM_OK)
+  {
+    /* Chunks stop short of the trailer, which is read on its own */
+    limit = (pipeline->in_size < end) ? end : size;
+    length = UPDATE_PIPELINE_CHUNK_SIZE + overhead;
+    if (length > limit - pipeline->in_size)
+    {
+      length = limit - pipeline->in_size;
+    }
+    tickstart = HAL_GetTick();
+    bytes_read = UpdatePipeline_Read(source, buffer, length);
+    pipeline->read_ms += HAL_GetTick() - tickstart;
+    if (bytes_read <= 0)
+    {
+      status = (bytes_read < 0) ? COM_ERROR : COM_OK;
+      break;
+    }
+    pipeline->in_size += (uint32_t)bytes_read;
+
+    length = UpdatePipeline_Transform(pipeline, buffer, (uint32_t)bytes_read);
+    if (length == UPDATE_TRANSFORM_FAILED)
+    {
+      /* Rejected before the chunk reaches the sink */
+      status = COM_DATA;
+      break;
+    }
+
+    if (sink != NULL)
+    {
+      tickstart = HAL_GetTick();
+      status = ImageSink_Write(sink, buffer, length);
+      pipeline->write_ms += HAL_GetTick() - tickstart;
+      pipeline->out_size += length;
+    }
+
+    UpdatePipeline_Progress(pipeline->in_size, size, &last);
+  }
+  source->ops->Close(source);
+
+  for (i = 0; (i < pipeline->transform_count) && (status == COM_OK); i++)
+  {
+    status = pipeline->transform[i]->ops->Finish(pipeline->transform[i]);
+  }
+
+  /* A failed run drops a partial file, the Flash sink keeps what it has */
+  if (sink != NULL)
+  {
+    tickstart = HAL_GetTick();
+    finish_status = ImageSink_Close(sink, status == COM_OK);
+    pipeline->write_ms += HAL_GetTick() - tickstart;
+    if (status == COM_OK)
+    {
+      status = finish_status;
+    }
+  }
+  Serial_PutString((uint8_t *)"\r\n");
+  return status;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Source reading a file of the mounted TF card, the name given to
+ *         UpdatePipeline_Run is the full FatFs path
+ * @param  source: source to set up
+ * @retval None
+ */
+void UpdateSource_InitFatFs(UpdateSource_TypeDef *source)
+{
+  source->ops = &FatFsSourceOps;
+  source->label = "TF card";
+}
+
+/**
+ * @brief  Source reading a file of the mounted LittleFS
+ * @param  source: source to set up
+ * @retval None
+ */
+void UpdateSource_InitLfs(UpdateSource_TypeDef *source)
+{
+  source->ops = &LfsSourceOps;
+  source->label = "SPI Flash (LittleFS)";
+}
+
+/**
+ * @brief  Source reading a range of the internal Flash
+ * @param  source: source to set up
+ * @param  address: first byte
+ * @param  size: bytes
+ * @retval None
+ */
+void UpdateSource_InitFlash(UpdateSource_TypeDef *source, uint32_t address, uint32_t size)
+{
+  source->ops = &FlashSourceOps;
+  source->label = "internal Flash";
+  source->address = address;
+  source->size = size;
+  source->offset = 0;
+}
+
+/**
+ * @brief  Transform decrypting a file made by AES_encrypt_file
+ * @param  transform: transform to set up
+ * @retval None
+ */
+void UpdateTransform_InitDecrypt(UpdateTransform_TypeDef *transform)
+{
+  transform->ops = &DecryptTransformOps;
+  transform->label = "AES-256-CBC decrypt";
+  transform->prologue = AES_FILE_HEADER_SIZE;
+  transform->overhead = 0;
+  transform->check_first = 0;
+  transform->trailer = 0;
+}
+
+/**
+ * @brief  Transform authenticating and decrypting a sealed image (.aex) made
+ *         with AES_SEAL_CHUNK_SIZE chunks. Every record is authenticated
+ *         before the sink is opened, so an image that does not authenticate
+ *         leaves the sink untouched.
+ * @param  transform: transform to set up
+ * @retval None
+ */
+void UpdateTransform_InitUnseal(UpdateTransform_TypeDef *transform)
+{
+  transform->ops = &UnsealTransformOps;
+  transform->label = "AES-CTR/CMAC unseal";
+  transform->prologue = AES_SEAL_HEADER_SIZE;
+  transform->overhead = AES_SEAL_TAG_SIZE;
+  transform->check_first = 1;
+  transform->trailer = 0;
+}
+
+/**
+ * @brief  Transform computing the CRC-32 of the data at its place in the chain
+ * @param  transform: transform to set up
+ * @param  check: 1 to fail the run when the CRC is not expected
+ * @param  expected: CRC-32 to check
+ * @retval None
+ */
+void UpdateTransform_InitCrc(UpdateTransform_TypeDef *transform, uint32_t check, uint32_t expected)
+{
+  transform->ops = &CrcTransformOps;
+  transform->label = "CRC-32";
+  transform->prologue = 0;
+  transform->overhead = 0;
+  transform->check_first = 0;
+  transform->trailer = 0;
+  transform->check = check;
+  transform->expected = expected;
+  transform->crc = CRC32_INIT;
+}
+
+/**
+ * @brief  Connect a source to a sink, with no transform yet
+ * @param  pipeline: pipeline to set up
+ * @param  source: source set up by one of the UpdateSource_Init functions
+ * @param  sink: sink set up by one of the ImageSink_Init functions
+ * @retval None
+ */
+void UpdatePipeline_Init(UpdatePipeline_TypeDef *pipeline, UpdateSource_TypeDef *source, ImageSink_TypeDef *sink)
+{
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->source = source;
+  pipeline->sink = sink;
+}
+
+/**
+ * @brief  Append a transform to the chain, transforms run in the order added
+ * @param  pipeline: pipeline
+ * @param  transform: transform set up by one of the UpdateTransform_Init
+ *         functions
+ * @retval COM_OK or COM_LIMIT when the chain is full
+ */
+COM_StatusTypeDef UpdatePipeline_Add(UpdatePipeline_TypeDef *pipeline, UpdateTransform_TypeDef *transform)
+{
+  if (pipeline->transform_count >= UPDATE_PIPELINE_MAX_TRANSFORMS)
+  {
+    return COM_LIMIT;
+  }
+  pipeline->transform[pipeline->transform_count++] = transform;
+  return COM_OK;
+}
+
+/**
+ * @brief  Move one image from the source to the sink. A chain with a
+ *         check_first transform reads the source twice: once through the
+ *         chain alone, then again into the sink.
+ * @param  pipeline: pipeline
+ * @param  source_name: file to read, ignored by the Flash source
+ * @param  sink_name: file to write, ignored by the Flash sink
+ * @retval COM_OK, COM_LIMIT if empty, too big or with a bad length prefix,
+ *         COM_DATA on a write error, a CRC mismatch or a sealed image that
+ *         does not authenticate, COM_ERROR on a read error, a truncated
+ *         file, or when the I/O arena has no room
+ */
+COM_StatusTypeDef UpdatePipeline_Run(UpdatePipeline_TypeDef *pipeline, const char *source_name, const char *sink_name)
+{
+  COM_StatusTypeDef status = COM_ERROR;
+  uint32_t total_start = HAL_GetTick();
+  uint32_t i, check_first = 0;
+  uint8_t *buffer;
+
+  pipeline->in_size = 0;
+  pipeline->out_size = 0;
+  pipeline->read_ms = 0;
+  pipeline->transform_ms = 0;
+  pipeline->write_ms = 0;
+
+  buffer = IoArena_Get(UPDATE_PIPELINE_BUFFER_SIZE, "update pipeline");
+  if (buffer != NULL)
+  {
+    status = COM_OK;
+    for (i = 0; i < pipeline->transform_count; i++)
+    {
+      check_first |= pipeline->transform[i]->check_first;
+    }
+    if (check_first)
+    {
+      /* The Flash sink erases the whole range when it opens, so a sealed
+         image is authenticated to its last record before anything is
+         erased, then read again to be written */
+      Serial_PutString((uint8_t *)"Authenticating...\r\n");
+      status = UpdatePipeline_Copy(pipeline, buffer, NULL, source_name, NULL);
+      pipeline->in_size = 0;
+    }
+    if (status == COM_OK)
+    {
+      status = UpdatePipeline_Copy(pipeline, buffer, pipeline->sink, source_name, sink_name);
+    }
+  }
+  IoArena_Put(buffer);
+
+  pipeline->total_ms = HAL_GetTick() - total_start;
+  return status;
+}
+
+/**
+ * @brief  Print the time spent in each stage
+ * @param  pipeline: pipeline after UpdatePipeline_Run
+ * @retval None
+ */
+void UpdatePipeline_ShowStats(const UpdatePipeline_TypeDef *pipeline)
+{
+  uint8_t number[11];
+  uint32_t i;
+
+  Serial_PutString((uint8_t *)"  Read (");
+  Serial_PutString((uint8_t *)pipeline->source->label);
+  Serial_PutString((uint8_t *)"): ");
+  Int2Str(number, pipeline->read_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n");
+  for (i = 0; i < pipeline->transform_count; i++)
+  {
+    Serial_PutString((uint8_t *)"  Transform: ");
+    Serial_PutString((uint8_t *)pipeline->transform[i]->label);
+    Serial_PutString((uint8_t *)"\r\n");
+  }
+  if (pipeline->transform_count != 0)
+  {
+    Serial_PutString((uint8_t *)"  Transforms: ");
+    Int2Str(number, pipeline->transform_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" ms\r\n");
+  }
+  Serial_PutString((uint8_t *)"  Write (");
+  Serial_PutString((uint8_t *)pipeline->sink->label);
+  Serial_PutString((uint8_t *)"): ");
+  Int2Str(number, pipeline->write_ms);
+  Serial_PutString(number);
+  Serial_PutString((uint8_t *)" ms\r\n  Total: ");
+  Int2Str(number, pipeline->total_ms);
+  Serial_PutString(number);
+  if (pipeline->total_ms != 0)
+  {
+    Serial_PutString((uint8_t *)" ms (");
+    Int2Str(number, pipeline->in_size / pipeline->total_ms);
+    Serial_PutString(number);
+    Serial_PutString((uint8_t *)" KB/s)");
+  }
+  else
+  {
+    Serial_PutString((uint8_t *)" ms");
+  }
+  Serial_PutString((uint8_t *)"\r\n");
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,128 @@
+/**
+ ******************************************************************************
+ * @file    IAP/update_pipeline.h
+ * @brief   Update pipeline: a source, a chain of in place transforms and an
+ *          image sink, driven by one copy loop.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __UPDATE_PIPELINE_H
+#define __UPDATE_PIPELINE_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f4xx_hal.h"
+#include "ymodem.h"
+#include "image_sink.h"
+#include "aes.h"
+#include "aes_seal.h"
+#include "ff.h"
+#include "lfs.h"
+
+/* Exported constants --------------------------------------------------------*/
+/* Same as the sink staging buffer, so whole chunks are programmed from the
+   pipeline buffer without a copy */
+#define UPDATE_PIPELINE_CHUNK_SIZE     IMAGE_SINK_BUFFER_SIZE
+#define UPDATE_PIPELINE_MAX_TRANSFORMS ((uint32_t)3)
+/* Most bytes a transform consumes per chunk on top of it, the tag of a
+   sealed record */
+#define UPDATE_PIPELINE_MAX_OVERHEAD   ((uint32_t)AES_SEAL_TAG_SIZE)
+#define UPDATE_PIPELINE_BUFFER_SIZE    (UPDATE_PIPELINE_CHUNK_SIZE + UPDATE_PIPELINE_MAX_OVERHEAD)
+/* Returned by Apply to stop the run before the chunk reaches the sink */
+#define UPDATE_TRANSFORM_FAILED        ((uint32_t)0xFFFFFFFF)
+
+/* Exported types ------------------------------------------------------------*/
+typedef struct UpdateSource UpdateSource_TypeDef;
+typedef struct UpdateTransform UpdateTransform_TypeDef;
+
+/**
+ * @brief  Backend of a source
+ */
+typedef struct
+{
+  COM_StatusTypeDef (*Open)(UpdateSource_TypeDef *source, const char *name, uint32_t *p_size);
+  int32_t (*Read)(UpdateSource_TypeDef *source, uint8_t *data, uint32_t length); /* 0 at the end, < 0 on error */
+  COM_StatusTypeDef (*Seek)(UpdateSource_TypeDef *source, uint32_t offset);     /* From the start, COM_OK or COM_ERROR */
+  void (*Close)(UpdateSource_TypeDef *source);
+} UpdateSource_OpsTypeDef;
+
+struct UpdateSource
+{
+  const UpdateSource_OpsTypeDef *ops;
+  const char *label;   /* Shown to the user */
+  uint32_t address;    /* Flash source: first byte */
+  uint32_t size;       /* Flash source: bytes in the range */
+  uint32_t offset;     /* Flash source: next byte to read */
+  union
+  {
+    lfs_file_t lfs;
+    FIL fil;
+  } file;
+};
+
+/**
+ * @brief  Backend of a transform. Apply works in place and never returns
+ *         more bytes than it was given, or UPDATE_TRANSFORM_FAILED.
+ */
+typedef struct
+{
+  void (*Start)(UpdateTransform_TypeDef *transform);
+  uint32_t (*Apply)(UpdateTransform_TypeDef *transform, uint8_t *data, uint32_t length);
+  COM_StatusTypeDef (*Size)(UpdateTransform_TypeDef *transform, uint32_t *p_size); /* NULL: size unchanged */
+  COM_StatusTypeDef (*Finish)(UpdateTransform_TypeDef *transform);
+} UpdateTransform_OpsTypeDef;
+
+struct UpdateTransform
+{
+  const UpdateTransform_OpsTypeDef *ops;
+  const char *label;
+  uint32_t prologue;   /* Bytes read and passed on alone before the first chunk */
+  uint32_t overhead;   /* Bytes read with each chunk and dropped, at most
+                          UPDATE_PIPELINE_MAX_OVERHEAD */
+  uint32_t check_first; /* 1: the whole image goes through the chain once
+                           before the sink is opened */
+  uint32_t trailer;    /* Bytes at the end of the source read on their own
+                          after the last chunk, set by Size (e.g. the
+                          index of a sealed image) */
+  uint32_t crc;        /* CRC transform: CRC-32 of the data seen so far */
+  uint32_t expected;   /* CRC transform: value checked by Finish */
+  uint32_t check;      /* CRC transform: 1 to check expected */
+  int32_t error;       /* Unseal transform: first AES_SEAL_ERR_x seen */
+  union
+  {
+    struct AES_stream stream;
+    struct AES_seal seal;
+  } aes;
+};
+
+/**
+ * @brief  Source, transforms and sink of one run, with the time spent in
+ *         each stage
+ */
+typedef struct
+{
+  UpdateSource_TypeDef *source;
+  UpdateTransform_TypeDef *transform[UPDATE_PIPELINE_MAX_TRANSFORMS];
+  uint32_t transform_count;
+  ImageSink_TypeDef *sink;
+  uint32_t in_size;      /* Bytes read from the source */
+  uint32_t out_size;     /* Bytes written to the sink */
+  uint32_t read_ms;
+  uint32_t transform_ms;
+  uint32_t write_ms;
+  uint32_t total_ms;
+} UpdatePipeline_TypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void UpdateSource_InitFatFs(UpdateSource_TypeDef *source);
+void UpdateSource_InitLfs(UpdateSource_TypeDef *source);
+void UpdateSource_InitFlash(UpdateSource_TypeDef *source, uint32_t address, uint32_t size);
+void UpdateTransform_InitDecrypt(UpdateTransform_TypeDef *transform);
+void UpdateTransform_InitUnseal(UpdateTransform_TypeDef *transform);
+void UpdateTransform_InitCrc(UpdateTransform_TypeDef *transform, uint32_t check, uint32_t expected);
+void UpdatePipeline_Init(UpdatePipeline_TypeDef *pipeline, UpdateSource_TypeDef *source, ImageSink_TypeDef *sink);
+COM_StatusTypeDef UpdatePipeline_Add(UpdatePipeline_TypeDef *pipeline, UpdateTransform_TypeDef *transform);
+COM_StatusTypeDef UpdatePipeline_Run(UpdatePipeline_TypeDef *pipeline, const char *source_name, const char *sink_name);
+void UpdatePipeline_ShowStats(const UpdatePipeline_TypeDef *pipeline);
+
+#endif /* __UPDATE_PIPELINE_H */
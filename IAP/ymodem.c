@@ -27,20 +27,61 @@
 #include "string.h"
 #include "main.h"
 #include "menu.h"
+#include "image_sink.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 #define CRC16_F       /* activate the CRC16 integrity */
+/* One packet slot rounded up so that every slot keeps the data 32bit aligned */
+#define PACKET_SLOT_SIZE  ((PACKET_1K_SIZE + PACKET_DATA_INDEX + PACKET_TRAILER_SIZE + 3U) & ~3U)
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
-__IO uint32_t flashdestination;
-/* @note ATTENTION - please keep this variable 32bit aligned */
-uint8_t aPacketData[PACKET_1K_SIZE + PACKET_DATA_INDEX + PACKET_TRAILER_SIZE];
+/* @note ATTENTION - please keep this variable 32bit aligned
+ *       Two slots: one packet is programmed while the next one is received */
+__ALIGNED(4) uint8_t aPacketData[2][PACKET_SLOT_SIZE];
+
+/* CRC-16/XMODEM (poly 0x1021) lookup table, one entry per input byte */
+static const uint16_t aCRC16Table[256] =
+{
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
 
 /* Private function prototypes -----------------------------------------------*/
 static void PrepareIntialPacket(uint8_t *p_data, const uint8_t *p_file_name, uint32_t length);
 static void PreparePacket(uint8_t *p_source, uint8_t *p_packet, uint8_t pkt_nr, uint32_t size_blk);
 static HAL_StatusTypeDef ReceivePacket(uint8_t *p_data, uint32_t *p_length, uint32_t timeout);
+static uint32_t FinalizePacket(uint8_t *p_packet, uint32_t pkt_size);
 uint16_t UpdateCRC16(uint16_t crc_in, uint8_t byte);
 uint16_t Cal_CRC16(const uint8_t* p_data, uint32_t size);
 uint8_t CalcChecksum(const uint8_t *p_data, uint32_t size);
@@ -52,11 +93,13 @@ uint8_t CalcChecksum(const uint8_t *p_data, uint32_t size);
   * @param  data
   * @param  length
   *     0: end of transmission
+  *     1: YMODEM-G streaming requested
   *     2: abort by sender
   *    >0: packet length
   * @param  timeout
   * @retval HAL_OK: normally return
   *         HAL_BUSY: abort by user
+  *         HAL_ERROR: bad packet, or receive ring overrun (Serial_DMA_RxOverrun)
   */
 static HAL_StatusTypeDef ReceivePacket(uint8_t *p_data, uint32_t *p_length, uint32_t timeout)
 {
@@ -66,7 +109,7 @@ static HAL_StatusTypeDef ReceivePacket(uint8_t *p_data, uint32_t *p_length, uint
   uint8_t char1;
 
   *p_length = 0;
-  status = HAL_UART_Receive(&UartHandle, &char1, 1, timeout);
+  status = Serial_DMA_Receive(&char1, 1, timeout);
 
   if (status == HAL_OK)
   {
@@ -81,7 +124,7 @@ static HAL_StatusTypeDef ReceivePacket(uint8_t *p_data, uint32_t *p_length, uint
       case EOT:
         break;
       case CA:
-        if ((HAL_UART_Receive(&UartHandle, &char1, 1, timeout) == HAL_OK) && (char1 == CA))
+        if ((Serial_DMA_Receive(&char1, 1, timeout) == HAL_OK) && (char1 == CA))
         {
           packet_size = 2;
         }
@@ -94,6 +137,10 @@ static HAL_StatusTypeDef ReceivePacket(uint8_t *p_data, uint32_t *p_length, uint
       case ABORT2:
         status = HAL_BUSY;
         break;
+      case STREAM1:
+      case STREAM2:
+        packet_size = 1;
+        break;
       default:
         status = HAL_ERROR;
         break;
@@ -102,7 +149,7 @@ static HAL_StatusTypeDef ReceivePacket(uint8_t *p_data, uint32_t *p_length, uint
 
     if (packet_size >= PACKET_SIZE )
     {
-      status = HAL_UART_Receive(&UartHandle, &p_data[PACKET_NUMBER_INDEX], packet_size + PACKET_OVERHEAD_SIZE, timeout);
+      status = Serial_DMA_Receive(&p_data[PACKET_NUMBER_INDEX], packet_size + PACKET_OVERHEAD_SIZE, timeout);
 
       /* Simple packet sanity check */
       if (status == HAL_OK )
@@ -203,10 +250,7 @@ static void PreparePacket(uint8_t *p_source, uint8_t *p_packet, uint8_t pkt_nr,
   p_record = p_source;
 
   /* Filename packet has valid data */
-  for (i = PACKET_DATA_INDEX; i < size + PACKET_DATA_INDEX;i++)
-  {
-    p_packet[i] = *p_record++;
-  }
+  memcpy(&p_packet[PACKET_DATA_INDEX], p_record, size);
   if ( size  <= packet_size)
   {
     for (i = size + PACKET_DATA_INDEX; i < packet_size + PACKET_DATA_INDEX; i++)
@@ -216,6 +260,26 @@ static void PreparePacket(uint8_t *p_source, uint8_t *p_packet, uint8_t pkt_nr,
   }
 }
 
+/**
+  * @brief  Append the CRC (or checksum) to a prepared packet
+  * @param  p_packet: packet slot filled by PreparePacket/PrepareIntialPacket
+  * @param  pkt_size: payload size of the packet
+  * @retval number of bytes to send, starting at PACKET_START_INDEX
+  */
+static uint32_t FinalizePacket(uint8_t *p_packet, uint32_t pkt_size)
+{
+#ifdef CRC16_F
+  uint32_t crc = Cal_CRC16(&p_packet[PACKET_DATA_INDEX], pkt_size);
+
+  p_packet[pkt_size + PACKET_DATA_INDEX] = crc >> 8;
+  p_packet[pkt_size + PACKET_DATA_INDEX + 1] = crc & 0xFF;
+  return pkt_size + PACKET_HEADER_SIZE + 2;
+#else /* CRC16_F */
+  p_packet[pkt_size + PACKET_DATA_INDEX] = CalcChecksum(&p_packet[PACKET_DATA_INDEX], pkt_size);
+  return pkt_size + PACKET_HEADER_SIZE + 1;
+#endif /* CRC16_F */
+}
+
 /**
   * @brief  Update CRC16 for input byte
   * @param  crc_in input value 
@@ -244,6 +308,8 @@ uint16_t UpdateCRC16(uint16_t crc_in, uint8_t byte)
 
 /**
   * @brief  Cal CRC16 for YModem Packet
+  * @note   Table driven, same result as feeding every byte through
+  *         UpdateCRC16 followed by two zero bytes.
   * @param  data
   * @param  length
   * @retval None
@@ -254,10 +320,7 @@ uint16_t Cal_CRC16(const uint8_t* p_data, uint32_t size)
   const uint8_t* dataEnd = p_data+size;
 
   while(p_data < dataEnd)
-    crc = UpdateCRC16(crc, *p_data++);
- 
-  crc = UpdateCRC16(crc, 0);
-  crc = UpdateCRC16(crc, 0);
+    crc = (crc << 8) ^ aCRC16Table[((crc >> 8) ^ *p_data++) & 0xffu];
 
   return crc&0xffffu;
 }
@@ -284,20 +347,33 @@ uint8_t CalcChecksum(const uint8_t *p_data, uint32_t size)
 /* Public functions ---------------------------------------------------------*/
 /**
   * @brief  Receive a file using the ymodem protocol with CRC16.
+  * @note   Reception runs on the UART4 DMA ring with two packet slots: a data
+  *         packet is ACKed as soon as its CRC is good and is programmed while
+  *         the sender already pushes the next one into the ring. A failed
+  *         write is reported on the following packet (or EOT) by CA CA.
+  *         Pressing 'G' before the transfer starts switches to YMODEM-G:
+  *         data packets are no longer ACKed and any error aborts the session.
+  *         A sink slow enough for the sender to lap the ring ends a YMODEM-G
+  *         session with COM_OVERRUN, plain YMODEM resends the packet.
   * @param  p_size The size of the file.
+  * @param  sink Destination of the file, see image_sink.h
   * @retval COM_StatusTypeDef result of reception/programming
   */
-COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size )
+COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size, ImageSink_TypeDef *sink )
 {
   uint32_t i, packet_length, session_done = 0, file_done, errors = 0, session_begin = 0;
- // uint32_t flashdestination;
-  uint32_t ramsource, filesize, packets_received;
+  uint32_t filesize, packets_received, file_remaining = 0;
+  uint32_t rx_slot = 0, pending_length = 0, write_failed = 0, streaming = 0, overrun;
+  uint8_t poll_char = CRC16;
+  uint8_t *p_packet, *p_pending = NULL;
   uint8_t *file_ptr;
   uint8_t file_size[FILE_SIZE_LENGTH], tmp;
   COM_StatusTypeDef result = COM_OK;
 
-  /* Initialize flashdestination variable */
-  flashdestination = APPLICATION_ADDRESS;
+  if (Serial_DMA_RxStart() != HAL_OK)
+  {
+    return COM_ERROR;
+  }
 
   while ((session_done == 0) && (result == COM_OK))
   {
@@ -305,10 +381,35 @@ COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size )
     file_done = 0;
     while ((file_done == 0) && (result == COM_OK))
     {
-      switch (ReceivePacket(aPacketData, &packet_length, DOWNLOAD_TIMEOUT))
+      /* Program the packet ACKed last time while the next one is arriving */
+      if (p_pending != NULL)
+      {
+        /* The padding of the last packet is not part of the file */
+        if (pending_length > file_remaining)
+        {
+          pending_length = file_remaining;
+        }
+        if (ImageSink_Write(sink, &p_pending[PACKET_DATA_INDEX], pending_length) != COM_OK)
+        {
+          write_failed = 1;
+        }
+        file_remaining -= pending_length;
+        p_pending = NULL;
+      }
+
+      p_packet = aPacketData[rx_slot];
+      switch (ReceivePacket(p_packet, &packet_length, DOWNLOAD_TIMEOUT))
       {
         case HAL_OK:
           errors = 0;
+          if ((write_failed != 0) && (packet_length != 2))
+          {
+            /* Deferred report of an error while writing to Flash memory */
+            Serial_PutByte(CA);
+            Serial_PutByte(CA);
+            result = COM_DATA;
+            break;
+          }
           switch (packet_length)
           {
             case 2:
@@ -317,26 +418,59 @@ COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size )
               result = COM_ABORT;
               break;
             case 0:
-              /* End of transmission */
+              /* End of transmission, ask for the next header right away */
+              if (ImageSink_Close(sink, 1) != COM_OK)
+              {
+                Serial_PutByte(CA);
+                Serial_PutByte(CA);
+                result = COM_DATA;
+                break;
+              }
               Serial_PutByte(ACK);
+              Serial_PutByte(poll_char);
               file_done = 1;
               break;
+            case 1:
+              /* Streaming request, only honoured before the first header */
+              if ((session_begin == 0) && (streaming == 0))
+              {
+                streaming = 1;
+                poll_char = CRC16_G;
+                Serial_PutByte(poll_char);
+              }
+              break;
             default:
               /* Normal packet */
-              if (aPacketData[PACKET_NUMBER_INDEX] != (uint8_t)packets_received)
+              if (p_packet[PACKET_NUMBER_INDEX] != (uint8_t)packets_received)
               {
-                Serial_PutByte(NAK);
+                if ((packets_received > 1) &&
+                    (p_packet[PACKET_NUMBER_INDEX] == (uint8_t)(packets_received - 1)))
+                {
+                  /* Our ACK got lost, the packet is already in Flash */
+                  Serial_PutByte(ACK);
+                }
+                else if (streaming != 0)
+                {
+                  /* No retransmission in YMODEM-G, give up */
+                  Serial_PutByte(CA);
+                  Serial_PutByte(CA);
+                  result = COM_ERROR;
+                }
+                else
+                {
+                  Serial_PutByte(NAK);
+                }
               }
               else
               {
                 if (packets_received == 0)
                 {
                   /* File name packet */
-                  if (aPacketData[PACKET_DATA_INDEX] != 0)
+                  if (p_packet[PACKET_DATA_INDEX] != 0)
                   {
                     /* File name extraction */
                     i = 0;
-                    file_ptr = aPacketData + PACKET_DATA_INDEX;
+                    file_ptr = p_packet + PACKET_DATA_INDEX;
                     while ( (*file_ptr != 0) && (i < FILE_NAME_LENGTH))
                     {
                       aFileName[i++] = *file_ptr++;
@@ -351,24 +485,27 @@ COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size )
                       file_size[i++] = *file_ptr++;
                     }
                     file_size[i++] = '\0';
+                    filesize = 0;
                     Str2Int(file_size, &filesize);
+                    *p_size = filesize;
+                    file_remaining = (filesize != 0) ? filesize : 0xFFFFFFFF;
 
-                    /* Test the size of the image to be sent */
-                    /* Image size is greater than Flash size */
-                    if (filesize > (USER_FLASH_SIZE + 1))
+                    /* Erase the area / create the file, the sink rejects
+                       an image bigger than its destination with COM_LIMIT */
+                    result = ImageSink_Open(sink, (char *)aFileName, filesize);
+                    if (result != COM_OK)
                     {
                       /* End session */
                       tmp = CA;
                       HAL_UART_Transmit(&UartHandle, &tmp, 1, NAK_TIMEOUT);
                       HAL_UART_Transmit(&UartHandle, &tmp, 1, NAK_TIMEOUT);
-                      result = COM_LIMIT;
+                      break;
                     }
-                    /* erase user application area */
-                    FLASH_If_Erase(APPLICATION_ADDRESS);
-                    *p_size = filesize;
 
+                    /* The sender may have queued bytes during the erase / file creation */
+                    Serial_DMA_RxFlush();
                     Serial_PutByte(ACK);
-                    Serial_PutByte(CRC16);
+                    Serial_PutByte(poll_char);
                   }
                   /* File header packet is empty, end session */
                   else
@@ -381,20 +518,14 @@ COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size )
                 }
                 else /* Data packet */
                 {
-                  ramsource = (uint32_t) & aPacketData[PACKET_DATA_INDEX];
-                  /* Write received data in Flash */
-                  if (FLASH_If_Write(flashdestination, (uint32_t*) ramsource, packet_length/4) == FLASHIF_OK)
+                  /* ACK first, the write happens while the next packet arrives */
+                  if (streaming == 0)
                   {
-                    flashdestination += packet_length;
                     Serial_PutByte(ACK);
                   }
-                  else /* An error occurred while writing to Flash memory */
-                  {
-                    /* End session */
-                    Serial_PutByte(CA);
-                    Serial_PutByte(CA);
-                    result = COM_DATA;
-                  }
+                  p_pending = p_packet;
+                  pending_length = packet_length;
+                  rx_slot ^= 1;
                 }
                 packets_received ++;
                 session_begin = 1;
@@ -412,77 +543,102 @@ COM_StatusTypeDef Ymodem_Receive ( uint32_t *p_size )
           {
             errors ++;
           }
-          if (errors > MAX_ERRORS)
+          /* The sender lapped the ring while the last packet was written,
+             the bytes in it are no longer in order */
+          overrun = Serial_DMA_RxOverrun();
+          /* Resynchronise on the next packet start */
+          Serial_DMA_RxFlush();
+          if ((errors > MAX_ERRORS) || ((streaming != 0) && (packets_received > 0)))
           {
             /* Abort communication */
             Serial_PutByte(CA);
             Serial_PutByte(CA);
+            result = (overrun != 0) ? COM_OVERRUN : COM_ERROR;
           }
           else
           {
-            Serial_PutByte(CRC16); /* Ask for a packet */
+            Serial_PutByte(poll_char); /* Ask for a packet */
           }
           break;
       }
     }
   }
+
+  Serial_DMA_RxStop();
+
+  /* Drop a partially received file */
+  ImageSink_Close(sink, 0);
   return result;
 }
 
+/**
+  * @brief  Wait for the second CA of a cancel sequence
+  * @param  None
+  * @retval 1 if the receiver cancelled the transfer
+  */
+static uint32_t CheckCancel(void)
+{
+  uint8_t ctrl;
+
+  if ((Serial_DMA_Receive(&ctrl, 1, NAK_TIMEOUT) == HAL_OK) && (ctrl == CA))
+  {
+    HAL_Delay( 2 );
+    Serial_DMA_RxFlush();
+    return 1;
+  }
+  return 0;
+}
+
 /**
   * @brief  Transmit a file using the ymodem protocol
+  * @note   Packets are sent by DMA from two slots: packet N+1 is copied and
+  *         its CRC computed while packet N is still on the wire. With
+  *         streaming set (receiver opened with 'G') no per-packet ACK is
+  *         awaited, only a CA from the receiver stops the transfer.
   * @param  p_buf: Address of the first byte
   * @param  p_file_name: Name of the file sent
   * @param  file_size: Size of the transmission
+  * @param  streaming: 1 for YMODEM-G, 0 for YMODEM
   * @retval COM_StatusTypeDef result of the communication
   */
-COM_StatusTypeDef Ymodem_Transmit (uint8_t *p_buf, const uint8_t *p_file_name, uint32_t file_size)
+COM_StatusTypeDef Ymodem_Transmit (uint8_t *p_buf, const uint8_t *p_file_name, uint32_t file_size, uint32_t streaming)
 {
-  uint32_t errors = 0, ack_recpt = 0, size = 0, pkt_size;
+  uint32_t errors = 0, ack_recpt = 0, size = 0, pkt_size, next_size;
+  uint32_t tx_slot = 0, tx_length, next_length = 0, next_ready;
   uint8_t *p_buf_int;
   COM_StatusTypeDef result = COM_OK;
   uint32_t blk_number = 1;
   uint8_t a_rx_ctrl[2];
-  uint8_t i;
-#ifdef CRC16_F    
-  uint32_t temp_crc;
-#else /* CRC16_F */   
-  uint8_t temp_chksum;
-#endif /* CRC16_F */  
+
+  if (Serial_DMA_RxStart() != HAL_OK)
+  {
+    return COM_ERROR;
+  }
 
   /* Prepare first block - header */
-  PrepareIntialPacket(aPacketData, p_file_name, file_size);
+  PrepareIntialPacket(aPacketData[0], p_file_name, file_size);
+  tx_length = FinalizePacket(aPacketData[0], PACKET_SIZE);
 
   while (( !ack_recpt ) && ( result == COM_OK ))
   {
     /* Send Packet */
-    HAL_UART_Transmit(&UartHandle, &aPacketData[PACKET_START_INDEX], PACKET_SIZE + PACKET_HEADER_SIZE, NAK_TIMEOUT);
-
-    /* Send CRC or Check Sum based on CRC16_F */
-#ifdef CRC16_F    
-    temp_crc = Cal_CRC16(&aPacketData[PACKET_DATA_INDEX], PACKET_SIZE);
-    Serial_PutByte(temp_crc >> 8);
-    Serial_PutByte(temp_crc & 0xFF);
-#else /* CRC16_F */   
-    temp_chksum = CalcChecksum (&aPacketData[PACKET_DATA_INDEX], PACKET_SIZE);
-    Serial_PutByte(temp_chksum);
-#endif /* CRC16_F */
+    if ((Serial_DMA_Transmit(&aPacketData[0][PACKET_START_INDEX], tx_length) != HAL_OK) ||
+        (Serial_DMA_TxWait(NAK_TIMEOUT) != HAL_OK))
+    {
+      result = COM_ERROR;
+      break;
+    }
 
-    /* Wait for Ack and 'C' */
-    if (HAL_UART_Receive(&UartHandle, &a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK)
+    /* Wait for Ack */
+    if (Serial_DMA_Receive(&a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK)
     {
       if (a_rx_ctrl[0] == ACK)
       {
         ack_recpt = 1;
       }
-      else if (a_rx_ctrl[0] == CA)
+      else if ((a_rx_ctrl[0] == CA) && CheckCancel())
       {
-        if ((HAL_UART_Receive(&UartHandle, &a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK) && (a_rx_ctrl[0] == CA))
-        {
-          HAL_Delay( 2 );
-          __HAL_UART_FLUSH_DRREGISTER(&UartHandle);
-          result = COM_ABORT;
-        }
+        result = COM_ABORT;
       }
     }
     else
@@ -495,66 +651,80 @@ COM_StatusTypeDef Ymodem_Transmit (uint8_t *p_buf, const uint8_t *p_file_name, u
     }
   }
 
+  /* The receiver asks for the data with 'C' (or 'G') after the header ACK */
+  if (result == COM_OK)
+  {
+    if (Serial_DMA_Receive(&a_rx_ctrl[0], 1, NAK_TIMEOUT) != HAL_OK)
+    {
+      result = COM_ERROR;
+    }
+    else if (a_rx_ctrl[0] == CA)
+    {
+      result = CheckCancel() ? COM_ABORT : COM_ERROR;
+    }
+    else if (a_rx_ctrl[0] == CRC16_G)
+    {
+      streaming = 1;
+    }
+  }
+
   p_buf_int = p_buf;
   size = file_size;
 
   /* Here 1024 bytes length is used to send the packets */
+  if (size)
+  {
+    pkt_size = size >= PACKET_1K_SIZE ? PACKET_1K_SIZE : PACKET_SIZE;
+    PreparePacket(p_buf_int, aPacketData[tx_slot], blk_number, size);
+    tx_length = FinalizePacket(aPacketData[tx_slot], pkt_size);
+  }
+
   while ((size) && (result == COM_OK ))
   {
-    /* Prepare next packet */
-    PreparePacket(p_buf_int, aPacketData, blk_number, size);
     ack_recpt = 0;
     a_rx_ctrl[0] = 0;
     errors = 0;
+    next_ready = 0;
 
     /* Resend packet if NAK for few times else end of communication */
     while (( !ack_recpt ) && ( result == COM_OK ))
     {
-      /* Send next packet */
-      if (size >= PACKET_1K_SIZE)
+      if (Serial_DMA_Transmit(&aPacketData[tx_slot][PACKET_START_INDEX], tx_length) != HAL_OK)
       {
-        pkt_size = PACKET_1K_SIZE;
+        result = COM_ERROR;
+        break;
       }
-      else
+
+      /* Build the next packet in the other slot while this one is sent */
+      if ((next_ready == 0) && (size > pkt_size))
       {
-        pkt_size = PACKET_SIZE;
+        next_size = size - pkt_size;
+        PreparePacket(p_buf_int + pkt_size, aPacketData[tx_slot ^ 1], blk_number + 1, next_size);
+        next_length = FinalizePacket(aPacketData[tx_slot ^ 1],
+                                     next_size >= PACKET_1K_SIZE ? PACKET_1K_SIZE : PACKET_SIZE);
+        next_ready = 1;
       }
 
-      HAL_UART_Transmit(&UartHandle, &aPacketData[PACKET_START_INDEX], pkt_size + PACKET_HEADER_SIZE, NAK_TIMEOUT);
-      
-      /* Send CRC or Check Sum based on CRC16_F */
-#ifdef CRC16_F    
-      temp_crc = Cal_CRC16(&aPacketData[PACKET_DATA_INDEX], pkt_size);
-      Serial_PutByte(temp_crc >> 8);
-      Serial_PutByte(temp_crc & 0xFF);
-#else /* CRC16_F */   
-      temp_chksum = CalcChecksum (&aPacketData[PACKET_DATA_INDEX], pkt_size);
-      Serial_PutByte(temp_chksum);
-#endif /* CRC16_F */
-      
-      /* Wait for Ack */
-      if ((HAL_UART_Receive(&UartHandle, &a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK) && (a_rx_ctrl[0] == ACK))
+      if (Serial_DMA_TxWait(NAK_TIMEOUT) != HAL_OK)
       {
+        result = COM_ERROR;
+        break;
+      }
+
+      if (streaming)
+      {
+        /* No ACK in YMODEM-G, only look for a cancel from the receiver */
         ack_recpt = 1;
-        if (size > pkt_size)
-        {
-          p_buf_int += pkt_size;
-          size -= pkt_size;
-          if (blk_number == (USER_FLASH_SIZE / PACKET_1K_SIZE))
-          {
-            result = COM_LIMIT; /* boundary error */
-          }
-          else
-          {
-            blk_number++;
-          }
-        }
-        else
+        if ((Serial_DMA_Receive(&a_rx_ctrl[0], 1, 0) == HAL_OK) && (a_rx_ctrl[0] == CA) && CheckCancel())
         {
-          p_buf_int += pkt_size;
-          size = 0;
+          result = COM_ABORT;
         }
       }
+      /* Wait for Ack */
+      else if ((Serial_DMA_Receive(&a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK) && (a_rx_ctrl[0] == ACK))
+      {
+        ack_recpt = 1;
+      }
       else
       {
         errors++;
@@ -566,6 +736,31 @@ COM_StatusTypeDef Ymodem_Transmit (uint8_t *p_buf, const uint8_t *p_file_name, u
         result = COM_ERROR;
       }
     }
+
+    if ((ack_recpt) && (result == COM_OK))
+    {
+      if (size > pkt_size)
+      {
+        p_buf_int += pkt_size;
+        size -= pkt_size;
+        if (blk_number == (USER_FLASH_SIZE / PACKET_1K_SIZE))
+        {
+          result = COM_LIMIT; /* boundary error */
+        }
+        else
+        {
+          blk_number++;
+          tx_slot ^= 1;
+          tx_length = next_length;
+          pkt_size = size >= PACKET_1K_SIZE ? PACKET_1K_SIZE : PACKET_SIZE;
+        }
+      }
+      else
+      {
+        p_buf_int += pkt_size;
+        size = 0;
+      }
+    }
   }
 
   /* Sending End Of Transmission char */
@@ -577,20 +772,15 @@ COM_StatusTypeDef Ymodem_Transmit (uint8_t *p_buf, const uint8_t *p_file_name, u
     Serial_PutByte(EOT);
 
     /* Wait for Ack */
-    if (HAL_UART_Receive(&UartHandle, &a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK)
+    if (Serial_DMA_Receive(&a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK)
     {
       if (a_rx_ctrl[0] == ACK)
       {
         ack_recpt = 1;
       }
-      else if (a_rx_ctrl[0] == CA)
+      else if ((a_rx_ctrl[0] == CA) && CheckCancel())
       {
-        if ((HAL_UART_Receive(&UartHandle, &a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK) && (a_rx_ctrl[0] == CA))
-        {
-          HAL_Delay( 2 );
-          __HAL_UART_FLUSH_DRREGISTER(&UartHandle);
-          result = COM_ABORT;
-        }
+        result = COM_ABORT;
       }
     }
     else
@@ -607,40 +797,42 @@ COM_StatusTypeDef Ymodem_Transmit (uint8_t *p_buf, const uint8_t *p_file_name, u
   /* Empty packet sent - some terminal emulators need this to close session */
   if ( result == COM_OK )
   {
-    /* Preparing an empty packet */
-    aPacketData[PACKET_START_INDEX] = SOH;
-    aPacketData[PACKET_NUMBER_INDEX] = 0;
-    aPacketData[PACKET_CNUMBER_INDEX] = 0xFF;
-    for (i = PACKET_DATA_INDEX; i < (PACKET_SIZE + PACKET_DATA_INDEX); i++)
+    /* The receiver polls for the next header, a missing poll is tolerated */
+    if ((Serial_DMA_Receive(&a_rx_ctrl[0], 1, DOWNLOAD_TIMEOUT) == HAL_OK) &&
+        (a_rx_ctrl[0] == CA) && CheckCancel())
     {
-      aPacketData [i] = 0x00;
+      result = COM_ABORT;
     }
+  }
 
-    /* Send Packet */
-    HAL_UART_Transmit(&UartHandle, &aPacketData[PACKET_START_INDEX], PACKET_SIZE + PACKET_HEADER_SIZE, NAK_TIMEOUT);
-
-    /* Send CRC or Check Sum based on CRC16_F */
-#ifdef CRC16_F    
-    temp_crc = Cal_CRC16(&aPacketData[PACKET_DATA_INDEX], PACKET_SIZE);
-    Serial_PutByte(temp_crc >> 8);
-    Serial_PutByte(temp_crc & 0xFF);
-#else /* CRC16_F */   
-    temp_chksum = CalcChecksum (&aPacketData[PACKET_DATA_INDEX], PACKET_SIZE);
-    Serial_PutByte(temp_chksum);
-#endif /* CRC16_F */
+  if ( result == COM_OK )
+  {
+    /* Preparing an empty packet */
+    aPacketData[0][PACKET_START_INDEX] = SOH;
+    aPacketData[0][PACKET_NUMBER_INDEX] = 0;
+    aPacketData[0][PACKET_CNUMBER_INDEX] = 0xFF;
+    memset(&aPacketData[0][PACKET_DATA_INDEX], 0x00, PACKET_SIZE);
+    tx_length = FinalizePacket(aPacketData[0], PACKET_SIZE);
 
-    /* Wait for Ack and 'C' */
-    if (HAL_UART_Receive(&UartHandle, &a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK)
+    /* Send Packet */
+    if ((Serial_DMA_Transmit(&aPacketData[0][PACKET_START_INDEX], tx_length) != HAL_OK) ||
+        (Serial_DMA_TxWait(NAK_TIMEOUT) != HAL_OK))
+    {
+      result = COM_ERROR;
+    }
+    /* Wait for Ack */
+    else if (Serial_DMA_Receive(&a_rx_ctrl[0], 1, NAK_TIMEOUT) == HAL_OK)
     {
       if (a_rx_ctrl[0] == CA)
       {
-          HAL_Delay( 2 );
-          __HAL_UART_FLUSH_DRREGISTER(&UartHandle);
-          result = COM_ABORT;
+        HAL_Delay( 2 );
+        Serial_DMA_RxFlush();
+        result = COM_ABORT;
       }
     }
   }
 
+  Serial_DMA_RxStop();
   return result; /* file transmitted successfully */
 }
 
@@ -38,7 +38,8 @@ typedef enum
   COM_ABORT    = 0x02,
   COM_TIMEOUT  = 0x03,
   COM_DATA     = 0x04,
-  COM_LIMIT    = 0x05
+  COM_LIMIT    = 0x05,
+  COM_OVERRUN  = 0x06   /* Receive ring lapped, the sink is too slow */
 } COM_StatusTypeDef;
 /**
   * @}
@@ -73,18 +74,22 @@ typedef enum
 #define NAK                     ((uint8_t)0x15)  /* negative acknowledge */
 #define CA                      ((uint32_t)0x18) /* two of these in succession aborts transfer */
 #define CRC16                   ((uint8_t)0x43)  /* 'C' == 0x43, request 16-bit CRC */
+#define CRC16_G                 ((uint8_t)0x47)  /* 'G' == 0x47, request YMODEM-G streaming */
 #define NEGATIVE_BYTE           ((uint8_t)0xFF)
 
 #define ABORT1                  ((uint8_t)0x41)  /* 'A' == 0x41, abort by user */
 #define ABORT2                  ((uint8_t)0x61)  /* 'a' == 0x61, abort by user */
+#define STREAM1                 ((uint8_t)0x47)  /* 'G' == 0x47, select YMODEM-G by user */
+#define STREAM2                 ((uint8_t)0x67)  /* 'g' == 0x67, select YMODEM-G by user */
 
 #define NAK_TIMEOUT             ((uint32_t)0x100000)
 #define DOWNLOAD_TIMEOUT        ((uint32_t)5000) /* Five second retry delay */
 #define MAX_ERRORS              ((uint32_t)5)
 
 /* Exported functions ------------------------------------------------------- */
-COM_StatusTypeDef Ymodem_Receive(uint32_t *p_size);
-COM_StatusTypeDef Ymodem_Transmit(uint8_t *p_buf, const uint8_t *p_file_name, uint32_t file_size);
+struct ImageSink;
+COM_StatusTypeDef Ymodem_Receive(uint32_t *p_size, struct ImageSink *sink);
+COM_StatusTypeDef Ymodem_Transmit(uint8_t *p_buf, const uint8_t *p_file_name, uint32_t file_size, uint32_t streaming);
 
 #endif  /* __YMODEM_H_ */
 
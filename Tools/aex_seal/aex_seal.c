@@ -0,0 +1,263 @@
+/**
+ ******************************************************************************
+ * @file    Tools/aex_seal/aex_seal.c
+ * @brief   Host tool making sealed images (.aex) for the bootloader and
+ *          checking them, on the same User/aes_seal.c as the firmware. An
+ *          image that fits AES_SEAL_INDEX_MAX_CHUNKS chunks is indexed, as
+ *          AES_seal_file does, so it installs sector by sector.
+ *
+ *          make && ./aex_seal app.bin app.aex          seal, random nonce
+ *          ./aex_seal --no-index app.bin app.aex       whole-image install
+ *          ./aex_seal --check app.aex [app.out]        authenticate, unseal
+ *          --key <64 hex digits>                       other than the image key
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "aes_seal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Private variables ---------------------------------------------------------*/
+static struct AES_seal Seal;
+static uint8_t Record[AES_SEAL_CHUNK_SIZE + AES_SEAL_TAG_SIZE];
+static uint8_t Index[AES_SEAL_INDEX_MAX_SIZE];
+
+/* Private functions ---------------------------------------------------------*/
+
+static int Tool_ParseHex(const char *text, uint8_t *out, size_t length)
+{
+  size_t i;
+  unsigned int byte;
+
+  if (strlen(text) != length * 2)
+  {
+    return -1;
+  }
+  for (i = 0; i < length; i++)
+  {
+    if (sscanf(&text[i * 2], "%2x", &byte) != 1)
+    {
+      return -1;
+    }
+    out[i] = (uint8_t)byte;
+  }
+  return 0;
+}
+
+/* Never reused with the same key, so it comes from the system RNG */
+static int Tool_Nonce(uint8_t *nonce)
+{
+  FILE *random = fopen("/dev/urandom", "rb");
+  size_t got;
+
+  if (random == NULL)
+  {
+    return -1;
+  }
+  got = fread(nonce, 1, AES_SEAL_NONCE_SIZE, random);
+  fclose(random);
+  return (got == AES_SEAL_NONCE_SIZE) ? 0 : -1;
+}
+
+static int Tool_Seal(const char *in_path, const char *out_path, const uint8_t *key, int indexed)
+{
+  uint8_t header[AES_SEAL_HEADER_SIZE];
+  uint8_t nonce[AES_SEAL_NONCE_SIZE];
+  FILE *in, *out;
+  long size;
+  size_t got, record;
+  uint32_t chunks;
+  int err = 0;
+
+  in = fopen(in_path, "rb");
+  if ((in == NULL) || (fseek(in, 0, SEEK_END) != 0) || ((size = ftell(in)) < 0) || (fseek(in, 0, SEEK_SET) != 0))
+  {
+    fprintf(stderr, "%s: cannot read\n", in_path);
+    return 1;
+  }
+  if ((unsigned long)size > 0xFFFFFFFFUL)
+  {
+    fprintf(stderr, "%s: too big\n", in_path);
+    fclose(in);
+    return 1;
+  }
+  if (Tool_Nonce(nonce) != 0)
+  {
+    fprintf(stderr, "no random nonce\n");
+    fclose(in);
+    return 1;
+  }
+  chunks = ((uint32_t)size + AES_SEAL_CHUNK_SIZE - 1) / AES_SEAL_CHUNK_SIZE;
+  indexed = indexed && (chunks <= AES_SEAL_INDEX_MAX_CHUNKS);
+
+  out = fopen(out_path, "wb");
+  if (out == NULL)
+  {
+    fprintf(stderr, "%s: cannot create\n", out_path);
+    fclose(in);
+    return 1;
+  }
+  AES_seal_init(&Seal, key);
+  AES_seal_create(&Seal, nonce, AES_SEAL_CHUNK_SIZE, (uint32_t)size, indexed ? Index : NULL, header);
+  if (fwrite(header, 1, sizeof(header), out) != sizeof(header))
+  {
+    err = 1;
+  }
+  while (!err && !AES_seal_complete(&Seal))
+  {
+    got = fread(Record, 1, AES_SEAL_CHUNK_SIZE, in);
+    if ((got == 0) || ((got < AES_SEAL_CHUNK_SIZE) && (Seal.done + got != Seal.size)))
+    {
+      err = 1; /* The file changed while it was read */
+      break;
+    }
+    record = AES_seal_record(&Seal, Record, got);
+    err = (fwrite(Record, 1, record, out) != record);
+  }
+  record = AES_seal_index_length(&Seal);
+  if (!err && (record != 0))
+  {
+    err = (fwrite(Index, 1, record, out) != record);
+  }
+  fclose(in);
+  if ((fclose(out) != 0) || err)
+  {
+    fprintf(stderr, "%s: write failed\n", out_path);
+    remove(out_path);
+    return 1;
+  }
+  printf("%s: %ld bytes, %lu chunks, %s\n", out_path, size, (unsigned long)chunks,
+         indexed ? "indexed" : "no index");
+  return 0;
+}
+
+/* Checks what the bootloader checks: header, every record in order, the
+   index, and the file size */
+static int Tool_Check(const char *in_path, const char *out_path, const uint8_t *key)
+{
+  uint8_t header[AES_SEAL_HEADER_SIZE];
+  FILE *in, *out = NULL;
+  long size;
+  size_t length, plain;
+  int err;
+
+  in = fopen(in_path, "rb");
+  if ((in == NULL) || (fseek(in, 0, SEEK_END) != 0) || ((size = ftell(in)) < 0) || (fseek(in, 0, SEEK_SET) != 0) ||
+      (fread(header, 1, sizeof(header), in) != sizeof(header)))
+  {
+    fprintf(stderr, "%s: cannot read\n", in_path);
+    return 1;
+  }
+  AES_seal_init(&Seal, key);
+  err = AES_seal_open(&Seal, header);
+  if (err != AES_SEAL_OK)
+  {
+    fprintf(stderr, "%s: %s\n", in_path, (err == AES_SEAL_ERR_AUTH) ? "header does not authenticate" : "not a sealed image");
+    fclose(in);
+    return 1;
+  }
+  if (((unsigned long)size != AES_seal_file_size(&Seal)) || (Seal.chunk_size > AES_SEAL_CHUNK_SIZE))
+  {
+    fprintf(stderr, "%s: truncated, or chunks the bootloader does not take\n", in_path);
+    fclose(in);
+    return 1;
+  }
+  if (out_path != NULL)
+  {
+    out = fopen(out_path, "wb");
+    if (out == NULL)
+    {
+      fprintf(stderr, "%s: cannot create\n", out_path);
+      fclose(in);
+      return 1;
+    }
+  }
+
+  while ((err == AES_SEAL_OK) && !AES_seal_complete(&Seal))
+  {
+    length = AES_seal_record_length(&Seal);
+    if (fread(Record, 1, length, in) != length)
+    {
+      err = AES_SEAL_ERR_FORMAT;
+      break;
+    }
+    err = AES_unseal_record(&Seal, Record, length, &plain);
+    if ((err == AES_SEAL_OK) && (out != NULL) && (fwrite(Record, 1, plain, out) != plain))
+    {
+      err = AES_SEAL_ERR_FORMAT;
+    }
+  }
+  length = AES_seal_index_length(&Seal);
+  if ((err == AES_SEAL_OK) && (length != 0))
+  {
+    err = (fread(Index, 1, length, in) == length) ? AES_seal_open_index(&Seal, Index) : AES_SEAL_ERR_FORMAT;
+  }
+  fclose(in);
+  if (out != NULL)
+  {
+    fclose(out);
+    if (err != AES_SEAL_OK)
+    {
+      remove(out_path);
+    }
+  }
+  if (err != AES_SEAL_OK)
+  {
+    fprintf(stderr, "%s: record %lu %s\n", in_path, (unsigned long)Seal.chunk,
+            (err == AES_SEAL_ERR_AUTH) ? "does not authenticate" : "cannot be read");
+    return 1;
+  }
+  printf("%s: %lu bytes in %lu chunks of %lu, %s, authenticated\n", in_path, (unsigned long)Seal.size,
+         (unsigned long)AES_seal_chunk_count(&Seal), (unsigned long)Seal.chunk_size,
+         (length != 0) ? "indexed" : "no index");
+  return 0;
+}
+
+static int Tool_Usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [--key hex] [--no-index] in.bin out.aex\n"
+          "       %s [--key hex] --check in.aex [out.bin]\n",
+          name, name);
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  uint8_t key[AES_KEYLEN];
+  int check = 0, indexed = 1, arg = 1;
+
+  memcpy(key, AES_image_key, AES_KEYLEN);
+  for (; (arg < argc) && (strncmp(argv[arg], "--", 2) == 0); arg++)
+  {
+    if (strcmp(argv[arg], "--check") == 0)
+    {
+      check = 1;
+    }
+    else if (strcmp(argv[arg], "--no-index") == 0)
+    {
+      indexed = 0;
+    }
+    else if ((strcmp(argv[arg], "--key") == 0) && (arg + 1 < argc) &&
+             (Tool_ParseHex(argv[arg + 1], key, AES_KEYLEN) == 0))
+    {
+      arg++;
+    }
+    else
+    {
+      return Tool_Usage(argv[0]);
+    }
+  }
+
+  if (check && ((argc - arg == 1) || (argc - arg == 2)))
+  {
+    return Tool_Check(argv[arg], (argc - arg == 2) ? argv[arg + 1] : NULL, key);
+  }
+  if (!check && (argc - arg == 2))
+  {
+    return Tool_Seal(argv[arg], argv[arg + 1], key, indexed);
+  }
+  return Tool_Usage(argv[0]);
+}
@@ -0,0 +1,257 @@
+/**
+ ******************************************************************************
+ * @file    Tools/lfs_bench/flash_sim.c
+ * @brief   RAM or file backed W25Q128 model for the LittleFS benchmarks.
+ *          Reads and programs are split and timed the way User/w25q128.c
+ *          issues them, erases use the largest aligned erase the driver's
+ *          planner would pick.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "flash_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Private define ------------------------------------------------------------*/
+#define FLASH_SIM_SECTORS (FLASH_SIM_SIZE / FLASH_SIM_SECTOR_SIZE)
+
+/* Private variables ---------------------------------------------------------*/
+static uint8_t *SimMemory;
+static uint32_t *SimWear; /* Erase count of every 4 KB sector */
+static const char *SimImage;
+static FlashSim_StatsTypeDef SimStats;
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Time to clock bytes over SPI
+ * @param  bytes: bytes on the bus, command and address included
+ * @retval ns
+ */
+static uint64_t FlashSim_BusTime(uint64_t bytes)
+{
+  return (bytes * 8U * 1000000000ULL) / FLASH_SIM_SPI_HZ + FLASH_SIM_COMMAND_NS;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+/**
+ * @brief  Allocate the chip, erased or loaded from an image file
+ * @param  image: file to load if it exists and to write back with
+ *         FlashSim_Save, or NULL for a RAM only chip
+ * @retval 0, or -1 when out of memory or the image has the wrong size
+ */
+int FlashSim_Init(const char *image)
+{
+  FILE *file;
+
+  SimMemory = malloc(FLASH_SIM_SIZE);
+  SimWear = calloc(FLASH_SIM_SECTORS, sizeof(uint32_t));
+  if ((SimMemory == NULL) || (SimWear == NULL))
+  {
+    FlashSim_Free();
+    return -1;
+  }
+  memset(SimMemory, 0xFF, FLASH_SIM_SIZE);
+  SimImage = image;
+
+  if ((image != NULL) && ((file = fopen(image, "rb")) != NULL))
+  {
+    size_t count = fread(SimMemory, 1, FLASH_SIM_SIZE, file);
+
+    fclose(file);
+    if (count != FLASH_SIM_SIZE)
+    {
+      FlashSim_Free();
+      return -1;
+    }
+  }
+  FlashSim_ResetStats();
+  return 0;
+}
+
+/**
+ * @brief  Write the chip back to its image file
+ * @retval 0, or -1 on a write error
+ */
+int FlashSim_Save(void)
+{
+  FILE *file;
+  size_t count;
+
+  if (SimImage == NULL)
+  {
+    return 0;
+  }
+  file = fopen(SimImage, "wb");
+  if (file == NULL)
+  {
+    return -1;
+  }
+  count = fwrite(SimMemory, 1, FLASH_SIM_SIZE, file);
+  fclose(file);
+  return (count == FLASH_SIM_SIZE) ? 0 : -1;
+}
+
+/**
+ * @brief  Release the chip
+ * @retval None
+ */
+void FlashSim_Free(void)
+{
+  free(SimMemory);
+  free(SimWear);
+  SimMemory = NULL;
+  SimWear = NULL;
+}
+
+/**
+ * @brief  Clear the counters and the wear map
+ * @retval None
+ */
+void FlashSim_ResetStats(void)
+{
+  memset(&SimStats, 0, sizeof(SimStats));
+  if (SimWear != NULL)
+  {
+    memset(SimWear, 0, FLASH_SIM_SECTORS * sizeof(uint32_t));
+  }
+}
+
+/**
+ * @brief  Counters since the last FlashSim_ResetStats
+ * @retval counters
+ */
+const FlashSim_StatsTypeDef *FlashSim_Stats(void)
+{
+  return &SimStats;
+}
+
+/**
+ * @brief  Highest erase count of a sector since the last FlashSim_ResetStats
+ * @retval erase count
+ */
+uint32_t FlashSim_MaxWear(void)
+{
+  uint32_t sector, wear = 0;
+
+  for (sector = 0; sector < FLASH_SIM_SECTORS; sector++)
+  {
+    if (SimWear[sector] > wear)
+    {
+      wear = SimWear[sector];
+    }
+  }
+  return wear;
+}
+
+/**
+ * @brief  Fast Read (0Bh) under one chip select, as W25Q128_read
+ * @param  addr: first byte
+ * @param  buffer: destination
+ * @param  length: bytes
+ * @retval 0, or -1 past the end of the chip
+ */
+int FlashSim_Read(uint32_t addr, uint8_t *buffer, uint32_t length)
+{
+  if ((addr > FLASH_SIM_SIZE) || (length > FLASH_SIM_SIZE - addr))
+  {
+    return -1;
+  }
+  memcpy(buffer, &SimMemory[addr], length);
+  SimStats.reads++;
+  SimStats.read_bytes += length;
+  SimStats.time_ns += FlashSim_BusTime(5U + length);
+  return 0;
+}
+
+/**
+ * @brief  Program split at page boundaries, as W25Q128_program
+ * @param  addr: first byte
+ * @param  buffer: data
+ * @param  length: bytes
+ * @retval 0, or -1 past the end of the chip
+ */
+int FlashSim_Program(uint32_t addr, const uint8_t *buffer, uint32_t length)
+{
+  uint32_t n, i;
+
+  if ((addr > FLASH_SIM_SIZE) || (length > FLASH_SIM_SIZE - addr))
+  {
+    return -1;
+  }
+  while (length > 0)
+  {
+    n = FLASH_SIM_PAGE_SIZE - (addr % FLASH_SIM_PAGE_SIZE);
+    if (n > length)
+    {
+      n = length;
+    }
+    for (i = 0; i < n; i++)
+    {
+      /* NOR: programming can only clear bits */
+      if ((SimMemory[addr + i] & buffer[i]) != buffer[i])
+      {
+        SimStats.violations++;
+      }
+      SimMemory[addr + i] &= buffer[i];
+    }
+    SimStats.programs++;
+    SimStats.program_bytes += n;
+    SimStats.time_ns += FlashSim_BusTime(4U + n) + FLASH_SIM_PAGE_PROG_NS;
+    buffer += n;
+    addr += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+ * @brief  Erase a 4 KB aligned range with the largest aligned erases, as
+ *         W25Q128_erase_range
+ * @param  addr: first byte
+ * @param  length: bytes
+ * @retval 0, or -1 if not aligned or past the end of the chip
+ */
+int FlashSim_Erase(uint32_t addr, uint32_t length)
+{
+  uint32_t size, sector;
+  uint64_t time;
+
+  if ((((addr | length) % FLASH_SIM_SECTOR_SIZE) != 0) || (addr > FLASH_SIM_SIZE) ||
+      (length > FLASH_SIM_SIZE - addr))
+  {
+    return -1;
+  }
+  while (length > 0)
+  {
+    if (((addr % 0x10000U) == 0) && (length >= 0x10000U))
+    {
+      size = 0x10000U;
+      time = FLASH_SIM_ERASE_64K_NS;
+    }
+    else if (((addr % 0x8000U) == 0) && (length >= 0x8000U))
+    {
+      size = 0x8000U;
+      time = FLASH_SIM_ERASE_32K_NS;
+    }
+    else
+    {
+      size = FLASH_SIM_SECTOR_SIZE;
+      time = FLASH_SIM_ERASE_4K_NS;
+    }
+    memset(&SimMemory[addr], 0xFF, size);
+    for (sector = addr / FLASH_SIM_SECTOR_SIZE; sector < (addr + size) / FLASH_SIM_SECTOR_SIZE; sector++)
+    {
+      SimWear[sector]++;
+    }
+    SimStats.erases++;
+    SimStats.erase_bytes += size;
+    SimStats.time_ns += FlashSim_BusTime(4U) + time;
+    addr += size;
+    length -= size;
+  }
+  return 0;
+}
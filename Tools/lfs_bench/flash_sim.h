@@ -0,0 +1,60 @@
+/**
+ ******************************************************************************
+ * @file    Tools/lfs_bench/flash_sim.h
+ * @brief   Host model of the W25Q128 behind the LittleFS adapter: NOR
+ *          semantics (program only clears bits, erase sets them), the erase
+ *          sizes the driver plans with, operation counters and a timing
+ *          model of the 42 MHz SPI bus and the chip's typical erase and
+ *          program times.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FLASH_SIM_H
+#define __FLASH_SIM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported constants --------------------------------------------------------*/
+#define FLASH_SIM_SIZE        ((uint32_t)0x1000000) /* 16 MB, W25Q128 */
+#define FLASH_SIM_PAGE_SIZE   ((uint32_t)256)
+#define FLASH_SIM_SECTOR_SIZE ((uint32_t)4096)
+
+/* Timing, W25Q128 datasheet typical values and the bootloader's SPI1 */
+#define FLASH_SIM_SPI_HZ        42000000U /* APB2 84 MHz / 2 */
+#define FLASH_SIM_COMMAND_NS    2000U     /* Driver and HAL overhead per command */
+#define FLASH_SIM_PAGE_PROG_NS  700000U   /* tPP */
+#define FLASH_SIM_ERASE_4K_NS   45000000U /* tSE */
+#define FLASH_SIM_ERASE_32K_NS  120000000U
+#define FLASH_SIM_ERASE_64K_NS  150000000U
+
+/* Exported types ------------------------------------------------------------*/
+/**
+ * @brief  Operation counters, reset with FlashSim_ResetStats
+ */
+typedef struct
+{
+  uint64_t time_ns;      /* Simulated time on the bus and waiting for the chip */
+  uint32_t reads;        /* Read commands */
+  uint64_t read_bytes;
+  uint32_t programs;     /* Page program commands */
+  uint64_t program_bytes;
+  uint32_t erases;       /* Erase commands of any size */
+  uint64_t erase_bytes;
+  uint32_t violations;   /* Programs over bits that were not erased */
+} FlashSim_StatsTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+int FlashSim_Init(const char *image);
+int FlashSim_Save(void);
+void FlashSim_Free(void);
+void FlashSim_ResetStats(void);
+const FlashSim_StatsTypeDef *FlashSim_Stats(void);
+uint32_t FlashSim_MaxWear(void);
+
+int FlashSim_Read(uint32_t addr, uint8_t *buffer, uint32_t length);
+int FlashSim_Program(uint32_t addr, const uint8_t *buffer, uint32_t length);
+int FlashSim_Erase(uint32_t addr, uint32_t length);
+
+#endif /* __FLASH_SIM_H */
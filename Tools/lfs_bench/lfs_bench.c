@@ -0,0 +1,493 @@
+/**
+ ******************************************************************************
+ * @file    Tools/lfs_bench/lfs_bench.c
+ * @brief   Host benchmarks of LittleFS on a simulated W25Q128, to compare
+ *          lfs_config settings on the bootloader's own workloads: mount,
+ *          storing and reading an image, listing the stored images and an
+ *          append-heavy log. Times are simulated from the flash model, not
+ *          measured on the host, so runs are repeatable.
+ *
+ *          make && ./lfs_bench                  target configuration
+ *          ./lfs_bench --cache 1024 --lookahead 64
+ *          ./lfs_bench --sweep                  one setting at a time
+ *          ./lfs_bench --image flash.bin        keep the chip in a file
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "flash_sim.h"
+#include "lfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Private define ------------------------------------------------------------*/
+/* Same as User/lfs_spi_flash_adapter.h */
+#define BENCH_READ_SIZE     1
+#define BENCH_PROG_SIZE     256
+#define BENCH_RESERVED_SIZE 0x10000 /* Scratch block at the end of the chip */
+
+#define BENCH_IMAGE_SIZE    (384 * 1024) /* Application image */
+#define BENCH_CHUNK_SIZE    4096         /* Copy buffer of tf_copy and the menu */
+#define BENCH_CATALOG_FILES 24
+#define BENCH_CATALOG_SIZE  8192
+#define BENCH_LOG_RECORDS   1000
+#define BENCH_LOG_RECORD    64
+
+/* Private types -------------------------------------------------------------*/
+typedef struct
+{
+  lfs_size_t block_size;
+  lfs_size_t cache_size;
+  lfs_size_t lookahead_size;
+  int32_t block_cycles;
+} BenchConfigTypeDef;
+
+typedef struct
+{
+  const char *name;
+  int (*run)(lfs_t *lfs);
+} BenchScenarioTypeDef;
+
+/* Private variables ---------------------------------------------------------*/
+static uint8_t BenchBuffer[BENCH_CHUNK_SIZE];
+
+/* Private function prototypes -----------------------------------------------*/
+static int Bench_Format(lfs_t *lfs);
+static int Bench_StoreImage(lfs_t *lfs);
+static int Bench_ReadImage(lfs_t *lfs);
+static int Bench_ReplaceImage(lfs_t *lfs);
+static int Bench_Catalog(lfs_t *lfs);
+static int Bench_Log(lfs_t *lfs);
+static int Bench_Remount(lfs_t *lfs);
+
+static const BenchScenarioTypeDef BenchScenarios[] = {
+    {"format+mount", Bench_Format},
+    {"image store", Bench_StoreImage},
+    {"image read", Bench_ReadImage},
+    {"catalog list", Bench_Catalog},
+    {"log append", Bench_Log},
+    {"image replace", Bench_ReplaceImage},
+    {"remount", Bench_Remount},
+};
+#define BENCH_SCENARIOS (sizeof(BenchScenarios) / sizeof(BenchScenarios[0]))
+
+/* Target configuration, User/lfs_spi_flash_adapter.c */
+static const BenchConfigTypeDef BenchTarget = {4096, 4096, 512, 500};
+
+/* Private functions ---------------------------------------------------------*/
+
+/* Block device on the flash model, as the adapter maps blocks */
+static int Bench_BdRead(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer,
+                        lfs_size_t size)
+{
+  return (FlashSim_Read(block * c->block_size + off, buffer, size) == 0) ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int Bench_BdProg(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                        lfs_size_t size)
+{
+  return (FlashSim_Program(block * c->block_size + off, buffer, size) == 0) ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int Bench_BdErase(const struct lfs_config *c, lfs_block_t block)
+{
+  return (FlashSim_Erase(block * c->block_size, c->block_size) == 0) ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int Bench_BdSync(const struct lfs_config *c)
+{
+  (void)c;
+  return LFS_ERR_OK;
+}
+
+/**
+ * @brief  Fill a buffer with a pattern that depends on the file offset
+ * @param  buffer: destination
+ * @param  length: bytes
+ * @param  offset: file offset of buffer[0]
+ * @param  seed: varies the pattern between files and versions
+ * @retval None
+ */
+static void Bench_Pattern(uint8_t *buffer, uint32_t length, uint32_t offset, uint32_t seed)
+{
+  uint32_t i;
+
+  for (i = 0; i < length; i++)
+  {
+    buffer[i] = (uint8_t)(((offset + i) * 2654435761U + seed) >> 13);
+  }
+}
+
+/**
+ * @brief  Write a whole file in BENCH_CHUNK_SIZE writes
+ * @param  lfs: mounted file system
+ * @param  path: file
+ * @param  size: bytes
+ * @param  seed: pattern seed
+ * @retval LFS_ERR_OK or an lfs error
+ */
+static int Bench_WriteFile(lfs_t *lfs, const char *path, uint32_t size, uint32_t seed)
+{
+  lfs_file_t file;
+  uint32_t offset, n;
+  int err;
+
+  err = lfs_file_open(lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  for (offset = 0; (err >= 0) && (offset < size); offset += n)
+  {
+    n = (size - offset > BENCH_CHUNK_SIZE) ? BENCH_CHUNK_SIZE : size - offset;
+    Bench_Pattern(BenchBuffer, n, offset, seed);
+    err = lfs_file_write(lfs, &file, BenchBuffer, n);
+  }
+  if (err >= 0)
+  {
+    err = lfs_file_close(lfs, &file);
+  }
+  return (err < 0) ? err : LFS_ERR_OK;
+}
+
+static int Bench_Format(lfs_t *lfs)
+{
+  int err = lfs_format(lfs, lfs->cfg);
+
+  return (err != LFS_ERR_OK) ? err : lfs_mount(lfs, lfs->cfg);
+}
+
+static int Bench_StoreImage(lfs_t *lfs)
+{
+  return Bench_WriteFile(lfs, "/app.bin", BENCH_IMAGE_SIZE, 1);
+}
+
+static int Bench_ReplaceImage(lfs_t *lfs)
+{
+  return Bench_WriteFile(lfs, "/app.bin", BENCH_IMAGE_SIZE, 2);
+}
+
+static int Bench_ReadImage(lfs_t *lfs)
+{
+  static uint8_t expected[BENCH_CHUNK_SIZE];
+  lfs_file_t file;
+  uint32_t offset;
+  int err;
+
+  err = lfs_file_open(lfs, &file, "/app.bin", LFS_O_RDONLY);
+  for (offset = 0; (err >= 0) && (offset < BENCH_IMAGE_SIZE); offset += BENCH_CHUNK_SIZE)
+  {
+    err = lfs_file_read(lfs, &file, BenchBuffer, BENCH_CHUNK_SIZE);
+    Bench_Pattern(expected, BENCH_CHUNK_SIZE, offset, 1);
+    if ((err >= 0) && ((err != BENCH_CHUNK_SIZE) || (memcmp(BenchBuffer, expected, BENCH_CHUNK_SIZE) != 0)))
+    {
+      err = LFS_ERR_CORRUPT;
+    }
+  }
+  if (err >= 0)
+  {
+    err = lfs_file_close(lfs, &file);
+  }
+  return (err < 0) ? err : LFS_ERR_OK;
+}
+
+/**
+ * @brief  List the root and stat every entry, as ShowStoredImages. The files
+ *         are created first, outside the measurement.
+ */
+static int Bench_Catalog(lfs_t *lfs)
+{
+  struct lfs_info info, stat;
+  char path[LFS_NAME_MAX + 2];
+  lfs_dir_t dir;
+  uint32_t i;
+  int err = LFS_ERR_OK;
+
+  for (i = 0; (err == LFS_ERR_OK) && (i < BENCH_CATALOG_FILES); i++)
+  {
+    snprintf(path, sizeof(path), "/img_%02u.bin", (unsigned)i);
+    err = Bench_WriteFile(lfs, path, BENCH_CATALOG_SIZE, 100 + i);
+  }
+  if (err != LFS_ERR_OK)
+  {
+    return err;
+  }
+
+  FlashSim_ResetStats();
+  err = lfs_dir_open(lfs, &dir, "/");
+  while ((err >= 0) && ((err = lfs_dir_read(lfs, &dir, &info)) > 0))
+  {
+    if (info.type == LFS_TYPE_REG)
+    {
+      snprintf(path, sizeof(path), "/%s", info.name);
+      err = lfs_stat(lfs, path, &stat);
+    }
+  }
+  if (err >= 0)
+  {
+    err = lfs_dir_close(lfs, &dir);
+  }
+  return (err < 0) ? err : LFS_ERR_OK;
+}
+
+/**
+ * @brief  Open, append a record and close, once per record
+ */
+static int Bench_Log(lfs_t *lfs)
+{
+  lfs_file_t file;
+  uint32_t i;
+  int err = LFS_ERR_OK;
+
+  for (i = 0; (err >= 0) && (i < BENCH_LOG_RECORDS); i++)
+  {
+    err = lfs_file_open(lfs, &file, "/boot.log", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+    if (err >= 0)
+    {
+      Bench_Pattern(BenchBuffer, BENCH_LOG_RECORD, i * BENCH_LOG_RECORD, 7);
+      err = lfs_file_write(lfs, &file, BenchBuffer, BENCH_LOG_RECORD);
+      if (err >= 0)
+      {
+        err = lfs_file_close(lfs, &file);
+      }
+    }
+  }
+  return (err < 0) ? err : LFS_ERR_OK;
+}
+
+static int Bench_Remount(lfs_t *lfs)
+{
+  int err = lfs_unmount(lfs);
+
+  return (err != LFS_ERR_OK) ? err : lfs_mount(lfs, lfs->cfg);
+}
+
+/**
+ * @brief  Check a configuration against the limits of lfs and the chip
+ * @param  config: configuration
+ * @retval 0 if usable
+ */
+static int Bench_Check(const BenchConfigTypeDef *config)
+{
+  return (config->block_size < FLASH_SIM_SECTOR_SIZE) || (config->block_size % FLASH_SIM_SECTOR_SIZE) ||
+         (config->cache_size < BENCH_PROG_SIZE) || (config->cache_size % BENCH_PROG_SIZE) ||
+         (config->block_size % config->cache_size) || (config->lookahead_size == 0) ||
+         (config->lookahead_size % 8);
+}
+
+/**
+ * @brief  Run every scenario on a freshly erased chip
+ * @param  config: configuration
+ * @param  results: per scenario counters
+ * @param  wear: highest erase count of a sector in one scenario
+ * @retval LFS_ERR_OK or the error of the first scenario that failed
+ */
+static int Bench_Run(const BenchConfigTypeDef *config, FlashSim_StatsTypeDef *results, uint32_t *wear)
+{
+  struct lfs_config cfg;
+  lfs_t lfs;
+  uint32_t i, total_wear;
+  int err = LFS_ERR_OK;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.read = Bench_BdRead;
+  cfg.prog = Bench_BdProg;
+  cfg.erase = Bench_BdErase;
+  cfg.sync = Bench_BdSync;
+  cfg.read_size = BENCH_READ_SIZE;
+  cfg.prog_size = BENCH_PROG_SIZE;
+  cfg.block_size = config->block_size;
+  cfg.block_count = (FLASH_SIM_SIZE - BENCH_RESERVED_SIZE) / config->block_size;
+  cfg.cache_size = config->cache_size;
+  cfg.lookahead_size = config->lookahead_size;
+  cfg.block_cycles = config->block_cycles;
+  /* lfs_format needs cfg before the scenario mounts it */
+  lfs.cfg = &cfg;
+
+  FlashSim_Erase(0, FLASH_SIM_SIZE);
+  FlashSim_ResetStats();
+  total_wear = 0;
+  for (i = 0; (err == LFS_ERR_OK) && (i < BENCH_SCENARIOS); i++)
+  {
+    FlashSim_ResetStats();
+    err = BenchScenarios[i].run(&lfs);
+    results[i] = *FlashSim_Stats();
+    if (FlashSim_MaxWear() > total_wear)
+    {
+      total_wear = FlashSim_MaxWear();
+    }
+  }
+  if (err == LFS_ERR_OK)
+  {
+    lfs_unmount(&lfs);
+  }
+  *wear = total_wear;
+  return err;
+}
+
+/**
+ * @brief  Print one line describing a configuration
+ */
+static void Bench_ShowConfig(const BenchConfigTypeDef *config)
+{
+  printf("block_size=%u cache_size=%u lookahead_size=%u block_cycles=%d\n", (unsigned)config->block_size,
+         (unsigned)config->cache_size, (unsigned)config->lookahead_size, (int)config->block_cycles);
+}
+
+/**
+ * @brief  Run one configuration and print a line per scenario
+ */
+static int Bench_Report(const BenchConfigTypeDef *config)
+{
+  FlashSim_StatsTypeDef results[BENCH_SCENARIOS];
+  uint32_t i, wear;
+  int err;
+
+  Bench_ShowConfig(config);
+  err = Bench_Run(config, results, &wear);
+  printf("%-14s %10s %8s %9s %8s %9s %7s\n", "scenario", "sim ms", "reads", "read KB", "progs", "prog KB",
+         "erases");
+  for (i = 0; i < BENCH_SCENARIOS; i++)
+  {
+    if ((err != LFS_ERR_OK) && (results[i].time_ns == 0) && (i > 0))
+    {
+      break;
+    }
+    printf("%-14s %10.1f %8u %9.1f %8u %9.1f %7u\n", BenchScenarios[i].name, results[i].time_ns / 1e6,
+           (unsigned)results[i].reads, results[i].read_bytes / 1024.0, (unsigned)results[i].programs,
+           results[i].program_bytes / 1024.0, (unsigned)results[i].erases);
+    if (results[i].violations != 0)
+    {
+      printf("  %u programs over bits that were not erased\n", (unsigned)results[i].violations);
+    }
+  }
+  printf("highest erase count of a sector in one scenario: %u\n", (unsigned)wear);
+  if (err != LFS_ERR_OK)
+  {
+    printf("FAILED: lfs error %d\n", err);
+  }
+  return err;
+}
+
+/**
+ * @brief  Vary one setting at a time from the target configuration and
+ *         print the simulated time of every scenario
+ */
+static int Bench_Sweep(void)
+{
+  static const lfs_size_t caches[] = {256, 512, 1024, 2048, 4096};
+  static const lfs_size_t lookaheads[] = {16, 64, 256, 512};
+  static const int32_t cycles[] = {100, 500, 1000, -1};
+  static const lfs_size_t blocks[] = {4096, 8192, 16384};
+  BenchConfigTypeDef configs[32];
+  FlashSim_StatsTypeDef results[BENCH_SCENARIOS];
+  uint32_t count = 0, i, j, wear;
+  int err, failed = 0;
+
+  for (i = 0; i < sizeof(caches) / sizeof(caches[0]); i++)
+  {
+    configs[count] = BenchTarget;
+    configs[count++].cache_size = caches[i];
+  }
+  for (i = 0; i < sizeof(lookaheads) / sizeof(lookaheads[0]); i++)
+  {
+    configs[count] = BenchTarget;
+    configs[count++].lookahead_size = lookaheads[i];
+  }
+  for (i = 0; i < sizeof(cycles) / sizeof(cycles[0]); i++)
+  {
+    configs[count] = BenchTarget;
+    configs[count++].block_cycles = cycles[i];
+  }
+  for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+  {
+    configs[count] = BenchTarget;
+    configs[count++].block_size = blocks[i];
+  }
+
+  printf("simulated ms per scenario, target: ");
+  Bench_ShowConfig(&BenchTarget);
+  printf("%6s %5s %5s %6s", "block", "cache", "look", "cycles");
+  for (j = 0; j < BENCH_SCENARIOS; j++)
+  {
+    printf(" %13s", BenchScenarios[j].name);
+  }
+  printf(" %5s\n", "wear");
+  for (i = 0; i < count; i++)
+  {
+    printf("%6u %5u %5u %6d", (unsigned)configs[i].block_size, (unsigned)configs[i].cache_size,
+           (unsigned)configs[i].lookahead_size, (int)configs[i].block_cycles);
+    memset(results, 0, sizeof(results));
+    err = Bench_Run(&configs[i], results, &wear);
+    for (j = 0; j < BENCH_SCENARIOS; j++)
+    {
+      printf(" %13.1f", results[j].time_ns / 1e6);
+    }
+    printf(" %5u%s\n", (unsigned)wear, (err != LFS_ERR_OK) ? " FAILED" : "");
+    failed |= (err != LFS_ERR_OK);
+  }
+  return failed ? -1 : 0;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+  BenchConfigTypeDef config = BenchTarget;
+  const char *image = NULL;
+  int sweep = 0, i, err;
+
+  for (i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "--sweep") == 0))
+    {
+      sweep = 1;
+    }
+    else if ((i + 1 < argc) && (strcmp(argv[i], "--cache") == 0))
+    {
+      config.cache_size = (lfs_size_t)strtoul(argv[++i], NULL, 0);
+    }
+    else if ((i + 1 < argc) && (strcmp(argv[i], "--lookahead") == 0))
+    {
+      config.lookahead_size = (lfs_size_t)strtoul(argv[++i], NULL, 0);
+    }
+    else if ((i + 1 < argc) && (strcmp(argv[i], "--block-cycles") == 0))
+    {
+      config.block_cycles = (int32_t)strtol(argv[++i], NULL, 0);
+    }
+    else if ((i + 1 < argc) && (strcmp(argv[i], "--block-size") == 0))
+    {
+      config.block_size = (lfs_size_t)strtoul(argv[++i], NULL, 0);
+    }
+    else if ((i + 1 < argc) && (strcmp(argv[i], "--image") == 0))
+    {
+      image = argv[++i];
+    }
+    else
+    {
+      fprintf(stderr,
+              "usage: %s [--cache N] [--lookahead N] [--block-cycles N] [--block-size N] [--image FILE] "
+              "[--sweep]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (Bench_Check(&config) != 0)
+  {
+    fprintf(stderr, "block_size must be a multiple of 4096 and of cache_size, cache_size a multiple of %u, "
+                    "lookahead_size a multiple of 8\n",
+            (unsigned)BENCH_PROG_SIZE);
+    return 2;
+  }
+  if (FlashSim_Init(image) != 0)
+  {
+    fprintf(stderr, "cannot set up the simulated flash\n");
+    return 1;
+  }
+
+  err = sweep ? Bench_Sweep() : Bench_Report(&config);
+  if (FlashSim_Save() != 0)
+  {
+    fprintf(stderr, "cannot write %s\n", image);
+    err = -1;
+  }
+  FlashSim_Free();
+  return (err != 0) ? 1 : 0;
+}
@@ -2,6 +2,9 @@
 
 This is an implementation of the AES algorithm, specifically ECB, CTR and CBC mode.
 Block size can be chosen in aes.h - available choices are AES128, AES192, AES256.
+AES_TTABLE in aes.h selects the 32 bit T-table core, the original byte oriented
+core is kept for AES_TTABLE 0. AES_self_test runs the FIPS-197 and SP 800-38A
+known answer tests on whichever core is built.
 
 The implementation is verified against the test vectors in:
   National Institute of Standards and Technology Special Publication 800-38A 2001 ED
@@ -37,8 +40,11 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
 #include "fatfs.h"  // For file operations
 #include "file_opera.h" // For file operation utilities
+#include "io_arena.h" // Block buffers of the file functions
+#endif
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -132,6 +138,110 @@ static const uint8_t Rcon[11] = {
  *  up to rcon[8] for AES-192, up to rcon[7] for AES-256. rcon[0] is not used in AES algorithm."
  */
 
+#if defined(AES_TTABLE) && (AES_TTABLE == 1)
+// T-tables for little endian words: Te0[x] is the MixColumns column of
+// sbox[x] in row 0 and Td0[x] the InvMixColumns column of rsbox[x]. The other
+// rows are the same words rotated, which costs nothing on the Cortex-M4.
+static const uint32_t Te0_rom[256] = {
+  0xa56363c6, 0x847c7cf8, 0x997777ee, 0x8d7b7bf6, 0x0df2f2ff, 0xbd6b6bd6, 0xb16f6fde, 0x54c5c591,
+  0x50303060, 0x03010102, 0xa96767ce, 0x7d2b2b56, 0x19fefee7, 0x62d7d7b5, 0xe6abab4d, 0x9a7676ec,
+  0x45caca8f, 0x9d82821f, 0x40c9c989, 0x877d7dfa, 0x15fafaef, 0xeb5959b2, 0xc947478e, 0x0bf0f0fb,
+  0xecadad41, 0x67d4d4b3, 0xfda2a25f, 0xeaafaf45, 0xbf9c9c23, 0xf7a4a453, 0x967272e4, 0x5bc0c09b,
+  0xc2b7b775, 0x1cfdfde1, 0xae93933d, 0x6a26264c, 0x5a36366c, 0x413f3f7e, 0x02f7f7f5, 0x4fcccc83,
+  0x5c343468, 0xf4a5a551, 0x34e5e5d1, 0x08f1f1f9, 0x937171e2, 0x73d8d8ab, 0x53313162, 0x3f15152a,
+  0x0c040408, 0x52c7c795, 0x65232346, 0x5ec3c39d, 0x28181830, 0xa1969637, 0x0f05050a, 0xb59a9a2f,
+  0x0907070e, 0x36121224, 0x9b80801b, 0x3de2e2df, 0x26ebebcd, 0x6927274e, 0xcdb2b27f, 0x9f7575ea,
+  0x1b090912, 0x9e83831d, 0x742c2c58, 0x2e1a1a34, 0x2d1b1b36, 0xb26e6edc, 0xee5a5ab4, 0xfba0a05b,
+  0xf65252a4, 0x4d3b3b76, 0x61d6d6b7, 0xceb3b37d, 0x7b292952, 0x3ee3e3dd, 0x712f2f5e, 0x97848413,
+  0xf55353a6, 0x68d1d1b9, 0x00000000, 0x2cededc1, 0x60202040, 0x1ffcfce3, 0xc8b1b179, 0xed5b5bb6,
+  0xbe6a6ad4, 0x46cbcb8d, 0xd9bebe67, 0x4b393972, 0xde4a4a94, 0xd44c4c98, 0xe85858b0, 0x4acfcf85,
+  0x6bd0d0bb, 0x2aefefc5, 0xe5aaaa4f, 0x16fbfbed, 0xc5434386, 0xd74d4d9a, 0x55333366, 0x94858511,
+  0xcf45458a, 0x10f9f9e9, 0x06020204, 0x817f7ffe, 0xf05050a0, 0x443c3c78, 0xba9f9f25, 0xe3a8a84b,
+  0xf35151a2, 0xfea3a35d, 0xc0404080, 0x8a8f8f05, 0xad92923f, 0xbc9d9d21, 0x48383870, 0x04f5f5f1,
+  0xdfbcbc63, 0xc1b6b677, 0x75dadaaf, 0x63212142, 0x30101020, 0x1affffe5, 0x0ef3f3fd, 0x6dd2d2bf,
+  0x4ccdcd81, 0x140c0c18, 0x35131326, 0x2fececc3, 0xe15f5fbe, 0xa2979735, 0xcc444488, 0x3917172e,
+  0x57c4c493, 0xf2a7a755, 0x827e7efc, 0x473d3d7a, 0xac6464c8, 0xe75d5dba, 0x2b191932, 0x957373e6,
+  0xa06060c0, 0x98818119, 0xd14f4f9e, 0x7fdcdca3, 0x66222244, 0x7e2a2a54, 0xab90903b, 0x8388880b,
+  0xca46468c, 0x29eeeec7, 0xd3b8b86b, 0x3c141428, 0x79dedea7, 0xe25e5ebc, 0x1d0b0b16, 0x76dbdbad,
+  0x3be0e0db, 0x56323264, 0x4e3a3a74, 0x1e0a0a14, 0xdb494992, 0x0a06060c, 0x6c242448, 0xe45c5cb8,
+  0x5dc2c29f, 0x6ed3d3bd, 0xefacac43, 0xa66262c4, 0xa8919139, 0xa4959531, 0x37e4e4d3, 0x8b7979f2,
+  0x32e7e7d5, 0x43c8c88b, 0x5937376e, 0xb76d6dda, 0x8c8d8d01, 0x64d5d5b1, 0xd24e4e9c, 0xe0a9a949,
+  0xb46c6cd8, 0xfa5656ac, 0x07f4f4f3, 0x25eaeacf, 0xaf6565ca, 0x8e7a7af4, 0xe9aeae47, 0x18080810,
+  0xd5baba6f, 0x887878f0, 0x6f25254a, 0x722e2e5c, 0x241c1c38, 0xf1a6a657, 0xc7b4b473, 0x51c6c697,
+  0x23e8e8cb, 0x7cdddda1, 0x9c7474e8, 0x211f1f3e, 0xdd4b4b96, 0xdcbdbd61, 0x868b8b0d, 0x858a8a0f,
+  0x907070e0, 0x423e3e7c, 0xc4b5b571, 0xaa6666cc, 0xd8484890, 0x05030306, 0x01f6f6f7, 0x120e0e1c,
+  0xa36161c2, 0x5f35356a, 0xf95757ae, 0xd0b9b969, 0x91868617, 0x58c1c199, 0x271d1d3a, 0xb99e9e27,
+  0x38e1e1d9, 0x13f8f8eb, 0xb398982b, 0x33111122, 0xbb6969d2, 0x70d9d9a9, 0x898e8e07, 0xa7949433,
+  0xb69b9b2d, 0x221e1e3c, 0x92878715, 0x20e9e9c9, 0x49cece87, 0xff5555aa, 0x78282850, 0x7adfdfa5,
+  0x8f8c8c03, 0xf8a1a159, 0x80898909, 0x170d0d1a, 0xdabfbf65, 0x31e6e6d7, 0xc6424284, 0xb86868d0,
+  0xc3414182, 0xb0999929, 0x772d2d5a, 0x110f0f1e, 0xcbb0b07b, 0xfc5454a8, 0xd6bbbb6d, 0x3a16162c
+};
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+static const uint32_t Td0_rom[256] = {
+  0x50a7f451, 0x5365417e, 0xc3a4171a, 0x965e273a, 0xcb6bab3b, 0xf1459d1f, 0xab58faac, 0x9303e34b,
+  0x55fa3020, 0xf66d76ad, 0x9176cc88, 0x254c02f5, 0xfcd7e54f, 0xd7cb2ac5, 0x80443526, 0x8fa362b5,
+  0x495ab1de, 0x671bba25, 0x980eea45, 0xe1c0fe5d, 0x02752fc3, 0x12f04c81, 0xa397468d, 0xc6f9d36b,
+  0xe75f8f03, 0x959c9215, 0xeb7a6dbf, 0xda595295, 0x2d83bed4, 0xd3217458, 0x2969e049, 0x44c8c98e,
+  0x6a89c275, 0x78798ef4, 0x6b3e5899, 0xdd71b927, 0xb64fe1be, 0x17ad88f0, 0x66ac20c9, 0xb43ace7d,
+  0x184adf63, 0x82311ae5, 0x60335197, 0x457f5362, 0xe07764b1, 0x84ae6bbb, 0x1ca081fe, 0x942b08f9,
+  0x58684870, 0x19fd458f, 0x876cde94, 0xb7f87b52, 0x23d373ab, 0xe2024b72, 0x578f1fe3, 0x2aab5566,
+  0x0728ebb2, 0x03c2b52f, 0x9a7bc586, 0xa50837d3, 0xf2872830, 0xb2a5bf23, 0xba6a0302, 0x5c8216ed,
+  0x2b1ccf8a, 0x92b479a7, 0xf0f207f3, 0xa1e2694e, 0xcdf4da65, 0xd5be0506, 0x1f6234d1, 0x8afea6c4,
+  0x9d532e34, 0xa055f3a2, 0x32e18a05, 0x75ebf6a4, 0x39ec830b, 0xaaef6040, 0x069f715e, 0x51106ebd,
+  0xf98a213e, 0x3d06dd96, 0xae053edd, 0x46bde64d, 0xb58d5491, 0x055dc471, 0x6fd40604, 0xff155060,
+  0x24fb9819, 0x97e9bdd6, 0xcc434089, 0x779ed967, 0xbd42e8b0, 0x888b8907, 0x385b19e7, 0xdbeec879,
+  0x470a7ca1, 0xe90f427c, 0xc91e84f8, 0x00000000, 0x83868009, 0x48ed2b32, 0xac70111e, 0x4e725a6c,
+  0xfbff0efd, 0x5638850f, 0x1ed5ae3d, 0x27392d36, 0x64d90f0a, 0x21a65c68, 0xd1545b9b, 0x3a2e3624,
+  0xb1670a0c, 0x0fe75793, 0xd296eeb4, 0x9e919b1b, 0x4fc5c080, 0xa220dc61, 0x694b775a, 0x161a121c,
+  0x0aba93e2, 0xe52aa0c0, 0x43e0223c, 0x1d171b12, 0x0b0d090e, 0xadc78bf2, 0xb9a8b62d, 0xc8a91e14,
+  0x8519f157, 0x4c0775af, 0xbbdd99ee, 0xfd607fa3, 0x9f2601f7, 0xbcf5725c, 0xc53b6644, 0x347efb5b,
+  0x7629438b, 0xdcc623cb, 0x68fcedb6, 0x63f1e4b8, 0xcadc31d7, 0x10856342, 0x40229713, 0x2011c684,
+  0x7d244a85, 0xf83dbbd2, 0x1132f9ae, 0x6da129c7, 0x4b2f9e1d, 0xf330b2dc, 0xec52860d, 0xd0e3c177,
+  0x6c16b32b, 0x99b970a9, 0xfa489411, 0x2264e947, 0xc48cfca8, 0x1a3ff0a0, 0xd82c7d56, 0xef903322,
+  0xc74e4987, 0xc1d138d9, 0xfea2ca8c, 0x360bd498, 0xcf81f5a6, 0x28de7aa5, 0x268eb7da, 0xa4bfad3f,
+  0xe49d3a2c, 0x0d927850, 0x9bcc5f6a, 0x62467e54, 0xc2138df6, 0xe8b8d890, 0x5ef7392e, 0xf5afc382,
+  0xbe805d9f, 0x7c93d069, 0xa92dd56f, 0xb31225cf, 0x3b99acc8, 0xa77d1810, 0x6e639ce8, 0x7bbb3bdb,
+  0x097826cd, 0xf418596e, 0x01b79aec, 0xa89a4f83, 0x656e95e6, 0x7ee6ffaa, 0x08cfbc21, 0xe6e815ef,
+  0xd99be7ba, 0xce366f4a, 0xd4099fea, 0xd67cb029, 0xafb2a431, 0x31233f2a, 0x3094a5c6, 0xc066a235,
+  0x37bc4e74, 0xa6ca82fc, 0xb0d090e0, 0x15d8a733, 0x4a9804f1, 0xf7daec41, 0x0e50cd7f, 0x2ff69117,
+  0x8dd64d76, 0x4db0ef43, 0x544daacc, 0xdf0496e4, 0xe3b5d19e, 0x1b886a4c, 0xb81f2cc1, 0x7f516546,
+  0x04ea5e9d, 0x5d358c01, 0x737487fa, 0x2e410bfb, 0x5a1d67b3, 0x52d2db92, 0x335610e9, 0x1347d66d,
+  0x8c61d79a, 0x7a0ca137, 0x8e14f859, 0x893c13eb, 0xee27a9ce, 0x35c961b7, 0xede51ce1, 0x3cb1477a,
+  0x59dfd29c, 0x3f73f255, 0x79ce1418, 0xbf37c773, 0xeacdf753, 0x5baafd5f, 0x146f3ddf, 0x86db4478,
+  0x81f3afca, 0x3ec468b9, 0x2c342438, 0x5f40a3c2, 0x72c31d16, 0x0c25e2bc, 0x8b493c28, 0x41950dff,
+  0x7101a839, 0xdeb30c08, 0x9ce4b4d8, 0x90c15664, 0x6184cb7b, 0x70b632d5, 0x745c6c48, 0x4257b8d0
+};
+#endif
+
+#if defined(AES_TABLES_IN_CCM) && (AES_TABLES_IN_CCM == 1)
+// Zero initialised copies in the CCM RAM, filled by InitTables. The CCM is
+// not reachable by DMA, which never needs these.
+#if defined(__CC_ARM)
+static uint32_t Te0[256] __attribute__((at(0x10000000), zero_init));
+static uint32_t Td0[256] __attribute__((at(0x10000400), zero_init));
+#else
+static uint32_t Te0[256] __attribute__((section(".ccmram")));
+static uint32_t Td0[256] __attribute__((section(".ccmram")));
+#endif
+static uint8_t TablesReady = 0;
+#else
+#define Te0 Te0_rom
+#define Td0 Td0_rom
+#endif
+
+// Schedules of the last key set up. The bootloader uses one image key, so
+// every stream after the first one starts with a copy instead of expanding
+// the key and running InvMixColumns over the decryption schedule again.
+static struct
+{
+  uint8_t Valid;
+  uint8_t Key[AES_KEYLEN];
+  uint32_t RoundKey[Nb * (Nr + 1)];
+  uint32_t InvRoundKey[Nb * (Nr + 1)];
+} KeyCache;
+#endif // #if defined(AES_TTABLE) && (AES_TTABLE == 1)
+
 
 /*****************************************************************************/
 /* Private functions:                                                        */
@@ -144,6 +254,203 @@ static uint8_t getSBoxValue(uint8_t num)
 */
 #define getSBoxValue(num) (sbox[(num)])
 
+#if defined(AES_TTABLE) && (AES_TTABLE == 1)
+
+// Unaligned little endian word access, the buffers come from the callers
+#if defined(__CC_ARM)
+#define GETU32(p)    (*(const __packed uint32_t*)(p))
+#define PUTU32(p, v) (*(__packed uint32_t*)(p) = (v))
+#define ROR32(x, n)  __ror((x), (n))
+#else
+static uint32_t GETU32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+#define PUTU32(p, v) do { uint32_t v_ = (v); memcpy((p), &v_, 4); } while (0)
+#define ROR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#endif
+
+#define SBOX_WORD(w) ((uint32_t)getSBoxValue((w) & 0xff) | ((uint32_t)getSBoxValue(((w) >> 8) & 0xff) << 8) | \
+                      ((uint32_t)getSBoxValue(((w) >> 16) & 0xff) << 16) | ((uint32_t)getSBoxValue((w) >> 24) << 24))
+
+#if defined(AES_TABLES_IN_CCM) && (AES_TABLES_IN_CCM == 1)
+static void InitTables(void)
+{
+  if (!TablesReady)
+  {
+    memcpy(Te0, Te0_rom, sizeof(Te0));
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+    memcpy(Td0, Td0_rom, sizeof(Td0));
+#endif
+    TablesReady = 1;
+  }
+}
+#endif
+
+// This function produces Nb(Nr+1) round keys as little endian words, and the
+// schedule of the equivalent inverse cipher: the round keys in reverse order
+// with InvMixColumns applied to all but the first and the last one.
+static void KeyExpansion(uint32_t* RoundKey, uint32_t* InvRoundKey, const uint8_t* Key)
+{
+  unsigned i;
+  uint32_t temp;
+
+  // The first round key is the key itself.
+  for (i = 0; i < Nk; ++i)
+  {
+    RoundKey[i] = GETU32(Key + (i * 4));
+  }
+
+  // All other round keys are found from the previous round keys.
+  for (i = Nk; i < Nb * (Nr + 1); ++i)
+  {
+    temp = RoundKey[i - 1];
+    if (i % Nk == 0)
+    {
+      // RotWord() then SubWord(), the round constant goes into the first byte
+      temp = SBOX_WORD(ROR32(temp, 8)) ^ Rcon[i / Nk];
+    }
+#if defined(AES256) && (AES256 == 1)
+    else if (i % Nk == 4)
+    {
+      temp = SBOX_WORD(temp);
+    }
+#endif
+    RoundKey[i] = RoundKey[i - Nk] ^ temp;
+  }
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+  for (i = 0; i <= Nr; ++i)
+  {
+    unsigned j;
+    for (j = 0; j < Nb; ++j)
+    {
+      temp = RoundKey[((Nr - i) * Nb) + j];
+      if ((i != 0) && (i != Nr))
+      {
+        // Td0[sbox[x]] is InvMixColumns of x alone in the column
+        temp = Td0[getSBoxValue(temp & 0xff)] ^ ROR32(Td0[getSBoxValue((temp >> 8) & 0xff)], 24) ^
+               ROR32(Td0[getSBoxValue((temp >> 16) & 0xff)], 16) ^ ROR32(Td0[getSBoxValue(temp >> 24)], 8);
+      }
+      InvRoundKey[(i * Nb) + j] = temp;
+    }
+  }
+#else
+  (void)InvRoundKey;
+#endif
+}
+
+static void SetupKey(struct AES_ctx* ctx, const uint8_t* key)
+{
+#if defined(AES_TABLES_IN_CCM) && (AES_TABLES_IN_CCM == 1)
+  InitTables();
+#endif
+  if (!KeyCache.Valid || (memcmp(KeyCache.Key, key, AES_KEYLEN) != 0))
+  {
+    KeyExpansion(KeyCache.RoundKey, KeyCache.InvRoundKey, key);
+    memcpy(KeyCache.Key, key, AES_KEYLEN);
+    KeyCache.Valid = 1;
+  }
+  memcpy(ctx->RoundKey, KeyCache.RoundKey, sizeof(ctx->RoundKey));
+  memcpy(ctx->InvRoundKey, KeyCache.InvRoundKey, sizeof(ctx->InvRoundKey));
+}
+
+// One T-table round: ShiftRows picks the bytes, each lookup is SubBytes and
+// MixColumns of one byte, AddRoundKey closes it.
+#define ENC_ROUND(T, S, rk)                                                                                                \
+  do {                                                                                                                     \
+    (T)[0] = Te0[(S)[0] & 0xff] ^ ROR32(Te0[((S)[1] >> 8) & 0xff], 24) ^ ROR32(Te0[((S)[2] >> 16) & 0xff], 16) ^ ROR32(Te0[(S)[3] >> 24], 8) ^ (rk)[0]; \
+    (T)[1] = Te0[(S)[1] & 0xff] ^ ROR32(Te0[((S)[2] >> 8) & 0xff], 24) ^ ROR32(Te0[((S)[3] >> 16) & 0xff], 16) ^ ROR32(Te0[(S)[0] >> 24], 8) ^ (rk)[1]; \
+    (T)[2] = Te0[(S)[2] & 0xff] ^ ROR32(Te0[((S)[3] >> 8) & 0xff], 24) ^ ROR32(Te0[((S)[0] >> 16) & 0xff], 16) ^ ROR32(Te0[(S)[1] >> 24], 8) ^ (rk)[2]; \
+    (T)[3] = Te0[(S)[3] & 0xff] ^ ROR32(Te0[((S)[0] >> 8) & 0xff], 24) ^ ROR32(Te0[((S)[1] >> 16) & 0xff], 16) ^ ROR32(Te0[(S)[2] >> 24], 8) ^ (rk)[3]; \
+  } while (0)
+
+#define DEC_ROUND(T, S, rk)                                                                                                \
+  do {                                                                                                                     \
+    (T)[0] = Td0[(S)[0] & 0xff] ^ ROR32(Td0[((S)[3] >> 8) & 0xff], 24) ^ ROR32(Td0[((S)[2] >> 16) & 0xff], 16) ^ ROR32(Td0[(S)[1] >> 24], 8) ^ (rk)[0]; \
+    (T)[1] = Td0[(S)[1] & 0xff] ^ ROR32(Td0[((S)[0] >> 8) & 0xff], 24) ^ ROR32(Td0[((S)[3] >> 16) & 0xff], 16) ^ ROR32(Td0[(S)[2] >> 24], 8) ^ (rk)[1]; \
+    (T)[2] = Td0[(S)[2] & 0xff] ^ ROR32(Td0[((S)[1] >> 8) & 0xff], 24) ^ ROR32(Td0[((S)[0] >> 16) & 0xff], 16) ^ ROR32(Td0[(S)[3] >> 24], 8) ^ (rk)[2]; \
+    (T)[3] = Td0[(S)[3] & 0xff] ^ ROR32(Td0[((S)[2] >> 8) & 0xff], 24) ^ ROR32(Td0[((S)[1] >> 16) & 0xff], 16) ^ ROR32(Td0[(S)[0] >> 24], 8) ^ (rk)[3]; \
+  } while (0)
+
+// Cipher is the main function that encrypts the PlainText.
+static void Cipher(state_t* state, const uint32_t* RoundKey)
+{
+  uint8_t* buf = (uint8_t*)state;
+  uint32_t s[4], t[4];
+  uint8_t round;
+
+  s[0] = GETU32(buf) ^ RoundKey[0];
+  s[1] = GETU32(buf + 4) ^ RoundKey[1];
+  s[2] = GETU32(buf + 8) ^ RoundKey[2];
+  s[3] = GETU32(buf + 12) ^ RoundKey[3];
+
+  // Two rounds per pass, the last round has no MixColumns
+  for (round = 1; ; round += 2)
+  {
+    ENC_ROUND(t, s, RoundKey + (round * Nb));
+    if (round + 1 == Nr)
+    {
+      break;
+    }
+    ENC_ROUND(s, t, RoundKey + ((round + 1) * Nb));
+  }
+
+  RoundKey += Nr * Nb;
+  PUTU32(buf,      ((uint32_t)getSBoxValue(t[0] & 0xff) | ((uint32_t)getSBoxValue((t[1] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxValue((t[2] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxValue(t[3] >> 24) << 24)) ^ RoundKey[0]);
+  PUTU32(buf + 4,  ((uint32_t)getSBoxValue(t[1] & 0xff) | ((uint32_t)getSBoxValue((t[2] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxValue((t[3] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxValue(t[0] >> 24) << 24)) ^ RoundKey[1]);
+  PUTU32(buf + 8,  ((uint32_t)getSBoxValue(t[2] & 0xff) | ((uint32_t)getSBoxValue((t[3] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxValue((t[0] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxValue(t[1] >> 24) << 24)) ^ RoundKey[2]);
+  PUTU32(buf + 12, ((uint32_t)getSBoxValue(t[3] & 0xff) | ((uint32_t)getSBoxValue((t[0] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxValue((t[1] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxValue(t[2] >> 24) << 24)) ^ RoundKey[3]);
+}
+
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#define getSBoxInvert(num) (rsbox[(num)])
+
+// InvCipher runs the equivalent inverse cipher on the InvRoundKey schedule.
+static void InvCipher(state_t* state, const uint32_t* InvRoundKey)
+{
+  uint8_t* buf = (uint8_t*)state;
+  uint32_t s[4], t[4];
+  uint8_t round;
+
+  s[0] = GETU32(buf) ^ InvRoundKey[0];
+  s[1] = GETU32(buf + 4) ^ InvRoundKey[1];
+  s[2] = GETU32(buf + 8) ^ InvRoundKey[2];
+  s[3] = GETU32(buf + 12) ^ InvRoundKey[3];
+
+  for (round = 1; ; round += 2)
+  {
+    DEC_ROUND(t, s, InvRoundKey + (round * Nb));
+    if (round + 1 == Nr)
+    {
+      break;
+    }
+    DEC_ROUND(s, t, InvRoundKey + ((round + 1) * Nb));
+  }
+
+  InvRoundKey += Nr * Nb;
+  PUTU32(buf,      ((uint32_t)getSBoxInvert(t[0] & 0xff) | ((uint32_t)getSBoxInvert((t[3] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxInvert((t[2] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxInvert(t[1] >> 24) << 24)) ^ InvRoundKey[0]);
+  PUTU32(buf + 4,  ((uint32_t)getSBoxInvert(t[1] & 0xff) | ((uint32_t)getSBoxInvert((t[0] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxInvert((t[3] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxInvert(t[2] >> 24) << 24)) ^ InvRoundKey[1]);
+  PUTU32(buf + 8,  ((uint32_t)getSBoxInvert(t[2] & 0xff) | ((uint32_t)getSBoxInvert((t[1] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxInvert((t[0] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxInvert(t[3] >> 24) << 24)) ^ InvRoundKey[2]);
+  PUTU32(buf + 12, ((uint32_t)getSBoxInvert(t[3] & 0xff) | ((uint32_t)getSBoxInvert((t[2] >> 8) & 0xff) << 8) |
+                    ((uint32_t)getSBoxInvert((t[1] >> 16) & 0xff) << 16) | ((uint32_t)getSBoxInvert(t[0] >> 24) << 24)) ^ InvRoundKey[3]);
+}
+#endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+
+#define SETUP_KEY(ctx, key) SetupKey((ctx), (key))
+#define INV_ROUND_KEY(ctx)  ((ctx)->InvRoundKey)
+
+#else // #if defined(AES_TTABLE) && (AES_TTABLE == 1)
+
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
 static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
@@ -218,22 +525,6 @@ static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
   }
 }
 
-void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
-{
-  KeyExpansion(ctx->RoundKey, key);
-}
-#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
-void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
-{
-  KeyExpansion(ctx->RoundKey, key);
-  memcpy (ctx->Iv, iv, AES_BLOCKLEN);
-}
-void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv)
-{
-  memcpy (ctx->Iv, iv, AES_BLOCKLEN);
-}
-#endif
-
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
 static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
@@ -463,6 +754,27 @@ static void InvCipher(state_t* state, const uint8_t* RoundKey)
 }
 #endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
 
+#define SETUP_KEY(ctx, key) KeyExpansion((ctx)->RoundKey, (key))
+#define INV_ROUND_KEY(ctx)  ((ctx)->RoundKey)
+
+#endif // #if defined(AES_TTABLE) && (AES_TTABLE == 1)
+
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
+{
+  SETUP_KEY(ctx, key);
+}
+#if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
+void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
+{
+  SETUP_KEY(ctx, key);
+  memcpy (ctx->Iv, iv, AES_BLOCKLEN);
+}
+void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv)
+{
+  memcpy (ctx->Iv, iv, AES_BLOCKLEN);
+}
+#endif
+
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
@@ -478,7 +790,7 @@ void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf)
 void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf)
 {
   // The next function call decrypts the PlainText with the Key using AES algorithm.
-  InvCipher((state_t*)buf, ctx->RoundKey);
+  InvCipher((state_t*)buf, INV_ROUND_KEY(ctx));
 }
 
 
@@ -522,7 +834,7 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     memcpy(storeNextIv, buf, AES_BLOCKLEN);
-    InvCipher((state_t*)buf, ctx->RoundKey);
+    InvCipher((state_t*)buf, INV_ROUND_KEY(ctx));
     XorWithIv(buf, ctx->Iv);
     memcpy(ctx->Iv, storeNextIv, AES_BLOCKLEN);
     buf += AES_BLOCKLEN;
@@ -530,6 +842,96 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
 
 }
 
+void AES_CBC_stream_init(struct AES_stream *stream, const uint8_t *key, const uint8_t *iv)
+{
+  memset(stream, 0, sizeof(*stream));
+  AES_init_ctx_iv(&stream->ctx, key, iv);
+}
+
+size_t AES_CBC_stream_decrypt(struct AES_stream *stream, const uint8_t *in, size_t length, uint8_t *out)
+{
+  size_t produced = 0;
+  size_t n;
+  uint32_t blocks_end;
+
+  // Length prefix, stored little endian by the 32 bit target
+  while ((stream->header_fill < AES_FILE_HEADER_SIZE) && (length > 0))
+  {
+    stream->header[stream->header_fill++] = *in++;
+    length--;
+    if (stream->header_fill == AES_FILE_HEADER_SIZE)
+    {
+      stream->size = (uint32_t)stream->header[0] | ((uint32_t)stream->header[1] << 8) |
+                     ((uint32_t)stream->header[2] << 16) | ((uint32_t)stream->header[3] << 24);
+    }
+  }
+
+  blocks_end = stream->size - (stream->size % AES_BLOCKLEN);
+  while (length > 0)
+  {
+    if (stream->done >= blocks_end)
+    {
+      // Clear tail, anything after the announced size is dropped
+      n = stream->size - stream->done;
+      if (n > length)
+      {
+        n = length;
+      }
+      memmove(out + produced, in, n);
+      produced += n;
+      stream->done += n;
+      break;
+    }
+
+    if ((stream->carry_fill == 0) && (length >= AES_BLOCKLEN))
+    {
+      // Whole blocks straight from the input
+      n = blocks_end - stream->done;
+      if (n > length)
+      {
+        n = length;
+      }
+      n -= n % AES_BLOCKLEN;
+      memmove(out + produced, in, n);
+      AES_CBC_decrypt_buffer(&stream->ctx, out + produced, n);
+    }
+    else
+    {
+      // Block split over two calls
+      n = AES_BLOCKLEN - stream->carry_fill;
+      if (n > length)
+      {
+        n = length;
+      }
+      memcpy(stream->carry + stream->carry_fill, in, n);
+      stream->carry_fill += n;
+      in += n;
+      length -= n;
+      if (stream->carry_fill == AES_BLOCKLEN)
+      {
+        AES_CBC_decrypt_buffer(&stream->ctx, stream->carry, AES_BLOCKLEN);
+        memcpy(out + produced, stream->carry, AES_BLOCKLEN);
+        produced += AES_BLOCKLEN;
+        stream->done += AES_BLOCKLEN;
+        stream->carry_fill = 0;
+      }
+      continue;
+    }
+
+    in += n;
+    length -= n;
+    produced += n;
+    stream->done += n;
+  }
+
+  return produced;
+}
+
+int AES_CBC_stream_complete(const struct AES_stream *stream)
+{
+  return (stream->header_fill == AES_FILE_HEADER_SIZE) && (stream->done == stream->size);
+}
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 
@@ -572,10 +974,272 @@ void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
 
 #endif // #if defined(CTR) && (CTR == 1)
 
+#if defined(CMAC) && (CMAC == 1)
+
+// Multiplication by x in GF(2^128), the subkeys of SP 800-38B
+static void ShiftSubkey(uint8_t* out, const uint8_t* in)
+{
+  uint8_t i;
+  uint8_t msb = in[0] & 0x80;
+
+  for (i = 0; i < AES_BLOCKLEN - 1; ++i)
+  {
+    out[i] = (uint8_t)((in[i] << 1) | (in[i + 1] >> 7));
+  }
+  out[AES_BLOCKLEN - 1] = (uint8_t)(in[AES_BLOCKLEN - 1] << 1);
+  if (msb)
+  {
+    out[AES_BLOCKLEN - 1] ^= 0x87;
+  }
+}
+
+void AES_CMAC_init(struct AES_cmac* cmac, const uint8_t* key)
+{
+  uint8_t L[AES_BLOCKLEN];
+
+  AES_init_ctx(&cmac->ctx, key);
+  memset(L, 0, AES_BLOCKLEN);
+  Cipher((state_t*)L, cmac->ctx.RoundKey);
+  ShiftSubkey(cmac->K1, L);
+  ShiftSubkey(cmac->K2, cmac->K1);
+  AES_CMAC_reset(cmac);
+}
+
+void AES_CMAC_reset(struct AES_cmac* cmac)
+{
+  memset(cmac->X, 0, AES_BLOCKLEN);
+  cmac->fill = 0;
+}
+
+void AES_CMAC_update(struct AES_cmac* cmac, const uint8_t* data, size_t length)
+{
+  uint8_t i;
+  size_t n;
+
+  while (length > 0)
+  {
+    // A full block is only chained once more data shows it is not the last
+    if (cmac->fill == AES_BLOCKLEN)
+    {
+      for (i = 0; i < AES_BLOCKLEN; ++i)
+      {
+        cmac->X[i] ^= cmac->M[i];
+      }
+      Cipher((state_t*)cmac->X, cmac->ctx.RoundKey);
+      cmac->fill = 0;
+    }
+    n = AES_BLOCKLEN - cmac->fill;
+    if (n > length)
+    {
+      n = length;
+    }
+    memcpy(cmac->M + cmac->fill, data, n);
+    cmac->fill += (uint8_t)n;
+    data += n;
+    length -= n;
+  }
+}
+
+void AES_CMAC_final(struct AES_cmac* cmac, uint8_t* tag)
+{
+  const uint8_t* subkey = cmac->K1;
+  uint8_t i;
+
+  if (cmac->fill < AES_BLOCKLEN)
+  {
+    // Padding 10..0 and the second subkey
+    cmac->M[cmac->fill] = 0x80;
+    memset(cmac->M + cmac->fill + 1, 0, AES_BLOCKLEN - cmac->fill - 1);
+    subkey = cmac->K2;
+  }
+  for (i = 0; i < AES_BLOCKLEN; ++i)
+  {
+    cmac->X[i] ^= cmac->M[i] ^ subkey[i];
+  }
+  Cipher((state_t*)cmac->X, cmac->ctx.RoundKey);
+  memcpy(tag, cmac->X, AES_BLOCKLEN);
+  AES_CMAC_reset(cmac);
+}
+
+#endif // #if defined(CMAC) && (CMAC == 1)
+
+/**************************************************************************/
+/* Known answer tests                                                     */
+/**************************************************************************/
+
+// FIPS-197 appendix C: key 00 01 .. (AES_KEYLEN - 1), one block
+static const uint8_t fips197_plain[AES_BLOCKLEN] = {
+  0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+#if defined(AES256) && (AES256 == 1)
+static const uint8_t fips197_cipher[AES_BLOCKLEN] = {
+  0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+#elif defined(AES192) && (AES192 == 1)
+static const uint8_t fips197_cipher[AES_BLOCKLEN] = {
+  0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 };
+#else
+static const uint8_t fips197_cipher[AES_BLOCKLEN] = {
+  0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+#endif
+
+// SP 800-38A appendix F: four blocks of plain text under the F.2 keys, the
+// CMAC tags are those of SP 800-38B appendix D for the first 40 and 64 bytes
+static const uint8_t sp800_plain[AES_BLOCKLEN * 4] = {
+  0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+  0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+  0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+  0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+#if defined(AES256) && (AES256 == 1)
+static const uint8_t sp800_key[AES_KEYLEN] = {
+  0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+  0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+static const uint8_t sp800_cbc[AES_BLOCKLEN * 4] = {
+  0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+  0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d, 0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d,
+  0x39, 0xf2, 0x33, 0x69, 0xa9, 0xd9, 0xba, 0xcf, 0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+  0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc, 0xda, 0x6c, 0x19, 0x07, 0x8c, 0x6a, 0x9d, 0x1b };
+static const uint8_t sp800_ctr[AES_BLOCKLEN * 4] = {
+  0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+  0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a, 0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+  0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c, 0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+  0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6, 0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6 };
+static const uint8_t sp800_cmac40[AES_BLOCKLEN] = {
+  0xaa, 0xf3, 0xd8, 0xf1, 0xde, 0x56, 0x40, 0xc2, 0x32, 0xf5, 0xb1, 0x69, 0xb9, 0xc9, 0x11, 0xe6 };
+static const uint8_t sp800_cmac64[AES_BLOCKLEN] = {
+  0xe1, 0x99, 0x21, 0x90, 0x54, 0x9f, 0x6e, 0xd5, 0x69, 0x6a, 0x2c, 0x05, 0x6c, 0x31, 0x54, 0x10 };
+#elif defined(AES192) && (AES192 == 1)
+static const uint8_t sp800_key[AES_KEYLEN] = {
+  0x8e, 0x73, 0xb0, 0xf7, 0xda, 0x0e, 0x64, 0x52, 0xc8, 0x10, 0xf3, 0x2b, 0x80, 0x90, 0x79, 0xe5,
+  0x62, 0xf8, 0xea, 0xd2, 0x52, 0x2c, 0x6b, 0x7b };
+static const uint8_t sp800_cbc[AES_BLOCKLEN * 4] = {
+  0x4f, 0x02, 0x1d, 0xb2, 0x43, 0xbc, 0x63, 0x3d, 0x71, 0x78, 0x18, 0x3a, 0x9f, 0xa0, 0x71, 0xe8,
+  0xb4, 0xd9, 0xad, 0xa9, 0xad, 0x7d, 0xed, 0xf4, 0xe5, 0xe7, 0x38, 0x76, 0x3f, 0x69, 0x14, 0x5a,
+  0x57, 0x1b, 0x24, 0x20, 0x12, 0xfb, 0x7a, 0xe0, 0x7f, 0xa9, 0xba, 0xac, 0x3d, 0xf1, 0x02, 0xe0,
+  0x08, 0xb0, 0xe2, 0x79, 0x88, 0x59, 0x88, 0x81, 0xd9, 0x20, 0xa9, 0xe6, 0x4f, 0x56, 0x15, 0xcd };
+static const uint8_t sp800_ctr[AES_BLOCKLEN * 4] = {
+  0x1a, 0xbc, 0x93, 0x24, 0x17, 0x52, 0x1c, 0xa2, 0x4f, 0x2b, 0x04, 0x59, 0xfe, 0x7e, 0x6e, 0x0b,
+  0x09, 0x03, 0x39, 0xec, 0x0a, 0xa6, 0xfa, 0xef, 0xd5, 0xcc, 0xc2, 0xc6, 0xf4, 0xce, 0x8e, 0x94,
+  0x1e, 0x36, 0xb2, 0x6b, 0xd1, 0xeb, 0xc6, 0x70, 0xd1, 0xbd, 0x1d, 0x66, 0x56, 0x20, 0xab, 0xf7,
+  0x4f, 0x78, 0xa7, 0xf6, 0xd2, 0x98, 0x09, 0x58, 0x5a, 0x97, 0xda, 0xec, 0x58, 0xc6, 0xb0, 0x50 };
+static const uint8_t sp800_cmac40[AES_BLOCKLEN] = {
+  0x8a, 0x1d, 0xe5, 0xbe, 0x2e, 0xb3, 0x1a, 0xad, 0x08, 0x9a, 0x82, 0xe6, 0xee, 0x90, 0x8b, 0x0e };
+static const uint8_t sp800_cmac64[AES_BLOCKLEN] = {
+  0xa1, 0xd5, 0xdf, 0x0e, 0xed, 0x79, 0x0f, 0x79, 0x4d, 0x77, 0x58, 0x96, 0x59, 0xf3, 0x9a, 0x11 };
+#else
+static const uint8_t sp800_key[AES_KEYLEN] = {
+  0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t sp800_cbc[AES_BLOCKLEN * 4] = {
+  0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+  0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+  0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+  0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7 };
+static const uint8_t sp800_ctr[AES_BLOCKLEN * 4] = {
+  0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+  0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+  0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+  0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee };
+static const uint8_t sp800_cmac40[AES_BLOCKLEN] = {
+  0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27 };
+static const uint8_t sp800_cmac64[AES_BLOCKLEN] = {
+  0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe };
+#endif
+// CBC IV 00 01 .. 0f, CTR initial counter f0 f1 .. ff
+static const uint8_t sp800_cbc_iv[AES_BLOCKLEN] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const uint8_t sp800_ctr_iv[AES_BLOCKLEN] = {
+  0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+
+int AES_self_test(void)
+{
+  struct AES_ctx ctx;
+  uint8_t key[AES_KEYLEN];
+  uint8_t buf[AES_BLOCKLEN * 4];
+  uint8_t i;
+
+  for (i = 0; i < AES_KEYLEN; ++i)
+  {
+    key[i] = i;
+  }
+  AES_init_ctx(&ctx, key);
+
+  // 1, 2: FIPS-197 cipher and inverse cipher
+  memcpy(buf, fips197_plain, AES_BLOCKLEN);
+  Cipher((state_t*)buf, ctx.RoundKey);
+  if (memcmp(buf, fips197_cipher, AES_BLOCKLEN) != 0)
+  {
+    return 1;
+  }
+#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+  InvCipher((state_t*)buf, INV_ROUND_KEY(&ctx));
+  if (memcmp(buf, fips197_plain, AES_BLOCKLEN) != 0)
+  {
+    return 2;
+  }
+#endif
+
+  // 3, 4: SP 800-38A CBC encryption and decryption. The second call on the
+  // key takes the schedules from the cache on the T-table core.
+#if defined(CBC) && (CBC == 1)
+  AES_init_ctx_iv(&ctx, sp800_key, sp800_cbc_iv);
+  memcpy(buf, sp800_plain, sizeof(buf));
+  AES_CBC_encrypt_buffer(&ctx, buf, sizeof(buf));
+  if (memcmp(buf, sp800_cbc, sizeof(buf)) != 0)
+  {
+    return 3;
+  }
+  AES_init_ctx_iv(&ctx, sp800_key, sp800_cbc_iv);
+  AES_CBC_decrypt_buffer(&ctx, buf, sizeof(buf));
+  if (memcmp(buf, sp800_plain, sizeof(buf)) != 0)
+  {
+    return 4;
+  }
+#endif
+
+  // 5: SP 800-38A CTR, split so that the counter runs across calls
+#if defined(CTR) && (CTR == 1)
+  AES_init_ctx_iv(&ctx, sp800_key, sp800_ctr_iv);
+  memcpy(buf, sp800_plain, sizeof(buf));
+  AES_CTR_xcrypt_buffer(&ctx, buf, AES_BLOCKLEN);
+  AES_CTR_xcrypt_buffer(&ctx, buf + AES_BLOCKLEN, sizeof(buf) - AES_BLOCKLEN);
+  if (memcmp(buf, sp800_ctr, sizeof(buf)) != 0)
+  {
+    return 5;
+  }
+#endif
+
+  // 6, 7: SP 800-38B CMAC of a partial and of a complete last block
+#if defined(CMAC) && (CMAC == 1)
+  {
+    struct AES_cmac cmac;
+
+    AES_CMAC_init(&cmac, sp800_key);
+    AES_CMAC_update(&cmac, sp800_plain, 7);
+    AES_CMAC_update(&cmac, sp800_plain + 7, 40 - 7);
+    AES_CMAC_final(&cmac, buf);
+    if (memcmp(buf, sp800_cmac40, AES_BLOCKLEN) != 0)
+    {
+      return 6;
+    }
+    AES_CMAC_update(&cmac, sp800_plain, sizeof(sp800_plain));
+    AES_CMAC_final(&cmac, buf);
+    if (memcmp(buf, sp800_cmac64, AES_BLOCKLEN) != 0)
+    {
+      return 7;
+    }
+  }
+#endif
+
+  return 0;
+}
+
 /**************************************************************************/
 /* File encryption/decryption functions                                   */
 /**************************************************************************/
 
+const uint8_t AES_image_key[AES_KEYLEN] = "ThisIsA256BitKeyForAESTest!";
+const uint8_t AES_image_iv[AES_BLOCKLEN] = "InitialVector12";
+
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+
 #define FILE_BUFFER_SIZE 4096  // Buffer size for file operations
 
 /**
@@ -591,7 +1255,7 @@ FRESULT AES_encrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
     FIL source_file, dest_file;
     FRESULT res;
     UINT bytes_read, bytes_written;
-    uint8_t buffer[FILE_BUFFER_SIZE];
+    uint8_t *buffer;
     struct AES_ctx ctx;
     size_t file_size;
     size_t remaining_bytes;
@@ -629,6 +1293,15 @@ FRESULT AES_encrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
         return res;
     }
     
+    // The block buffer comes from the I/O arena
+    buffer = IoArena_Get(FILE_BUFFER_SIZE, "AES file");
+    if (buffer == NULL)
+    {
+        f_close(&source_file);
+        f_close(&dest_file);
+        return FR_NOT_ENOUGH_CORE;
+    }
+    
     // Process the file in blocks
     while (remaining_bytes > 0)
     {
@@ -666,6 +1339,8 @@ FRESULT AES_encrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
         remaining_bytes -= read_size;
     }
     
+    IoArena_Put(buffer);
+    
     // Close both files
     f_close(&source_file);
     f_close(&dest_file);
@@ -689,7 +1364,7 @@ int AES_encrypt_file_lfs(const char* source_path, const char* dest_path, const u
 {
     struct lfs_file source_file, dest_file;
     int err;
-    uint8_t buffer[FILE_BUFFER_SIZE];
+    uint8_t *buffer;
     struct AES_ctx ctx;
     size_t file_size;
     size_t remaining_bytes;
@@ -705,7 +1380,7 @@ int AES_encrypt_file_lfs(const char* source_path, const char* dest_path, const u
     AES_init_ctx_iv(&ctx, key, iv);
     
     // Open source file for reading
-    err = lfs_file_open(&lfs_instance, &source_file, source_path, LFS_O_RDONLY);
+    err = lfs_spi_flash_file_open(&lfs_instance, &source_file, source_path, LFS_O_RDONLY);
     if (err != LFS_ERR_OK)
     {
         return err;
@@ -716,7 +1391,7 @@ int AES_encrypt_file_lfs(const char* source_path, const char* dest_path, const u
     remaining_bytes = file_size;
     
     // Open destination file for writing
-    err = lfs_file_open(&lfs_instance, &dest_file, dest_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    err = lfs_spi_flash_file_open(&lfs_instance, &dest_file, dest_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
     if (err != LFS_ERR_OK)
     {
         lfs_file_close(&lfs_instance, &source_file);
@@ -732,6 +1407,15 @@ int AES_encrypt_file_lfs(const char* source_path, const char* dest_path, const u
         return (bytes_written < 0) ? bytes_written : LFS_ERR_IO;
     }
     
+    // The block buffer comes from the I/O arena
+    buffer = IoArena_Get(FILE_BUFFER_SIZE, "AES file");
+    if (buffer == NULL)
+    {
+        lfs_file_close(&lfs_instance, &source_file);
+        lfs_file_close(&lfs_instance, &dest_file);
+        return LFS_ERR_NOMEM;
+    }
+    
     // Process the file in blocks
     while (remaining_bytes > 0)
     {
@@ -769,6 +1453,8 @@ int AES_encrypt_file_lfs(const char* source_path, const char* dest_path, const u
         remaining_bytes -= read_size;
     }
     
+    IoArena_Put(buffer);
+    
     // Sync and close both files
     lfs_file_sync(&lfs_instance, &source_file);
     lfs_file_sync(&lfs_instance, &dest_file);
@@ -790,7 +1476,7 @@ int AES_decrypt_file_lfs(const char* source_path, const char* dest_path, const u
 {
     struct lfs_file source_file, dest_file;
     int err;
-    uint8_t buffer[FILE_BUFFER_SIZE];
+    uint8_t *buffer;
     struct AES_ctx ctx;
     size_t original_file_size;
     size_t remaining_bytes;
@@ -806,7 +1492,7 @@ int AES_decrypt_file_lfs(const char* source_path, const char* dest_path, const u
     AES_init_ctx_iv(&ctx, key, iv);
     
     // Open source file for reading
-    err = lfs_file_open(&lfs_instance, &source_file, source_path, LFS_O_RDONLY);
+    err = lfs_spi_flash_file_open(&lfs_instance, &source_file, source_path, LFS_O_RDONLY);
     if (err != LFS_ERR_OK)
     {
         return err;
@@ -821,7 +1507,7 @@ int AES_decrypt_file_lfs(const char* source_path, const char* dest_path, const u
     }
     
     // Open destination file for writing
-    err = lfs_file_open(&lfs_instance, &dest_file, dest_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    err = lfs_spi_flash_file_open(&lfs_instance, &dest_file, dest_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
     if (err != LFS_ERR_OK)
     {
         lfs_file_close(&lfs_instance, &source_file);
@@ -832,6 +1518,15 @@ int AES_decrypt_file_lfs(const char* source_path, const char* dest_path, const u
     size_t file_size = lfs_file_size(&lfs_instance, &source_file);
     remaining_bytes = file_size - sizeof(original_file_size);
     
+    // The block buffer comes from the I/O arena
+    buffer = IoArena_Get(FILE_BUFFER_SIZE, "AES file");
+    if (buffer == NULL)
+    {
+        lfs_file_close(&lfs_instance, &source_file);
+        lfs_file_close(&lfs_instance, &dest_file);
+        return LFS_ERR_NOMEM;
+    }
+    
     // Process the file in blocks
     while (remaining_bytes > 0)
     {
@@ -869,6 +1564,8 @@ int AES_decrypt_file_lfs(const char* source_path, const char* dest_path, const u
         original_file_size -= write_size;
     }
     
+    IoArena_Put(buffer);
+    
     // Sync and close both files
     lfs_file_sync(&lfs_instance, &source_file);
     lfs_file_sync(&lfs_instance, &dest_file);
@@ -891,7 +1588,7 @@ FRESULT AES_decrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
     FIL source_file, dest_file;
     FRESULT res;
     UINT bytes_read, bytes_written;
-    uint8_t buffer[FILE_BUFFER_SIZE];
+    uint8_t *buffer;
     struct AES_ctx ctx;
     size_t original_file_size;
     size_t remaining_bytes;
@@ -927,6 +1624,15 @@ FRESULT AES_decrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
     // Calculate remaining bytes to read (excluding the size header)
     remaining_bytes = f_size(&source_file) - sizeof(original_file_size);
     
+    // The block buffer comes from the I/O arena
+    buffer = IoArena_Get(FILE_BUFFER_SIZE, "AES file");
+    if (buffer == NULL)
+    {
+        f_close(&source_file);
+        f_close(&dest_file);
+        return FR_NOT_ENOUGH_CORE;
+    }
+    
     // Process the file in blocks
     while (remaining_bytes > 0)
     {
@@ -964,6 +1670,8 @@ FRESULT AES_decrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
         original_file_size -= write_size;
     }
     
+    IoArena_Put(buffer);
+    
     // Close both files
     f_close(&source_file);
     f_close(&dest_file);
@@ -971,3 +1679,4 @@ FRESULT AES_decrypt_file(const TCHAR* source_path, const TCHAR* dest_path, const
     return res;
 }
 
+#endif // #if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
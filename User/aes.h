@@ -3,13 +3,23 @@
 
 #include <stdint.h>
 #include <stddef.h>
+
+// AES_FILE_IO builds the file encryption functions on FatFs and LittleFS.
+// 0 leaves the cipher core alone, for the host builds under Tools/.
+#ifndef AES_FILE_IO
+#define AES_FILE_IO 1
+#endif
+
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
 #include "ff.h" // For FatFs definitions and FRESULT type
 #include "lfs_spi_flash_adapter.h" // For LittleFS definitions and functions
+#endif
 
 // #define the macros below to 1/0 to enable/disable the mode of operation.
 //
 // CBC enables AES encryption in CBC-mode of operation.
 // CTR enables encryption in counter-mode.
+// CMAC enables the SP 800-38B message authentication code.
 // ECB enables the basic ECB 16-byte block algorithm. All can be enabled simultaneously.
 
 // The #ifndef-guard allows it to be configured before #include'ing or at compile time.
@@ -25,6 +35,23 @@
 #define CTR 1
 #endif
 
+#ifndef CMAC
+#define CMAC 1
+#endif
+
+// AES_TTABLE selects the 32 bit T-table core: one 1 KB table per direction,
+// round keys kept as words and the decryption schedule expanded once per key.
+// 0 falls back to the byte oriented core, smaller but several times slower.
+#ifndef AES_TTABLE
+#define AES_TTABLE 1
+#endif
+
+// AES_TABLES_IN_CCM copies the T-tables into the core coupled RAM on the first
+// key setup, so the lookups do not compete with the code for the Flash cache.
+#ifndef AES_TABLES_IN_CCM
+#define AES_TABLES_IN_CCM 0
+#endif
+
 // #define AES128 1
 // #define AES192 1
 #define AES256 1
@@ -44,7 +71,12 @@
 
 struct AES_ctx
 {
+#if defined(AES_TTABLE) && (AES_TTABLE == 1)
+  uint32_t RoundKey[AES_keyExpSize / 4];
+  uint32_t InvRoundKey[AES_keyExpSize / 4]; // Equivalent inverse cipher schedule
+#else
   uint8_t RoundKey[AES_keyExpSize];
+#endif
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
   uint8_t Iv[AES_BLOCKLEN];
 #endif
@@ -56,6 +88,10 @@ void AES_init_ctx_iv(struct AES_ctx *ctx, const uint8_t *key, const uint8_t *iv)
 void AES_ctx_set_iv(struct AES_ctx *ctx, const uint8_t *iv);
 #endif
 
+// Known answer tests from FIPS-197 and SP 800-38A, 0 when all of them pass,
+// otherwise the number of the first failing vector
+int AES_self_test(void);
+
 #if defined(ECB) && (ECB == 1)
 // buffer size is exactly AES_BLOCKLEN bytes;
 // you need only AES_init_ctx as IV is not used in ECB
@@ -73,6 +109,30 @@ void AES_ECB_decrypt(const struct AES_ctx *ctx, uint8_t *buf);
 void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length);
 void AES_CBC_decrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length);
 
+// Length prefix written by AES_encrypt_file: the size_t of the 32 bit target
+#define AES_FILE_HEADER_SIZE 4
+
+// Decryption of a file made by AES_encrypt_file/AES_encrypt_file_lfs fed in
+// pieces of any size: length prefix, whole CBC blocks, then the last
+// (size % AES_BLOCKLEN) bytes that the encryption leaves in clear.
+struct AES_stream
+{
+  struct AES_ctx ctx;
+  uint32_t size;        // Plain size from the length prefix
+  uint32_t done;        // Plain bytes output so far
+  uint8_t header_fill;
+  uint8_t carry_fill;   // Bytes of an incomplete block kept for the next call
+  uint8_t header[AES_FILE_HEADER_SIZE];
+  uint8_t carry[AES_BLOCKLEN];
+};
+
+void AES_CBC_stream_init(struct AES_stream *stream, const uint8_t *key, const uint8_t *iv);
+// out receives at most length + AES_BLOCKLEN - 1 bytes, and never more than
+// the announced size in total. out can be in itself when carry_fill is 0.
+size_t AES_CBC_stream_decrypt(struct AES_stream *stream, const uint8_t *in, size_t length, uint8_t *out);
+// 1 once the length prefix is parsed and all plain bytes were output
+int AES_CBC_stream_complete(const struct AES_stream *stream);
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 #if defined(CTR) && (CTR == 1)
@@ -86,10 +146,39 @@ void AES_CTR_xcrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length);
 
 #endif // #if defined(CTR) && (CTR == 1)
 
+#if defined(CMAC) && (CMAC == 1)
+
+// CMAC over a message fed in pieces of any size. The last block is held back
+// until AES_CMAC_final, which needs to know it is the last one.
+struct AES_cmac
+{
+  struct AES_ctx ctx;
+  uint8_t K1[AES_BLOCKLEN];  // Subkey for a complete last block
+  uint8_t K2[AES_BLOCKLEN];  // Subkey for a padded last block
+  uint8_t X[AES_BLOCKLEN];   // Chaining value
+  uint8_t M[AES_BLOCKLEN];   // Block not yet chained
+  uint8_t fill;
+};
+
+void AES_CMAC_init(struct AES_cmac *cmac, const uint8_t *key);
+// Start a new message with the same key
+void AES_CMAC_reset(struct AES_cmac *cmac);
+void AES_CMAC_update(struct AES_cmac *cmac, const uint8_t *data, size_t length);
+// tag receives AES_BLOCKLEN bytes, the state is reset for the next message
+void AES_CMAC_final(struct AES_cmac *cmac, uint8_t *tag);
+
+#endif // #if defined(CMAC) && (CMAC == 1)
+
 /**************************************************************************/
 /* File encryption/decryption functions declarations                      */
 /**************************************************************************/
 
+// Key and IV of the firmware images (.aes) installed by the bootloader
+extern const uint8_t AES_image_key[AES_KEYLEN];
+extern const uint8_t AES_image_iv[AES_BLOCKLEN];
+
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+
 /**
  * @brief  Encrypts a file using AES CBC mode (FatFs)
  * @param  source_path: Path to the source file
@@ -130,4 +219,6 @@ int AES_encrypt_file_lfs(const char *source_path, const char *dest_path, const u
  */
 int AES_decrypt_file_lfs(const char *source_path, const char *dest_path, const uint8_t *key, const uint8_t *iv);
 
+#endif // #if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+
 #endif // _AES_H_
@@ -0,0 +1,563 @@
+/*
+
+Sealed image container, see aes_seal.h for the layout.
+
+Every record is authenticated before it is decrypted, so a corrupted or
+tampered chunk never reaches the caller. The header carries the plain size
+and the chunk index is part of every tag, so dropped, reordered or
+truncated records are caught as well.
+
+The index entries are truncated MACs of the plain chunks, not CRCs, so they
+tell nothing about the plain text to whoever lacks the key, and the index
+tag binds them to the nonce of the image.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <string.h>
+#include "aes_seal.h"
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+#include "io_arena.h" // Record buffers of the file functions
+#endif
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define SEAL_DOMAIN_HEADER 'H'
+#define SEAL_DOMAIN_CHUNK  'C'
+#define SEAL_DOMAIN_PLAIN  'P'
+#define SEAL_DOMAIN_INDEX  'I'
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void PutLe32(uint8_t* p, uint32_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t GetLe32(const uint8_t* p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// SP 800-108 counter mode KDF with CMAC as PRF:
+// K(i) = CMAC(key, i | label | 0x00 | bit length of the output, big endian)
+static void DeriveKey(struct AES_cmac* prf, const char* label, uint8_t* out)
+{
+  uint8_t block[AES_BLOCKLEN];
+  uint8_t suffix[3] = { 0x00, (uint8_t)((AES_KEYLEN * 8) >> 8), (uint8_t)(AES_KEYLEN * 8) };
+  uint8_t i;
+  size_t n;
+
+  for (i = 1; (size_t)(i - 1) * AES_BLOCKLEN < AES_KEYLEN; ++i)
+  {
+    AES_CMAC_update(prf, &i, 1);
+    AES_CMAC_update(prf, (const uint8_t*)label, strlen(label));
+    AES_CMAC_update(prf, suffix, sizeof(suffix));
+    AES_CMAC_final(prf, block);
+    n = AES_KEYLEN - (size_t)(i - 1) * AES_BLOCKLEN;
+    memcpy(out + (size_t)(i - 1) * AES_BLOCKLEN, block, (n > AES_BLOCKLEN) ? AES_BLOCKLEN : n);
+  }
+}
+
+static void HeaderTag(struct AES_seal* seal, const uint8_t* header, uint8_t* tag)
+{
+  const uint8_t domain = SEAL_DOMAIN_HEADER;
+
+  AES_CMAC_update(&seal->cmac, &domain, 1);
+  AES_CMAC_update(&seal->cmac, header, AES_SEAL_HEADER_SIZE - AES_SEAL_TAG_SIZE);
+  AES_CMAC_final(&seal->cmac, tag);
+}
+
+// Tag of the cipher text ('C') or index entry of the plain text ('P') of a chunk
+static void ChunkTag(struct AES_seal* seal, uint8_t domain, uint32_t chunk, const uint8_t* data, size_t length,
+                     uint8_t* tag)
+{
+  uint8_t prefix[1 + AES_SEAL_NONCE_SIZE + 8];
+
+  prefix[0] = domain;
+  memcpy(prefix + 1, seal->nonce, AES_SEAL_NONCE_SIZE);
+  PutLe32(prefix + 1 + AES_SEAL_NONCE_SIZE, chunk);
+  PutLe32(prefix + 5 + AES_SEAL_NONCE_SIZE, (uint32_t)length);
+  AES_CMAC_update(&seal->cmac, prefix, sizeof(prefix));
+  AES_CMAC_update(&seal->cmac, data, length);
+  AES_CMAC_final(&seal->cmac, tag);
+}
+
+static void IndexTag(struct AES_seal* seal, const uint8_t* index, uint8_t* tag)
+{
+  const uint8_t domain = SEAL_DOMAIN_INDEX;
+
+  AES_CMAC_update(&seal->cmac, &domain, 1);
+  AES_CMAC_update(&seal->cmac, seal->nonce, AES_SEAL_NONCE_SIZE);
+  AES_CMAC_update(&seal->cmac, index, AES_seal_chunk_count(seal) * AES_SEAL_INDEX_ENTRY_SIZE);
+  AES_CMAC_final(&seal->cmac, tag);
+}
+
+// Plain length of a chunk
+static size_t ChunkLength(const struct AES_seal* seal, uint32_t chunk)
+{
+  uint32_t left = seal->size - chunk * seal->chunk_size;
+
+  return (left > seal->chunk_size) ? seal->chunk_size : left;
+}
+
+// CTR over one chunk, the counter starts at the chunk's first block number
+static void ChunkCrypt(struct AES_seal* seal, uint8_t* data, size_t length)
+{
+  uint8_t counter[AES_BLOCKLEN];
+  uint32_t block = seal->chunk * (seal->chunk_size / AES_BLOCKLEN);
+
+  memcpy(counter, seal->nonce, AES_SEAL_NONCE_SIZE);
+  counter[12] = (uint8_t)(block >> 24);
+  counter[13] = (uint8_t)(block >> 16);
+  counter[14] = (uint8_t)(block >> 8);
+  counter[15] = (uint8_t)block;
+  AES_ctx_set_iv(&seal->ctx, counter);
+  AES_CTR_xcrypt_buffer(&seal->ctx, data, length);
+}
+
+// Constant time, a mismatch does not tell how many bytes matched
+static int TagEqual(const uint8_t* a, const uint8_t* b, uint8_t length)
+{
+  uint8_t diff = 0;
+  uint8_t i;
+
+  for (i = 0; i < length; ++i)
+  {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+void AES_seal_init(struct AES_seal* seal, const uint8_t* key)
+{
+  uint8_t derived[AES_KEYLEN];
+
+  memset(seal, 0, sizeof(*seal));
+  AES_CMAC_init(&seal->cmac, key);
+  DeriveKey(&seal->cmac, "AEX1 enc", derived);
+  AES_init_ctx(&seal->ctx, derived);
+  DeriveKey(&seal->cmac, "AEX1 mac", derived);
+  AES_CMAC_init(&seal->cmac, derived);
+  memset(derived, 0, sizeof(derived));
+}
+
+void AES_seal_create(struct AES_seal* seal, const uint8_t* nonce, uint32_t chunk_size, uint32_t size,
+                     uint8_t* index, uint8_t* header)
+{
+  memcpy(seal->nonce, nonce, AES_SEAL_NONCE_SIZE);
+  seal->chunk_size = chunk_size;
+  seal->size = size;
+  seal->flags = (index != NULL) ? AES_SEAL_FLAG_INDEX : 0;
+  seal->chunk = 0;
+  seal->done = 0;
+  seal->index = index;
+
+  memcpy(header, AES_SEAL_MAGIC, 4);
+  PutLe32(header + 4, chunk_size);
+  PutLe32(header + 8, size);
+  memcpy(header + 12, nonce, AES_SEAL_NONCE_SIZE);
+  PutLe32(header + 24, seal->flags);
+  PutLe32(header + 28, 0);
+  HeaderTag(seal, header, header + AES_SEAL_HEADER_SIZE - AES_SEAL_TAG_SIZE);
+
+  if ((index != NULL) && (size == 0))
+  {
+    IndexTag(seal, index, index);
+  }
+}
+
+size_t AES_seal_record(struct AES_seal* seal, uint8_t* data, size_t length)
+{
+  uint8_t tag[AES_SEAL_TAG_SIZE];
+
+  if (seal->index != NULL)
+  {
+    ChunkTag(seal, SEAL_DOMAIN_PLAIN, seal->chunk, data, length, tag);
+    memcpy(seal->index + seal->chunk * AES_SEAL_INDEX_ENTRY_SIZE, tag, AES_SEAL_INDEX_ENTRY_SIZE);
+  }
+  ChunkCrypt(seal, data, length);
+  ChunkTag(seal, SEAL_DOMAIN_CHUNK, seal->chunk, data, length, data + length);
+  seal->chunk++;
+  seal->done += (uint32_t)length;
+  if ((seal->index != NULL) && (seal->done == seal->size))
+  {
+    IndexTag(seal, seal->index, seal->index + seal->chunk * AES_SEAL_INDEX_ENTRY_SIZE);
+  }
+  return length + AES_SEAL_TAG_SIZE;
+}
+
+int AES_seal_open(struct AES_seal* seal, const uint8_t* header)
+{
+  uint8_t tag[AES_SEAL_TAG_SIZE];
+  uint32_t chunk_size = GetLe32(header + 4);
+  uint32_t flags = GetLe32(header + 24);
+
+  if ((memcmp(header, AES_SEAL_MAGIC, 4) != 0) || (chunk_size == 0) || (chunk_size % AES_BLOCKLEN != 0) ||
+      ((flags & ~(uint32_t)AES_SEAL_FLAG_INDEX) != 0))
+  {
+    return AES_SEAL_ERR_FORMAT;
+  }
+  HeaderTag(seal, header, tag);
+  if (!TagEqual(tag, header + AES_SEAL_HEADER_SIZE - AES_SEAL_TAG_SIZE, AES_SEAL_TAG_SIZE))
+  {
+    return AES_SEAL_ERR_AUTH;
+  }
+  memcpy(seal->nonce, header + 12, AES_SEAL_NONCE_SIZE);
+  seal->chunk_size = chunk_size;
+  seal->size = GetLe32(header + 8);
+  seal->flags = flags;
+  seal->chunk = 0;
+  seal->done = 0;
+  seal->index = NULL;
+  return AES_SEAL_OK;
+}
+
+size_t AES_seal_record_length(const struct AES_seal* seal)
+{
+  uint32_t left = seal->size - seal->done;
+
+  if (left == 0)
+  {
+    return 0;
+  }
+  return ((left > seal->chunk_size) ? seal->chunk_size : left) + AES_SEAL_TAG_SIZE;
+}
+
+int AES_unseal_record(struct AES_seal* seal, uint8_t* record, size_t length, size_t* p_plain)
+{
+  uint8_t tag[AES_SEAL_TAG_SIZE];
+  size_t expected = AES_seal_record_length(seal);
+
+  *p_plain = 0;
+  if (expected == 0)
+  {
+    return AES_SEAL_ERR_ORDER;
+  }
+  if (length != expected)
+  {
+    return AES_SEAL_ERR_FORMAT;
+  }
+  length -= AES_SEAL_TAG_SIZE;
+  ChunkTag(seal, SEAL_DOMAIN_CHUNK, seal->chunk, record, length, tag);
+  if (!TagEqual(tag, record + length, AES_SEAL_TAG_SIZE))
+  {
+    return AES_SEAL_ERR_AUTH;
+  }
+  ChunkCrypt(seal, record, length);
+  seal->chunk++;
+  seal->done += (uint32_t)length;
+  *p_plain = length;
+  return AES_SEAL_OK;
+}
+
+void AES_seal_peek(struct AES_seal* seal, const uint8_t* record, uint8_t* out, size_t count)
+{
+  memcpy(out, record, count);
+  ChunkCrypt(seal, out, count);
+}
+
+int AES_seal_complete(const struct AES_seal* seal)
+{
+  return (seal->chunk_size != 0) && (seal->done == seal->size);
+}
+
+uint32_t AES_seal_chunk_count(const struct AES_seal* seal)
+{
+  return (seal->size + seal->chunk_size - 1) / seal->chunk_size;
+}
+
+uint32_t AES_seal_record_offset(const struct AES_seal* seal, uint32_t chunk)
+{
+  uint32_t plain = chunk * seal->chunk_size;
+
+  // Past the last record, which may be short: the index
+  if (plain > seal->size)
+  {
+    plain = seal->size;
+  }
+  return AES_SEAL_HEADER_SIZE + plain + chunk * AES_SEAL_TAG_SIZE;
+}
+
+size_t AES_seal_index_length(const struct AES_seal* seal)
+{
+  if (!(seal->flags & AES_SEAL_FLAG_INDEX))
+  {
+    return 0;
+  }
+  return AES_seal_chunk_count(seal) * AES_SEAL_INDEX_ENTRY_SIZE + AES_SEAL_TAG_SIZE;
+}
+
+uint32_t AES_seal_file_size(const struct AES_seal* seal)
+{
+  return AES_seal_record_offset(seal, AES_seal_chunk_count(seal)) + (uint32_t)AES_seal_index_length(seal);
+}
+
+int AES_seal_open_index(struct AES_seal* seal, uint8_t* index)
+{
+  uint8_t tag[AES_SEAL_TAG_SIZE];
+
+  if (!(seal->flags & AES_SEAL_FLAG_INDEX))
+  {
+    return AES_SEAL_ERR_FORMAT;
+  }
+  IndexTag(seal, index, tag);
+  if (!TagEqual(tag, index + AES_seal_chunk_count(seal) * AES_SEAL_INDEX_ENTRY_SIZE, AES_SEAL_TAG_SIZE))
+  {
+    return AES_SEAL_ERR_AUTH;
+  }
+  seal->index = index;
+  return AES_SEAL_OK;
+}
+
+int AES_seal_seek(struct AES_seal* seal, uint32_t chunk)
+{
+  if (chunk > AES_seal_chunk_count(seal))
+  {
+    return AES_SEAL_ERR_ORDER;
+  }
+  seal->chunk = chunk;
+  seal->done = (chunk * seal->chunk_size < seal->size) ? chunk * seal->chunk_size : seal->size;
+  return AES_SEAL_OK;
+}
+
+int AES_seal_chunk_match(struct AES_seal* seal, uint32_t chunk, const uint8_t* plain)
+{
+  uint8_t tag[AES_SEAL_TAG_SIZE];
+
+  if ((seal->index == NULL) || (chunk >= AES_seal_chunk_count(seal)))
+  {
+    return 0;
+  }
+  ChunkTag(seal, SEAL_DOMAIN_PLAIN, chunk, plain, ChunkLength(seal, chunk), tag);
+  return TagEqual(tag, seal->index + chunk * AES_SEAL_INDEX_ENTRY_SIZE, AES_SEAL_INDEX_ENTRY_SIZE);
+}
+
+/**************************************************************************/
+/* File functions                                                         */
+/**************************************************************************/
+
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+
+// Used by the file functions, too big for the stack
+static struct AES_seal FileSeal;
+
+// Images of more than AES_SEAL_INDEX_MAX_CHUNKS chunks are sealed without an index
+#define FILE_INDEXED(size) (((size) + AES_SEAL_CHUNK_SIZE - 1) / AES_SEAL_CHUNK_SIZE <= AES_SEAL_INDEX_MAX_CHUNKS)
+
+/**
+ * @brief  Seals a file (FatFs)
+ * @note   Indexed when it has at most AES_SEAL_INDEX_MAX_CHUNKS chunks
+ * @param  source_path: Path to the plain file
+ * @param  dest_path: Path to the sealed file
+ * @param  key: image key
+ * @param  nonce: AES_SEAL_NONCE_SIZE bytes, unique per image
+ * @retval FRESULT: FatFs result code
+ */
+FRESULT AES_seal_file(const TCHAR* source_path, const TCHAR* dest_path, const uint8_t* key, const uint8_t* nonce)
+{
+  FIL source_file, dest_file;
+  FRESULT res;
+  UINT bytes_read, bytes_written;
+  uint8_t header[AES_SEAL_HEADER_SIZE];
+  uint8_t* buffer;
+  uint8_t* index;
+  uint32_t remaining_bytes;
+  size_t record;
+
+  res = f_open(&source_file, source_path, FA_READ);
+  if (res != FR_OK)
+  {
+    return res;
+  }
+  remaining_bytes = (uint32_t)f_size(&source_file);
+
+  res = f_open(&dest_file, dest_path, FA_CREATE_ALWAYS | FA_WRITE);
+  if (res != FR_OK)
+  {
+    f_close(&source_file);
+    return res;
+  }
+
+  buffer = IoArena_Get(AES_SEAL_CHUNK_SIZE + AES_SEAL_TAG_SIZE, "AES seal");
+  index = FILE_INDEXED(remaining_bytes) ? IoArena_Get(AES_SEAL_INDEX_MAX_SIZE, "AES seal index") : NULL;
+  if ((buffer == NULL) || (FILE_INDEXED(remaining_bytes) && (index == NULL)))
+  {
+    IoArena_Put(index);
+    IoArena_Put(buffer);
+    f_close(&source_file);
+    f_close(&dest_file);
+    return FR_NOT_ENOUGH_CORE;
+  }
+
+  AES_seal_init(&FileSeal, key);
+  AES_seal_create(&FileSeal, nonce, AES_SEAL_CHUNK_SIZE, remaining_bytes, index, header);
+  res = f_write(&dest_file, header, AES_SEAL_HEADER_SIZE, &bytes_written);
+  if ((res == FR_OK) && (bytes_written != AES_SEAL_HEADER_SIZE))
+  {
+    res = FR_DENIED;
+  }
+
+  while ((res == FR_OK) && (remaining_bytes > 0))
+  {
+    UINT read_size = (remaining_bytes > AES_SEAL_CHUNK_SIZE) ? AES_SEAL_CHUNK_SIZE : remaining_bytes;
+
+    res = f_read(&source_file, buffer, read_size, &bytes_read);
+    if ((res == FR_OK) && (bytes_read != read_size))
+    {
+      res = FR_INT_ERR; // The file shrank while it was read
+    }
+    if (res != FR_OK)
+    {
+      break;
+    }
+
+    record = AES_seal_record(&FileSeal, buffer, bytes_read);
+    res = f_write(&dest_file, buffer, record, &bytes_written);
+    if ((res == FR_OK) && (bytes_written != record))
+    {
+      res = FR_DENIED; // Volume full
+    }
+    remaining_bytes -= read_size;
+  }
+
+  record = AES_seal_index_length(&FileSeal);
+  if ((res == FR_OK) && (record != 0))
+  {
+    res = f_write(&dest_file, index, record, &bytes_written);
+    if ((res == FR_OK) && (bytes_written != record))
+    {
+      res = FR_DENIED;
+    }
+  }
+
+  IoArena_Put(index);
+  IoArena_Put(buffer);
+  f_close(&source_file);
+  f_close(&dest_file);
+  if (res != FR_OK)
+  {
+    f_unlink(dest_path);
+  }
+  return res;
+}
+
+/**
+ * @brief  Seals a file (LittleFS), the file system must be mounted
+ * @note   Indexed when it has at most AES_SEAL_INDEX_MAX_CHUNKS chunks
+ * @param  source_path: Path to the plain file
+ * @param  dest_path: Path to the sealed file
+ * @param  key: image key
+ * @param  nonce: AES_SEAL_NONCE_SIZE bytes, unique per image
+ * @retval int: LFS_ERR_OK on success, or error code on failure
+ */
+int AES_seal_file_lfs(const char* source_path, const char* dest_path, const uint8_t* key, const uint8_t* nonce)
+{
+  struct lfs_file source_file, dest_file;
+  uint8_t header[AES_SEAL_HEADER_SIZE];
+  uint8_t* buffer;
+  uint8_t* index;
+  lfs_soff_t file_size;
+  uint32_t remaining_bytes;
+  size_t record;
+  int err;
+  int n;
+
+  err = lfs_spi_flash_file_open(&lfs_instance, &source_file, source_path, LFS_O_RDONLY);
+  if (err != LFS_ERR_OK)
+  {
+    return err;
+  }
+  file_size = lfs_file_size(&lfs_instance, &source_file);
+  if (file_size < 0)
+  {
+    lfs_file_close(&lfs_instance, &source_file);
+    return (int)file_size;
+  }
+  remaining_bytes = (uint32_t)file_size;
+
+  err = lfs_spi_flash_file_open(&lfs_instance, &dest_file, dest_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  if (err != LFS_ERR_OK)
+  {
+    lfs_file_close(&lfs_instance, &source_file);
+    return err;
+  }
+
+  buffer = IoArena_Get(AES_SEAL_CHUNK_SIZE + AES_SEAL_TAG_SIZE, "AES seal");
+  index = FILE_INDEXED(remaining_bytes) ? IoArena_Get(AES_SEAL_INDEX_MAX_SIZE, "AES seal index") : NULL;
+  if ((buffer == NULL) || (FILE_INDEXED(remaining_bytes) && (index == NULL)))
+  {
+    IoArena_Put(index);
+    IoArena_Put(buffer);
+    lfs_file_close(&lfs_instance, &source_file);
+    lfs_file_close(&lfs_instance, &dest_file);
+    return LFS_ERR_NOMEM;
+  }
+
+  AES_seal_init(&FileSeal, key);
+  AES_seal_create(&FileSeal, nonce, AES_SEAL_CHUNK_SIZE, remaining_bytes, index, header);
+  n = lfs_file_write(&lfs_instance, &dest_file, header, AES_SEAL_HEADER_SIZE);
+  if (n != AES_SEAL_HEADER_SIZE)
+  {
+    err = (n < 0) ? n : LFS_ERR_IO;
+  }
+
+  while ((err == LFS_ERR_OK) && (remaining_bytes > 0))
+  {
+    uint32_t read_size = (remaining_bytes > AES_SEAL_CHUNK_SIZE) ? AES_SEAL_CHUNK_SIZE : remaining_bytes;
+
+    n = lfs_file_read(&lfs_instance, &source_file, buffer, read_size);
+    if (n != (int)read_size)
+    {
+      err = (n < 0) ? n : LFS_ERR_IO;
+      break;
+    }
+
+    record = AES_seal_record(&FileSeal, buffer, read_size);
+    n = lfs_file_write(&lfs_instance, &dest_file, buffer, record);
+    if (n != (int)record)
+    {
+      err = (n < 0) ? n : LFS_ERR_IO;
+      break;
+    }
+    remaining_bytes -= read_size;
+  }
+
+  record = AES_seal_index_length(&FileSeal);
+  if ((err == LFS_ERR_OK) && (record != 0))
+  {
+    n = lfs_file_write(&lfs_instance, &dest_file, index, record);
+    if (n != (int)record)
+    {
+      err = (n < 0) ? n : LFS_ERR_IO;
+    }
+  }
+
+  IoArena_Put(index);
+  IoArena_Put(buffer);
+  lfs_file_close(&lfs_instance, &source_file);
+  n = lfs_file_close(&lfs_instance, &dest_file);
+  if ((err == LFS_ERR_OK) && (n < 0))
+  {
+    err = n;
+  }
+  if (err != LFS_ERR_OK)
+  {
+    lfs_remove(&lfs_instance, dest_path);
+  }
+  return err;
+}
+
+#endif // #if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
@@ -0,0 +1,131 @@
+#ifndef _AES_SEAL_H_
+#define _AES_SEAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "aes.h"
+
+// Sealed image (.aex): AES-CTR encryption with a CMAC tag per chunk, so an
+// image is decrypted and authenticated in one pass and a bad chunk is caught
+// before its bytes are used.
+//
+//   header  48 bytes, little endian
+//     0  magic "AEX1"
+//     4  chunk size, a multiple of AES_BLOCKLEN
+//     8  plain size
+//    12  nonce, never reused with the same key
+//    24  flags, AES_SEAL_FLAG_INDEX or 0
+//    28  reserved, 0
+//    32  tag = CMAC(mac key, 'H' | bytes 0-31)
+//   records, one per chunk of plain text, the last one may be short
+//     cipher text = CTR(enc key, counter nonce | big endian block number)
+//     tag = CMAC(mac key, 'C' | nonce | chunk index | length | cipher text)
+//   index, only with AES_SEAL_FLAG_INDEX
+//     one AES_SEAL_INDEX_ENTRY_SIZE entry per chunk, the first bytes of
+//       CMAC(mac key, 'P' | nonce | chunk index | length | plain text)
+//     tag = CMAC(mac key, 'I' | nonce | entries)
+//
+// The encryption and MAC keys are derived from the image key with the
+// SP 800-108 counter mode KDF on CMAC, the image key itself is never used
+// for CTR or CMAC. Block numbers count from the start of the image, so
+// every chunk can be decrypted on its own.
+//
+// The index sits behind the records so an image is still written in one
+// pass and read in one pass by readers that do not need it. With it a
+// reader can tell which chunks the target already holds without decrypting
+// anything, then seek to the records it is missing: an interrupted install
+// picks up where it stopped and unchanged Flash sectors are left alone.
+#define AES_SEAL_MAGIC         "AEX1"
+#define AES_SEAL_HEADER_SIZE   48
+#define AES_SEAL_TAG_SIZE      AES_BLOCKLEN
+#define AES_SEAL_NONCE_SIZE    12
+#define AES_SEAL_CHUNK_SIZE    4096  // Written by AES_seal_file, one update pipeline chunk
+#define AES_SEAL_FLAG_INDEX    0x00000001
+#define AES_SEAL_INDEX_ENTRY_SIZE 8
+// AES_seal_file indexes images of up to this many chunks, 1 MB of 4 KB chunks
+#define AES_SEAL_INDEX_MAX_CHUNKS 256
+#define AES_SEAL_INDEX_MAX_SIZE (AES_SEAL_INDEX_MAX_CHUNKS * AES_SEAL_INDEX_ENTRY_SIZE + AES_SEAL_TAG_SIZE)
+
+#define AES_SEAL_OK            0
+#define AES_SEAL_ERR_FORMAT    (-1)  // Not a sealed image, or bad chunk size or length
+#define AES_SEAL_ERR_AUTH      (-2)  // Tag mismatch, nothing is decrypted
+#define AES_SEAL_ERR_ORDER     (-3)  // Record past the end of the image
+
+struct AES_seal
+{
+  struct AES_ctx ctx;      // Derived encryption key, CTR
+  struct AES_cmac cmac;    // Derived MAC key
+  uint8_t nonce[AES_SEAL_NONCE_SIZE];
+  uint32_t chunk_size;
+  uint32_t size;           // Plain size
+  uint32_t flags;
+  uint32_t chunk;          // Index of the next record
+  uint32_t done;           // Plain bytes sealed or unsealed so far
+  uint8_t* index;          // Filled by the writer, checked index of the reader, or NULL
+};
+
+// Derive the keys, once per image
+void AES_seal_init(struct AES_seal *seal, const uint8_t *key);
+
+// Writer: fill the header of an image of size bytes, then seal the chunks in
+// order. data needs AES_SEAL_TAG_SIZE bytes of room after length. With an
+// index buffer of AES_seal_index_length bytes the image is indexed, the
+// buffer is complete once the last chunk is sealed and goes after it.
+void AES_seal_create(struct AES_seal *seal, const uint8_t *nonce, uint32_t chunk_size, uint32_t size,
+                     uint8_t *index, uint8_t *header);
+size_t AES_seal_record(struct AES_seal *seal, uint8_t *data, size_t length);
+
+// Reader: check the header, then unseal the records in order. A record is
+// decrypted in place only once its tag matched.
+int AES_seal_open(struct AES_seal *seal, const uint8_t *header);
+size_t AES_seal_record_length(const struct AES_seal *seal);
+int AES_unseal_record(struct AES_seal *seal, uint8_t *record, size_t length, size_t *p_plain);
+// Decrypt the first count bytes of the next record into out without
+// authenticating it, for showing what an image holds. Nothing may be
+// installed from it, the record is only trusted once it is unsealed.
+void AES_seal_peek(struct AES_seal *seal, const uint8_t *record, uint8_t *out, size_t count);
+// 1 once every record of the image was unsealed
+int AES_seal_complete(const struct AES_seal *seal);
+
+// Layout of an open or created image
+uint32_t AES_seal_chunk_count(const struct AES_seal *seal);
+uint32_t AES_seal_record_offset(const struct AES_seal *seal, uint32_t chunk);
+size_t AES_seal_index_length(const struct AES_seal *seal); // 0 without an index
+uint32_t AES_seal_file_size(const struct AES_seal *seal);
+
+// Random access: check the index read from AES_seal_record_offset(seal,
+// AES_seal_chunk_count(seal)), the buffer is used until the image is done
+// with. Then AES_seal_seek makes chunk the next record to unseal, and
+// AES_seal_chunk_match tells whether plain, the full length of chunk, is
+// what the image holds there.
+int AES_seal_open_index(struct AES_seal *seal, uint8_t *index);
+int AES_seal_seek(struct AES_seal *seal, uint32_t chunk);
+int AES_seal_chunk_match(struct AES_seal *seal, uint32_t chunk, const uint8_t *plain);
+
+#if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+
+/**
+ * @brief  Seals a file (FatFs)
+ * @note   Indexed when it has at most AES_SEAL_INDEX_MAX_CHUNKS chunks
+ * @param  source_path: Path to the plain file
+ * @param  dest_path: Path to the sealed file
+ * @param  key: image key
+ * @param  nonce: AES_SEAL_NONCE_SIZE bytes, unique per image
+ * @retval FRESULT: FatFs result code
+ */
+FRESULT AES_seal_file(const TCHAR *source_path, const TCHAR *dest_path, const uint8_t *key, const uint8_t *nonce);
+
+/**
+ * @brief  Seals a file (LittleFS)
+ * @note   Indexed when it has at most AES_SEAL_INDEX_MAX_CHUNKS chunks
+ * @param  source_path: Path to the plain file
+ * @param  dest_path: Path to the sealed file
+ * @param  key: image key
+ * @param  nonce: AES_SEAL_NONCE_SIZE bytes, unique per image
+ * @retval int: LFS_ERR_OK on success, or error code on failure
+ */
+int AES_seal_file_lfs(const char *source_path, const char *dest_path, const uint8_t *key, const uint8_t *nonce);
+
+#endif // #if defined(AES_FILE_IO) && (AES_FILE_IO == 1)
+
+#endif // _AES_SEAL_H_
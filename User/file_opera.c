@@ -1,6 +1,7 @@
 #include "file_opera.h"
 #include "fatfs.h"
 #include "main.h"
+#include "io_arena.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -49,26 +50,16 @@ void fatTest_GetDiskInfo(void)
 
 void fatTest_ScanDir(const TCHAR *PathName)
 {
-    // 使用动态内存分配
-    DIR *dir = (DIR *)malloc(sizeof(DIR));
-    FILINFO *dir_info = (FILINFO *)malloc(sizeof(FILINFO));
-
-    if (dir == NULL || dir_info == NULL)
-    {
-        printf("Error: Not enough memory for directory scan\r\n");
-        if (dir)
-            free(dir);
-        if (dir_info)
-            free(dir_info);
-        return;
-    }
+    // 静态分配, 不再使用堆 (函数不可重入)
+    static DIR scan_dir;
+    static FILINFO scan_info;
+    DIR *dir = &scan_dir;
+    FILINFO *dir_info = &scan_info;
 
     FRESULT res = f_opendir(dir, PathName);
     if (res != FR_OK)
     {
         printf("Error: Failed to open directory '%s' (Error code: %d)\r\n", PathName, res);
-        free(dir);
-        free(dir_info);
         return;
     }
 
@@ -115,8 +106,6 @@ void fatTest_ScanDir(const TCHAR *PathName)
     printf("========================================\r\n\r\n");
 
     f_closedir(dir);
-    free(dir);
-    free(dir_info);
 }
 
 void fatTest_WriteTXTFile(TCHAR *filename, uint16_t year, uint8_t month, uint8_t day)
@@ -225,7 +214,7 @@ void fatTest_ReadBinFile(TCHAR *filename)
             pointCount = 1000;
         }
 
-        uint32_t *value = (uint32_t *)malloc(pointCount * sizeof(uint32_t));
+        uint32_t *value = (uint32_t *)IoArena_Get(pointCount * sizeof(uint32_t), "bin file points");
         if (value != NULL)
         {
             uint32_t read_count = 0;
@@ -255,7 +244,7 @@ void fatTest_ReadBinFile(TCHAR *filename)
                 printf("  [%d] = %d\r\n", read_count - 1, (int)value[read_count - 1]);
             }
 
-            free(value);
+            IoArena_Put(value);
             printf("File read completed successfully\r\n");
         }
         else
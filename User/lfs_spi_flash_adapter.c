@@ -1,9 +1,65 @@
 #include "lfs_spi_flash_adapter.h"
+#include "w25q128_async.h"
 #include <string.h>
 
 // 定义lfs句柄
 struct lfs lfs_instance;
 
+// LittleFS分区的块数, 检测前按W25Q128
+lfs_size_t lfs_spi_flash_blocks = (W25Q128_CHIP_SIZE - SPI_FLASH_RESERVED_SIZE) / SPI_FLASH_BLOCK_SIZE;
+
+// 静态缓存, 都在SRAM中(DMA访问不到CCM), 按字对齐
+static uint32_t lfs_spi_flash_read_buffer[SPI_FLASH_CACHE_SIZE / 4];
+static uint32_t lfs_spi_flash_prog_buffer[SPI_FLASH_CACHE_SIZE / 4];
+static uint32_t lfs_spi_flash_lookahead_buffer[SPI_FLASH_LOOKAHEAD_SIZE / 4];
+
+// 文件缓存池, owner为使用该缓存的文件
+// 文件关闭后不在lfs->mlist中, 缓存即视为空闲, 调用者照常使用lfs_file_close
+static uint32_t lfs_spi_flash_file_buffer[SPI_FLASH_FILE_BUFFERS][SPI_FLASH_CACHE_SIZE / 4];
+static struct lfs_file_config lfs_spi_flash_file_cfg[SPI_FLASH_FILE_BUFFERS];
+static struct
+{
+    struct lfs *lfs;
+    lfs_file_t *file;
+} lfs_spi_flash_file_owner[SPI_FLASH_FILE_BUFFERS];
+
+// 预擦除位图: 置1的块擦除后没有编程过, LittleFS擦除它时直接返回
+// 后台擦除完成时在中断中置位, 前台只清除, 中断丢失的置位只会多擦一次
+static uint32_t lfs_spi_flash_erased[SPI_FLASH_BITMAP_BLOCKS / 32];
+// 空闲时扫描得到的在用块
+static uint32_t lfs_spi_flash_used[SPI_FLASH_BITMAP_BLOCKS / 32];
+// 上次扫描后文件系统有过擦除或编程, 在用块需要重新扫描
+static uint8_t lfs_spi_flash_changed = 1;
+// 正在后台擦除的块, count为0表示没有
+static volatile lfs_block_t lfs_spi_flash_pre_erase_block;
+static volatile lfs_size_t lfs_spi_flash_pre_erase_count;
+// 下次查找空闲块的起点
+static lfs_block_t lfs_spi_flash_pre_erase_next;
+
+lfs_spi_flash_idle_stats_t lfs_spi_flash_idle_stats;
+
+// 位图操作, 超出位图的块视为未擦除
+static int lfs_spi_flash_bit_get(const uint32_t *map, lfs_block_t block)
+{
+    return (block < SPI_FLASH_BITMAP_BLOCKS) && ((map[block / 32] >> (block % 32)) & 1U);
+}
+
+static void lfs_spi_flash_bit_set(uint32_t *map, lfs_block_t block)
+{
+    if (block < SPI_FLASH_BITMAP_BLOCKS)
+    {
+        map[block / 32] |= 1U << (block % 32);
+    }
+}
+
+static void lfs_spi_flash_bit_clear(uint32_t *map, lfs_block_t block)
+{
+    if (block < SPI_FLASH_BITMAP_BLOCKS)
+    {
+        map[block / 32] &= ~(1U << (block % 32));
+    }
+}
+
 // SPI Flash块设备操作函数
 
 // 读取数据
@@ -19,7 +75,10 @@ static int lfs_spi_flash_read(const struct lfs_config *c, lfs_block_t block, lfs
     }
 
     // 调用W25Q128的读取函数
-    W25Q128_read((uint8_t *)buffer, addr, size);
+    if (W25Q128_read((uint8_t *)buffer, addr, size) != 0)
+    {
+        return LFS_ERR_IO;
+    }
 
     return LFS_ERR_OK;
 }
@@ -29,6 +88,7 @@ static int lfs_spi_flash_prog(const struct lfs_config *c, lfs_block_t block, lfs
 {
     // 计算实际地址
     uint32_t addr = block * SPI_FLASH_BLOCK_SIZE + off;
+    int err;
 
     // 检查地址范围
     if (block >= SPI_FLASH_BLOCK_COUNT || (off + size) > SPI_FLASH_BLOCK_SIZE)
@@ -38,31 +98,14 @@ static int lfs_spi_flash_prog(const struct lfs_config *c, lfs_block_t block, lfs
 
     // 对于LittleFS，擦除操作由lfs_spi_flash_erase单独处理
     // 所以这里我们只进行写入操作，不执行擦除
-    // 先发送写使能
-    W25Q128_write_enable();
-    W25Q128_wait_busy();
+    // 写缓存为4KB, 一次写入可以跨页, 按页拆分, 每页一次DMA传输
+    err = W25Q128_program((const uint8_t *)buffer, addr, size);
 
-    // 拉低CS端为低电平
-    W25QXX_CS_ON(1);
-    // 发送指令02h
-    spi_read_write_byte(W25X_PageProgram);
-    // 发送写入的24位地址中的高8位
-    spi_read_write_byte((uint8_t)((addr) >> 16));
-    // 发送写入的24位地址中的中8位
-    spi_read_write_byte((uint8_t)((addr) >> 8));
-    // 发送写入的24位地址中的低8位
-    spi_read_write_byte((uint8_t)addr);
-    // 根据写入的字节长度连续写入数据buffer
-    for (uint32_t i = 0; i < size; i++)
-    {
-        spi_read_write_byte(((uint8_t *)buffer)[i]);
-    }
-    // 恢复CS端为高电平
-    W25QXX_CS_ON(0);
-    // 忙检测
-    W25Q128_wait_busy();
+    // 编程前会等后台擦除全部完成, 完成回调可能刚把这个块置位, 编程后再清除
+    lfs_spi_flash_bit_clear(lfs_spi_flash_erased, block);
+    lfs_spi_flash_changed = 1;
 
-    return LFS_ERR_OK;
+    return (err != 0) ? LFS_ERR_IO : LFS_ERR_OK;
 }
 
 // 擦除块
@@ -74,13 +117,247 @@ static int lfs_spi_flash_erase(const struct lfs_config *c, lfs_block_t block)
         return LFS_ERR_INVAL;
     }
 
+    lfs_spi_flash_changed = 1;
+
+    // 空闲时已预擦除的块不必再擦除, 写入路径上没有擦除等待
+    if (lfs_spi_flash_bit_get(lfs_spi_flash_erased, block))
+    {
+        lfs_spi_flash_bit_clear(lfs_spi_flash_erased, block);
+        lfs_spi_flash_idle_stats.hits++;
+        return LFS_ERR_OK;
+    }
+
     // 注意：W25Q128_erase_sector函数内部会将输入值乘以4096
     // 我们需要直接传递块号，而不是计算后的地址
     W25Q128_erase_sector(block);
 
+    // 擦除前等待后台擦除时, 完成回调可能把这个块置位, 擦除后再清除
+    lfs_spi_flash_bit_clear(lfs_spi_flash_erased, block);
+    lfs_spi_flash_idle_stats.misses++;
+
     return LFS_ERR_OK;
 }
 
+// 文件是否仍打开: 在lfs的打开文件链表中
+static int lfs_spi_flash_file_is_open(struct lfs *lfs, const lfs_file_t *file)
+{
+    struct lfs_mlist *item;
+
+    for (item = lfs->mlist; item != NULL; item = item->next)
+    {
+        if ((const void *)item == (const void *)file)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 打开文件, 文件缓存从缓存池中分配
+int lfs_spi_flash_file_opencfg(struct lfs *lfs, lfs_file_t *file, const char *path, int flags,
+                               const struct lfs_file_config *config)
+{
+    int i, slot = -1;
+    int err;
+
+    for (i = 0; i < SPI_FLASH_FILE_BUFFERS; i++)
+    {
+        // 同一个文件结构上次打开后未归还的缓存, 文件现在没有打开, 可以重用
+        if (lfs_spi_flash_file_owner[i].file == file)
+        {
+            lfs_spi_flash_file_owner[i].file = NULL;
+        }
+        if ((lfs_spi_flash_file_owner[i].file != NULL) &&
+            !lfs_spi_flash_file_is_open(lfs_spi_flash_file_owner[i].lfs, lfs_spi_flash_file_owner[i].file))
+        {
+            lfs_spi_flash_file_owner[i].file = NULL;
+        }
+        if ((slot < 0) && (lfs_spi_flash_file_owner[i].file == NULL))
+        {
+            slot = i;
+        }
+    }
+    if (slot < 0)
+    {
+        return LFS_ERR_NOMEM;
+    }
+
+    // 复制调用者的配置(属性), 缓存由缓存池提供, 配置在文件打开期间保持有效
+    if (config != NULL)
+    {
+        lfs_spi_flash_file_cfg[slot] = *config;
+    }
+    else
+    {
+        memset(&lfs_spi_flash_file_cfg[slot], 0, sizeof(lfs_spi_flash_file_cfg[slot]));
+    }
+    lfs_spi_flash_file_cfg[slot].buffer = lfs_spi_flash_file_buffer[slot];
+
+    err = lfs_file_opencfg(lfs, file, path, flags, &lfs_spi_flash_file_cfg[slot]);
+    if (err == LFS_ERR_OK)
+    {
+        lfs_spi_flash_file_owner[slot].lfs = lfs;
+        lfs_spi_flash_file_owner[slot].file = file;
+    }
+    return err;
+}
+
+// 打开文件, 没有额外配置
+int lfs_spi_flash_file_open(struct lfs *lfs, lfs_file_t *file, const char *path, int flags)
+{
+    return lfs_spi_flash_file_opencfg(lfs, file, path, flags, NULL);
+}
+
+// 擦除连续的多个块, 由擦除规划器合并成尽量少的32KB/64KB块擦除
+int lfs_spi_flash_erase_blocks(lfs_block_t block, lfs_size_t count, W25Q128_EraseStatsTypeDef *stats)
+{
+    // 检查块范围
+    if (block > SPI_FLASH_BLOCK_COUNT || count > SPI_FLASH_BLOCK_COUNT - block)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    if (W25Q128_erase_range(block * SPI_FLASH_BLOCK_SIZE, count * SPI_FLASH_BLOCK_SIZE, stats) != 0)
+    {
+        return LFS_ERR_INVAL;
+    }
+
+    // 擦除过的块记入预擦除位图, 格式化和之后的写入不再擦除它们
+    for (; count > 0; count--, block++)
+    {
+        lfs_spi_flash_bit_set(lfs_spi_flash_erased, block);
+    }
+    lfs_spi_flash_changed = 1;
+
+    return LFS_ERR_OK;
+}
+
+// 后台擦除完成, 在TIM1中断中调用
+static void lfs_spi_flash_pre_erase_done(void *context, int status)
+{
+    lfs_block_t block;
+
+    (void)context;
+    if (status == 0)
+    {
+        for (block = lfs_spi_flash_pre_erase_block;
+             block < lfs_spi_flash_pre_erase_block + lfs_spi_flash_pre_erase_count; block++)
+        {
+            lfs_spi_flash_bit_set(lfs_spi_flash_erased, block);
+        }
+        lfs_spi_flash_idle_stats.pre_erased += lfs_spi_flash_pre_erase_count;
+    }
+    lfs_spi_flash_pre_erase_count = 0;
+}
+
+// lfs_fs_traverse回调: 记录在用块
+static int lfs_spi_flash_mark_used(void *data, lfs_block_t block)
+{
+    (void)data;
+    lfs_spi_flash_bit_set(lfs_spi_flash_used, block);
+    return 0;
+}
+
+// 可以预擦除: 空闲且未擦除
+static int lfs_spi_flash_pre_erasable(lfs_block_t block)
+{
+    return !lfs_spi_flash_bit_get(lfs_spi_flash_used, block) && !lfs_spi_flash_bit_get(lfs_spi_flash_erased, block);
+}
+
+// 空闲时维护一步
+int lfs_spi_flash_idle(struct lfs *lfs)
+{
+    lfs_size_t blocks, i;
+    lfs_block_t block, end;
+    int err;
+
+    // 上一段还在后台擦除
+    if (lfs_spi_flash_pre_erase_count != 0)
+    {
+        return 1;
+    }
+    // 有打开的文件时在用块随时会变, 不做维护
+    if (lfs->mlist != NULL)
+    {
+        return 0;
+    }
+
+    if (lfs_spi_flash_changed)
+    {
+        // 修复孤立块, 压缩超过compact_thresh的元数据对, 预先填充lookahead
+        err = lfs_fs_gc(lfs);
+        if (err != LFS_ERR_OK)
+        {
+            return err;
+        }
+
+        // 扫描在用块, 其余的块LittleFS不会再读, 可以擦除
+        memset(lfs_spi_flash_used, 0, sizeof(lfs_spi_flash_used));
+        err = lfs_fs_traverse(lfs, lfs_spi_flash_mark_used, NULL);
+        if (err != LFS_ERR_OK)
+        {
+            return err;
+        }
+        lfs_spi_flash_changed = 0;
+        lfs_spi_flash_idle_stats.gc_runs++;
+    }
+
+    // 从上次的位置找下一个可以预擦除的块
+    blocks = (lfs->block_count < SPI_FLASH_BITMAP_BLOCKS) ? lfs->block_count : SPI_FLASH_BITMAP_BLOCKS;
+    block = 0;
+    for (i = 0; i < blocks; i++)
+    {
+        block = (lfs_spi_flash_pre_erase_next + i) % blocks;
+        if (lfs_spi_flash_pre_erasable(block))
+        {
+            break;
+        }
+    }
+    if (i == blocks)
+    {
+        return 0;
+    }
+
+    // 向后延伸到64KB边界, 整块时擦除规划器用一条64KB擦除指令
+    end = block + 1;
+    while ((end < blocks) && ((end % (W25Q128_BLOCK64_SIZE / SPI_FLASH_BLOCK_SIZE)) != 0) &&
+           lfs_spi_flash_pre_erasable(end))
+    {
+        end++;
+    }
+    lfs_spi_flash_pre_erase_next = end % blocks;
+
+    lfs_spi_flash_pre_erase_block = block;
+    lfs_spi_flash_pre_erase_count = end - block;
+    if (W25Q128_async_erase(block * SPI_FLASH_BLOCK_SIZE, (end - block) * SPI_FLASH_BLOCK_SIZE,
+                            lfs_spi_flash_pre_erase_done, NULL) != 0)
+    {
+        // 队列已满, 下次再试
+        lfs_spi_flash_pre_erase_count = 0;
+    }
+    return 1;
+}
+
+// 已预擦除的块数
+lfs_size_t lfs_spi_flash_ready_blocks(void)
+{
+    lfs_size_t count = 0;
+    lfs_block_t block;
+
+    for (block = 0; block < SPI_FLASH_BITMAP_BLOCKS; block++)
+    {
+        count += lfs_spi_flash_bit_get(lfs_spi_flash_erased, block);
+    }
+    return count;
+}
+
+// 忘记预擦除过的块
+void lfs_spi_flash_forget_erased(void)
+{
+    memset(lfs_spi_flash_erased, 0, sizeof(lfs_spi_flash_erased));
+    lfs_spi_flash_changed = 1;
+}
+
 // 同步操作
 static int lfs_spi_flash_sync(const struct lfs_config *c)
 {
@@ -92,7 +369,7 @@ static int lfs_spi_flash_sync(const struct lfs_config *c)
 }
 
 // lfs配置结构体
-const struct lfs_config lfs_spi_flash_cfg = {
+struct lfs_config lfs_spi_flash_cfg = {
     .context = NULL,
     .read = lfs_spi_flash_read,
     .prog = lfs_spi_flash_prog,
@@ -101,10 +378,13 @@ const struct lfs_config lfs_spi_flash_cfg = {
     .read_size = SPI_FLASH_READ_SIZE,
     .prog_size = SPI_FLASH_PROG_SIZE,
     .block_size = SPI_FLASH_BLOCK_SIZE,
-    .block_count = SPI_FLASH_BLOCK_COUNT,
-    .cache_size = SPI_FLASH_PROG_SIZE,
-    .lookahead_size = 16,
+    .block_count = (W25Q128_CHIP_SIZE - SPI_FLASH_RESERVED_SIZE) / SPI_FLASH_BLOCK_SIZE,
+    .cache_size = SPI_FLASH_CACHE_SIZE,
+    .lookahead_size = SPI_FLASH_LOOKAHEAD_SIZE,
     .block_cycles = 500,
+    .read_buffer = lfs_spi_flash_read_buffer,
+    .prog_buffer = lfs_spi_flash_prog_buffer,
+    .lookahead_buffer = lfs_spi_flash_lookahead_buffer,
 };
 
 // 初始化SPI Flash和littlefs
@@ -113,37 +393,49 @@ int lfs_spi_flash_init(void)
     // 初始化W25Q128
     w25q128_init();
 
-    // 检查SPI Flash是否正常工作
-    uint16_t flash_id = W25Q128_readID();
-    if (flash_id == 0xFFFF || flash_id == 0x0000)
+    // 读取JEDEC ID和SFDP, 检查SPI Flash是否正常工作
+    if (W25Q128_detect() != 0)
     {
         return -1; // SPI Flash初始化失败
     }
 
+    // 按容量建立分区表, 块大小不变, 已有的文件系统挂载时扩展
+    lfs_spi_flash_blocks = (W25Q128_info.capacity - SPI_FLASH_RESERVED_SIZE) / SPI_FLASH_BLOCK_SIZE;
+    lfs_spi_flash_cfg.block_count = lfs_spi_flash_blocks;
+
     return 0; // 初始化成功
 }
 
-// 挂载文件系统
-int lfs_spi_flash_mount(struct lfs *lfs)
+// 挂载已有的文件系统, 失败时不格式化
+int lfs_spi_flash_mount_existing(struct lfs *lfs)
 {
     // 如果提供了lfs指针就使用它，否则使用全局实例
     struct lfs *target_lfs = (lfs != NULL) ? lfs : &lfs_instance;
+    int err;
 
-    // 尝试挂载文件系统
-    int err = lfs_mount(target_lfs, &lfs_spi_flash_cfg);
-
-    // 如果挂载失败，尝试格式化后再挂载
+    // block_count为0时按超级块中的块数挂载, 以前格式化的分区可能更小
+    lfs_spi_flash_cfg.block_count = 0;
+    err = lfs_mount(target_lfs, &lfs_spi_flash_cfg);
+    lfs_spi_flash_cfg.block_count = lfs_spi_flash_blocks;
     if (err != LFS_ERR_OK)
     {
-        err = lfs_format(target_lfs, &lfs_spi_flash_cfg);
-        if (err != LFS_ERR_OK)
-        {
-            return err;
-        }
-
-        err = lfs_mount(target_lfs, &lfs_spi_flash_cfg);
+        return err;
     }
 
+    // 文件系统比分区小时扩展到整个分区, 只改写超级块, 文件不动
+    if (target_lfs->block_count < lfs_spi_flash_blocks)
+    {
+        err = lfs_fs_grow(target_lfs, lfs_spi_flash_blocks);
+    }
+    else if (target_lfs->block_count > lfs_spi_flash_blocks)
+    {
+        // 文件系统比芯片大, 不是这块芯片上格式化的
+        err = LFS_ERR_INVAL;
+    }
+    if (err != LFS_ERR_OK)
+    {
+        lfs_unmount(target_lfs);
+    }
     return err;
 }
 
@@ -152,6 +444,17 @@ int lfs_spi_flash_unmount(struct lfs *lfs)
 {
     // 如果提供了lfs指针就使用它，否则使用全局实例
     struct lfs *target_lfs = (lfs != NULL) ? lfs : &lfs_instance;
+    int i;
+
+    // 卸载后仍打开的文件不能再使用, 归还它们的缓存
+    for (i = 0; i < SPI_FLASH_FILE_BUFFERS; i++)
+    {
+        if (lfs_spi_flash_file_owner[i].lfs == target_lfs)
+        {
+            lfs_spi_flash_file_owner[i].lfs = NULL;
+            lfs_spi_flash_file_owner[i].file = NULL;
+        }
+    }
 
     return lfs_unmount(target_lfs);
 }
@@ -6,19 +6,45 @@
 
 // 定义SPI Flash的块大小、扇区大小等参数
 #define SPI_FLASH_BLOCK_SIZE 4096  // 块大小，W25Q128一个扇区为4KB
-#define SPI_FLASH_BLOCK_COUNT 1024 // 块数量，设置为4MB存储空间，4MB / 4KB = 1024块
+#define SPI_FLASH_BLOCK_COUNT lfs_spi_flash_blocks // 块数量，由检测到的容量决定
 #define SPI_FLASH_PROG_SIZE 256    // 编程大小，W25Q128一页为256字节
 #define SPI_FLASH_READ_SIZE 1      // 读取大小，最小为1字节
 
+// 分区表: LittleFS从0开始占满芯片, 最后64KB(W25Q128_SCRATCH_ADDR)留给速度测试
+#define SPI_FLASH_RESERVED_SIZE W25Q128_BLOCK64_SIZE
+
+// 静态缓存, 不使用堆(工程定义了LFS_NO_MALLOC)
+// 读/写缓存和文件缓存各为一个块, 一次读写4KB
+#define SPI_FLASH_CACHE_SIZE SPI_FLASH_BLOCK_SIZE
+// lookahead位图覆盖整个W25Q128, 一次扫描找出所有空闲块
+#define SPI_FLASH_LOOKAHEAD_SIZE (W25Q128_CHIP_SIZE / SPI_FLASH_BLOCK_SIZE / 8)
+// 同时打开的文件数, 每个文件占用一个文件缓存
+#define SPI_FLASH_FILE_BUFFERS 3
+
+// 预擦除位图覆盖的块数, 容量更大的芯片超出部分照常同步擦除
+#define SPI_FLASH_BITMAP_BLOCKS (W25Q128_CHIP_SIZE / SPI_FLASH_BLOCK_SIZE)
+
+// 空闲维护的统计
+typedef struct
+{
+    uint32_t gc_runs;    // lfs_fs_gc和在用块扫描的次数
+    uint32_t pre_erased; // 后台擦除的块数
+    uint32_t hits;       // 擦除回调遇到已预擦除的块, 直接返回
+    uint32_t misses;     // 擦除回调同步擦除的块
+} lfs_spi_flash_idle_stats_t;
+
 // 声明lfs配置结构体和实例
-extern const struct lfs_config lfs_spi_flash_cfg;
+// block_count在lfs_spi_flash_init中按检测到的容量设置
+extern struct lfs_config lfs_spi_flash_cfg;
+extern lfs_size_t lfs_spi_flash_blocks;
 extern struct lfs lfs_instance;
+extern lfs_spi_flash_idle_stats_t lfs_spi_flash_idle_stats;
 
-// 初始化SPI Flash和littlefs
+// 初始化SPI Flash和littlefs: 检测Flash参数, 建立分区表
 int lfs_spi_flash_init(void);
 
-// 挂载文件系统
-int lfs_spi_flash_mount(struct lfs *lfs);
+// 挂载已有的文件系统, 失败时不格式化(格式化由Storage_Format在用户确认后进行)
+int lfs_spi_flash_mount_existing(struct lfs *lfs);
 
 // 卸载文件系统
 int lfs_spi_flash_unmount(struct lfs *lfs);
@@ -26,4 +52,27 @@ int lfs_spi_flash_unmount(struct lfs *lfs);
 // 格式化文件系统
 int lfs_spi_flash_format(struct lfs *lfs);
 
+// 打开文件, 文件缓存从静态缓存池中分配, 没有空闲缓存时返回LFS_ERR_NOMEM
+// 文件用lfs_file_close关闭, 关闭后缓存自动归还
+int lfs_spi_flash_file_open(struct lfs *lfs, lfs_file_t *file, const char *path, int flags);
+
+// 同上, config中的属性(attrs)被复制, buffer由缓存池提供, config可为NULL
+int lfs_spi_flash_file_opencfg(struct lfs *lfs, lfs_file_t *file, const char *path, int flags,
+                               const struct lfs_file_config *config);
+
+// 擦除连续的多个块(不经过LittleFS, 用于整区清除), stats可为NULL
+int lfs_spi_flash_erase_blocks(lfs_block_t block, lfs_size_t count, W25Q128_EraseStatsTypeDef *stats);
+
+// 空闲时维护一步: 文件系统有写入后先运行lfs_fs_gc并扫描在用块,
+// 再把一段空闲块(最多到64KB边界)交给后台擦除, 擦除回调遇到这些块时不再等待擦除.
+// 只能在没有打开的文件、没有其他操作时调用.
+// 返回1还有工作, 0全部空闲块已擦除, 负数为lfs错误
+int lfs_spi_flash_idle(struct lfs *lfs);
+
+// 已预擦除、可直接使用的块数
+lfs_size_t lfs_spi_flash_ready_blocks(void);
+
+// 忘记预擦除过的块, 芯片被绕过LittleFS写过之后调用
+void lfs_spi_flash_forget_erased(void);
+
 #endif /* LFS_SPI_FLASH_ADAPTER_H */
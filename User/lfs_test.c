@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "w25q128.h" // 包含W25Q128头文件用于直接访问
+#include "storage.h" // 文件系统挂载会话
 
 // 获取错误信息描述
 const char *lfs_get_error_string(int err)
@@ -70,11 +71,11 @@ void lfs_test(void)
     printf("  Block count: %d\r\n", lfs_spi_flash_cfg.block_count);
     printf("  Total size: %d KB\r\n", (lfs_spi_flash_cfg.block_size * lfs_spi_flash_cfg.block_count) / 1024);
 
-    // 挂载文件系统
+    // 挂载文件系统, 已挂载时直接使用; 没有文件系统时不格式化
     printf("Mounting littlefs...\r\n");
-    err = lfs_spi_flash_mount(NULL); // 使用NULL让函数使用内部的全局实例
-    if (err != LFS_ERR_OK)
+    if (Storage_Acquire(STORAGE_LFS) != COM_OK)
     {
+        err = Storage_GetState(STORAGE_LFS)->error;
         printf("Failed to mount littlefs: %d - %s\r\n", err, lfs_get_error_string(err));
         return;
     }
@@ -110,11 +111,11 @@ void lfs_test(void)
     const char *filename = "test.txt";
 
     // 确保使用完整路径
-    err = lfs_file_open(&lfs_instance, &file, filename, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    err = lfs_spi_flash_file_open(&lfs_instance, &file, filename, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
     if (err != LFS_ERR_OK)
     {
         printf("Failed to open file: %d - %s\r\n", err, lfs_get_error_string(err));
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("Successfully opened file for writing\r\n");
@@ -126,7 +127,7 @@ void lfs_test(void)
     {
         printf("Failed to write file: %d - %s\r\n", err, lfs_get_error_string(err));
         lfs_file_close(&lfs_instance, &file);
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("Written %d of %d expected bytes to file\r\n", err, expected_size);
@@ -143,7 +144,7 @@ void lfs_test(void)
     {
         printf("Failed to sync file: %d - %s\r\n", err, lfs_get_error_string(err));
         lfs_file_close(&lfs_instance, &file);
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("File sync completed successfully\r\n");
@@ -152,7 +153,7 @@ void lfs_test(void)
     if (err != LFS_ERR_OK)
     {
         printf("Failed to close file: %d - %s\r\n", err, lfs_get_error_string(err));
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("File closed successfully\r\n");
@@ -190,7 +191,7 @@ void lfs_test(void)
 
     // 测试文件读取
     printf("Testing file read...\r\n");
-    err = lfs_file_open(&lfs_instance, &file, filename, LFS_O_RDONLY);
+    err = lfs_spi_flash_file_open(&lfs_instance, &file, filename, LFS_O_RDONLY);
     if (err != LFS_ERR_OK)
     {
         printf("Failed to open file for reading: %d - %s\r\n", err, lfs_get_error_string(err));
@@ -218,7 +219,7 @@ void lfs_test(void)
             printf("    Failed to open directory: %d - %s\r\n", err, lfs_get_error_string(err));
         }
 
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("Successfully opened file for reading\r\n");
@@ -229,7 +230,7 @@ void lfs_test(void)
     {
         printf("Failed to read file: %d - %s\r\n", err, lfs_get_error_string(err));
         lfs_file_close(&lfs_instance, &file);
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("Read %d bytes from file: %s\r\n", err, read_buffer);
@@ -238,7 +239,7 @@ void lfs_test(void)
     if (err != LFS_ERR_OK)
     {
         printf("Failed to close file: %d - %s\r\n", err, lfs_get_error_string(err));
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
 
@@ -248,20 +249,14 @@ void lfs_test(void)
     if (err != LFS_ERR_OK)
     {
         printf("Failed to delete file: %d - %s\r\n", err, lfs_get_error_string(err));
-        lfs_spi_flash_unmount(&lfs_instance);
+        Storage_Release(STORAGE_LFS);
         return;
     }
     printf("File deleted successfully.\r\n");
 
-    // 卸载文件系统
-    printf("Unmounting littlefs...\r\n");
-    err = lfs_spi_flash_unmount(&lfs_instance);
-    if (err != LFS_ERR_OK)
-    {
-        printf("Failed to unmount littlefs: %d - %s\r\n", err, lfs_get_error_string(err));
-        return;
-    }
-    printf("littlefs unmounted successfully.\r\n");
+    // 释放文件系统, 保持挂载供后续操作使用
+    Storage_Release(STORAGE_LFS);
+    printf("littlefs released.\r\n");
 
     printf("littlefs test completed!\r\n");
 }
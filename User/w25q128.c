@@ -11,9 +11,316 @@
  * 2025-01-27     Lingma       移植到HAL库
  */
 #include "w25q128.h"
+#include "w25q128_async.h"
+#include <string.h>
 
 extern SPI_HandleTypeDef hspi1;
 
+// DMA传输状态, 由HAL的完成/错误回调更新
+static volatile uint8_t spi_dma_busy = 0;
+static volatile uint8_t spi_dma_error = 0;
+// 0: 每字节一次HAL_SPI_TransmitReceive(原实现, 用于速度对比)
+static uint8_t spi_use_dma = 1;
+
+// 检测前按W25Q128: 16MB, 3字节地址, 64KB/32KB/4KB擦除
+W25Q128_InfoTypeDef W25Q128_info = {
+    0xEF, 0x40, 0x18, 0, 3, W25X_FastReadData, W25Q128_CHIP_SIZE, W25Q128_PAGE_SIZE,
+    {{W25Q128_BLOCK64_SIZE, W25X_BlockErase}, {W25Q128_BLOCK32_SIZE, W25X_BlockErase32},
+     {W25Q128_SECTOR_SIZE, W25X_SectorErase}, {0, 0}}};
+
+// CCM RAM(0x10000000)不在DMA总线上, 其中的缓冲区只能轮询传输
+#define SPI_DMA_REACHABLE(p) (((uint32_t)(p) & 0xFFFF0000U) != 0x10000000U)
+// 在中断中(W25Q128_async_tick)只能轮询传输, DMA完成中断的优先级更低, 等不到
+#define SPI_IN_ISR() (__get_IPSR() != 0U)
+
+/**********************************************************
+ * 函 数 名 称：spi_wait_dma
+ * 函 数 功 能：等待DMA传输完成
+ * 传 入 参 数：无
+ * 函 数 返 回：0成功, -1出错或超时
+ * 作       者：LC
+ * 备       注：超时后中止传输
+ **********************************************************/
+static int spi_wait_dma(void)
+{
+    uint32_t tickstart = HAL_GetTick();
+
+    while (spi_dma_busy)
+    {
+        if ((HAL_GetTick() - tickstart) > W25Q128_DMA_TIMEOUT)
+        {
+            HAL_SPI_Abort(&hspi1);
+            spi_dma_busy = 0;
+            return -1;
+        }
+    }
+    return spi_dma_error ? -1 : 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_transmit
+ * 函 数 功 能：连续发送一段数据, 接收到的数据丢弃
+ * 传 入 参 数：data - 要发送的数据  length - 长度
+ * 函 数 返 回：0成功, -1出错
+ * 作       者：LC
+ * 备       注：长数据用DMA发送, 完成回调后SPI已空闲, 可以直接拉高CS
+ **********************************************************/
+static int spi_transmit(const uint8_t *data, uint32_t length)
+{
+    uint32_t n;
+
+    if (!spi_use_dma)
+    {
+        for (n = 0; n < length; n++)
+        {
+            spi_read_write_byte(data[n]);
+        }
+        return 0;
+    }
+
+    while (length > 0)
+    {
+        n = (length > W25Q128_DMA_MAX_LENGTH) ? W25Q128_DMA_MAX_LENGTH : length;
+        if ((n < W25Q128_DMA_MIN_LENGTH) || !SPI_DMA_REACHABLE(data) || SPI_IN_ISR())
+        {
+            if (HAL_SPI_Transmit(&hspi1, (uint8_t *)data, (uint16_t)n, HAL_MAX_DELAY) != HAL_OK)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            spi_dma_error = 0;
+            spi_dma_busy = 1;
+            if (HAL_SPI_Transmit_DMA(&hspi1, (uint8_t *)data, (uint16_t)n) != HAL_OK)
+            {
+                spi_dma_busy = 0;
+                return -1;
+            }
+            if (spi_wait_dma() != 0)
+            {
+                return -1;
+            }
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_receive_start
+ * 函 数 功 能：开始接收一段数据, 不超过W25Q128_DMA_MAX_LENGTH
+ * 传 入 参 数：data - 接收缓冲区  length - 长度
+ * 函 数 返 回：0成功, -1出错
+ * 作       者：LC
+ * 备       注：用DMA时立即返回, 由spi_wait_dma等待完成; 短数据和CCM中的
+ *             缓冲区轮询接收, 返回时已完成
+ *             主机全双工接收时HAL把缓冲区原有内容作为哑字节发出, Flash在
+ *             数据阶段忽略MOSI
+ **********************************************************/
+static int spi_receive_start(uint8_t *data, uint32_t length)
+{
+    spi_dma_error = 0;
+    if ((length < W25Q128_DMA_MIN_LENGTH) || !SPI_DMA_REACHABLE(data) || SPI_IN_ISR())
+    {
+        spi_dma_busy = 0;
+        return (HAL_SPI_Receive(&hspi1, data, (uint16_t)length, HAL_MAX_DELAY) == HAL_OK) ? 0 : -1;
+    }
+
+    spi_dma_busy = 1;
+    if (HAL_SPI_Receive_DMA(&hspi1, data, (uint16_t)length) != HAL_OK)
+    {
+        spi_dma_busy = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_receive
+ * 函 数 功 能：连续接收一段数据
+ * 传 入 参 数：data - 接收缓冲区  length - 长度
+ * 函 数 返 回：0成功, -1出错
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+static int spi_receive(uint8_t *data, uint32_t length)
+{
+    uint32_t n;
+
+    if (!spi_use_dma)
+    {
+        for (n = 0; n < length; n++)
+        {
+            data[n] = spi_read_write_byte(0xFF);
+        }
+        return 0;
+    }
+
+    while (length > 0)
+    {
+        n = (length > W25Q128_DMA_MAX_LENGTH) ? W25Q128_DMA_MAX_LENGTH : length;
+        if ((spi_receive_start(data, n) != 0) || (spi_wait_dma() != 0))
+        {
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_header
+ * 函 数 功 能：组装指令和地址
+ * 传 入 参 数：header - 至少6字节  cmd - 指令  addr - 地址
+ *             dummy - 地址后的哑字节数
+ * 函 数 返 回：长度
+ * 作       者：LC
+ * 备       注：地址为W25Q128_info.addr_bytes字节
+ **********************************************************/
+static uint32_t spi_header(uint8_t *header, uint8_t cmd, uint32_t addr, uint32_t dummy)
+{
+    uint32_t length = 0;
+
+    header[length++] = cmd;
+    if (W25Q128_info.addr_bytes == 4)
+    {
+        header[length++] = (uint8_t)(addr >> 24);
+    }
+    header[length++] = (uint8_t)(addr >> 16);
+    header[length++] = (uint8_t)(addr >> 8);
+    header[length++] = (uint8_t)addr;
+    while (dummy-- > 0)
+    {
+        header[length++] = 0xFF;
+    }
+    return length;
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_command
+ * 函 数 功 能：发送指令和地址
+ * 传 入 参 数：cmd - 指令  addr - 地址
+ * 函 数 返 回：0成功, -1出错
+ * 作       者：LC
+ * 备       注：调用前拉低CS
+ **********************************************************/
+static int spi_command(uint8_t cmd, uint32_t addr)
+{
+    uint8_t header[6];
+
+    return spi_transmit(header, spi_header(header, cmd, addr, 0));
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_read_begin
+ * 函 数 功 能：发送读指令, 之后的每个时钟读出一个字节
+ * 传 入 参 数：addr - 读取地址
+ * 函 数 返 回：0成功, -1出错
+ * 作       者：LC
+ * 备       注：调用前拉低CS. SPI时钟高于W25Q128_READ_DATA_MAX_HZ时用
+ *             快速读(0Bh), 地址后多一个哑字节
+ **********************************************************/
+static int spi_read_begin(uint32_t addr)
+{
+    // BR[2:0]在CR1的第3位, 分频系数为2 << BR
+    uint32_t clock = HAL_RCC_GetPCLK2Freq() >> ((hspi1.Init.BaudRatePrescaler >> 3) + 1);
+    uint8_t header[6];
+
+    if (clock > W25Q128_READ_DATA_MAX_HZ)
+    {
+        return spi_transmit(header, spi_header(header, W25Q128_info.read_cmd, addr, 1));
+    }
+    return spi_transmit(header, spi_header(header, W25X_ReadData, addr, 0));
+}
+
+/**********************************************************
+ * 函 数 名 称：spi_erase
+ * 函 数 功 能：发送一条擦除指令并等待擦除完成
+ * 传 入 参 数：cmd - 20h/52h/D8h/C7h  addr - 擦除地址, C7h忽略
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：先等排队的异步操作完成
+ **********************************************************/
+static void spi_erase(uint8_t cmd, uint32_t addr)
+{
+    W25Q128_async_enter(1);
+    W25Q128_wait_busy();    // 判断忙，如果忙则一直等待
+    W25Q128_erase_start(cmd, addr);
+    // 等待擦除完成
+    W25Q128_wait_busy();
+    W25Q128_async_leave();
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_set_dma
+ * 函 数 功 能：选择批量传输方式
+ * 传 入 参 数：enable - 1用DMA, 0每字节轮询(原实现)
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：默认用DMA, 轮询方式只留作速度对比
+ **********************************************************/
+void W25Q128_set_dma(uint8_t enable)
+{
+    spi_use_dma = enable ? 1 : 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_get_dma
+ * 函 数 功 能：查询批量传输方式
+ * 传 入 参 数：无
+ * 函 数 返 回：1用DMA, 0每字节轮询
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+uint8_t W25Q128_get_dma(void)
+{
+    return spi_use_dma;
+}
+
+/**********************************************************
+ * 函 数 名 称：HAL_SPI_TxCpltCallback等
+ * 函 数 功 能：SPI1 DMA传输完成/出错回调
+ * 传 入 参 数：hspi - SPI句柄
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：在DMA中断中调用
+ **********************************************************/
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    if (hspi->Instance == SPI1)
+    {
+        spi_dma_busy = 0;
+    }
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    if (hspi->Instance == SPI1)
+    {
+        spi_dma_busy = 0;
+    }
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    if (hspi->Instance == SPI1)
+    {
+        spi_dma_busy = 0;
+    }
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    if (hspi->Instance == SPI1)
+    {
+        spi_dma_error = 1;
+        spi_dma_busy = 0;
+    }
+}
+
 /**********************************************************
  * 函 数 名 称：bsp_spi_init
  * 函 数 功 能：初始化SPI
@@ -64,6 +371,7 @@ uint16_t W25Q128_readID(void)
 {
     uint16_t temp = 0;
 
+    W25Q128_async_enter(1);
     // 将CS端拉低为低电平
     W25QXX_CS_ON(1);
 
@@ -84,11 +392,187 @@ uint16_t W25Q128_readID(void)
 
     // 恢复CS端为高电平
     W25QXX_CS_ON(0);
+    W25Q128_async_leave();
 
     // 返回ID
     return temp;
 }
 
+/**********************************************************
+ * 函 数 名 称：sfdp_read
+ * 函 数 功 能：读取SFDP参数区
+ * 传 入 参 数：addr - SFDP地址  buffer - 读出数据的保存地址  length - 长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：5Ah指令总是3字节地址加1个哑字节
+ **********************************************************/
+static int sfdp_read(uint32_t addr, uint8_t *buffer, uint32_t length)
+{
+    uint8_t header[5];
+    int err;
+
+    header[0] = W25X_ReadSFDP;
+    header[1] = (uint8_t)(addr >> 16);
+    header[2] = (uint8_t)(addr >> 8);
+    header[3] = (uint8_t)addr;
+    header[4] = 0xFF;
+
+    W25QXX_CS_ON(1);
+    err = spi_transmit(header, sizeof(header));
+    if (err == 0)
+    {
+        err = spi_receive(buffer, length);
+    }
+    W25QXX_CS_ON(0);
+    return err;
+}
+
+/**********************************************************
+ * 函 数 名 称：sfdp_parse
+ * 函 数 功 能：从SFDP基本参数表(BFPT)得到容量、页大小、擦除类型和地址模式
+ * 传 入 参 数：info - 结果
+ * 函 数 返 回：0成功, -1没有SFDP或表不完整
+ * 作       者：LC
+ * 备       注：按JESD216: 第1个双字的地址字节数, 第2个双字的容量,
+ *             第8、9个双字的擦除类型, 第11个双字(JESD216A起)的页大小
+ **********************************************************/
+static int sfdp_parse(W25Q128_InfoTypeDef *info)
+{
+    uint8_t header[16];
+    uint32_t dword[11];
+    uint32_t pointer, length, i, j, size;
+    uint8_t cmd;
+
+    // SFDP头和第一个参数头, 第一个参数头总是BFPT
+    if ((sfdp_read(0, header, sizeof(header)) != 0) || (memcmp(header, "SFDP", 4) != 0) ||
+        (header[8] != 0x00) || (header[15] != 0xFF))
+    {
+        return -1;
+    }
+    length = header[11];
+    pointer = header[12] | ((uint32_t)header[13] << 8) | ((uint32_t)header[14] << 16);
+    if (length < 9)
+    {
+        return -1;
+    }
+    if (length > 11)
+    {
+        length = 11;
+    }
+    if (sfdp_read(pointer, (uint8_t *)dword, length * 4) != 0)
+    {
+        return -1;
+    }
+
+    // 容量: 位31为0时是位数减1, 为1时是2^N位
+    if (dword[1] & 0x80000000U)
+    {
+        if ((dword[1] & 0x7FFFFFFFU) < 3 || (dword[1] & 0x7FFFFFFFU) > 34)
+        {
+            return -1;
+        }
+        info->capacity = 1U << ((dword[1] & 0x7FFFFFFFU) - 3);
+    }
+    else
+    {
+        info->capacity = (dword[1] >> 3) + 1;
+    }
+
+    // 地址字节数: 00只有3字节, 01可切换, 10只有4字节
+    info->addr_bytes = (((dword[0] >> 17) & 0x3) == 0x2) ? 4 : 3;
+
+    // 擦除类型: 每种一个字节的2^N长度和一个字节的指令, 按长度从大到小插入
+    memset(info->erase, 0, sizeof(info->erase));
+    for (i = 0; i < 4; i++)
+    {
+        j = dword[7 + i / 2] >> ((i % 2) * 16);
+        if (((j & 0xFF) == 0) || ((j & 0xFF) > 31))
+        {
+            continue;
+        }
+        size = 1U << (j & 0xFF);
+        cmd = (uint8_t)(j >> 8);
+        for (j = W25Q128_ERASE_TYPES - 1; (j > 0) && (info->erase[j - 1].size < size); j--)
+        {
+            info->erase[j] = info->erase[j - 1];
+        }
+        info->erase[j].size = size;
+        info->erase[j].cmd = cmd;
+    }
+
+    // 页大小: 第11个双字的位7:4为2^N, JESD216之前的表没有, 按256字节
+    info->page_size = (length >= 11) ? (1U << ((dword[10] >> 4) & 0xF)) : W25Q128_PAGE_SIZE;
+    info->sfdp = 1;
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_detect
+ * 函 数 功 能：读取JEDEC ID和SFDP, 得到Flash参数
+ * 传 入 参 数：无
+ * 函 数 返 回：0成功, -1没有检测到Flash
+ * 作       者：LC
+ * 备       注：结果在W25Q128_info中. 没有SFDP时按JEDEC ID的容量和
+ *             W25Q系列的页大小、擦除类型. 超过16MB的芯片切换到4字节地址
+ **********************************************************/
+int W25Q128_detect(void)
+{
+    W25Q128_InfoTypeDef info;
+    uint8_t id[3];
+
+    W25Q128_async_enter(1);
+    // 9Fh: 厂商ID, 存储器类型, 容量
+    W25QXX_CS_ON(1);
+    spi_read_write_byte(W25X_JedecDeviceID);
+    id[0] = spi_read_write_byte(0xFF);
+    id[1] = spi_read_write_byte(0xFF);
+    id[2] = spi_read_write_byte(0xFF);
+    W25QXX_CS_ON(0);
+    if ((id[0] == 0x00) || (id[0] == 0xFF) || (id[2] < 0x10) || (id[2] > 0x20))
+    {
+        W25Q128_async_leave();
+        return -1;
+    }
+
+    // 默认参数, SFDP有的会覆盖
+    info = W25Q128_info;
+    info.manufacturer = id[0];
+    info.memory_type = id[1];
+    info.capacity_id = id[2];
+    info.sfdp = 0;
+    // 0x20(2^32字节)超出32位, 只有SFDP给出容量时才接受; 有的厂商用它表示512Mbit
+    info.capacity = (id[2] < 32) ? (1U << id[2]) : 0;
+    info.addr_bytes = (info.capacity > W25Q128_CHIP_SIZE) ? 4 : 3;
+    info.read_cmd = W25X_FastReadData;
+    info.page_size = W25Q128_PAGE_SIZE;
+    sfdp_parse(&info);
+    if (info.capacity == 0)
+    {
+        W25Q128_async_leave();
+        return -1;
+    }
+    if ((info.erase[0].size == 0) || (info.page_size < W25Q128_PAGE_SIZE))
+    {
+        info.erase[0] = W25Q128_info.erase[0];
+        info.erase[1] = W25Q128_info.erase[1];
+        info.erase[2] = W25Q128_info.erase[2];
+        info.erase[3] = W25Q128_info.erase[3];
+        info.page_size = W25Q128_PAGE_SIZE;
+    }
+    // 超过16MB的区域需要4字节地址, 可切换的芯片用B7h进入4字节模式
+    if (info.capacity > W25Q128_CHIP_SIZE)
+    {
+        if (info.addr_bytes != 4)
+        {
+            W25Q128_command(W25X_Enter4ByteAddr);
+        }
+        info.addr_bytes = 4;
+    }
+    W25Q128_info = info;
+    W25Q128_async_leave();
+    return 0;
+}
+
 /**********************************************************
  * 函 数 名 称：W25Q128_write_enable
  * 函 数 功 能：发送写使能
@@ -118,6 +602,8 @@ void W25Q128_write_enable(void)
 void W25Q128_wait_busy(void)
 {
     uint8_t byte = 0;
+
+    W25Q128_async_enter(0);
     do
     {
         // 拉低CS端为低电平
@@ -130,6 +616,131 @@ void W25Q128_wait_busy(void)
         W25QXX_CS_ON(0);
         // 判断BUSY位是否为1 如果为1说明在忙，重新读写BUSY位直到为0
     } while ((byte & 0x01) == 1);
+    W25Q128_async_leave();
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_read_status
+ * 函 数 功 能：读取状态寄存器
+ * 传 入 参 数：cmd - 05h状态寄存器1, 35h状态寄存器2
+ * 函 数 返 回：寄存器值
+ * 作       者：LC
+ * 备       注：不等待忙, 擦除和编程期间也可以读
+ **********************************************************/
+uint8_t W25Q128_read_status(uint8_t cmd)
+{
+    uint8_t byte;
+
+    // 拉低CS端为低电平
+    W25QXX_CS_ON(1);
+    spi_read_write_byte(cmd);
+    byte = spi_read_write_byte(0xFF);
+    // 恢复CS端为高电平
+    W25QXX_CS_ON(0);
+    return byte;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_command
+ * 函 数 功 能：发送一个单字节指令
+ * 传 入 参 数：cmd - 指令, 如75h暂停、7Ah恢复
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+void W25Q128_command(uint8_t cmd)
+{
+    // 拉低CS端为低电平
+    W25QXX_CS_ON(1);
+    spi_read_write_byte(cmd);
+    // 恢复CS端为高电平
+    W25QXX_CS_ON(0);
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_erase_plan
+ * 函 数 功 能：选择擦除一段地址开头部分的指令
+ * 传 入 参 数：addr=起始地址  length=长度, 都按4KB对齐
+ *             p_size=这条指令擦除的长度
+ * 函 数 返 回：擦除指令
+ * 作       者：LC
+ * 备       注：整片用C7h; 否则用对齐且不超过长度的最大擦除,
+ *             W25Q128为64KB D8h、32KB 52h、4KB 20h
+ **********************************************************/
+uint8_t W25Q128_erase_plan(uint32_t addr, uint32_t length, uint32_t *p_size)
+{
+    uint32_t i;
+
+    if ((addr == 0) && (length == W25Q128_info.capacity))
+    {
+        *p_size = W25Q128_info.capacity;
+        return W25X_ChipErase;
+    }
+    for (i = 0; (i < W25Q128_ERASE_TYPES) && (W25Q128_info.erase[i].size != 0); i++)
+    {
+        if (((addr % W25Q128_info.erase[i].size) == 0) && (length >= W25Q128_info.erase[i].size))
+        {
+            *p_size = W25Q128_info.erase[i].size;
+            return W25Q128_info.erase[i].cmd;
+        }
+    }
+    // 4KB擦除是JEDEC SFDP要求的, 表中总有
+    *p_size = W25Q128_SECTOR_SIZE;
+    return W25X_SectorErase;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_erase_start
+ * 函 数 功 能：发送写使能和擦除指令, 不等待擦除完成
+ * 传 入 参 数：cmd - 20h/52h/D8h/C7h  addr - 擦除地址, C7h忽略
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：调用前Flash须空闲
+ **********************************************************/
+void W25Q128_erase_start(uint8_t cmd, uint32_t addr)
+{
+    W25Q128_write_enable(); // 写使能
+
+    // 拉低CS端为低电平
+    W25QXX_CS_ON(1);
+    if (cmd == W25X_ChipErase)
+    {
+        spi_read_write_byte(cmd);
+    }
+    else
+    {
+        // 发送指令和24位地址
+        spi_command(cmd, addr);
+    }
+    // 恢复CS端为高电平
+    W25QXX_CS_ON(0);
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_program_start
+ * 函 数 功 能：发送写使能和页编程指令及数据, 不等待编程完成
+ * 传 入 参 数：buffer=写入的数据内容  addr=写入地址  numbyte=写入数据的长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：调用前Flash须空闲, 数据不能跨越页边界
+ **********************************************************/
+int W25Q128_program_start(const uint8_t *buffer, uint32_t addr, uint16_t numbyte)
+{
+    int err;
+
+    // 写使能
+    W25Q128_write_enable();
+    // 拉低CS端为低电平
+    W25QXX_CS_ON(1);
+    // 发送指令02h和24位地址, 再连续写入数据buffer
+    err = spi_command(W25X_PageProgram, addr);
+    if (err == 0)
+    {
+        err = spi_transmit(buffer, numbyte);
+    }
+    // 恢复CS端为高电平
+    W25QXX_CS_ON(0);
+    return err;
 }
 
 /**********************************************************
@@ -146,91 +757,284 @@ W25Q128的最小擦除单位为一个扇区，也就是每次必须擦除4K个
 void W25Q128_erase_sector(uint32_t addr)
 {
     // 计算扇区号，一个扇区4KB=4096
-    addr *= 4096;
-    W25Q128_write_enable(); // 写使能
-    W25Q128_wait_busy();    // 判断忙，如果忙则一直等待
+    spi_erase(W25X_SectorErase, addr * 4096);
+}
 
-    // 拉低CS端为低电平
-    W25QXX_CS_ON(1);
-    // 发送指令20h
-    spi_read_write_byte(W25X_SectorErase);
-    // 发送24位扇区地址的高8位
-    spi_read_write_byte((uint8_t)((addr) >> 16));
-    // 发送24位扇区地址的中8位
-    spi_read_write_byte((uint8_t)((addr) >> 8));
-    // 发送24位扇区地址的低8位
-    spi_read_write_byte((uint8_t)addr);
-    // 恢复CS端为高电平
-    W25QXX_CS_ON(0);
-    // 等待擦除完成
+/**********************************************************
+ * 函 数 名 称：W25Q128_erase_range
+ * 函 数 功 能：用最少的擦除指令擦除一段地址
+ * 传 入 参 数：addr=起始地址  length=长度, 都按4KB对齐
+ *             p_stats=擦除统计, 可为NULL
+ * 函 数 返 回：0成功, -1地址或长度未对齐或超出容量
+ * 作       者：LC
+ * 备       注：从低地址开始按W25Q128_erase_plan选择指令. 各指令的擦除
+ *             时间差别不大, 大块擦除可省下大部分时间
+ **********************************************************/
+int W25Q128_erase_range(uint32_t addr, uint32_t length, W25Q128_EraseStatsTypeDef *p_stats)
+{
+    W25Q128_EraseStatsTypeDef stats;
+    uint32_t tickstart = HAL_GetTick();
+    uint32_t size;
+    uint8_t cmd;
+
+    if (((addr | length) % W25Q128_SECTOR_SIZE) != 0 || (addr > W25Q128_info.capacity) ||
+        (length > W25Q128_info.capacity - addr))
+    {
+        return -1;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    stats.sectors = length / W25Q128_SECTOR_SIZE;
+    W25Q128_async_enter(1);
+    while (length > 0)
+    {
+        cmd = W25Q128_erase_plan(addr, length, &size);
+        spi_erase(cmd, addr);
+        if (cmd == W25X_ChipErase)
+        {
+            stats.chip++;
+        }
+        else if (size >= W25Q128_BLOCK64_SIZE)
+        {
+            stats.block64++;
+        }
+        else if (size >= W25Q128_BLOCK32_SIZE)
+        {
+            stats.block32++;
+        }
+        else
+        {
+            stats.sector++;
+        }
+        addr += size;
+        length -= size;
+    }
+    W25Q128_async_leave();
+    stats.ms = HAL_GetTick() - tickstart;
+
+    if (p_stats != NULL)
+    {
+        *p_stats = stats;
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_page_program
+ * 函 数 功 能：页编程, 不擦除
+ * 传 入 参 数：buffer=写入的数据内容  addr=写入地址  numbyte=写入数据的长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：数据不能跨越256字节的页边界, 目标区域须已擦除.
+ *             先等排队的异步操作完成
+ **********************************************************/
+int W25Q128_page_program(const uint8_t *buffer, uint32_t addr, uint16_t numbyte)
+{
+    int err;
+
+    W25Q128_async_enter(1);
+    // 忙检测
+    W25Q128_wait_busy();
+    // 写使能, 发送指令02h和数据
+    err = W25Q128_program_start(buffer, addr, numbyte);
+    // 忙检测
     W25Q128_wait_busy();
+    W25Q128_async_leave();
+    return err;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_program
+ * 函 数 功 能：编程任意长度的数据, 不擦除
+ * 传 入 参 数：buffer=写入的数据内容  addr=写入地址  length=写入数据的长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：在页边界处拆分成多次页编程(W25Q128_info.page_size), 超过页尾
+ *             的数据不会回绕到页首.
+ *             目标区域须已擦除
+ **********************************************************/
+int W25Q128_program(const uint8_t *buffer, uint32_t addr, uint32_t length)
+{
+    uint32_t n;
+    int err = 0;
+
+    while ((err == 0) && (length > 0))
+    {
+        // 本页剩余的字节数
+        n = W25Q128_info.page_size - (addr % W25Q128_info.page_size);
+        if (n > length)
+        {
+            n = length;
+        }
+        err = W25Q128_page_program(buffer, addr, (uint16_t)n);
+        buffer += n;
+        addr += n;
+        length -= n;
+    }
+    return err;
 }
 
 /**********************************************************
  * 函 数 名 称：W25Q128_write
  * 函 数 功 能：写数据到W25Q128进行保存
  * 传 入 参 数：buffer=写入的数据内容  addr=写入地址  numbyte=写入数据的长度
- * 函 数 返 回：无
+ * 函 数 返 回：0成功, -1 SPI传输出错
  * 作       者：LC
- * 备       注：无
+ * 备       注：先擦除数据所在的每个扇区, 扇区中的其他数据随之丢失;
+ *             需要保留时用w25q128_cache.h的扇区缓存读-改-写
  **********************************************************/
-void W25Q128_write(uint8_t *buffer, uint32_t addr, uint16_t numbyte)
+int W25Q128_write(const uint8_t *buffer, uint32_t addr, uint32_t numbyte)
 {
-    uint32_t i = 0;
+    uint32_t sector;
+
+    if (numbyte == 0)
+    {
+        return 0;
+    }
     // 擦除扇区数据
-    W25Q128_erase_sector(addr / 4096);
-    // 写使能
-    W25Q128_write_enable();
-    // 忙检测
-    W25Q128_wait_busy();
+    for (sector = addr / W25Q128_SECTOR_SIZE; sector <= (addr + numbyte - 1) / W25Q128_SECTOR_SIZE; sector++)
+    {
+        W25Q128_erase_sector(sector);
+    }
     // 写入数据
+    return W25Q128_program(buffer, addr, numbyte);
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_read
+ * 函 数 功 能：读取W25Q128的数据
+ * 传 入 参 数：buffer=读出数据的保存地址  read_addr=读取地址   read_length=读去长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：一次片选读完, 数据阶段按W25Q128_DMA_MAX_LENGTH分段DMA传输.
+ *             异步擦除或编程进行中时暂停它(75h), 读完恢复(7Ah)
+ **********************************************************/
+int W25Q128_read(uint8_t *buffer, uint32_t read_addr, uint32_t read_length)
+{
+    int err, suspended;
+
+    // 正在擦除或编程时暂停它, 读完再恢复
+    W25Q128_async_enter(0);
+    suspended = W25Q128_async_suspend(read_addr, read_length);
     // 拉低CS端为低电平
     W25QXX_CS_ON(1);
-    // 发送指令02h
-    spi_read_write_byte(W25X_PageProgram);
-    // 发送写入的24位地址中的高8位
-    spi_read_write_byte((uint8_t)((addr) >> 16));
-    // 发送写入的24位地址中的中8位
-    spi_read_write_byte((uint8_t)((addr) >> 8));
-    // 发送写入的24位地址中的低8位
-    spi_read_write_byte((uint8_t)addr);
-    // 根据写入的字节长度连续写入数据buffer
-    for (i = 0; i < numbyte; i++)
-    {
-        spi_read_write_byte(buffer[i]);
+    // 发送读指令和24位读取数据地址
+    err = spi_read_begin(read_addr);
+    // 根据读取长度读取出地址保存到buffer中
+    if (err == 0)
+    {
+        err = spi_receive(buffer, read_length);
     }
     // 恢复CS端为高电平
     W25QXX_CS_ON(0);
-    // 忙检测
-    W25Q128_wait_busy();
+    W25Q128_async_resume(suspended);
+    W25Q128_async_leave();
+    return err;
 }
 
 /**********************************************************
- * 函 数 名 称：W25Q128_read
- * 函 数 功 能：读取W25Q128的数据
- * 传 入 参 数：buffer=读出数据的保存地址  read_addr=读取地址   read_length=读去长度
- * 函 数 返 回：无
+ * 函 数 名 称：read_stream
+ * 函 数 功 能：W25Q128_read_stream的读取过程
+ * 传 入 参 数：同W25Q128_read_stream
+ * 函 数 返 回：同W25Q128_read_stream
  * 作       者：LC
  * 备       注：无
  **********************************************************/
-void W25Q128_read(uint8_t *buffer, uint32_t read_addr, uint16_t read_length)
+static int read_stream(uint32_t addr, uint32_t length, uint8_t *buffer, uint32_t chunk,
+                       W25Q128_ReadCallback callback, void *context)
 {
-    uint16_t i;
+    uint8_t *ready;
+    uint32_t n, ready_length;
+    int half = 0;
+    int err;
+
+    if ((chunk == 0) || (chunk > W25Q128_DMA_MAX_LENGTH))
+    {
+        return -1;
+    }
+
     // 拉低CS端为低电平
     W25QXX_CS_ON(1);
-    // 发送指令03h
-    spi_read_write_byte(W25X_ReadData);
-    // 发送24位读取数据地址的高8位
-    spi_read_write_byte((uint8_t)((read_addr) >> 16));
-    // 发送24位读取数据地址的中8位
-    spi_read_write_byte((uint8_t)((read_addr) >> 8));
-    // 发送24位读取数据地址的低8位
-    spi_read_write_byte((uint8_t)read_addr);
-    // 根据读取长度读取出地址保存到buffer中
-    for (i = 0; i < read_length; i++)
+    err = spi_read_begin(addr);
+
+    if (!spi_use_dma)
     {
-        buffer[i] = spi_read_write_byte(0XFF);
+        // 轮询方式没有可重叠的传输, 读一段处理一段
+        while ((err == 0) && (length > 0))
+        {
+            n = (length > chunk) ? chunk : length;
+            err = spi_receive(buffer, n);
+            if (err == 0)
+            {
+                err = callback(context, buffer, n);
+            }
+            length -= n;
+        }
+        W25QXX_CS_ON(0);
+        return err;
+    }
+
+    n = (length > chunk) ? chunk : length;
+    if ((err == 0) && (n > 0))
+    {
+        err = spi_receive_start(buffer, n);
+    }
+    length -= n;
+    while ((err == 0) && (n > 0))
+    {
+        err = spi_wait_dma();
+        if (err != 0)
+        {
+            break;
+        }
+        ready = &buffer[half * chunk];
+        ready_length = n;
+
+        // 先启动下一段, 再处理已读完的一段
+        half ^= 1;
+        n = (length > chunk) ? chunk : length;
+        if (n > 0)
+        {
+            err = spi_receive_start(&buffer[half * chunk], n);
+            length -= n;
+        }
+        if (err == 0)
+        {
+            err = callback(context, ready, ready_length);
+        }
+    }
+    // 回调中止时等正在进行的DMA结束再释放片选
+    if (spi_dma_busy)
+    {
+        spi_wait_dma();
     }
     // 恢复CS端为高电平
     W25QXX_CS_ON(0);
+    return err;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_read_stream
+ * 函 数 功 能：流式读取, 每读完一段就交给回调处理
+ * 传 入 参 数：addr=读取地址  length=读取长度
+ *             buffer=2*chunk字节的缓冲区  chunk=每段长度
+ *             callback=处理函数  context=回调参数
+ * 函 数 返 回：0成功, -1 SPI传输出错, 或回调返回的非0值
+ * 作       者：LC
+ * 备       注：buffer分成两半轮流使用, 回调处理一半时DMA正在读入另一半,
+ *             读Flash和处理数据重叠进行. 整个过程只有一次片选, 回调中
+ *             不能访问W25Q128. 回调返回非0时停止读取. 异步擦除或编程
+ *             进行中时整个读取期间暂停它
+ **********************************************************/
+int W25Q128_read_stream(uint32_t addr, uint32_t length, uint8_t *buffer, uint32_t chunk,
+                        W25Q128_ReadCallback callback, void *context)
+{
+    int err, suspended;
+
+    W25Q128_async_enter(0);
+    suspended = W25Q128_async_suspend(addr, length);
+    err = read_stream(addr, length, buffer, chunk, callback, context);
+    W25Q128_async_resume(suspended);
+    W25Q128_async_leave();
+    return err;
 }
@@ -20,12 +20,14 @@
 #define W25X_WriteEnable 0x06
 #define W25X_WriteDisable 0x04
 #define W25X_ReadStatusReg 0x05
+#define W25X_ReadStatusReg2 0x35
 #define W25X_WriteStatusReg 0x01
 #define W25X_ReadData 0x03
 #define W25X_FastReadData 0x0B
 #define W25X_FastReadDual 0x3B
 #define W25X_PageProgram 0x02
 #define W25X_BlockErase 0xD8
+#define W25X_BlockErase32 0x52
 #define W25X_SectorErase 0x20
 #define W25X_ChipErase 0xC7
 #define W25X_PowerDown 0xB9
@@ -33,20 +35,99 @@
 #define W25X_DeviceID 0xAB
 #define W25X_ManufactDeviceID 0x90
 #define W25X_JedecDeviceID 0x9F
+#define W25X_ReadSFDP 0x5A
+#define W25X_Enter4ByteAddr 0xB7
+#define W25X_EraseSuspend 0x75
+#define W25X_EraseResume 0x7A
+
+// 状态寄存器位
+#define W25X_SR1_BUSY 0x01 // 状态寄存器1: 擦除或编程进行中
+#define W25X_SR2_SUS 0x80  // 状态寄存器2: 擦除或编程已暂停
 
 // 定义W25Q128的CS引脚宏
 #define W25QXX_CS_GPIO_PORT GPIOA
 #define W25QXX_CS_PIN GPIO_PIN_4
 #define W25QXX_CS_ON(x) HAL_GPIO_WritePin(W25QXX_CS_GPIO_PORT, W25QXX_CS_PIN, (x) ? GPIO_PIN_RESET : GPIO_PIN_SET)
 
+// W25Q128结构参数, 检测前的默认值. 实际芯片的参数由W25Q128_detect读取
+// JEDEC ID和SFDP得到, 见W25Q128_info
+#define W25Q128_PAGE_SIZE 256
+#define W25Q128_SECTOR_SIZE 4096
+#define W25Q128_BLOCK32_SIZE 0x8000
+#define W25Q128_BLOCK64_SIZE 0x10000
+#define W25Q128_CHIP_SIZE 0x1000000
+// SFDP最多描述4种擦除
+#define W25Q128_ERASE_TYPES 4
+// 20h擦除一个扇区的典型时间(ms), 估算只用扇区擦除的耗时
+#define W25Q128_SECTOR_ERASE_MS 45
+// 最后一个64KB块, 在LittleFS区域之外, 供速度测试擦写
+#define W25Q128_SCRATCH_ADDR (W25Q128_info.capacity - W25Q128_BLOCK64_SIZE)
+
+// SPI1 DMA传输(RX: DMA2_Stream0, TX: DMA2_Stream5, 通道3)
+// 短于此长度的传输用轮询, DMA启动开销更大
+#define W25Q128_DMA_MIN_LENGTH 16
+// DMA计数器为16位, 更长的传输分段进行
+#define W25Q128_DMA_MAX_LENGTH 0xFFFF
+// 03h读指令在较早的W25Q128上只保证到33MHz(JV为50MHz), 更高的时钟用0Bh快速读
+#define W25Q128_READ_DATA_MAX_HZ 33000000U
+// 一次DMA传输的超时(ms), 64KB在42MHz下约12.5ms
+#define W25Q128_DMA_TIMEOUT 100
+
+// 检测到的Flash参数
+typedef struct
+{
+    uint8_t manufacturer; // 9Fh: 厂商ID, Winbond为EFh
+    uint8_t memory_type;  // 9Fh: 存储器类型
+    uint8_t capacity_id;  // 9Fh: 容量, 2^n字节
+    uint8_t sfdp;         // 1: 参数来自SFDP基本参数表, 0: 来自JEDEC ID
+    uint8_t addr_bytes;   // 地址字节数, 超过16MB的芯片为4
+    uint8_t read_cmd;     // 高时钟下的读指令, 单线SPI只能用0Bh
+    uint32_t capacity;    // 容量(字节)
+    uint32_t page_size;   // 页编程的最大长度
+    struct
+    {
+        uint32_t size; // 擦除长度, 0表示没有
+        uint8_t cmd;   // 擦除指令
+    } erase[W25Q128_ERASE_TYPES]; // 从大到小排列
+} W25Q128_InfoTypeDef;
+
+extern W25Q128_InfoTypeDef W25Q128_info;
+
+// W25Q128_erase_range的擦除统计
+typedef struct
+{
+    uint32_t chip;    // C7h整片擦除次数
+    uint32_t block64; // 64KB及以上的块擦除次数(D8h)
+    uint32_t block32; // 32KB块擦除次数(52h)
+    uint32_t sector;  // 4KB扇区擦除次数(20h)
+    uint32_t sectors; // 擦除范围内的扇区数
+    uint32_t ms;      // 耗时
+} W25Q128_EraseStatsTypeDef;
+
+// 流式读取的回调: 处理一段读出的数据, 返回0继续, 非0停止读取
+typedef int (*W25Q128_ReadCallback)(void *context, const uint8_t *data, uint32_t length);
+
 // W25Q128相关函数声明
 void w25q128_init(void);
 uint8_t spi_read_write_byte(uint8_t dat);
 uint16_t W25Q128_readID(void);
+int W25Q128_detect(void);
 void W25Q128_write_enable(void);
 void W25Q128_wait_busy(void);
 void W25Q128_erase_sector(uint32_t addr);
-void W25Q128_write(uint8_t *buffer, uint32_t addr, uint16_t numbyte);
-void W25Q128_read(uint8_t *buffer, uint32_t read_addr, uint16_t read_length);
+uint8_t W25Q128_read_status(uint8_t cmd);
+void W25Q128_command(uint8_t cmd);
+uint8_t W25Q128_erase_plan(uint32_t addr, uint32_t length, uint32_t *p_size);
+void W25Q128_erase_start(uint8_t cmd, uint32_t addr);
+int W25Q128_program_start(const uint8_t *buffer, uint32_t addr, uint16_t numbyte);
+int W25Q128_erase_range(uint32_t addr, uint32_t length, W25Q128_EraseStatsTypeDef *p_stats);
+int W25Q128_page_program(const uint8_t *buffer, uint32_t addr, uint16_t numbyte);
+int W25Q128_program(const uint8_t *buffer, uint32_t addr, uint32_t length);
+int W25Q128_write(const uint8_t *buffer, uint32_t addr, uint32_t numbyte);
+int W25Q128_read(uint8_t *buffer, uint32_t read_addr, uint32_t read_length);
+int W25Q128_read_stream(uint32_t addr, uint32_t length, uint8_t *buffer, uint32_t chunk,
+                        W25Q128_ReadCallback callback, void *context);
+void W25Q128_set_dma(uint8_t enable);
+uint8_t W25Q128_get_dma(void);
 
 #endif
@@ -0,0 +1,361 @@
+#include "w25q128_async.h"
+
+// 请求类型
+#define ASYNC_ERASE 0
+#define ASYNC_PROGRAM 1
+
+typedef struct
+{
+    uint8_t op;
+    int status;
+    const uint8_t *data;
+    uint32_t addr;   // 下一步的地址
+    uint32_t length; // 剩余长度
+    W25Q128_AsyncCallback callback;
+    void *context;
+} W25Q128_AsyncRequest;
+
+static W25Q128_AsyncRequest queue[W25Q128_ASYNC_QUEUE_SIZE];
+static volatile uint32_t queue_head = 0;
+static volatile uint32_t queue_count = 0;
+// Flash正在执行的一步: 地址范围, 为0表示空闲
+static volatile uint32_t active_addr = 0;
+static volatile uint32_t active_size = 0;
+// 前台占用SPI总线的层数, 不为0时中断不访问总线
+static volatile uint32_t bus_lock = 0;
+// 上次7Ah恢复时的DWT周期数
+static uint32_t resume_cycles = 0;
+
+/**********************************************************
+ * 函 数 名 称：async_run
+ * 函 数 功 能：推进队首请求
+ * 传 入 参 数：无
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：Flash忙时读一次状态就返回; 空闲时完成已结束的请求,
+ *             再发出下一步的擦除或页编程指令
+ **********************************************************/
+static void async_run(void)
+{
+    W25Q128_AsyncRequest *request;
+    W25Q128_AsyncCallback callback;
+    void *context;
+    uint32_t size;
+    uint8_t cmd;
+    int status;
+
+    if (active_size != 0)
+    {
+        if (W25Q128_read_status(W25X_ReadStatusReg) & W25X_SR1_BUSY)
+        {
+            return;
+        }
+        active_size = 0;
+    }
+
+    while (queue_count > 0)
+    {
+        request = &queue[queue_head];
+        if ((request->length == 0) || (request->status != 0))
+        {
+            callback = request->callback;
+            context = request->context;
+            status = request->status;
+            queue_head = (queue_head + 1) % W25Q128_ASYNC_QUEUE_SIZE;
+            queue_count--;
+            if (callback != NULL)
+            {
+                callback(context, status);
+            }
+            continue;
+        }
+
+        if (request->op == ASYNC_ERASE)
+        {
+            cmd = W25Q128_erase_plan(request->addr, request->length, &size);
+            W25Q128_erase_start(cmd, request->addr);
+        }
+        else
+        {
+            // 一次编程到页尾
+            size = W25Q128_info.page_size - (request->addr % W25Q128_info.page_size);
+            if (size > request->length)
+            {
+                size = request->length;
+            }
+            request->status = W25Q128_program_start(request->data, request->addr, (uint16_t)size);
+            if (request->status != 0)
+            {
+                continue;
+            }
+            request->data += size;
+        }
+        active_addr = request->addr;
+        active_size = size;
+        request->addr += size;
+        request->length -= size;
+        return;
+    }
+}
+
+/**********************************************************
+ * 函 数 名 称：async_push
+ * 函 数 功 能：请求入队
+ * 传 入 参 数：request - 请求
+ * 函 数 返 回：0成功, -1队列已满
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+static int async_push(const W25Q128_AsyncRequest *request)
+{
+    int err = -1;
+
+    // 占用总线期间中断不动队列
+    bus_lock++;
+    if (queue_count < W25Q128_ASYNC_QUEUE_SIZE)
+    {
+        queue[(queue_head + queue_count) % W25Q128_ASYNC_QUEUE_SIZE] = *request;
+        queue_count++;
+        err = 0;
+    }
+    bus_lock--;
+    return err;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_erase
+ * 函 数 功 能：排队擦除一段地址
+ * 传 入 参 数：addr=起始地址  length=长度, 都按4KB对齐
+ *             callback=完成回调, 可为NULL  context=回调参数
+ * 函 数 返 回：0已排队, -1地址未对齐、超出容量或队列已满
+ * 作       者：LC
+ * 备       注：按W25Q128_erase_plan用尽量少的擦除指令
+ **********************************************************/
+int W25Q128_async_erase(uint32_t addr, uint32_t length, W25Q128_AsyncCallback callback, void *context)
+{
+    W25Q128_AsyncRequest request;
+
+    if (((addr | length) % W25Q128_SECTOR_SIZE) != 0 || (addr > W25Q128_info.capacity) ||
+        (length > W25Q128_info.capacity - addr))
+    {
+        return -1;
+    }
+
+    request.op = ASYNC_ERASE;
+    request.status = 0;
+    request.data = NULL;
+    request.addr = addr;
+    request.length = length;
+    request.callback = callback;
+    request.context = context;
+    return async_push(&request);
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_program
+ * 函 数 功 能：排队编程一段数据, 不擦除
+ * 传 入 参 数：buffer=写入的数据内容  addr=写入地址  length=写入数据的长度
+ *             callback=完成回调, 可为NULL  context=回调参数
+ * 函 数 返 回：0已排队, -1超出容量或队列已满
+ * 作       者：LC
+ * 备       注：在页边界处拆分. buffer在回调之前不能改动
+ **********************************************************/
+int W25Q128_async_program(const uint8_t *buffer, uint32_t addr, uint32_t length,
+                          W25Q128_AsyncCallback callback, void *context)
+{
+    W25Q128_AsyncRequest request;
+
+    if ((addr > W25Q128_info.capacity) || (length > W25Q128_info.capacity - addr))
+    {
+        return -1;
+    }
+
+    request.op = ASYNC_PROGRAM;
+    request.status = 0;
+    request.data = buffer;
+    request.addr = addr;
+    request.length = length;
+    request.callback = callback;
+    request.context = context;
+    return async_push(&request);
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_pending
+ * 函 数 功 能：查询未完成的请求数
+ * 传 入 参 数：无
+ * 函 数 返 回：请求数
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+uint32_t W25Q128_async_pending(void)
+{
+    return queue_count;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_wait
+ * 函 数 功 能：等待全部请求完成
+ * 传 入 参 数：无
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：在前台连续推进, 不等定时器
+ **********************************************************/
+void W25Q128_async_wait(void)
+{
+    W25Q128_async_enter(1);
+    W25Q128_async_leave();
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_tick
+ * 函 数 功 能：定时推进异步请求
+ * 传 入 参 数：无
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：在TIM1的1ms中断中调用. 前台占用总线时跳过
+ **********************************************************/
+void W25Q128_async_tick(void)
+{
+    if ((bus_lock != 0) || ((active_size == 0) && (queue_count == 0)))
+    {
+        return;
+    }
+    bus_lock++;
+    async_run();
+    bus_lock--;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_enter
+ * 函 数 功 能：前台占用SPI总线
+ * 传 入 参 数：drain - 1先完成全部排队的请求
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：可嵌套, 与W25Q128_async_leave配对. TIM1中断的优先级最高,
+ *             计数加1之后中断就不会再访问总线
+ **********************************************************/
+void W25Q128_async_enter(uint8_t drain)
+{
+    bus_lock++;
+    if (drain)
+    {
+        while ((active_size != 0) || (queue_count > 0))
+        {
+            async_run();
+        }
+    }
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_leave
+ * 函 数 功 能：前台释放SPI总线
+ * 传 入 参 数：无
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+void W25Q128_async_leave(void)
+{
+    bus_lock--;
+}
+
+/**********************************************************
+ * 函 数 名 称：async_queued_overlap
+ * 函 数 功 能：查找排队中与读取范围重叠的请求
+ * 传 入 参 数：addr=读取地址  length=读取长度
+ * 函 数 返 回：从队首起须完成的请求数, 0没有重叠
+ * 作       者：LC
+ * 备       注：只看各请求尚未发出的部分, 正在执行的一步由调用者检查
+ **********************************************************/
+static uint32_t async_queued_overlap(uint32_t addr, uint32_t length)
+{
+    W25Q128_AsyncRequest *request;
+    uint32_t i, count = 0;
+
+    for (i = 0; i < queue_count; i++)
+    {
+        request = &queue[(queue_head + i) % W25Q128_ASYNC_QUEUE_SIZE];
+        if ((request->length != 0) && (addr < request->addr + request->length) &&
+            (request->addr < addr + length))
+        {
+            count = i + 1;
+        }
+    }
+    return count;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_suspend
+ * 函 数 功 能：为读取暂停进行中的擦除或编程
+ * 传 入 参 数：addr=读取地址  length=读取长度
+ * 函 数 返 回：1已暂停, 读完须W25Q128_async_resume(1); 0没有暂停
+ * 作       者：LC
+ * 备       注：在W25Q128_async_enter之后调用. 排队中的请求要擦写读取
+ *             范围时, 先完成到最后一个这样的请求, 否则读到的是即将被
+ *             改掉的旧数据; 读取范围与正在擦写的区域重叠或正在整片擦除
+ *             时, 等它完成而不暂停
+ **********************************************************/
+int W25Q128_async_suspend(uint32_t addr, uint32_t length)
+{
+    uint32_t gap = (SystemCoreClock / 1000000U) * W25Q128_ASYNC_RESUME_GAP_US;
+    uint32_t target;
+
+    // 占用总线期间不会有新请求入队, 队首的请求按顺序完成
+    target = async_queued_overlap(addr, length);
+    if (target != 0)
+    {
+        target = queue_count - target;
+        while (queue_count > target)
+        {
+            async_run();
+        }
+    }
+
+    if (active_size == 0)
+    {
+        return 0;
+    }
+    if ((addr < active_addr + active_size) && (active_addr < addr + length))
+    {
+        W25Q128_wait_busy();
+        active_size = 0;
+        return 0;
+    }
+    if (!(W25Q128_read_status(W25X_ReadStatusReg) & W25X_SR1_BUSY))
+    {
+        active_size = 0;
+        return 0;
+    }
+
+    while ((DWT->CYCCNT - resume_cycles) < gap)
+    {
+    }
+    W25Q128_command(W25X_EraseSuspend);
+    // 暂停最多需要20us, 之后BUSY清0
+    W25Q128_wait_busy();
+    if (!(W25Q128_read_status(W25X_ReadStatusReg2) & W25X_SR2_SUS))
+    {
+        // 暂停指令到达前已经完成
+        active_size = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_async_resume
+ * 函 数 功 能：恢复被暂停的擦除或编程
+ * 传 入 参 数：suspended - W25Q128_async_suspend的返回值
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+void W25Q128_async_resume(int suspended)
+{
+    if (suspended)
+    {
+        W25Q128_command(W25X_EraseResume);
+        resume_cycles = DWT->CYCCNT;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __W25Q128_ASYNC_H__
+#define __W25Q128_ASYNC_H__
+
+#include "w25q128.h"
+
+// W25Q128异步擦除和编程
+// 请求排队后立即返回, 由TIM1的1ms中断调用W25Q128_async_tick推进: 空闲时
+// 发出下一条擦除或页编程指令, 忙时读一次状态寄存器看是否完成, 不在中断
+// 中等待. 前台的读取遇到进行中的擦除或编程时用75h暂停它, 读完用7Ah恢复,
+// 不必等几百毫秒的擦除结束; 读的正是被擦写的区域, 或排队中的请求要擦写
+// 读取的区域时, 才等这些请求完成.
+// 前台的同步擦除和编程先等队列中的请求全部完成.
+
+#define W25Q128_ASYNC_QUEUE_SIZE 8
+// 7Ah恢复后至少隔这么久(us)才再暂停, 保证擦除在连续的读取中仍有进展
+#define W25Q128_ASYNC_RESUME_GAP_US 50
+
+// 请求完成的回调, status为0成功, -1 SPI传输出错.
+// 可能在中断中调用, 不能访问W25Q128
+typedef void (*W25Q128_AsyncCallback)(void *context, int status);
+
+int W25Q128_async_erase(uint32_t addr, uint32_t length, W25Q128_AsyncCallback callback, void *context);
+int W25Q128_async_program(const uint8_t *buffer, uint32_t addr, uint32_t length,
+                          W25Q128_AsyncCallback callback, void *context);
+uint32_t W25Q128_async_pending(void);
+void W25Q128_async_wait(void);
+void W25Q128_async_tick(void);
+
+// 供w25q128.c使用: 占用SPI总线(可嵌套), drain为1时先完成全部请求
+void W25Q128_async_enter(uint8_t drain);
+void W25Q128_async_leave(void);
+int W25Q128_async_suspend(uint32_t addr, uint32_t length);
+void W25Q128_async_resume(int suspended);
+
+#endif
@@ -0,0 +1,215 @@
+#include "w25q128_cache.h"
+#include <string.h>
+
+/**********************************************************
+ * 函 数 名 称：cache_page_state
+ * 函 数 功 能：比较缓存中的一页和Flash中的内容
+ * 传 入 参 数：cache - 缓存  offset - 页在扇区内的偏移
+ *             p_state - 0没变 1只把1改成0 2需要擦除
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：无
+ **********************************************************/
+static int cache_page_state(W25Q128_CacheTypeDef *cache, uint32_t offset, uint8_t *p_state)
+{
+    uint8_t page[W25Q128_PAGE_SIZE];
+    const uint8_t *data = &cache->buffer[offset];
+    uint32_t i;
+
+    if (W25Q128_read(page, cache->sector * W25Q128_SECTOR_SIZE + offset, W25Q128_PAGE_SIZE) != 0)
+    {
+        return -1;
+    }
+    *p_state = 0;
+    for (i = 0; i < W25Q128_PAGE_SIZE; i++)
+    {
+        if ((page[i] & data[i]) != data[i])
+        {
+            *p_state = 2;
+            break;
+        }
+        if (page[i] != data[i])
+        {
+            *p_state = 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：cache_load
+ * 函 数 功 能：把一个扇区读入缓存
+ * 传 入 参 数：cache - 缓存  sector - 扇区号  whole - 1表示整个扇区
+ *             都将被改写, 不必读出
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：先写回原来缓存的扇区
+ **********************************************************/
+static int cache_load(W25Q128_CacheTypeDef *cache, uint32_t sector, uint8_t whole)
+{
+    if (cache->sector == sector)
+    {
+        return 0;
+    }
+    if (W25Q128_cache_flush(cache) != 0)
+    {
+        return -1;
+    }
+    cache->sector = W25Q128_CACHE_NONE;
+    if (!whole && (W25Q128_read(cache->buffer, sector * W25Q128_SECTOR_SIZE, W25Q128_SECTOR_SIZE) != 0))
+    {
+        return -1;
+    }
+    cache->sector = sector;
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_cache_init
+ * 函 数 功 能：初始化扇区缓存
+ * 传 入 参 数：cache - 缓存  buffer - W25Q128_SECTOR_SIZE字节
+ * 函 数 返 回：无
+ * 作       者：LC
+ * 备       注：buffer在CCM RAM中时读写不能用DMA, 会慢一些
+ **********************************************************/
+void W25Q128_cache_init(W25Q128_CacheTypeDef *cache, uint8_t *buffer)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->buffer = buffer;
+    cache->sector = W25Q128_CACHE_NONE;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_cache_read
+ * 函 数 功 能：读取数据, 包括缓存中还没写回的部分
+ * 传 入 参 数：cache - 缓存  buffer - 读出数据的保存地址
+ *             addr - 读取地址  length - 读取长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：不改变缓存的扇区
+ **********************************************************/
+int W25Q128_cache_read(W25Q128_CacheTypeDef *cache, uint8_t *buffer, uint32_t addr, uint32_t length)
+{
+    uint32_t offset, n;
+
+    while (length > 0)
+    {
+        offset = addr % W25Q128_SECTOR_SIZE;
+        n = W25Q128_SECTOR_SIZE - offset;
+        if (n > length)
+        {
+            n = length;
+        }
+        if (addr / W25Q128_SECTOR_SIZE == cache->sector)
+        {
+            memcpy(buffer, &cache->buffer[offset], n);
+        }
+        else if (W25Q128_read(buffer, addr, n) != 0)
+        {
+            return -1;
+        }
+        buffer += n;
+        addr += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_cache_write
+ * 函 数 功 能：写入数据, 扇区中的其他数据保持不变
+ * 传 入 参 数：cache - 缓存  buffer - 写入的数据内容
+ *             addr - 写入地址  length - 写入数据的长度
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：数据先留在缓存中, 断电前须调用W25Q128_cache_flush
+ **********************************************************/
+int W25Q128_cache_write(W25Q128_CacheTypeDef *cache, const uint8_t *buffer, uint32_t addr, uint32_t length)
+{
+    uint32_t offset, n;
+
+    cache->writes++;
+    while (length > 0)
+    {
+        offset = addr % W25Q128_SECTOR_SIZE;
+        n = W25Q128_SECTOR_SIZE - offset;
+        if (n > length)
+        {
+            n = length;
+        }
+        if (cache_load(cache, addr / W25Q128_SECTOR_SIZE, (uint8_t)(n == W25Q128_SECTOR_SIZE)) != 0)
+        {
+            return -1;
+        }
+        memcpy(&cache->buffer[offset], buffer, n);
+        cache->dirty = 1;
+        buffer += n;
+        addr += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**********************************************************
+ * 函 数 名 称：W25Q128_cache_flush
+ * 函 数 功 能：把缓存的扇区写回Flash
+ * 传 入 参 数：cache - 缓存
+ * 函 数 返 回：0成功, -1 SPI传输出错
+ * 作       者：LC
+ * 备       注：只把1改成0时不擦除, 只编程改变了的页; 否则擦除扇区,
+ *             编程不全为0xFF的页. 扇区仍留在缓存中
+ **********************************************************/
+int W25Q128_cache_flush(W25Q128_CacheTypeDef *cache)
+{
+    uint32_t addr = cache->sector * W25Q128_SECTOR_SIZE;
+    uint32_t offset, i;
+    uint8_t changed[W25Q128_SECTOR_SIZE / W25Q128_PAGE_SIZE];
+    uint8_t state, erase = 0;
+
+    if ((cache->sector == W25Q128_CACHE_NONE) || !cache->dirty)
+    {
+        return 0;
+    }
+
+    for (offset = 0; offset < W25Q128_SECTOR_SIZE; offset += W25Q128_PAGE_SIZE)
+    {
+        if (cache_page_state(cache, offset, &state) != 0)
+        {
+            return -1;
+        }
+        changed[offset / W25Q128_PAGE_SIZE] = state;
+        if (state == 2)
+        {
+            erase = 1;
+            break;
+        }
+    }
+
+    if (erase)
+    {
+        W25Q128_erase_sector(cache->sector);
+        cache->erases++;
+    }
+    for (offset = 0; offset < W25Q128_SECTOR_SIZE; offset += W25Q128_PAGE_SIZE)
+    {
+        if (erase)
+        {
+            // 擦除后全为0xFF的页不用编程
+            for (i = 0; (i < W25Q128_PAGE_SIZE) && (cache->buffer[offset + i] == 0xFF); i++)
+            {
+            }
+            state = (i < W25Q128_PAGE_SIZE);
+        }
+        else
+        {
+            state = changed[offset / W25Q128_PAGE_SIZE];
+        }
+        if (state && (W25Q128_page_program(&cache->buffer[offset], addr + offset, W25Q128_PAGE_SIZE) != 0))
+        {
+            return -1;
+        }
+    }
+    cache->dirty = 0;
+    cache->flushes++;
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __W25Q128_CACHE_H__
+#define __W25Q128_CACHE_H__
+
+#include "w25q128.h"
+
+// W25Q128扇区写回缓存
+// 给不经过LittleFS的数据(原始暂存分区、配置数据等)用: 缓存一个4KB扇区,
+// 写入只改RAM中的副本, 换到别的扇区或W25Q128_cache_flush时才写回Flash.
+// 写回时新数据只把1改成0就不擦除直接编程, 内容没变的页不编程.
+// 同一扇区上的多次小写入因此只擦除一次或不擦除.
+
+#define W25Q128_CACHE_NONE 0xFFFFFFFFU
+
+typedef struct
+{
+    uint8_t *buffer;  // W25Q128_SECTOR_SIZE字节, 由调用者提供
+    uint32_t sector;  // 缓存的扇区号, 或W25Q128_CACHE_NONE
+    uint8_t dirty;    // RAM中的副本比Flash新
+    uint32_t writes;  // 统计: 写入次数
+    uint32_t flushes; // 统计: 写回次数
+    uint32_t erases;  // 统计: 擦除次数
+} W25Q128_CacheTypeDef;
+
+void W25Q128_cache_init(W25Q128_CacheTypeDef *cache, uint8_t *buffer);
+int W25Q128_cache_read(W25Q128_CacheTypeDef *cache, uint8_t *buffer, uint32_t addr, uint32_t length);
+int W25Q128_cache_write(W25Q128_CacheTypeDef *cache, const uint8_t *buffer, uint32_t addr, uint32_t length);
+int W25Q128_cache_flush(W25Q128_CacheTypeDef *cache);
+
+#endif